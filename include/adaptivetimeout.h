@@ -0,0 +1,112 @@
+/**
+ * @file adaptivetimeout.h Diameter request timeouts that adapt to the HSS's
+ * latency.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef ADAPTIVETIMEOUT_H__
+#define ADAPTIVETIMEOUT_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <vector>
+
+/// Works out the timeout to use for one type of Diameter request from the
+/// latencies of recent requests of that type.
+///
+/// Latencies are kept in a histogram with 1ms buckets covering the last one
+/// to two periods. The timeout is a percentile (by default the 99th) of
+/// those latencies multiplied by a factor, clamped between a floor and a
+/// ceiling. Until there are enough samples to go on, the initial timeout is
+/// used.
+class AdaptiveTimeout
+{
+public:
+  /// Constructor.
+  /// @param initial_ms - the timeout to use until there are enough samples.
+  /// @param floor_ms   - the shortest timeout to use.
+  /// @param ceiling_ms - the longest timeout to use.
+  /// @param factor     - what to multiply the percentile latency by.
+  /// @param period     - how long (in seconds) latencies are remembered for.
+  /// @param percentile - which percentile of the latencies to use.
+  AdaptiveTimeout(int initial_ms,
+                  int floor_ms,
+                  int ceiling_ms,
+                  double factor = 2.0,
+                  int period = 60,
+                  int percentile = 99);
+  virtual ~AdaptiveTimeout();
+
+  /// Returns the timeout to use for the next request.
+  int timeout_ms();
+
+  /// Returns the percentile latency (in ms) of recent requests, or 0 if
+  /// there aren't enough samples to go on yet.
+  int percentile_ms();
+
+  /// Records the latency of a request. Requests that time out should be
+  /// recorded too, with the timeout as their latency.
+  void record(unsigned long latency_us);
+
+private:
+  static const uint32_t MIN_SAMPLES = 100;
+  static const uint32_t RECALCULATE_INTERVAL = 10;
+
+  static time_t now();
+  void rotate(time_t now);
+  void recalculate();
+
+  int _initial_ms;
+  int _floor_ms;
+  int _ceiling_ms;
+  double _factor;
+  int _period;
+  double _percentile;
+
+  // Histograms of latencies (in ms) for the current and previous periods.
+  // The last bucket also counts any latencies above the ceiling.
+  std::vector<uint32_t> _current;
+  std::vector<uint32_t> _previous;
+  uint32_t _current_count;
+  uint32_t _previous_count;
+  time_t _period_start;
+
+  int _percentile_ms;
+  int _timeout_ms;
+  pthread_mutex_t _lock;
+};
+
+#endif
@@ -0,0 +1,120 @@
+/**
+ * @file akavectorpool.h Pool of unused AKA authentication vectors.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef AKAVECTORPOOL_H__
+#define AKAVECTORPOOL_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "authvector.h"
+
+/// Holds AKA authentication vectors that the HSS returned in a batch but
+/// which haven't been used yet, keyed on private ID.
+///
+/// Each vector is handed out at most once, and is discarded if it isn't
+/// handed out within the configured TTL.
+class AkaVectorPool
+{
+public:
+  /// Constructor.
+  /// @param batch_size - the number of vectors to request from the HSS at
+  ///                     once (in SIP-Number-Auth-Items).
+  /// @param low_water  - refill the pool for a private ID when it holds
+  ///                     fewer than this many vectors.
+  /// @param vector_ttl - how long (in seconds) a pooled vector may be used
+  ///                     for.
+  /// @param max_impis  - the maximum number of private IDs to hold vectors
+  ///                     for.
+  AkaVectorPool(int batch_size,
+                int low_water = 1,
+                int vector_ttl = 30,
+                int max_impis = 10000);
+  virtual ~AkaVectorPool();
+
+  inline int batch_size() const { return _batch_size; }
+
+  /// Takes a vector for the private ID out of the pool.
+  /// @returns true if a vector was found.
+  /// @param needs_refill - set if the pool for this private ID is now below
+  ///                       the low-water mark and no refill is in progress.
+  ///                       The caller should refill it and call add() or
+  ///                       refill_failed() once done.
+  bool get(const std::string& impi, AKAAuthVector& av, bool& needs_refill);
+
+  /// Adds vectors for the private ID to the pool, and marks any refill as
+  /// complete.
+  void add(const std::string& impi, const std::vector<AKAAuthVector>& avs);
+
+  /// Marks a refill for the private ID as complete without adding vectors.
+  void refill_failed(const std::string& impi);
+
+  /// Discards all vectors for the private ID, for example because the
+  /// client has resynchronized its sequence number.
+  void flush(const std::string& impi);
+
+  /// Returns the number of usable vectors pooled for the private ID.
+  size_t count(const std::string& impi);
+
+private:
+  struct PooledVector
+  {
+    AKAAuthVector av;
+    time_t expiry;
+  };
+  typedef std::deque<PooledVector> PooledVectors;
+
+  static time_t now();
+  void remove_expired(PooledVectors& avs, time_t now);
+  void remove_expired_impis(time_t now);
+
+  int _batch_size;
+  size_t _low_water;
+  int _vector_ttl;
+  size_t _max_impis;
+
+  std::map<std::string, PooledVectors> _vectors;
+  std::set<std::string> _refilling;
+  pthread_mutex_t _lock;
+};
+
+#endif
@@ -0,0 +1,150 @@
+/**
+ * @file bulkderegistrar.h Deregisters lists of subscribers in the background.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef BULKDEREGISTRAR_H__
+#define BULKDEREGISTRAR_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "adaptivetimeout.h"
+#include "cache.h"
+#include "httpconnection.h"
+#include "sproutconnection.h"
+
+/// Administratively deregisters lists of subscribers in the background.
+///
+/// Each public ID is deregistered by sending a dereg-admin PUT to this
+/// Homestead's own /impu/<id>/reg-data interface, so it goes through exactly
+/// the same processing (cache read, SAR and cache delete) as a deregistration
+/// from Sprout. Sprout is then told to remove its bindings.
+///
+/// The deregistrations are pipelined, but the number in progress at once is
+/// limited. The limit is increased slowly while the PUTs complete within the
+/// target latency, and halved when they don't. It is also halved whenever the
+/// latency of live SARs goes above the target, so that the deregistrations
+/// back off when they start to slow down live traffic.
+class BulkDeregistrar
+{
+public:
+  /// Progress through the deregistrations passed to the deregistrar.
+  struct Progress
+  {
+    uint64_t queued;
+    uint64_t in_progress;
+    uint64_t succeeded;
+    uint64_t failed;
+    int concurrency;
+  };
+
+  /// Constructor.
+  /// @param http              - connection to this Homestead's HTTP
+  ///                            interface. The deregistrar takes ownership.
+  /// @param cache             - cache used to look up the public IDs for
+  ///                            private IDs.
+  /// @param sprout_conn       - connection to Sprout (may be NULL).
+  /// @param max_concurrency   - the most deregistrations to run at once.
+  /// @param target_latency_ms - the latency above which the deregistrations
+  ///                            back off.
+  /// @param live_latency      - tracks the latency of live SARs (may be
+  ///                            NULL, in which case only the latency of the
+  ///                            deregistrations themselves is used).
+  /// @param lookup_timeout_ms - how long to wait for the cache to look up
+  ///                            the public IDs for a private ID.
+  BulkDeregistrar(HttpConnection* http,
+                  Cache* cache,
+                  SproutConnection* sprout_conn,
+                  int max_concurrency,
+                  int target_latency_ms,
+                  AdaptiveTimeout* live_latency = NULL,
+                  int lookup_timeout_ms = 5000);
+  virtual ~BulkDeregistrar();
+
+  /// Queues identities to deregister. Entries starting sip: or tel: are
+  /// public IDs; anything else is treated as a private ID, and all the IRSs
+  /// it is registered with are deregistered.
+  void add(const std::vector<std::string>& ids);
+
+  /// Returns progress so far.
+  Progress progress();
+
+  /// Starts the background threads.
+  void start();
+
+  /// Stops the background threads, once the deregistrations in progress
+  /// complete. Anything still queued is discarded.
+  void stop();
+
+private:
+  bool deregister(const std::string& id);
+  bool deregister_impu(const std::string& impu,
+                       const std::string& impi,
+                       SAS::TrailId trail);
+  bool get_primary_public_ids(const std::string& impi,
+                              std::vector<std::string>& impus,
+                              SAS::TrailId trail);
+  void update_concurrency(uint64_t latency_ms);
+  static uint64_t now_ms();
+  void thread_function();
+  static void* thread_entry_point(void* deregistrar);
+
+  HttpConnection* _http;
+  Cache* _cache;
+  SproutConnection* _sprout_conn;
+  int _max_concurrency;
+  int _target_latency_ms;
+  AdaptiveTimeout* _live_latency;
+  int _lookup_timeout_ms;
+
+  // Identities waiting to be deregistered, progress counters, and the
+  // current limit on the number of deregistrations in progress.
+  std::deque<std::string> _queue;
+  uint64_t _in_progress;
+  uint64_t _succeeded;
+  uint64_t _failed;
+  double _concurrency;
+
+  std::vector<pthread_t> _threads;
+  bool _terminated;
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+};
+
+#endif
@@ -265,6 +265,13 @@ public:
     };
     virtual void get_result(Result& result);
 
+    /// Fills in the result from the columns read from the public ID's row.
+    ///
+    /// @param columns the columns in the row.
+    /// @param now     the time of the read, as from generate_timestamp.
+    void read_columns(const std::vector<org::apache::cassandra::ColumnOrSuperColumn>& columns,
+                      int64_t now);
+
   protected:
     // Request parameters.
     std::string _public_id;
@@ -285,6 +292,55 @@ public:
     return new GetRegData(public_id);
   }
 
+  class MultiGetRegData : public CassandraStore::Operation
+  {
+  public:
+    /// Get the IMS subscription XML for several public identities in one
+    /// operation.
+    ///
+    /// @param public_ids the public identities.
+    MultiGetRegData(const std::vector<std::string>& public_ids);
+    virtual ~MultiGetRegData();
+
+    /// Access the result of the request for one of the public identities.
+    /// The result is owned by this operation. Returns NULL if the public
+    /// identity couldn't be read - see get_error().
+    ///
+    /// @param public_id the public identity.
+    virtual GetRegData* get_reg_data(const std::string& public_id);
+
+    /// Access the reason one of the public identities couldn't be read.
+    ///
+    /// @param public_id the public identity.
+    /// @param error     the result code.
+    /// @param text      a description of the error.
+    virtual void get_error(const std::string& public_id,
+                           CassandraStore::ResultCode& error,
+                           std::string& text);
+
+  protected:
+    // Request parameters.
+    std::vector<std::string> _public_ids;
+
+    // Result, for each public ID.
+    std::map<std::string, GetRegData*> _reg_data;
+
+    // The public IDs that couldn't be read, and why.
+    std::map<std::string, std::pair<CassandraStore::ResultCode, std::string> > _errors;
+
+    bool perform(CassandraStore::Client* client, SAS::TrailId trail);
+    void perform_one(CassandraStore::Client* client,
+                     const std::string& public_id,
+                     GetRegData* reg_data,
+                     int64_t now,
+                     SAS::TrailId trail);
+  };
+
+  virtual MultiGetRegData* create_MultiGetRegData(const std::vector<std::string>& public_ids)
+  {
+    return new MultiGetRegData(public_ids);
+  }
+
   /// Get all the public IDs that are associated with one or more
   /// private IDs.
 
@@ -506,6 +562,37 @@ public:
     return new DeletePrivateIDs(private_ids, timestamp);
   }
 
+  /// DeleteAuthVector operates on the "impi" Cassandra table, and deletes
+  /// the digest authentication vector columns for each private ID while
+  /// leaving its associated public IDs in place.
+
+  /// The main use-case is invalidating digest vectors that were cached from
+  /// the HSS when the HSS tells us the subscriber's data has changed.
+
+  class DeleteAuthVector : public CassandraStore::Operation
+  {
+  public:
+    /// Delete the digest vectors for the private IDs.
+    ///
+    /// @param private_ids the private IDs to delete vectors for.
+    DeleteAuthVector(const std::vector<std::string>& private_ids,
+                     int64_t timestamp);
+    virtual ~DeleteAuthVector() {};
+
+  protected:
+    std::vector<std::string> _private_ids;
+    int64_t _timestamp;
+
+    bool perform(CassandraStore::Client* client, SAS::TrailId trail);
+  };
+
+  virtual DeleteAuthVector*
+    create_DeleteAuthVector(const std::vector<std::string>& private_ids,
+                            int64_t timestamp)
+  {
+    return new DeleteAuthVector(private_ids, timestamp);
+  }
+
   /// DeleteIMPIMapping operates on the "impi_mapping" Cassandra table,
   /// and deletes whole rows - effectively causing the cache to
   /// "forget" that a particular IMPI has been used to authenticate any
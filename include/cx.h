@@ -201,7 +201,8 @@ public:
                         const std::string& impu,
                         const std::string& server_name,
                         const std::string& sip_auth_scheme,
-                        const std::string& sip_authorization = "");
+                        const std::string& sip_authorization = "",
+                        const int32_t sip_number_auth_items = 1);
   inline MultimediaAuthRequest(Diameter::Message& msg) : Diameter::Message(msg) {};
 
   inline std::string impu() const
@@ -231,13 +232,20 @@ public:
                        const std::string& scheme,
                        const DigestAuthVector& digest_av,
                        const AKAAuthVector& aka_av);
+  MultimediaAuthAnswer(const Dictionary* dict,
+                       Diameter::Stack* stack,
+                       const int32_t& result_code,
+                       const std::string& scheme,
+                       const std::vector<AKAAuthVector>& aka_avs);
   inline MultimediaAuthAnswer(Diameter::Message& msg) : Diameter::Message(msg) {};
 
   std::string sip_auth_scheme() const;
   DigestAuthVector digest_auth_vector() const;
   AKAAuthVector aka_auth_vector() const;
+  std::vector<AKAAuthVector> aka_auth_vectors() const;
 
 private:
+  AKAAuthVector aka_auth_vector(Diameter::AVP::iterator& avps) const;
   static std::string hex(const uint8_t* data, size_t len);
   static std::string base64(const uint8_t* data, size_t len);
 };
@@ -267,7 +275,8 @@ public:
                           const std::string& impi,
                           const std::string& impu,
                           const std::string& server_name,
-                          const Cx::ServerAssignmentType type);
+                          const Cx::ServerAssignmentType type,
+                          const bool user_data_already_available = false);
   inline ServerAssignmentRequest(Diameter::Message& msg) : Diameter::Message(msg) {};
 
   inline std::string impu() const
@@ -0,0 +1,124 @@
+/**
+ * @file cxcircuitbreaker.h Fails Cx requests fast while the HSS is down.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef CXCIRCUITBREAKER_H__
+#define CXCIRCUITBREAKER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "sas.h"
+
+class StatisticsManager;
+
+/// Stops sending Cx requests to the HSS while it is failing, so that
+/// requests can be failed straight away rather than each waiting for the
+/// Diameter timeout.
+///
+/// The breaker starts closed. It opens once at least a minimum number of
+/// requests have completed within the window and too high a proportion of
+/// them have timed out or been refused. While it is open every request is
+/// refused. After the open time it goes half-open and lets a single probe
+/// request through at a time. The first probe to succeed closes the breaker
+/// again, and one that fails re-opens it.
+class CxCircuitBreaker
+{
+public:
+  enum State
+  {
+    CLOSED,
+    OPEN,
+    HALF_OPEN
+  };
+
+  /// Constructor.
+  /// @param failure_percent - the percentage of failed requests at which
+  ///                          to open.
+  /// @param min_requests    - the fewest requests in the window to judge
+  ///                          the HSS on.
+  /// @param window_ms       - how long requests are counted for.
+  /// @param open_ms         - how long to stay open before probing.
+  /// @param stats           - where to report the breaker opening and
+  ///                          requests being refused. May be NULL.
+  CxCircuitBreaker(int failure_percent,
+                   int min_requests = 20,
+                   int window_ms = 10000,
+                   int open_ms = 5000,
+                   StatisticsManager* stats = NULL);
+  virtual ~CxCircuitBreaker();
+
+  /// Returns whether a request may be sent to the HSS. If it may, the
+  /// outcome must be reported to on_complete().
+  bool allow(SAS::TrailId trail);
+
+  /// Records the outcome of a request that was allowed.
+  /// @param failed - whether the request timed out or the HSS couldn't
+  ///                 handle it.
+  void on_complete(bool failed, SAS::TrailId trail);
+
+  /// Returns the breaker's current state.
+  State state();
+
+private:
+  static uint64_t now_ms();
+  void open(uint64_t now);
+  void reset_counts(uint64_t now);
+  static void report_state(int event_id, SAS::TrailId trail);
+
+  int _failure_percent;
+  uint32_t _min_requests;
+  uint64_t _window_ms;
+  uint64_t _open_ms;
+  StatisticsManager* _stats;
+
+  State _state;
+
+  // Requests and failures in the current and previous windows.
+  uint32_t _requests;
+  uint32_t _failures;
+  uint32_t _previous_requests;
+  uint32_t _previous_failures;
+  uint64_t _window_start_ms;
+
+  // When the breaker can next go half-open, and when the current probe (if
+  // any) was sent.
+  uint64_t _open_until_ms;
+  uint64_t _probe_sent_ms;
+
+  pthread_mutex_t _lock;
+};
+
+#endif
@@ -0,0 +1,120 @@
+/**
+ * @file cxhedger.h Sends duplicate Cx requests when the HSS is slow to answer.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef CXHEDGER_H__
+#define CXHEDGER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <map>
+
+#include <boost/function.hpp>
+
+class StatisticsManager;
+
+/// Schedules hedges for idempotent Cx requests - that is, sending a request
+/// again if it hasn't been answered after a while, and taking whichever
+/// answer comes back first.
+///
+/// The callers decide when a hedge is due and what sending one involves; the
+/// hedger runs a thread that calls them back at the right time, and caps the
+/// number of hedges sent so that they can't add more than a fixed percentage
+/// to the load on the HSS.
+class CxHedger
+{
+public:
+  /// Callback invoked when a hedge is due.
+  typedef boost::function<void()> clbk_t;
+
+  /// Constructor.
+  /// @param budget_percent - the most hedges to send, as a percentage of the
+  ///                         requests that could be hedged.
+  /// @param stats          - where to report hedges. May be NULL.
+  CxHedger(int budget_percent, StatisticsManager* stats = NULL);
+  virtual ~CxHedger();
+
+  /// Calls clbk after delay_ms. Each scheduled hedge also earns a share of
+  /// the hedge budget.
+  void schedule(int delay_ms, clbk_t clbk);
+
+  /// Returns true if the budget allows another hedge to be sent, using up
+  /// that part of the budget.
+  bool try_hedge();
+
+  /// Records that the hedge of a request was answered before the original.
+  void hedge_won();
+
+  /// Calls back any hedges that are due. Called by the background thread.
+  void poll();
+
+  /// Returns the number of hedges scheduled but not yet due.
+  size_t pending();
+
+  /// Starts the background thread.
+  void start();
+
+  /// Stops the background thread. Hedges that aren't yet due are dropped.
+  void stop();
+
+private:
+  // The most hedges that can be saved up for a burst of slow requests.
+  static const int MAX_BUDGET = 10;
+
+  // How long the background thread sleeps for when nothing is scheduled.
+  static const int IDLE_WAIT_MS = 1000;
+
+  static uint64_t now_ms();
+  void thread_function();
+  static void* thread_entry_point(void* hedger);
+
+  int _budget_percent;
+  StatisticsManager* _stats;
+
+  // Hedges indexed by when they are due, and the budget for sending them
+  // (in hundredths of a hedge).
+  std::multimap<uint64_t, clbk_t> _pending;
+  int _budget;
+
+  // Background thread state.
+  bool _running;
+  bool _terminated;
+  pthread_t _thread;
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+};
+
+#endif
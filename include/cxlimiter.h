@@ -0,0 +1,144 @@
+/**
+ * @file cxlimiter.h Adaptive concurrency limit on Cx requests to the HSS.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef CXLIMITER_H__
+#define CXLIMITER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+#include <boost/function.hpp>
+
+class StatisticsManager;
+
+/// Limits the number of Cx requests outstanding to the HSS, so that an HSS
+/// slowdown doesn't turn into a wave of timeouts.
+///
+/// The limit (the window) adapts using AIMD: it grows by one for each
+/// window's worth of answers, and halves (at most once per round trip) when
+/// a request times out or the HSS answers DIAMETER_TOO_BUSY.
+///
+/// Requests that don't fit in the window wait in a short priority queue.
+/// A request is shed straight away, rather than queued, if the queue is full
+/// or the expected wait is longer than the request's timeout, and is shed
+/// from the queue if its timeout passes before it can be sent.
+class CxLimiter
+{
+public:
+  /// Request priorities, highest first.
+  enum Priority
+  {
+    HIGH,   // Deregistration SARs.
+    MEDIUM, // MARs and other SARs.
+    LOW,    // UARs and LIRs.
+    NUM_PRIORITIES
+  };
+
+  /// Callback that sends a request, or sheds it.
+  typedef boost::function<void()> clbk_t;
+
+  /// Constructor.
+  /// @param max_window - the maximum number of outstanding requests.
+  /// @param max_queue  - the maximum number of requests waiting to be sent.
+  /// @param stats      - where to report the window and queueing delay. May
+  ///                     be NULL.
+  CxLimiter(int max_window,
+            int max_queue = 100,
+            StatisticsManager* stats = NULL);
+  virtual ~CxLimiter();
+
+  /// Sends a request (by calling send_clbk) if there's room in the window,
+  /// and otherwise queues it. If the request can't be sent within
+  /// timeout_ms, calls shed_clbk instead. Either callback may be called
+  /// before this method returns, or later on another thread.
+  void send(Priority priority,
+            int timeout_ms,
+            clbk_t send_clbk,
+            clbk_t shed_clbk);
+
+  /// Must be called when a request sent by this limiter completes.
+  /// @param latency_us - how long the request took.
+  /// @param failed     - whether the request timed out or the HSS was too
+  ///                     busy to answer it.
+  void on_complete(unsigned long latency_us, bool failed);
+
+  /// Returns the current window.
+  int window();
+
+  /// Returns the number of requests outstanding.
+  int in_flight();
+
+  /// Returns the number of requests waiting to be sent.
+  size_t queued();
+
+private:
+  struct Entry
+  {
+    clbk_t send_clbk;
+    clbk_t shed_clbk;
+    uint64_t enqueued_us;
+    uint64_t deadline_us;
+  };
+
+  static uint64_t now_us();
+  int limit();
+  size_t queue_length();
+  size_t queued_ahead(Priority priority);
+  bool make_room(Priority priority, std::vector<clbk_t>& shed);
+  void expire(uint64_t now, std::vector<clbk_t>& shed);
+
+  double _max_window;
+  size_t _max_queue;
+  StatisticsManager* _stats;
+
+  // The current window, the number of requests outstanding and the queues
+  // of waiting requests (one per priority).
+  double _window;
+  int _in_flight;
+  std::deque<Entry> _queues[NUM_PRIORITIES];
+
+  // A smoothed average of the request latency, used to estimate how long a
+  // queued request will wait, and the time the window was last reduced.
+  double _avg_latency_us;
+  uint64_t _last_decrease_us;
+
+  pthread_mutex_t _lock;
+};
+
+#endif
@@ -0,0 +1,161 @@
+/**
+ * @file cxpeerselector.h Chooses which HSS peer to send each Cx request to.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef CXPEERSELECTOR_H__
+#define CXPEERSELECTOR_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/// Chooses which HSS peer to send each Cx request to, based on how each
+/// peer has been performing.
+///
+/// Only peers that the Diameter stack is directly connected to, and that
+/// serve the destination realm, are ever chosen - a Destination-Host is
+/// never pinned to a peer that the stack can only reach through a relay.
+/// For each peer the selector keeps smoothed averages of its latency and
+/// error rate (learnt from the Origin-Host of its answers), and the number
+/// of requests outstanding to it. Requests are sent to the better of two
+/// peers picked at random (the "power of two choices"), where a peer's cost
+/// is its latency scaled by its outstanding requests.
+///
+/// A peer whose error rate gets too high, or whose latency gets much worse
+/// than the best peer's, is marked as degraded and isn't chosen for a
+/// while - typically well before the Diameter stack would blacklist it.
+///
+/// Some requests are deliberately left to the Diameter stack's realm
+/// routing, so that the selector keeps hearing how the peers it isn't
+/// choosing are doing.
+class CxPeerSelector
+{
+public:
+  /// A snapshot of what is known about one peer.
+  struct PeerStats
+  {
+    std::string host;
+    unsigned long latency_us;
+    double error_rate;
+    int outstanding;
+    bool degraded;
+  };
+
+  /// Constructor.
+  /// @param dest_realm     - the realm that chosen peers must serve.
+  /// @param latency_factor - a peer is degraded if its latency is more than
+  ///                         this multiple of the best peer's.
+  /// @param max_error_rate - a peer is degraded if its error rate is higher
+  ///                         than this.
+  /// @param degraded_time  - how long (in seconds) a degraded peer is left
+  ///                         out for.
+  CxPeerSelector(const std::string& dest_realm,
+                 double latency_factor = 4.0,
+                 double max_error_rate = 0.5,
+                 int degraded_time = 30);
+  virtual ~CxPeerSelector();
+
+  /// Chooses the connected peer to send a request to, avoiding the given
+  /// peer if there's a choice, and counts the request as outstanding to it.
+  /// Returns an empty string if the request should be left to realm routing.
+  std::string choose(const std::string& avoid = "");
+
+  /// Must be called when the Diameter stack connects to or disconnects from
+  /// a peer.
+  void peer_connection_cb(bool connected,
+                          const std::string& host,
+                          const std::string& realm);
+
+  /// Must be called when a request completes.
+  /// @param chosen      - the peer returned by choose() for the request.
+  /// @param answered_by - the Origin-Host of the answer, or empty if the
+  ///                      request timed out.
+  /// @param latency_us  - how long the request took.
+  /// @param failed      - whether the request timed out or the peer was
+  ///                      too busy to answer it.
+  void on_complete(const std::string& chosen,
+                   const std::string& answered_by,
+                   unsigned long latency_us,
+                   bool failed);
+
+  /// Returns a snapshot of the known peers.
+  std::vector<PeerStats> peer_stats();
+
+private:
+  // Leave one request in this many to realm routing.
+  static const uint32_t EXPLORE_INTERVAL = 20;
+
+  // Don't judge a peer on fewer answers than this.
+  static const uint32_t MIN_SAMPLES = 10;
+
+  struct Peer
+  {
+    Peer() :
+      latency_us(0),
+      error_rate(0),
+      outstanding(0),
+      samples(0),
+      degraded_until_us(0)
+    {}
+
+    double latency_us;
+    double error_rate;
+    int outstanding;
+    uint32_t samples;
+    uint64_t degraded_until_us;
+  };
+
+  static uint64_t now_us();
+  bool is_degraded(Peer& peer, uint64_t now);
+  void check_degraded(const std::string& host, Peer& peer, uint64_t now);
+
+  double _latency_factor;
+  double _max_error_rate;
+  uint64_t _degraded_time_us;
+
+  std::string _dest_realm;
+  std::set<std::string> _connected;
+  std::map<std::string, Peer> _peers;
+  uint32_t _requests;
+  unsigned int _seed;
+
+  pthread_mutex_t _lock;
+};
+
+#endif
@@ -0,0 +1,116 @@
+/**
+ * @file digestavcache.h Short-lived cache of digest authentication vectors.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#ifndef DIGESTAVCACHE_H__
+#define DIGESTAVCACHE_H__
+
+#include <pthread.h>
+#include <time.h>
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "authvector.h"
+
+/// Holds digest authentication vectors retrieved from the HSS for a short
+/// time, keyed on private and public ID, so that frequent re-registrations
+/// don't each need a Cx round trip.
+///
+/// The cache is bounded by an approximate memory budget. When the budget is
+/// exceeded the least recently used vectors are discarded.
+class DigestAvCache
+{
+public:
+  /// Constructor.
+  /// @param ttl           - how long (in seconds) to cache a vector for.
+  /// @param max_bytes     - the memory budget for the in-memory cache. If
+  ///                        zero, vectors are not cached in memory.
+  /// @param use_cassandra - whether vectors should also be written to the
+  ///                        impi table in Cassandra.
+  DigestAvCache(int ttl, size_t max_bytes, bool use_cassandra = false);
+  virtual ~DigestAvCache();
+
+  inline int ttl() const { return _ttl; }
+  inline bool use_cassandra() const { return _use_cassandra; }
+
+  /// Looks up the vector for the private and public ID.
+  /// @returns true if an unexpired vector was found.
+  bool get(const std::string& impi,
+           const std::string& impu,
+           DigestAuthVector& av);
+
+  /// Caches the vector for the private and public ID.
+  void put(const std::string& impi,
+           const std::string& impu,
+           const DigestAuthVector& av);
+
+  /// Discards all vectors for the private ID.
+  void invalidate(const std::string& impi);
+
+  /// Returns the approximate memory currently used by cached vectors.
+  size_t size_bytes();
+
+private:
+  struct Entry
+  {
+    std::string key;
+    DigestAuthVector av;
+    time_t expiry;
+    size_t bytes;
+  };
+  typedef std::list<Entry> Entries;
+
+  static std::string make_key(const std::string& impi,
+                              const std::string& impu);
+  static time_t now();
+  void remove(std::map<std::string, Entries::iterator>::iterator it);
+
+  int _ttl;
+  size_t _max_bytes;
+  bool _use_cassandra;
+
+  // Entries are held in LRU order, most recently used first, and indexed by
+  // key. The key is the private ID followed by the public ID, so all the
+  // entries for a private ID are adjacent in the index.
+  Entries _lru;
+  std::map<std::string, Entries::iterator> _index;
+  size_t _bytes;
+  pthread_mutex_t _lock;
+};
+
+#endif
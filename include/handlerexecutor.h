@@ -0,0 +1,110 @@
+/**
+ * @file handlerexecutor.h Runs handler work off the Diameter threads.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef HANDLEREXECUTOR_H__
+#define HANDLEREXECUTOR_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+#include <boost/function.hpp>
+
+#include "statisticsmanager.h"
+
+/// A pool of threads (normally one per core) that handler work is passed to,
+/// so that freeDiameter's threads only have to decode messages and queue
+/// them. This stops slow processing of one message (such as parsing a large
+/// User-Data document) from holding up answers to other requests.
+class HandlerExecutor
+{
+public:
+  /// The stages of processing that can be passed to the executor. The time
+  /// spent running each is reported separately.
+  enum Stage
+  {
+    CX_ANSWER, // Handling an answer to a Cx request we sent.
+    RTR,       // Handling a Registration-Termination request.
+    PPR        // Handling a Push-Profile request.
+  };
+
+  typedef boost::function<void()> work_t;
+
+  /// Constructor.
+  /// @param num_threads - the number of threads to run work on.
+  /// @param stats       - statistics manager to report the queue depth and
+  ///                      timings to (may be NULL).
+  HandlerExecutor(int num_threads, StatisticsManager* stats = NULL);
+  virtual ~HandlerExecutor();
+
+  /// Starts the worker threads.
+  void start();
+
+  /// Stops the worker threads, once they have run all the queued work.
+  void stop();
+
+  /// Queues work to run on one of the worker threads.
+  void submit(Stage stage, work_t work);
+
+  /// Returns the number of pieces of work waiting to run.
+  size_t depth();
+
+private:
+  struct Item
+  {
+    Stage stage;
+    work_t work;
+    uint64_t queued_us;
+  };
+
+  static uint64_t now_us();
+  void run(Item& item);
+  void thread_function();
+  static void* thread_entry_point(void* executor);
+
+  int _num_threads;
+  StatisticsManager* _stats;
+
+  std::deque<Item> _queue;
+  std::vector<pthread_t> _threads;
+  bool _terminated;
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+};
+
+#endif
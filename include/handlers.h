@@ -37,6 +37,9 @@
 #ifndef HANDLERS_H__
 #define HANDLERS_H__
 
+#include <deque>
+#include <map>
+
 #include <boost/bind.hpp>
 
 #include "cx.h"
@@ -47,6 +50,21 @@
 #include "sas.h"
 #include "sproutconnection.h"
 #include "health_checker.h"
+#include "hotkeytracker.h"
+#include "akavectorpool.h"
+#include "digestavcache.h"
+#include "icscfcache.h"
+#include "cxlimiter.h"
+#include "adaptivetimeout.h"
+#include "cxhedger.h"
+#include "cxpeerselector.h"
+#include "cxcircuitbreaker.h"
+#include "handlerexecutor.h"
+#include "bulkderegistrar.h"
+#include "responsecompressor.h"
+#include "regdatacache.h"
+#include "imssubscription.h"
+#include "load_monitor.h"
 
 // Result-Code AVP constants
 const int32_t DIAMETER_SUCCESS = 2001;
@@ -56,6 +74,7 @@ const int32_t DIAMETER_SUBSEQUENT_REGISTRATION = 2002;
 const int32_t DIAMETER_UNREGISTERED_SERVICE = 2003;
 //Added as per RFC 3588 
 const int32_t DIAMETER_COMMAND_UNSUPPORTED = 3001;
+const int32_t DIAMETER_UNABLE_TO_DELIVER = 3002;
 const int32_t DIAMETER_REALM_NOT_SERVED = 3003;
 const int32_t DIAMETER_TOO_BUSY = 3004;
 const int32_t DIAMETER_LOOP_DETECTED = 3005;
@@ -123,6 +142,23 @@ const std::string JSON_CRYPTKEY = "cryptkey";
 const std::string JSON_INTEGRITYKEY = "integritykey";
 const std::string JSON_RC = "result-code";
 const std::string JSON_SCSCF = "scscf";
+const std::string JSON_PEERS = "peers";
+const std::string JSON_HOST = "host";
+const std::string JSON_LATENCY_US = "latency_us";
+const std::string JSON_ERROR_RATE = "error_rate";
+const std::string JSON_OUTSTANDING = "outstanding";
+const std::string JSON_DEGRADED = "degraded";
+const std::string JSON_QUEUED = "queued";
+const std::string JSON_IN_PROGRESS = "in_progress";
+const std::string JSON_SUCCEEDED = "succeeded";
+const std::string JSON_FAILED = "failed";
+const std::string JSON_CONCURRENCY = "concurrency";
+const std::string JSON_IMPU = "impu";
+const std::string JSON_PRIVATE_ID = "private_id";
+const std::string JSON_REQTYPE = "reqtype";
+const std::string JSON_RESPONSES = "responses";
+const std::string JSON_STATUS = "status";
+const std::string JSON_BODY = "body";
 
 enum class StatsFlags
   {
@@ -134,9 +170,7 @@ enum class StatsFlags
 class HssCacheTask : public HttpStackUtils::Task
 {
 public:
-  HssCacheTask(HttpStack::Request& req, SAS::TrailId trail) :
-    HttpStackUtils::Task(req, trail)
-  {};
+  HssCacheTask(HttpStack::Request& req, SAS::TrailId trail);
 
   static void configure_diameter(Diameter::Stack* diameter_stack,
                                  const std::string& dest_realm,
@@ -146,6 +180,36 @@ public:
   static void configure_cache(Cache* cache);
   static void configure_health_checker(HealthChecker* hc);
   static void configure_stats(StatisticsManager* stats_manager);
+  static void configure_hot_key_tracker(HotKeyTracker* tracker);
+  static void configure_icscf_cache(IcscfCache* icscf_cache);
+  static void configure_request_coalescing(bool enabled);
+  static void configure_cx_limiter(CxLimiter* cx_limiter);
+  static void configure_adaptive_timeouts(AdaptiveTimeout* mar_timeout,
+                                          AdaptiveTimeout* sar_timeout,
+                                          AdaptiveTimeout* uar_timeout,
+                                          AdaptiveTimeout* lir_timeout);
+  static void configure_hedging(CxHedger* cx_hedger,
+                                AdaptiveTimeout* mar_hedge_delay,
+                                AdaptiveTimeout* uar_hedge_delay,
+                                AdaptiveTimeout* lir_hedge_delay);
+  static void configure_cx_peer_selector(CxPeerSelector* cx_peer_selector);
+  static void configure_cx_circuit_breaker(CxCircuitBreaker* cx_circuit_breaker);
+  static void configure_default_deadline(int default_deadline_ms);
+  static void configure_handler_executor(HandlerExecutor* handler_executor);
+
+  /// Runs work on the handler executor if there is one, and otherwise
+  /// straight away on this thread.
+  static void dispatch(HandlerExecutor::Stage stage,
+                       HandlerExecutor::work_t work);
+
+  /// The request header Sprout can use to say how long (in milliseconds) it
+  /// will wait for an answer.
+  static const std::string DEADLINE_HEADER;
+
+  /// Discards any cached I-CSCF answers for the private and public IDs, for
+  /// example because the HSS has told us the subscriber has moved.
+  static void invalidate_icscf_answers(const std::vector<std::string>& impis,
+                                       const std::vector<std::string>& impus);
 
   inline Cache* cache() const
   {
@@ -153,6 +217,25 @@ public:
   }
 
   void on_diameter_timeout();
+  void on_hss_unavailable();
+
+  /// Called once this task has replied and has nothing more to do. Deletes
+  /// the task.
+  virtual void finish_task();
+
+  /// Whether the requester has already given up on this request, so there
+  /// is no point doing any more work on it. If so, the caller should call
+  /// on_deadline_expired() rather than carrying on.
+  bool past_deadline() const;
+  void on_deadline_expired();
+
+  /// Returns timeout_ms, cut down to the time left before the deadline.
+  int remaining_timeout_ms(int timeout_ms) const;
+
+  /// Stops this task from being abandoned at its deadline. Must be called
+  /// for requests that change state, which have to be finished whether or
+  /// not the requester is still waiting for the answer.
+  void clear_deadline();
 
   // Stats the HSS cache handlers can update.
   
@@ -162,6 +245,8 @@ public:
   public:
     typedef void(H::*timeout_clbk_t)();
     typedef void(H::*response_clbk_t)(Diameter::Message&);
+    typedef boost::function<void(DiameterTransaction<H>*, int)> transmit_clbk_t;
+    typedef void(StatisticsManager::*timeout_stat_t)(unsigned long);
 
     DiameterTransaction(Cx::Dictionary* dict,
                         H* handler,
@@ -170,47 +255,742 @@ public:
                         timeout_clbk_t timeout_clbk = &HssCacheTask::on_diameter_timeout) :
       Diameter::Transaction(dict,
                             ((handler != NULL) ? handler->trail() : 0)),
+      _cx_dict(dict),
       _handler(handler),
       _stat_updates(stat_updates),
       _response_clbk(response_clbk),
-      _timeout_clbk(timeout_clbk)
+      _timeout_clbk(timeout_clbk),
+      _in_flight_key(),
+      _limited(false),
+      _adaptive_timeout(NULL),
+      _default_timeout_ms(0),
+      _hedge_delay(NULL),
+      _hedge_group(NULL),
+      _is_hedge(false),
+      _breaker_allowed(false)
     {};
 
+    /// Constructor for a background request that no handler is waiting on.
+    /// Subclasses deal with the answer by overriding on_response and
+    /// on_timeout (and calling up to this class's versions).
+    DiameterTransaction(Cx::Dictionary* dict,
+                        StatsFlags stat_updates,
+                        SAS::TrailId trail) :
+      Diameter::Transaction(dict, trail),
+      _cx_dict(dict),
+      _handler(NULL),
+      _stat_updates(stat_updates),
+      _response_clbk(NULL),
+      _timeout_clbk(NULL),
+      _in_flight_key(),
+      _limited(false),
+      _adaptive_timeout(NULL),
+      _default_timeout_ms(0),
+      _hedge_delay(NULL),
+      _hedge_group(NULL),
+      _is_hedge(false),
+      _breaker_allowed(false)
+    {};
+
+    virtual ~DiameterTransaction()
+    {
+      stop_leading();
+    }
+
+    /// If request coalescing is enabled and an identical request (as
+    /// identified by the key) is already in flight, attaches this
+    /// transaction's handler to that request and returns true. The caller
+    /// should then delete this transaction rather than sending it.
+    ///
+    /// Otherwise returns false, and this transaction becomes the one that
+    /// later identical requests attach to until it completes.
+    bool join_in_flight(const std::string& key)
+    {
+      if (!HssCacheTask::_coalesce_requests)
+      {
+        return false;
+      }
+
+      bool joined = false;
+      pthread_mutex_lock(&_in_flight_lock);
+
+      typename std::map<std::string, DiameterTransaction<H>*>::iterator it =
+                                                          _in_flight.find(key);
+      if (it != _in_flight.end())
+      {
+        it->second->_followers.push_back(_handler);
+        joined = true;
+      }
+      else
+      {
+        _in_flight[key] = this;
+        _in_flight_key = key;
+      }
+
+      pthread_mutex_unlock(&_in_flight_lock);
+
+      return joined;
+    }
+
+    /// Returns the timeout to use for this request - from adaptive_timeout
+    /// if there is one (in which case this request's latency is fed back to
+    /// it when the request completes, and the timeout is recorded in
+    /// timeout_stat), and otherwise default_ms. Either way the timeout is
+    /// cut down to the time left before the handler's deadline.
+    int choose_timeout(AdaptiveTimeout* adaptive_timeout,
+                       timeout_stat_t timeout_stat,
+                       int default_ms)
+    {
+      _adaptive_timeout = adaptive_timeout;
+      _default_timeout_ms = default_ms;
+
+      if (adaptive_timeout != NULL)
+      {
+        StatisticsManager* stats = HssCacheTask::_stats_manager;
+        if (stats != NULL)
+        {
+          (stats->*timeout_stat)(adaptive_timeout->timeout_ms());
+        }
+      }
+
+      return current_timeout_ms();
+    }
+
+    /// Sends a request on this transaction, by calling transmit_clbk. If
+    /// there is a Cx concurrency limiter this may happen later, once the HSS
+    /// has room for the request, so the timeout passed to transmit_clbk is
+    /// worked out afresh when it is called. (timeout_ms is how long the
+    /// request may wait for room.) If the limiter sheds the request instead,
+    /// its handlers are timed out and this transaction is deleted.
+    ///
+    /// If the handler's deadline has already passed, or the HSS circuit
+    /// breaker is open, the handlers are failed and this transaction is
+    /// deleted without sending anything.
+    void send_limited(CxLimiter::Priority priority,
+                      int timeout_ms,
+                      transmit_clbk_t transmit_clbk)
+    {
+      // A hedge's handler may already have gone away, so it checks the
+      // deadline when it's sent instead.
+      if ((!_is_hedge) && (_handler != NULL) && (_handler->past_deadline()))
+      {
+        fail_without_sending(&HssCacheTask::on_deadline_expired);
+        return;
+      }
+
+      CxCircuitBreaker* breaker = HssCacheTask::_cx_circuit_breaker;
+      if (breaker != NULL)
+      {
+        if (!breaker->allow(trail()))
+        {
+          if (_is_hedge)
+          {
+            drop_hedge();
+          }
+          else
+          {
+            fail_without_sending(&HssCacheTask::on_hss_unavailable);
+          }
+          return;
+        }
+        _breaker_allowed = true;
+      }
+
+      CxLimiter* limiter = HssCacheTask::_cx_limiter;
+
+      if (limiter == NULL)
+      {
+        transmit(transmit_clbk);
+      }
+      else
+      {
+        _limited = true;
+        limiter->send(priority,
+                      timeout_ms,
+                      boost::bind(&DiameterTransaction<H>::transmit,
+                                  this,
+                                  transmit_clbk),
+                      boost::bind(&DiameterTransaction<H>::shed, this));
+      }
+    }
+
+    /// Returns the Destination-Host to send this request to - the configured
+    /// host if there is one, and otherwise the peer picked by the HSS peer
+    /// selector (if any).
+    std::string choose_dest_host(const std::string& configured_host)
+    {
+      CxPeerSelector* selector = HssCacheTask::_cx_peer_selector;
+
+      if ((!configured_host.empty()) || (selector == NULL))
+      {
+        return configured_host;
+      }
+
+      _peer = selector->choose(_avoid_peer);
+      return _peer;
+    }
+
+    /// If hedging is configured (and hedge_delay isn't NULL), arranges for
+    /// this request to be sent again on a second transaction if it hasn't
+    /// been answered after the hedge delay. Whichever answer arrives first is
+    /// passed to the handlers, and the other is dropped. The hedge goes
+    /// through the circuit breaker and concurrency limiter (at low priority)
+    /// like any other request.
+    ///
+    /// Must be called just before the request is first sent, with a
+    /// transmit_clbk that sends the request on the transaction it is given.
+    /// Does nothing when called for the hedge itself.
+    void hedge(AdaptiveTimeout* hedge_delay,
+               int timeout_ms,
+               transmit_clbk_t transmit_clbk)
+    {
+      CxHedger* hedger = HssCacheTask::_cx_hedger;
+
+      if ((hedger == NULL) ||
+          (hedge_delay == NULL) ||
+          (_is_hedge) ||
+          (_hedge_group != NULL))
+      {
+        return;
+      }
+
+      // This request's latency feeds into the hedge delay whether or not it
+      // gets hedged. There's no point hedging if the hedge would have no
+      // time left before the original times out.
+      _hedge_delay = hedge_delay;
+      int delay_ms = hedge_delay->timeout_ms();
+      if (delay_ms >= timeout_ms)
+      {
+        return;
+      }
+
+      _hedge_group = new HedgeGroup(this, timeout_ms - delay_ms, transmit_clbk);
+      hedger->schedule(delay_ms,
+                       boost::bind(&DiameterTransaction<H>::send_hedge,
+                                   _hedge_group));
+    }
+
   protected:
+    Cx::Dictionary* _cx_dict;
     H* _handler;
     StatsFlags _stat_updates;
     response_clbk_t _response_clbk;
     timeout_clbk_t _timeout_clbk;
 
+    // Handlers that are waiting for the answer to this request, and the key
+    // this request is in flight under (if any).
+    std::vector<H*> _followers;
+    std::string _in_flight_key;
+
+    static std::map<std::string, DiameterTransaction<H>*> _in_flight;
+    static pthread_mutex_t _in_flight_lock;
+
     void on_timeout()
     {
-      update_latency_stats();
+      record_latency();
+      release_cx_slot(true);
+      report_to_peer_selector(NULL, true);
 
-      if ((_handler != NULL) && (_timeout_clbk != NULL))
+      std::vector<H*> followers;
+      bool deliver = finish(false, followers);
+      report_to_circuit_breaker(true);
+
+      if (deliver)
       {
-        boost::bind(_timeout_clbk, _handler)();
+        update_latency_stats();
+        time_out_handlers(followers);
       }
     }
 
     void on_response(Diameter::Message& rsp)
     {
+      record_latency();
+
+      int32_t result_code = 0;
+      bool overloaded = (rsp.result_code(result_code) && (result_code == 3004));
+      release_cx_slot(overloaded);
+      report_to_peer_selector(&rsp, overloaded);
+
+      std::vector<H*> followers;
+      bool deliver = finish(true, followers);
+      report_to_circuit_breaker(overloaded ||
+                                (result_code == DIAMETER_UNABLE_TO_DELIVER));
+
+      if (!deliver)
+      {
+        // The other copy of a hedged request has already been answered.
+        return;
+      }
+
       update_latency_stats();
 
       // If we got an overload response (result code of 3004) record a penalty
       // for the purposes of overload control.
-      int32_t result_code;
-      if (rsp.result_code(result_code) && (result_code == 3004))
+      if ((overloaded) && (_handler != NULL))
       {
         _handler->record_penalty();
       }
 
-      if ((_handler != NULL) && (_response_clbk != NULL))
+      if (_response_clbk != NULL)
       {
-        boost::bind(_response_clbk, _handler, rsp)();
+        HandlerExecutor* executor = HssCacheTask::_handler_executor;
+
+        if (executor == NULL)
+        {
+          deliver_response(_handler, followers, _response_clbk, rsp);
+        }
+        else
+        {
+          // Pass the answer to a handler thread, which takes ownership of
+          // it, so that processing it doesn't hold up this Diameter thread.
+          struct msg* fd_rsp = rsp.fd_msg();
+          rsp.revoke_ownership();
+          executor->submit(HandlerExecutor::CX_ANSWER,
+                           boost::bind(&DiameterTransaction<H>::deliver_queued_response,
+                                       _cx_dict,
+                                       _handler,
+                                       followers,
+                                       _response_clbk,
+                                       fd_rsp));
+        }
       }
     }
 
   private:
+    // Passes an answer to the handler and any followers.
+    static void deliver_response(H* handler,
+                                 const std::vector<H*>& followers,
+                                 response_clbk_t response_clbk,
+                                 Diameter::Message& rsp)
+    {
+      if (handler != NULL)
+      {
+        boost::bind(response_clbk, handler, rsp)();
+      }
+
+      // The callbacks only read the answer, so every follower can be given
+      // the same one.
+      for (typename std::vector<H*>::const_iterator it = followers.begin();
+           it != followers.end();
+           ++it)
+      {
+        boost::bind(response_clbk, *it, rsp)();
+      }
+    }
+
+    // As above, for an answer that has been passed to a handler thread.
+    static void deliver_queued_response(Cx::Dictionary* dict,
+                                        H* handler,
+                                        std::vector<H*> followers,
+                                        response_clbk_t response_clbk,
+                                        struct msg* fd_rsp)
+    {
+      Diameter::Message rsp(dict, fd_rsp, HssCacheTask::_diameter_stack);
+      deliver_response(handler, followers, response_clbk, rsp);
+    }
+
+    // State shared between a hedged request and its hedge. The group is
+    // reference counted, as the transactions and the scheduled hedge can go
+    // away in any order.
+    struct HedgeGroup
+    {
+      HedgeGroup(DiameterTransaction<H>* primary,
+                 int hedge_timeout_ms,
+                 transmit_clbk_t transmit_clbk) :
+        primary(primary),
+        hedge_timeout_ms(hedge_timeout_ms),
+        transmit_clbk(transmit_clbk),
+        refs(2),
+        outstanding(1),
+        done(false),
+        breaker_allowed(false),
+        transmitting(NULL)
+      {
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&transmitted, NULL);
+      }
+
+      ~HedgeGroup()
+      {
+        pthread_cond_destroy(&transmitted);
+        pthread_mutex_destroy(&lock);
+      }
+
+      // The original transaction, while it is outstanding.
+      DiameterTransaction<H>* primary;
+      int hedge_timeout_ms;
+      transmit_clbk_t transmit_clbk;
+
+      // Handlers waiting for the answer that the original transaction has
+      // handed over.
+      std::vector<H*> followers;
+
+      int refs;
+      int outstanding;
+      bool done;
+
+      // Whether the circuit breaker let any of the transactions through. The
+      // group's outcome is reported to it once, by the transaction that
+      // finishes the group.
+      bool breaker_allowed;
+
+      // The hedge, while it is being built and sent. It uses the handler's
+      // state, so the result isn't passed to the handler (which may then go
+      // away) until it has finished.
+      DiameterTransaction<H>* transmitting;
+      pthread_cond_t transmitted;
+
+      pthread_mutex_t lock;
+    };
+
+    bool _limited;
+    AdaptiveTimeout* _adaptive_timeout;
+    int _default_timeout_ms;
+    AdaptiveTimeout* _hedge_delay;
+    HedgeGroup* _hedge_group;
+    bool _is_hedge;
+
+    // The peer this request was sent to, if the HSS peer selector chose
+    // one, and a peer to avoid if possible.
+    std::string _peer;
+    std::string _avoid_peer;
+
+    // Whether the HSS circuit breaker let this request through, and so
+    // needs to know how it went.
+    bool _breaker_allowed;
+
+    // The timeout for this request as of now - from its adaptive timeout if
+    // it has one, and otherwise its default - cut down to the time left
+    // before the handler's deadline.
+    int current_timeout_ms() const
+    {
+      int timeout_ms = (_adaptive_timeout != NULL) ?
+                         _adaptive_timeout->timeout_ms() : _default_timeout_ms;
+
+      if (_handler != NULL)
+      {
+        timeout_ms = _handler->remaining_timeout_ms(timeout_ms);
+      }
+
+      return timeout_ms;
+    }
+
+    // Sends this request now, with the timeout as it stands now.
+    void transmit(transmit_clbk_t transmit_clbk)
+    {
+      if (_is_hedge)
+      {
+        transmit_hedge(transmit_clbk);
+      }
+      else
+      {
+        transmit_clbk(this, current_timeout_ms());
+      }
+    }
+
+    // As above, for a hedge. The hedge is only sent if the original request
+    // hasn't finished yet, and the handlers aren't passed the result until
+    // it has been sent.
+    void transmit_hedge(transmit_clbk_t transmit_clbk)
+    {
+      HedgeGroup* group = _hedge_group;
+
+      pthread_mutex_lock(&group->lock);
+      bool send = ((!group->done) && (!_handler->past_deadline()));
+      if (send)
+      {
+        group->transmitting = this;
+        group->refs++;
+      }
+      pthread_mutex_unlock(&group->lock);
+
+      if (!send)
+      {
+        release_cx_slot(false);
+        drop_hedge();
+        return;
+      }
+
+      // Once it is sent, this transaction may complete (and be deleted) at
+      // any time, so only the group is used after this.
+      transmit_clbk(this, current_timeout_ms());
+
+      pthread_mutex_lock(&group->lock);
+      group->transmitting = NULL;
+      pthread_cond_broadcast(&group->transmitted);
+      pthread_mutex_unlock(&group->lock);
+      release(group);
+    }
+
+    // Called instead of sending a hedge if it isn't needed, or can't be
+    // sent. If the original request has already timed out, this times out
+    // the handlers and reports the timeout to the circuit breaker.
+    void drop_hedge()
+    {
+      std::vector<H*> followers;
+      bool deliver = finish(false, followers);
+      report_to_circuit_breaker(true);
+
+      if (deliver)
+      {
+        time_out_handlers(followers);
+      }
+
+      delete this;
+    }
+
+    // Called by the hedger when a hedge is due. Sends the hedge if neither
+    // transaction has finished and the hedge budget allows it.
+    static void send_hedge(HedgeGroup* group)
+    {
+      DiameterTransaction<H>* tsx = NULL;
+
+      pthread_mutex_lock(&group->lock);
+
+      if ((!group->done) &&
+          (group->primary != NULL) &&
+          (HssCacheTask::_cx_hedger->try_hedge()))
+      {
+        TRC_DEBUG("No answer from HSS yet - hedging request");
+        DiameterTransaction<H>* primary = group->primary;
+        tsx = new DiameterTransaction<H>(primary->_cx_dict,
+                                         primary->_handler,
+                                         primary->_stat_updates,
+                                         primary->_response_clbk,
+                                         primary->_timeout_clbk);
+        tsx->_is_hedge = true;
+        tsx->_avoid_peer = primary->_peer;
+        tsx->_default_timeout_ms = group->hedge_timeout_ms;
+        tsx->_hedge_group = group;
+        group->refs++;
+        group->outstanding++;
+      }
+
+      pthread_mutex_unlock(&group->lock);
+
+      if (tsx != NULL)
+      {
+        tsx->send_limited(CxLimiter::LOW,
+                          group->hedge_timeout_ms,
+                          group->transmit_clbk);
+      }
+
+      release(group);
+    }
+
+    static void release(HedgeGroup* group)
+    {
+      pthread_mutex_lock(&group->lock);
+      bool last = (--group->refs == 0);
+      pthread_mutex_unlock(&group->lock);
+
+      if (last)
+      {
+        delete group;
+      }
+    }
+
+    // Called when this transaction is answered or times out. Returns true if
+    // the result should be passed to the handlers (filling in the other
+    // handlers that are waiting for it), or false if this is the losing half
+    // of a hedged request.
+    //
+    // A hedged request is finished by the first answer, or by the timeout
+    // of whichever transaction is outstanding last. Only the transaction
+    // that finishes it reports to the circuit breaker, once for the group.
+    bool finish(bool answered, std::vector<H*>& followers)
+    {
+      HedgeGroup* group = _hedge_group;
+
+      if (group == NULL)
+      {
+        followers = stop_leading();
+        return true;
+      }
+
+      pthread_mutex_lock(&group->lock);
+
+      group->outstanding--;
+      group->breaker_allowed = group->breaker_allowed || _breaker_allowed;
+      _breaker_allowed = false;
+      if (group->primary == this)
+      {
+        std::vector<H*> stopped = stop_leading();
+        group->followers.insert(group->followers.end(),
+                                stopped.begin(),
+                                stopped.end());
+        group->primary = NULL;
+      }
+
+      bool deliver = ((!group->done) &&
+                      ((answered) || (group->outstanding == 0)));
+      if (deliver)
+      {
+        group->done = true;
+        _breaker_allowed = group->breaker_allowed;
+
+        // Wait for the hedge to be sent before the handlers can go away.
+        while ((group->transmitting != NULL) && (group->transmitting != this))
+        {
+          pthread_cond_wait(&group->transmitted, &group->lock);
+        }
+
+        followers.swap(group->followers);
+
+        if ((_is_hedge) && (answered))
+        {
+          HssCacheTask::_cx_hedger->hedge_won();
+        }
+      }
+
+      pthread_mutex_unlock(&group->lock);
+
+      _hedge_group = NULL;
+      release(group);
+
+      return deliver;
+    }
+
+    // Feeds this request's latency back to its adaptive timeout and hedge
+    // delay, if it has them.
+    void record_latency()
+    {
+      unsigned long latency = 0;
+      if (((_adaptive_timeout != NULL) || (_hedge_delay != NULL)) &&
+          (get_duration(latency)))
+      {
+        if (_adaptive_timeout != NULL)
+        {
+          _adaptive_timeout->record(latency);
+        }
+        if (_hedge_delay != NULL)
+        {
+          _hedge_delay->record(latency);
+        }
+      }
+    }
+
+    void time_out_handlers(const std::vector<H*>& followers)
+    {
+      if (_timeout_clbk != NULL)
+      {
+        if (_handler != NULL)
+        {
+          boost::bind(_timeout_clbk, _handler)();
+        }
+
+        for (typename std::vector<H*>::const_iterator it = followers.begin();
+             it != followers.end();
+             ++it)
+        {
+          boost::bind(_timeout_clbk, *it)();
+        }
+      }
+    }
+
+    // Called instead of sending this request if there's no point sending
+    // it. Fails the handlers using fail_clbk.
+    void fail_without_sending(timeout_clbk_t fail_clbk)
+    {
+      std::vector<H*> followers = stop_leading();
+
+      if (_handler != NULL)
+      {
+        boost::bind(fail_clbk, _handler)();
+      }
+
+      for (typename std::vector<H*>::iterator it = followers.begin();
+           it != followers.end();
+           ++it)
+      {
+        boost::bind(fail_clbk, *it)();
+      }
+
+      delete this;
+    }
+
+    // Tells the HSS circuit breaker how this request went, if it let the
+    // request through.
+    void report_to_circuit_breaker(bool failed)
+    {
+      if (_breaker_allowed)
+      {
+        HssCacheTask::_cx_circuit_breaker->on_complete(failed, trail());
+        _breaker_allowed = false;
+      }
+    }
+
+    // Called by the Cx concurrency limiter if it won't send this request.
+    // The request never reached the HSS, so it doesn't count against it.
+    void shed()
+    {
+      if (_is_hedge)
+      {
+        drop_hedge();
+        return;
+      }
+
+      report_to_circuit_breaker(false);
+      time_out_handlers(stop_leading());
+      delete this;
+    }
+
+    // Tells the Cx concurrency limiter this request has completed, freeing
+    // its slot for the next one.
+    void release_cx_slot(bool failed)
+    {
+      if (_limited)
+      {
+        unsigned long latency = 0;
+        get_duration(latency);
+        HssCacheTask::_cx_limiter->on_complete(latency, failed);
+        _limited = false;
+      }
+    }
+
+    // Tells the HSS peer selector how this request went. The answer (if
+    // there is one) says which peer answered it.
+    void report_to_peer_selector(Diameter::Message* rsp, bool failed)
+    {
+      CxPeerSelector* selector = HssCacheTask::_cx_peer_selector;
+
+      if (selector != NULL)
+      {
+        std::string answered_by;
+        if (rsp != NULL)
+        {
+          rsp->get_str_from_avp(_cx_dict->ORIGIN_HOST, answered_by);
+        }
+
+        unsigned long latency = 0;
+        get_duration(latency);
+        selector->on_complete(_peer, answered_by, latency, failed);
+      }
+    }
+
+    // Stops later identical requests from attaching to this one, and returns
+    // the handlers that have already attached.
+    std::vector<H*> stop_leading()
+    {
+      std::vector<H*> followers;
+
+      if (!_in_flight_key.empty())
+      {
+        pthread_mutex_lock(&_in_flight_lock);
+        typename std::map<std::string, DiameterTransaction<H>*>::iterator it =
+                                               _in_flight.find(_in_flight_key);
+        if ((it != _in_flight.end()) && (it->second == this))
+        {
+          _in_flight.erase(it);
+        }
+        followers.swap(_followers);
+        _in_flight_key.clear();
+        pthread_mutex_unlock(&_in_flight_lock);
+      }
+
+      return followers;
+    }
+
     void update_latency_stats()
     {
       StatisticsManager* stats = HssCacheTask::_stats_manager;
@@ -312,8 +1092,56 @@ protected:
   static Cache* _cache;
   static HealthChecker* _health_checker;
   static StatisticsManager* _stats_manager;
+  static HotKeyTracker* _hot_key_tracker;
+  static IcscfCache* _icscf_cache;
+  static bool _coalesce_requests;
+  static CxLimiter* _cx_limiter;
+  static CxHedger* _cx_hedger;
+  static CxPeerSelector* _cx_peer_selector;
+  static CxCircuitBreaker* _cx_circuit_breaker;
+  static int _default_deadline_ms;
+  static HandlerExecutor* _handler_executor;
+  static AdaptiveTimeout* _mar_hedge_delay;
+  static AdaptiveTimeout* _uar_hedge_delay;
+  static AdaptiveTimeout* _lir_hedge_delay;
+  static AdaptiveTimeout* _mar_timeout;
+  static AdaptiveTimeout* _sar_timeout;
+  static AdaptiveTimeout* _uar_timeout;
+  static AdaptiveTimeout* _lir_timeout;
+
+  bool reply_from_icscf_cache(const std::string& key);
+
+  // Add content to and send the HTTP reply. These are virtual so that tasks
+  // run on behalf of another request (such as the entries in a batch) can
+  // hand their replies back to it instead.
+  virtual void add_content(const std::string& content)
+  {
+    _req.add_content(content);
+  }
+
+  virtual void add_header(const std::string& name, const std::string& value)
+  {
+    _req.add_header(name, value);
+  }
+
+  virtual void send_http_reply(int status_code)
+  {
+    HttpStackUtils::Task::send_http_reply(status_code);
+  }
+
+  // The time (from the monotonic clock, in milliseconds) after which the
+  // requester will have given up on this request, or 0 if there's no
+  // deadline.
+  uint64_t _deadline_ms;
 };
 
+template <class H>
+std::map<std::string, HssCacheTask::DiameterTransaction<H>*>
+  HssCacheTask::DiameterTransaction<H>::_in_flight;
+template <class H>
+pthread_mutex_t HssCacheTask::DiameterTransaction<H>::_in_flight_lock =
+  PTHREAD_MUTEX_INITIALIZER;
+
 class ImpiTask : public HssCacheTask
 {
 public:
@@ -353,14 +1181,33 @@ public:
   void query_cache_impu();
   void on_get_impu_success(CassandraStore::Operation* op);
   void on_get_impu_failure(CassandraStore::Operation* op, CassandraStore::ResultCode error, std::string& text);
+  void query_digest_av_cache();
+  void on_get_cached_digest_av_success(CassandraStore::Operation* op);
+  void on_get_cached_digest_av_failure(CassandraStore::Operation* op, CassandraStore::ResultCode error, std::string& text);
   void send_mar();
   void on_mar_response(Diameter::Message& rsp);
   virtual void send_reply(const DigestAuthVector& av) = 0;
   virtual void send_reply(const AKAAuthVector& av) = 0;
   typedef HssCacheTask::CacheTransaction<ImpiTask> CacheTransaction;
   typedef HssCacheTask::DiameterTransaction<ImpiTask> DiameterTransaction;
+  void transmit_mar(DiameterTransaction* tsx, int timeout_ms);
+
+  static void configure_aka_vector_pool(AkaVectorPool* pool);
+  static void configure_digest_av_cache(DigestAvCache* cache);
+
+  /// Discards any digest vectors cached from the HSS for the private IDs,
+  /// for example because the HSS has told us the subscriber has changed.
+  static void invalidate_digest_avs(const std::vector<std::string>& impis);
 
 protected:
+  bool use_aka_vector_pool();
+  bool get_pooled_aka_vector();
+  void refill_aka_vector_pool();
+  void cache_digest_av(const DigestAuthVector& av);
+
+  static AkaVectorPool* _aka_vector_pool;
+  static DigestAvCache* _digest_av_cache;
+
   const Config* _cfg;
   std::string _impi;
   std::string _impu;
@@ -419,6 +1266,7 @@ public:
   void sas_log_hss_failure(int32_t result_code);
 
   typedef HssCacheTask::DiameterTransaction<ImpiRegistrationStatusTask> DiameterTransaction;
+  void transmit_uar(DiameterTransaction* tsx, int timeout_ms);
 
 private:
   const Config* _cfg;
@@ -456,6 +1304,7 @@ public:
 
   typedef HssCacheTask::DiameterTransaction<ImpuLocationInfoTask> DiameterTransaction;
   typedef HssCacheTask::CacheTransaction<ImpuLocationInfoTask> CacheTransaction;
+  void transmit_lir(DiameterTransaction* tsx, int timeout_ms);
 
 private:
   const Config* _cfg;
@@ -471,20 +1320,55 @@ public:
   {
     Config(bool _hss_configured = true,
            int _hss_reregistration_time = 3600,
-           int _diameter_timeout_ms = 200) :
+           int _diameter_timeout_ms = 200,
+           int _hss_reregistration_jitter = 0) :
       hss_configured(_hss_configured),
       hss_reregistration_time(_hss_reregistration_time),
-      diameter_timeout_ms(_diameter_timeout_ms) {}
+      diameter_timeout_ms(_diameter_timeout_ms),
+      hss_reregistration_jitter(_hss_reregistration_jitter) {}
     bool hss_configured;
     int hss_reregistration_time;
     int diameter_timeout_ms;
+    int hss_reregistration_jitter;
   };
 
   ImpuRegDataTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
-    HssCacheTask(req, trail), _cfg(cfg), _impi(), _impu()
+    HssCacheTask(req, trail), _cfg(cfg), _impi(), _impu(), _method(req.method()),
+    _subscription(ImsSubscription::create("")), _profile_cached(false),
+    _queued(false), _has_outcome(false)
   {}
-  virtual ~ImpuRegDataTask() {};
   virtual void run();
+  virtual void finish_task();
+  static void warm_up(const std::string& impu);
+  static void configure_reregistration_sar_rate(float max_rate);
+  static void configure_reg_data_serialization(bool enabled);
+  static void configure_incremental_irs_updates(bool enabled);
+  static void configure_response_compression(ResponseCompressor* compressor);
+  static void configure_reg_data_cache(RegDataCache* reg_data_cache);
+  static void configure_reg_data_streaming(bool enabled);
+
+  /// Returns everything the registration data is built from - the state,
+  /// User-Data and charging addresses - as a single string. Each part is
+  /// prefixed with its length, so different inputs can't run together.
+  static std::string reg_data_inputs(RegistrationState state,
+                                     const std::string& xml,
+                                     const ChargingAddresses& charging_addrs);
+
+  /// Returns the (strong) ETag for the registration data built from the
+  /// given inputs. This is only a hash of the inputs, so the cached bodies
+  /// check the inputs too.
+  static std::string reg_data_etag(const std::string& inputs);
+
+  /// Returns the ETag for the gzipped version of the body with the given
+  /// ETag. The two are different representations, so can't share a strong
+  /// ETag.
+  static std::string gzip_etag(const std::string& etag);
+
+  /// Whether the value of an If-None-Match header matches the ETag, or the
+  /// ETag of its gzipped version.
+  static bool etag_matches(const std::string& if_none_match,
+                           const std::string& etag);
+
   void on_get_reg_data_success(CassandraStore::Operation* op);
   void on_get_reg_data_failure(CassandraStore::Operation* op,
                                CassandraStore::ResultCode error,
@@ -494,6 +1378,9 @@ public:
 
   typedef HssCacheTask::CacheTransaction<ImpuRegDataTask> CacheTransaction;
   typedef HssCacheTask::DiameterTransaction<ImpuRegDataTask> DiameterTransaction;
+  void transmit_sar(DiameterTransaction* tsx,
+                    Cx::ServerAssignmentType type,
+                    int timeout_ms);
 
 protected:
 
@@ -507,22 +1394,114 @@ protected:
     UNKNOWN, REG, CALL, DEREG_USER, DEREG_ADMIN, DEREG_TIMEOUT, DEREG_AUTH_FAIL, DEREG_AUTH_TIMEOUT
   };
 
+  // The registration data for an IRS, either as read from the cache or as
+  // left there by the previous request for the same public ID.
+  struct RegData
+  {
+    RegData() :
+      state(RegistrationState::NOT_REGISTERED),
+      ttl(0),
+      ttl_updated_ms(0),
+      subscription(ImsSubscription::create(""))
+    {}
+    RegistrationState state;
+    int32_t ttl;
+    uint64_t ttl_updated_ms;
+    ImsSubscriptionPtr subscription;
+    std::vector<std::string> impis;
+    ChargingAddresses charging_addrs;
+  };
+
   virtual void send_reply();
+  void send_compressed_reply(const std::string& etag,
+                             const std::string& compressed);
+  int build_reg_data_body(const std::string& etag,
+                          const std::string& inputs,
+                          std::string& xml_str);
+  static int render_reg_data(RegistrationState state,
+                             const ImsSubscription& subscription,
+                             const ChargingAddresses& charging_addrs,
+                             std::string& xml_str);
+  static void prime_reg_data_cache(Cache::GetRegData* get_reg_data);
+  class WarmUpTransaction;
+  void get_reg_data();
+  void process_reg_data(const RegData& reg_data);
+  // A request that is ready to run because the one ahead of it in the queue
+  // has finished, and what that request left in the cache (if known).
+  struct HandOff
+  {
+    ImpuRegDataTask* next;
+    bool has_outcome;
+    RegData outcome;
+  };
+
+  bool join_impu_queue();
+  ImpuRegDataTask* leave_impu_queue();
+  static void run_hand_off(const HandOff& hand_off);
+  void resume(const RegData* reg_data);
   void put_in_cache();
   bool is_deregistration_request(RequestType type);
   bool is_auth_failure_request(RequestType type);
   Cx::ServerAssignmentType sar_type_for_request(RequestType type);
   RequestType request_type_from_body(std::string body);
+  static RequestType request_type_from_name(const std::string& reqtype);
   std::vector<std::string> get_associated_private_ids();
+  int reg_data_ttl();
+  int reregistration_threshold();
+  int reregistration_jitter();
+  static bool admit_reregistration_sar();
+
+  // Limits the rate at which RE_REGISTRATION SARs are sent to the HSS, shared
+  // across all tasks. NULL if the rate is unlimited.
+  static TokenBucket* _rereg_sar_bucket;
+  static pthread_mutex_t _rereg_sar_lock;
+
+  // When serialization is enabled, the PUTs in progress for each public ID,
+  // in arrival order. Only the request at the front of a queue runs - the
+  // others wait for it to finish.
+  static bool _serialize_reg_data;
+  static std::map<std::string, std::deque<ImpuRegDataTask*>> _impu_queues;
+  static pthread_mutex_t _impu_queues_lock;
+
+  // The hand-offs waiting to run on this thread, while it is running one.
+  static __thread std::deque<HandOff>* _pending_hand_offs;
+
+  // Whether to clean up public IDs that the HSS removes from an IRS.
+  static bool _incremental_irs_updates;
+
+  // Compresses large responses for clients that accept it. NULL if responses
+  // are never compressed.
+  static ResponseCompressor* _response_compressor;
+
+  // Holds recently sent registration data bodies. NULL if they aren't
+  // cached.
+  static RegDataCache* _reg_data_cache;
+
+  // Whether to splice the IMS subscription into reg-data bodies, rather
+  // than parsing it and printing it again.
+  static bool _stream_reg_data;
 
   const Config* _cfg;
   std::string _impi;
   std::string _impu;
+  htp_method _method;
+  std::string _if_none_match;
+  std::string _accept_encoding;
   std::string _type_param;
   RequestType _type;
-  std::string _xml;
+  ImsSubscriptionPtr _subscription;
   RegistrationState _new_state;
   ChargingAddresses _charging_addrs;
+  bool _profile_cached;
+
+  // The cached IMS subscription, if the HSS has sent a new one to replace it.
+  ImsSubscriptionPtr _replaced_subscription;
+
+  // Whether this request is in a per-public ID queue, and what it has left
+  // in the cache for the next request in that queue (if that's known).
+  bool _queued;
+  bool _has_outcome;
+  RegData _outcome;
 };
 
 class ImpuIMSSubscriptionTask : public ImpuRegDataTask
@@ -539,6 +1518,98 @@ private:
   void send_reply();
 };
 
+// Handles a batch of reg-data requests, for the URL "/impu/batch/reg-data".
+// The body is a JSON array of entries, each with an "impu" and optionally a
+// "private_id" and "reqtype" (as in a reg-data PUT - an entry without one is
+// treated like a GET). Each entry runs through the same logic as an
+// ImpuRegDataTask, but the cache reads for all of them are made in one
+// operation, and all their answers are returned in one response.
+class ImpuRegDataBatchTask : public HssCacheTask
+{
+public:
+  typedef ImpuRegDataTask::Config Config;
+
+  ImpuRegDataBatchTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail);
+  virtual ~ImpuRegDataBatchTask();
+
+  void run();
+  void on_get_reg_data_success(CassandraStore::Operation* op);
+  void on_get_reg_data_failure(CassandraStore::Operation* op,
+                               CassandraStore::ResultCode error,
+                               std::string& text);
+  void on_entry_complete(size_t index, int status_code, const std::string& body);
+
+  typedef HssCacheTask::CacheTransaction<ImpuRegDataBatchTask> CacheTransaction;
+
+  /// The most entries accepted in one batch.
+  static const size_t MAX_ENTRIES = 100;
+
+private:
+  class Entry;
+
+  struct Response
+  {
+    Response() : status_code(0) {}
+    std::string impu;
+    int status_code;
+    std::string body;
+  };
+
+  void release();
+  void send_reply();
+
+  const Config* _cfg;
+
+  // The entries waiting for the cache read, and the responses from all the
+  // entries. The batch is replied to once _outstanding drops to zero.
+  std::vector<Entry*> _reading;
+  std::vector<Response> _responses;
+  size_t _outstanding;
+  pthread_mutex_t _lock;
+};
+
+// Reports what the HSS peer selector knows about each HSS peer.
+class PeerStatusTask : public HssCacheTask
+{
+public:
+  struct Config {};
+
+  PeerStatusTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+    HssCacheTask(req, trail)
+  {}
+
+  void run();
+};
+
+// Administratively deregisters subscribers in bulk. A POST queues a list of
+// public and private IDs, one per line, for deregistration; a GET reports
+// progress through the deregistrations queued so far. Requests must carry
+// the configured secret as a bearer token, as this interface shares the
+// HTTP listener used by Sprout.
+class BulkDeregistrationTask : public HssCacheTask
+{
+public:
+  struct Config
+  {
+    Config(BulkDeregistrar* _deregistrar, const std::string& _secret) :
+      deregistrar(_deregistrar), secret(_secret) {}
+
+    BulkDeregistrar* deregistrar;
+    std::string secret;
+  };
+
+  BulkDeregistrationTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+    HssCacheTask(req, trail), _cfg(cfg)
+  {}
+
+  void run();
+
+private:
+  const Config* _cfg;
+
+  bool authorized();
+};
+
 class RegistrationTerminationTask : public Diameter::Task
 {
 public:
@@ -579,6 +1650,7 @@ private:
   std::vector<std::string> _impus;
   std::vector<std::vector<std::string>> _registration_sets;
 
+  void handle_rtr();
   void get_assoc_primary_public_ids_success(CassandraStore::Operation* op);
   void get_assoc_primary_public_ids_failure(CassandraStore::Operation* op,
                                             CassandraStore::ResultCode error,
@@ -589,6 +1661,7 @@ private:
                                     CassandraStore::ResultCode error,
                                     std::string& text);
   void delete_registrations();
+  void on_delete_registrations_complete(HTTPCode ret_code);
   void dissociate_implicit_registration_sets();
   void delete_impi_mappings();
   void send_rta(const std::string result_code);
@@ -602,49 +1675,108 @@ public:
     Config(Cache* _cache,
            Cx::Dictionary* _dict,
            int _impu_cache_ttl = 0,
-           int _hss_reregistration_time = 3600) :
+           int _hss_reregistration_time = 3600,
+           int _hss_reregistration_jitter = 0) :
       cache(_cache),
       dict(_dict),
       impu_cache_ttl(_impu_cache_ttl),
-      hss_reregistration_time(_hss_reregistration_time) {}
+      hss_reregistration_time(_hss_reregistration_time),
+      hss_reregistration_jitter(_hss_reregistration_jitter) {}
 
     Cache* cache;
     Cx::Dictionary* dict;
     int impu_cache_ttl;
     int hss_reregistration_time;
+    int hss_reregistration_jitter;
   };
 
   PushProfileTask(const Diameter::Dictionary* dict,
                   struct msg** fd_msg,
                   const Config* cfg,
                   SAS::TrailId trail) :
-    Diameter::Task(dict, fd_msg, trail), _cfg(cfg), _ppr(_msg)
+    Diameter::Task(dict, fd_msg, trail),
+    _cfg(cfg),
+    _ppr(_msg),
+    _impus_from_impi(false),
+    _next_irs(0),
+    _next_cached_irs_key(0)
   {}
 
   void run();
 
+  static void configure_ppr_batching(bool enabled);
+  static void configure_incremental_irs_updates(bool enabled);
+
   typedef HssCacheTask::CacheTransaction<PushProfileTask> CacheTransaction;
 
 private:
+  // When batching is enabled, the PPRs that have arrived for each IRS of a
+  // private ID while the cache is being updated for an earlier one. Once
+  // that update completes, they are all applied together.
+  static bool _batch_pprs;
+  static std::map<std::string, std::vector<PushProfileTask*>> _waiting_pprs;
+  static pthread_mutex_t _waiting_pprs_lock;
+
+  // Whether to compare new IMS subscriptions with the cached ones, and only
+  // update what has changed.
+  static bool _incremental_irs_updates;
+
   const Config* _cfg;
   Cx::PushProfileRequest _ppr;
 
+  // The batch this PPR belongs to - its private ID and, if it carries
+  // User-Data, the default public ID of the IRS it updates. A private ID can
+  // have several IRSs, and PPRs for different ones mustn't be merged.
+  std::string _batch_key;
+
+  // The PPRs whose updates have been merged into this one, and are answered
+  // along with it.
+  std::vector<PushProfileTask*> _batched_pprs;
+
   bool _ims_sub_present;
-  std::string _ims_subscription;
+  ImsSubscriptionPtr _ims_subscription;
   bool _charging_addrs_present;
   ChargingAddresses _charging_addrs;
   std::string _impi;
   std::vector<std::string> _impus;
 
+  // Whether _impus was looked up from the private ID, in which case each
+  // entry is the default public ID of a different IRS. _next_irs is the
+  // index of the IRS being written.
+  bool _impus_from_impi;
+  size_t _next_irs;
+
+  // The public IDs to try, in turn, when looking up the cached IMS
+  // subscription for the IRS being updated.
+  std::vector<std::string> _cached_irs_keys;
+  size_t _next_cached_irs_key;
+
+  void handle_ppr();
+  bool join_irs_batch();
+  void leave_irs_batch();
+  void apply_update();
   void on_get_impus_success(CassandraStore::Operation* op);
   void on_get_impus_failure(CassandraStore::Operation* op,
                             CassandraStore::ResultCode error,
                             std::string& text);
   void update_reg_data();
+  void on_get_irs_keys_success(CassandraStore::Operation* op);
+  void on_get_irs_keys_failure(CassandraStore::Operation* op,
+                               CassandraStore::ResultCode error,
+                               std::string& text);
+  void get_cached_irs();
+  void on_get_cached_irs_success(CassandraStore::Operation* op);
+  void on_get_cached_irs_failure(CassandraStore::Operation* op,
+                                 CassandraStore::ResultCode error,
+                                 std::string& text);
+  void write_reg_data();
+  void write_irs(const std::vector<std::string>& impus,
+                 const std::string& default_id);
   void update_reg_data_success(CassandraStore::Operation* op);
   void update_reg_data_failure(CassandraStore::Operation* op,
                                CassandraStore::ResultCode error,
                                std::string& text);
   void send_ppa(const std::string result_code);
+  void answer(const std::string& result_code);
 };
 #endif
@@ -81,6 +81,18 @@ namespace SASEvent
   const int NO_SIP_URI_IN_IRS = HOMESTEAD_BASE + 0x220;
   const int PPR_RECEIVED = HOMESTEAD_BASE + 0x230;
   const int RTR_RECEIVED = HOMESTEAD_BASE + 0x240;
+  const int AKA_AV_POOL_HIT = HOMESTEAD_BASE + 0x250;
+  const int DIGEST_AV_CACHE_HIT = HOMESTEAD_BASE + 0x260;
+  const int ICSCF_CACHE_HIT = HOMESTEAD_BASE + 0x270;
+  const int REG_DATA_QUEUED = HOMESTEAD_BASE + 0x280;
+  const int HSS_CIRCUIT_OPENED = HOMESTEAD_BASE + 0x290;
+  const int HSS_CIRCUIT_HALF_OPEN = HOMESTEAD_BASE + 0x2A0;
+  const int HSS_CIRCUIT_CLOSED = HOMESTEAD_BASE + 0x2B0;
+  const int HSS_FAST_FAIL = HOMESTEAD_BASE + 0x2C0;
+  const int DEADLINE_EXPIRED = HOMESTEAD_BASE + 0x2D0;
+  const int PPR_BATCHED = HOMESTEAD_BASE + 0x2E0;
+  const int BULK_DEREGISTRATION_QUEUED = HOMESTEAD_BASE + 0x2F0;
+  const int REG_DATA_BATCH = HOMESTEAD_BASE + 0x300;
 
 } // namespace SASEvent
 
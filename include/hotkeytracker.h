@@ -0,0 +1,125 @@
+/**
+ * @file hotkeytracker.h Tracks the most frequently requested keys so that
+ * they can be snapshotted to disk and used to warm up after a restart.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef HOTKEYTRACKER_H__
+#define HOTKEYTRACKER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+
+/// Keeps an approximate count of how often each key is requested, using a
+/// count-min sketch, and remembers the top K keys by estimated count.
+///
+/// The tracker can periodically write the top K keys to a snapshot file, and
+/// on startup can replay a previous snapshot through a warm-up callback at a
+/// throttled rate, so that a restarted node doesn't start completely cold.
+class HotKeyTracker
+{
+public:
+  /// Callback invoked for each key replayed during warm-up.
+  typedef boost::function<void(const std::string&)> warm_up_clbk_t;
+
+  /// Constructor.
+  /// @param snapshot_file     - file to read and write snapshots from. If
+  ///                            empty, snapshots are disabled.
+  /// @param max_keys          - the number of hot keys to remember.
+  /// @param snapshot_interval - how often (in seconds) to write a snapshot.
+  HotKeyTracker(const std::string& snapshot_file,
+                int max_keys = 1000,
+                int snapshot_interval = 300);
+  virtual ~HotKeyTracker();
+
+  /// Records a request for the given key.
+  void record(const std::string& key);
+
+  /// Returns the current hot keys, hottest first.
+  std::vector<std::string> hot_keys();
+
+  /// Writes the current hot keys to the snapshot file, and ages the counts
+  /// so that the hot set tracks changes in traffic.
+  bool save_snapshot();
+
+  /// Reads the hot keys from the snapshot file.
+  std::vector<std::string> load_snapshot();
+
+  /// Starts the background thread.  This replays the previous snapshot
+  /// through the warm-up callback (at no more than warm_up_rate keys per
+  /// second) and then writes a new snapshot every snapshot_interval seconds.
+  void start(warm_up_clbk_t warm_up_clbk, int warm_up_rate);
+
+  /// Stops the background thread, writing a final snapshot first.
+  void stop();
+
+private:
+  static const int SKETCH_DEPTH = 4;
+  static const int SKETCH_WIDTH = 4096;
+
+  uint32_t estimate(const std::string& key, bool increment);
+  void age();
+  bool wait_for(long ms);
+  void thread_function();
+  static void* thread_entry_point(void* tracker);
+
+  std::string _snapshot_file;
+  size_t _max_keys;
+  int _snapshot_interval_ms;
+
+  // The sketch counters, and the top K keys along with an index of those
+  // keys ordered by count.
+  uint32_t _sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+  std::map<std::string, uint32_t> _top_keys;
+  std::set<std::pair<uint32_t, std::string>> _top_keys_by_count;
+  pthread_mutex_t _lock;
+
+  // Background thread state.
+  warm_up_clbk_t _warm_up_clbk;
+  int _warm_up_rate;
+  bool _running;
+  bool _terminated;
+  pthread_t _thread;
+  pthread_mutex_t _thread_lock;
+  pthread_cond_t _thread_cond;
+};
+
+#endif
@@ -0,0 +1,127 @@
+/**
+ * @file icscfcache.h Short-lived cache of answers to I-CSCF queries.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#ifndef ICSCFCACHE_H__
+#define ICSCFCACHE_H__
+
+#include <pthread.h>
+#include <time.h>
+
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+
+/// Holds the answers that the HSS gave to recent I-CSCF queries
+/// (User-Authorization and Location-Info requests) for a short time, so that
+/// repeated queries for the same subscriber don't each need a Cx round trip.
+///
+/// Each answer is held against a key built from the request parameters, and
+/// is also indexed by the private and public IDs it relates to so that it
+/// can be discarded when the HSS tells us the subscriber has changed.
+class IcscfCache
+{
+public:
+  /// Constructor.
+  /// @param ttl         - how long (in seconds) to cache an answer for.
+  /// @param max_entries - the maximum number of answers to hold. When this is
+  ///                      exceeded the least recently used answer is
+  ///                      discarded.
+  IcscfCache(int ttl, size_t max_entries = 10000);
+  virtual ~IcscfCache();
+
+  /// Returns the key for a User-Authorization request.
+  static std::string uar_key(const std::string& impi,
+                             const std::string& impu,
+                             const std::string& visited_network,
+                             const std::string& authorization_type);
+
+  /// Returns the key for a Location-Info request.
+  static std::string lir_key(const std::string& impu,
+                             const std::string& originating,
+                             const std::string& authorization_type);
+
+  /// Looks up the answer for the key.
+  /// @returns true if an unexpired answer was found.
+  bool get(const std::string& key, std::string& answer);
+
+  /// Caches the answer for the key.
+  /// @param impi - the private ID the answer relates to. May be empty.
+  /// @param impu - the public ID the answer relates to.
+  void put(const std::string& key,
+           const std::string& impi,
+           const std::string& impu,
+           const std::string& answer);
+
+  /// Discards all answers relating to the private ID.
+  void invalidate_impi(const std::string& impi);
+
+  /// Discards all answers relating to the public ID.
+  void invalidate_impu(const std::string& impu);
+
+  /// Returns the number of answers currently held.
+  size_t size();
+
+private:
+  struct Entry
+  {
+    std::string key;
+    std::string impi;
+    std::string impu;
+    std::string answer;
+    time_t expiry;
+  };
+  typedef std::list<Entry> Entries;
+  typedef std::set<std::pair<std::string, std::string>> IdIndex;
+
+  static time_t now();
+  void remove(const std::string& key);
+  void remove_all(IdIndex& index, const std::string& id);
+
+  int _ttl;
+  size_t _max_entries;
+
+  // Entries are held in LRU order, most recently used first, and indexed by
+  // key. The ID indexes hold (ID, key) pairs.
+  Entries _lru;
+  std::map<std::string, Entries::iterator> _index;
+  IdIndex _impi_index;
+  IdIndex _impu_index;
+  pthread_mutex_t _lock;
+};
+
+#endif
@@ -0,0 +1,115 @@
+/**
+ * @file imssubscription.h A parsed IMS subscription.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef IMSSUBSCRIPTION_H__
+#define IMSSUBSCRIPTION_H__
+
+#include <pthread.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class ImsSubscription;
+
+/// IMS subscriptions are shared by reference-counted pointer, so that every
+/// task handling the same User-Data uses the same parsed copy of it.
+typedef std::shared_ptr<const ImsSubscription> ImsSubscriptionPtr;
+
+/// The User-Data XML the HSS sends for an implicit registration set, along
+/// with the parts of it that homestead needs - the private and public IDs,
+/// and the IMSSubscription element as it appears in a ClearwaterRegData
+/// document.
+///
+/// The IDs are parsed out of the XML the first time they are asked for, and
+/// the IMSSubscription element is printed the first time it is asked for -
+/// each is done at most once, and the element isn't printed at all if the
+/// body it would go in never needs building. Subscriptions can't be changed once they have been created, so
+/// they can be shared between tasks (and threads) freely.
+class ImsSubscription
+{
+public:
+  /// Creates a subscription for the given User-Data. All empty
+  /// subscriptions share the same object.
+  static ImsSubscriptionPtr create(const std::string& xml);
+
+  explicit ImsSubscription(const std::string& xml);
+  virtual ~ImsSubscription();
+
+  /// The User-Data XML, as the HSS sent it.
+  const std::string& xml() const { return _xml; }
+
+  /// Whether there is no User-Data at all.
+  bool empty() const { return _xml.empty(); }
+
+  /// Whether the User-Data is an IMSSubscription document that can be sent
+  /// on to Sprout. Empty User-Data is valid.
+  bool valid() const;
+
+  /// The PrivateID in the subscription, or an empty string if there isn't
+  /// one.
+  const std::string& private_id() const;
+
+  /// The public IDs in the subscription's service profiles, in the order
+  /// they appear. The first of these is the default public ID.
+  const std::vector<std::string>& public_ids() const;
+
+  /// The IMSSubscription element, indented and printed just as it is when
+  /// it is part of a ClearwaterRegData document. This is empty if the
+  /// User-Data is empty or invalid.
+  const std::string& reg_data_element() const;
+
+private:
+  // Not implemented - subscriptions are shared, not copied.
+  ImsSubscription(const ImsSubscription&);
+  ImsSubscription& operator=(const ImsSubscription&);
+
+  void parse() const;
+  void render() const;
+
+  const std::string _xml;
+
+  // Filled in by parse() and render(), the first time they're needed.
+  mutable pthread_mutex_t _lock;
+  mutable bool _parsed;
+  mutable bool _valid;
+  mutable std::string _private_id;
+  mutable std::vector<std::string> _public_ids;
+  mutable bool _rendered;
+  mutable std::string _reg_data_element;
+};
+
+#endif
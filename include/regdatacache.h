@@ -0,0 +1,112 @@
+/**
+ * @file regdatacache.h Caches rendered registration data bodies.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef REGDATACACHE_H__
+#define REGDATACACHE_H__
+
+#include <pthread.h>
+
+#include <list>
+#include <map>
+#include <string>
+
+/// Holds the ClearwaterRegData bodies most recently sent in reg-data
+/// responses, so that a repeat response can copy the body rather than parse
+/// and print the IMS subscription again.
+///
+/// Bodies are held against a key derived from everything they are built from
+/// (the registration data ETag), so they never need invalidating - when the
+/// registration data changes, its key does too and the old body just ages
+/// out. The key is only a hash, and the cache is shared by all subscribers,
+/// so the inputs themselves are stored too and checked on every lookup. A
+/// body is never returned for inputs that merely hash to the same key.
+class RegDataCache
+{
+public:
+  /// Constructor.
+  /// @param max_bytes - the most memory to use for bodies. When this is
+  ///                    exceeded the least recently used bodies are
+  ///                    discarded.
+  RegDataCache(size_t max_bytes);
+  virtual ~RegDataCache();
+
+  /// Looks up the body for the key.
+  /// @param key    - the hash of the inputs.
+  /// @param inputs - everything the body is built from.
+  /// @returns true if a body was found for these inputs.
+  bool get(const std::string& key,
+           const std::string& inputs,
+           std::string& body);
+
+  /// Caches the body for the key, replacing any body cached for different
+  /// inputs with the same key.
+  void put(const std::string& key,
+           const std::string& inputs,
+           const std::string& body);
+
+  /// Returns the number of bodies currently held.
+  size_t size();
+
+  /// Returns the memory currently used for bodies, in bytes.
+  size_t bytes();
+
+private:
+  // An estimate of the memory used by each entry, on top of its key, inputs
+  // and body.
+  static const size_t ENTRY_OVERHEAD = 128;
+
+  struct Entry
+  {
+    std::string key;
+    std::string inputs;
+    std::string body;
+  };
+  typedef std::list<Entry> Entries;
+
+  static size_t entry_bytes(const Entry& entry);
+  void remove(Entries::iterator entry);
+
+  size_t _max_bytes;
+  size_t _bytes;
+
+  // Entries are held in LRU order, most recently used first, and indexed by
+  // key.
+  Entries _lru;
+  std::map<std::string, Entries::iterator> _index;
+  pthread_mutex_t _lock;
+};
+
+#endif
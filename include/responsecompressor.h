@@ -0,0 +1,112 @@
+/**
+ * @file responsecompressor.h Compresses large HTTP response bodies.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef RESPONSECOMPRESSOR_H__
+#define RESPONSECOMPRESSOR_H__
+
+#include <pthread.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+#include "regdatacache.h"
+
+/// Gzips HTTP response bodies that are bigger than a threshold, for clients
+/// that accept gzip Content-Encoding.
+///
+/// Each thread that compresses a body gets its own zlib stream, which is
+/// reset and reused rather than set up afresh for every response. The
+/// compressed bodies are also cached, so that the same body isn't compressed
+/// over and over again. As in a RegDataCache, they are held against a
+/// caller-supplied key (such as an ETag) and the inputs the uncompressed
+/// body is built from, and only returned if both match.
+class ResponseCompressor
+{
+public:
+  /// Constructor.
+  /// @param threshold   - the smallest body (in bytes) worth compressing.
+  /// @param cache_bytes - the most memory to use for cached compressed
+  ///                      bodies.
+  /// @param level       - the zlib compression level. Level 1 saves nearly
+  ///                      as many bytes as the higher levels on reg-data
+  ///                      bodies, for a fraction of the CPU.
+  ResponseCompressor(size_t threshold,
+                     size_t cache_bytes = 4 * 1024 * 1024,
+                     int level = 1);
+  virtual ~ResponseCompressor();
+
+  /// Whether the value of an Accept-Encoding header allows gzip.
+  static bool accepts_gzip(const std::string& accept_encoding);
+
+  /// Looks up a cached compressed body, returning false if there isn't one.
+  bool lookup(const std::string& key,
+              const std::string& inputs,
+              std::string& compressed);
+
+  /// Compresses a body, returning false if it isn't worth compressing (or
+  /// can't be compressed), in which case it should be sent as it is.
+  /// @param key        - a hash of the inputs, for caching. If empty, the
+  ///                     compressed body isn't cached.
+  /// @param inputs     - everything the body is built from.
+  /// @param body       - the body to compress.
+  /// @param compressed - filled in with the gzipped body.
+  bool compress(const std::string& key,
+                const std::string& inputs,
+                const std::string& body,
+                std::string& compressed);
+
+  /// The Content-Encoding of compressed bodies.
+  static const std::string GZIP;
+
+private:
+  bool deflate_body(const std::string& body, std::string& compressed);
+  static void free_stream(z_stream* stream);
+
+  size_t _threshold;
+  int _level;
+
+  // Each thread's zlib stream, and all of the streams so that they can be
+  // freed along with the compressor (protected by _lock).
+  pthread_key_t _stream_key;
+  std::vector<z_stream*> _streams;
+  pthread_mutex_t _lock;
+
+  // The cached compressed bodies.
+  RegDataCache _cache;
+};
+
+#endif
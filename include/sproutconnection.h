@@ -37,11 +37,21 @@
 #ifndef SPROUTCONNECTION_H__
 #define SPROUTCONNECTION_H__
 
+#include <pthread.h>
+
+#include <deque>
+#include <vector>
+
+#include <boost/function.hpp>
+
 #include "httpconnection.h"
 
 class SproutConnection
 {
 public:
+  /// Callback invoked with Sprout's response to a deregistration.
+  typedef boost::function<void(HTTPCode)> deregister_clbk_t;
+
   SproutConnection(HttpConnection *http);
   virtual ~SproutConnection();
 
@@ -50,15 +60,62 @@ public:
                                        const std::vector<std::string>& impis,
                                        SAS::TrailId trail);
 
+  /// Asks Sprout to deregister bindings without waiting for the answer,
+  /// calling clbk with Sprout's response once it arrives.
+  ///
+  /// Once start() has been called, deregistrations are queued and sent by
+  /// background threads, and deregistrations that are queued together (with
+  /// the same send_notifications flag) are combined into a single request to
+  /// Sprout. Before then they are sent straight away, on this thread.
+  virtual void deregister_bindings_async(bool send_notifications,
+                                         const std::vector<std::string>& default_public_ids,
+                                         const std::vector<std::string>& impis,
+                                         SAS::TrailId trail,
+                                         deregister_clbk_t clbk);
+
+  /// Starts the background threads, which limit the number of requests
+  /// outstanding to Sprout to max_outstanding.
+  void start(int max_outstanding);
+
+  /// Stops the background threads. Deregistrations that haven't yet been
+  /// sent fail with HTTP_SERVER_UNAVAILABLE.
+  void stop();
+
   // JSON string constants
   static const std::string JSON_REGISTRATIONS;
   static const std::string JSON_PRIMARY_IMPU;
   static const std::string JSON_IMPI;
  
 private:
+  /// The largest number of deregistrations combined into one request.
+  static const size_t MAX_BATCH = 100;
+
+  struct Deregistration
+  {
+    bool send_notifications;
+    std::vector<std::string> default_public_ids;
+    std::vector<std::string> impis;
+    SAS::TrailId trail;
+    deregister_clbk_t clbk;
+  };
+
   std::string create_body(const std::vector<std::string>& default_public_ids,
                           const std::vector<std::string>& impis);
+  std::string create_body(const std::vector<Deregistration>& batch);
+  HTTPCode send_delete(bool send_notifications,
+                       const std::string& body,
+                       SAS::TrailId trail);
+  void thread_function();
+  static void* thread_entry_point(void* sprout_conn);
 
   HttpConnection* _http;
+
+  // Deregistrations waiting to be sent, and the background threads that
+  // send them.
+  std::deque<Deregistration> _queue;
+  std::vector<pthread_t> _threads;
+  bool _terminated;
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
 };
 #endif
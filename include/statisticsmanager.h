@@ -59,9 +59,30 @@ public:
   ACCUMULATOR_UPDATE_METHOD(H_hss_digest_latency_us);
   ACCUMULATOR_UPDATE_METHOD(H_hss_subscription_latency_us);
   ACCUMULATOR_UPDATE_METHOD(H_cache_latency_us);
+  ACCUMULATOR_UPDATE_METHOD(H_hss_concurrency_window);
+  ACCUMULATOR_UPDATE_METHOD(H_hss_queue_wait_us);
+  ACCUMULATOR_UPDATE_METHOD(H_hss_mar_timeout_ms);
+  ACCUMULATOR_UPDATE_METHOD(H_hss_sar_timeout_ms);
+  ACCUMULATOR_UPDATE_METHOD(H_hss_uar_timeout_ms);
+  ACCUMULATOR_UPDATE_METHOD(H_hss_lir_timeout_ms);
+  ACCUMULATOR_UPDATE_METHOD(H_handler_queue_depth);
+  ACCUMULATOR_UPDATE_METHOD(H_handler_queue_wait_us);
+  ACCUMULATOR_UPDATE_METHOD(H_handler_cx_answer_us);
+  ACCUMULATOR_UPDATE_METHOD(H_handler_rtr_us);
+  ACCUMULATOR_UPDATE_METHOD(H_handler_ppr_us);
+  ACCUMULATOR_UPDATE_METHOD(H_reg_data_cache_bytes);
 
   COUNTER_INCR_METHOD(H_incoming_requests);
   COUNTER_INCR_METHOD(H_rejected_overload);
+  COUNTER_INCR_METHOD(H_icscf_cache_hits);
+  COUNTER_INCR_METHOD(H_icscf_cache_misses);
+  COUNTER_INCR_METHOD(H_hss_hedged);
+  COUNTER_INCR_METHOD(H_hss_hedge_won);
+  COUNTER_INCR_METHOD(H_hss_circuit_opened);
+  COUNTER_INCR_METHOD(H_hss_fast_failed);
+  COUNTER_INCR_METHOD(H_deadline_expired);
+  COUNTER_INCR_METHOD(H_reg_data_cache_hits);
+  COUNTER_INCR_METHOD(H_reg_data_cache_misses);
 
   // Methods required to implement the HTTP stack stats interface.
   void update_http_latency_us(unsigned long latency_us)
@@ -77,9 +98,30 @@ private:
   SNMP::EventAccumulatorTable* H_hss_digest_latency_us;
   SNMP::EventAccumulatorTable* H_hss_subscription_latency_us;
   SNMP::EventAccumulatorTable* H_cache_latency_us;
+  SNMP::EventAccumulatorTable* H_hss_concurrency_window;
+  SNMP::EventAccumulatorTable* H_hss_queue_wait_us;
+  SNMP::EventAccumulatorTable* H_hss_mar_timeout_ms;
+  SNMP::EventAccumulatorTable* H_hss_sar_timeout_ms;
+  SNMP::EventAccumulatorTable* H_hss_uar_timeout_ms;
+  SNMP::EventAccumulatorTable* H_hss_lir_timeout_ms;
+  SNMP::EventAccumulatorTable* H_handler_queue_depth;
+  SNMP::EventAccumulatorTable* H_handler_queue_wait_us;
+  SNMP::EventAccumulatorTable* H_handler_cx_answer_us;
+  SNMP::EventAccumulatorTable* H_handler_rtr_us;
+  SNMP::EventAccumulatorTable* H_handler_ppr_us;
+  SNMP::EventAccumulatorTable* H_reg_data_cache_bytes;
 
   SNMP::CounterTable* H_incoming_requests;
   SNMP::CounterTable* H_rejected_overload;
+  SNMP::CounterTable* H_icscf_cache_hits;
+  SNMP::CounterTable* H_icscf_cache_misses;
+  SNMP::CounterTable* H_hss_hedged;
+  SNMP::CounterTable* H_hss_hedge_won;
+  SNMP::CounterTable* H_hss_circuit_opened;
+  SNMP::CounterTable* H_hss_fast_failed;
+  SNMP::CounterTable* H_deadline_expired;
+  SNMP::CounterTable* H_reg_data_cache_hits;
+  SNMP::CounterTable* H_reg_data_cache_misses;
 };
 
 #endif
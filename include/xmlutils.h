@@ -42,14 +42,58 @@
 #include "reg_state.h"
 #include "charging_addresses.h"
 
+class ImsSubscription;
+
 namespace XmlUtils
 {
+  /// The differences between two IMS subscriptions, used to work out which
+  /// cache rows need to change when the HSS sends a new subscription.
+  struct IrsDiff
+  {
+    /// Public IDs only in the new subscription.
+    std::vector<std::string> added;
+
+    /// Public IDs only in the old subscription, in the order they appear
+    /// there.
+    std::vector<std::string> removed;
+
+    /// Public IDs in both subscriptions.
+    std::vector<std::string> unchanged;
+
+    /// Whether the old default (first) public ID has been removed, in which
+    /// case it is the first entry in removed.
+    bool default_id_removed;
+
+    /// Whether anything in the service profiles has changed, including the
+    /// public IDs in them.
+    bool service_profiles_changed;
+
+    IrsDiff() : default_id_removed(false), service_profiles_changed(false) {}
+  };
+
+  IrsDiff diff_ims_subscriptions(const std::string& old_user_data,
+                                 const std::string& new_user_data);
+  IrsDiff diff_ims_subscriptions(const ImsSubscription& old_subscription,
+                                 const ImsSubscription& new_subscription);
   std::vector<std::string> get_public_ids(const std::string& user_data);
   std::string get_private_id(const std::string& user_data);
+  bool parse_ims_subscription(const std::string& user_data,
+                              std::string& private_id,
+                              std::vector<std::string>& public_ids);
+  bool render_reg_data_element(const std::string& user_data,
+                               std::string& reg_data_element);
   int build_ClearwaterRegData_xml(RegistrationState state,
                                   std::string user_data,
                                   const ChargingAddresses& charging_addrs,
                                   std::string& xml_str);
+  int build_ClearwaterRegData_xml(RegistrationState state,
+                                  const ImsSubscription& subscription,
+                                  const ChargingAddresses& charging_addrs,
+                                  std::string& xml_str);
+  int stream_ClearwaterRegData_xml(RegistrationState state,
+                                   const std::string& xml,
+                                   const ChargingAddresses& charging_addrs,
+                                   std::string& xml_str);
 }
 
 #endif
@@ -0,0 +1,180 @@
+/**
+ * @file adaptivetimeout.cpp Diameter request timeouts that adapt to the HSS's
+ * latency.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "adaptivetimeout.h"
+#include "log.h"
+
+AdaptiveTimeout::AdaptiveTimeout(int initial_ms,
+                                 int floor_ms,
+                                 int ceiling_ms,
+                                 double factor,
+                                 int period,
+                                 int percentile) :
+  _initial_ms(initial_ms),
+  _floor_ms(std::max(floor_ms, 1)),
+  _ceiling_ms(std::max(ceiling_ms, _floor_ms)),
+  _factor(factor),
+  _period(std::max(period, 1)),
+  _percentile(std::min(std::max(percentile, 1), 100) / 100.0),
+  _current(_ceiling_ms + 1, 0),
+  _previous(_ceiling_ms + 1, 0),
+  _current_count(0),
+  _previous_count(0),
+  _period_start(now()),
+  _percentile_ms(0),
+  _timeout_ms(initial_ms)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+AdaptiveTimeout::~AdaptiveTimeout()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+int AdaptiveTimeout::timeout_ms()
+{
+  pthread_mutex_lock(&_lock);
+  int timeout_ms = _timeout_ms;
+  pthread_mutex_unlock(&_lock);
+  return timeout_ms;
+}
+
+int AdaptiveTimeout::percentile_ms()
+{
+  pthread_mutex_lock(&_lock);
+  int percentile_ms = _percentile_ms;
+  pthread_mutex_unlock(&_lock);
+  return percentile_ms;
+}
+
+void AdaptiveTimeout::record(unsigned long latency_us)
+{
+  size_t bucket = std::min(latency_us / 1000, (unsigned long)_ceiling_ms);
+
+  pthread_mutex_lock(&_lock);
+
+  bool rotated = false;
+  time_t now_s = now();
+  if (now_s - _period_start >= _period)
+  {
+    rotate(now_s);
+    rotated = true;
+  }
+
+  _current[bucket]++;
+  _current_count++;
+
+  // Working out the percentile means walking the histogram, so don't do it
+  // on every sample.
+  if ((rotated) || (_current_count % RECALCULATE_INTERVAL == 0))
+  {
+    recalculate();
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+time_t AdaptiveTimeout::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+// Starts a new period. If more than a whole period has gone by since the
+// current one started, its samples are too old to keep. Must be called with
+// the lock held.
+void AdaptiveTimeout::rotate(time_t now_s)
+{
+  if (now_s - _period_start < 2 * _period)
+  {
+    _previous.swap(_current);
+    _previous_count = _current_count;
+  }
+  else
+  {
+    std::fill(_previous.begin(), _previous.end(), 0);
+    _previous_count = 0;
+  }
+
+  std::fill(_current.begin(), _current.end(), 0);
+  _current_count = 0;
+  _period_start = now_s;
+}
+
+// Works out the timeout from the current histograms. Must be called with the
+// lock held.
+void AdaptiveTimeout::recalculate()
+{
+  uint32_t count = _current_count + _previous_count;
+  if (count < MIN_SAMPLES)
+  {
+    _percentile_ms = 0;
+    _timeout_ms = _initial_ms;
+    return;
+  }
+
+  // Find the bucket containing the percentile, and take its upper bound.
+  uint32_t target = (uint32_t)ceil(count * _percentile);
+  uint32_t seen = 0;
+  int percentile_ms = _ceiling_ms;
+  for (int bucket = 0; bucket <= _ceiling_ms; bucket++)
+  {
+    seen += _current[bucket] + _previous[bucket];
+    if (seen >= target)
+    {
+      percentile_ms = bucket + 1;
+      break;
+    }
+  }
+
+  _percentile_ms = percentile_ms;
+  int timeout_ms = (int)ceil(percentile_ms * _factor);
+  timeout_ms = std::min(std::max(timeout_ms, _floor_ms), _ceiling_ms);
+
+  if (timeout_ms != _timeout_ms)
+  {
+    TRC_DEBUG("Percentile latency is %dms - timeout now %dms",
+              percentile_ms, timeout_ms);
+    _timeout_ms = timeout_ms;
+  }
+}
@@ -0,0 +1,213 @@
+/**
+ * @file akavectorpool.cpp Pool of unused AKA authentication vectors.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+
+#include "akavectorpool.h"
+#include "log.h"
+
+AkaVectorPool::AkaVectorPool(int batch_size,
+                             int low_water,
+                             int vector_ttl,
+                             int max_impis) :
+  _batch_size(batch_size),
+  _low_water(low_water),
+  _vector_ttl(vector_ttl),
+  _max_impis(max_impis)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+AkaVectorPool::~AkaVectorPool()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+bool AkaVectorPool::get(const std::string& impi,
+                        AKAAuthVector& av,
+                        bool& needs_refill)
+{
+  bool found = false;
+  needs_refill = false;
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, PooledVectors>::iterator it = _vectors.find(impi);
+  if (it != _vectors.end())
+  {
+    remove_expired(it->second, now());
+
+    if (!it->second.empty())
+    {
+      // Vectors are used in the order the HSS returned them, and removed
+      // from the pool as they're used so they can never be reused.
+      av = it->second.front().av;
+      it->second.pop_front();
+      found = true;
+
+      if ((it->second.size() < _low_water) &&
+          (_refilling.insert(impi).second))
+      {
+        needs_refill = true;
+      }
+    }
+
+    if (it->second.empty())
+    {
+      _vectors.erase(it);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  TRC_DEBUG("%s pooled AKA vector for %s%s",
+            found ? "Found" : "No",
+            impi.c_str(),
+            needs_refill ? " - refill needed" : "");
+  return found;
+}
+
+void AkaVectorPool::add(const std::string& impi,
+                        const std::vector<AKAAuthVector>& avs)
+{
+  pthread_mutex_lock(&_lock);
+
+  _refilling.erase(impi);
+
+  time_t current_time = now();
+  if ((_vectors.find(impi) == _vectors.end()) &&
+      (_vectors.size() >= _max_impis))
+  {
+    remove_expired_impis(current_time);
+  }
+
+  if ((_vectors.find(impi) != _vectors.end()) ||
+      (_vectors.size() < _max_impis))
+  {
+    PooledVectors& pooled = _vectors[impi];
+    for (std::vector<AKAAuthVector>::const_iterator it = avs.begin();
+         it != avs.end();
+         ++it)
+    {
+      PooledVector pv;
+      pv.av = *it;
+      pv.expiry = current_time + _vector_ttl;
+      pooled.push_back(pv);
+    }
+
+    if (pooled.empty())
+    {
+      _vectors.erase(impi);
+    }
+
+    TRC_DEBUG("Pooled %d AKA vectors for %s", avs.size(), impi.c_str());
+  }
+  else
+  {
+    TRC_DEBUG("AKA vector pool full - discarding %d vectors for %s",
+              avs.size(), impi.c_str());
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void AkaVectorPool::refill_failed(const std::string& impi)
+{
+  pthread_mutex_lock(&_lock);
+  _refilling.erase(impi);
+  pthread_mutex_unlock(&_lock);
+}
+
+void AkaVectorPool::flush(const std::string& impi)
+{
+  TRC_DEBUG("Discarding pooled AKA vectors for %s", impi.c_str());
+  pthread_mutex_lock(&_lock);
+  _vectors.erase(impi);
+  pthread_mutex_unlock(&_lock);
+}
+
+size_t AkaVectorPool::count(const std::string& impi)
+{
+  size_t count = 0;
+
+  pthread_mutex_lock(&_lock);
+  std::map<std::string, PooledVectors>::iterator it = _vectors.find(impi);
+  if (it != _vectors.end())
+  {
+    remove_expired(it->second, now());
+    count = it->second.size();
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return count;
+}
+
+time_t AkaVectorPool::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+// Removes expired vectors for a single private ID. Vectors are added in
+// batches with the same TTL, so the oldest are always at the front. Must be
+// called with the lock held.
+void AkaVectorPool::remove_expired(PooledVectors& avs, time_t now)
+{
+  while ((!avs.empty()) && (avs.front().expiry <= now))
+  {
+    avs.pop_front();
+  }
+}
+
+// Removes expired vectors for every private ID. Must be called with the lock
+// held.
+void AkaVectorPool::remove_expired_impis(time_t now)
+{
+  std::map<std::string, PooledVectors>::iterator it = _vectors.begin();
+  while (it != _vectors.end())
+  {
+    remove_expired(it->second, now);
+    if (it->second.empty())
+    {
+      _vectors.erase(it++);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
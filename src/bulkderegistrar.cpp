@@ -0,0 +1,418 @@
+/**
+ * @file bulkderegistrar.cpp Deregisters lists of subscribers in the background.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "bulkderegistrar.h"
+#include "log.h"
+#include "utils.h"
+
+// The body of a reg-data PUT for an administrative deregistration.
+static const std::string DEREG_ADMIN_BODY = "{\"reqtype\": \"dereg-admin\"}";
+
+// The result of a cache lookup, which the thread that issued it waits for.
+// This is shared with the transaction, as the thread may give up waiting
+// before the lookup completes.
+struct LookupResult
+{
+  LookupResult() : done(false), ok(false)
+  {
+    pthread_mutex_init(&lock, NULL);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+  }
+
+  ~LookupResult()
+  {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+
+  void complete(bool success, const std::vector<std::string>& result)
+  {
+    pthread_mutex_lock(&lock);
+    ok = success;
+    impus = result;
+    done = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+
+  // Waits for the lookup to complete, returning false if it doesn't do so
+  // within the timeout.
+  bool wait(int timeout_ms)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&lock);
+    int rc = 0;
+    while ((!done) && (rc != ETIMEDOUT))
+    {
+      rc = pthread_cond_timedwait(&cond, &lock, &deadline);
+    }
+    bool completed = done;
+    pthread_mutex_unlock(&lock);
+
+    return completed;
+  }
+
+  bool done;
+  bool ok;
+  std::vector<std::string> impus;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+// Transaction for looking up the primary public IDs for a private ID.
+class LookupTransaction : public CassandraStore::Transaction
+{
+public:
+  LookupTransaction(SAS::TrailId trail, std::shared_ptr<LookupResult> result) :
+    CassandraStore::Transaction(trail),
+    _result(result)
+  {}
+
+  void on_success(CassandraStore::Operation* op)
+  {
+    std::vector<std::string> impus;
+    ((Cache::GetAssociatedPrimaryPublicIDs*)op)->get_result(impus);
+    _result->complete(true, impus);
+  }
+
+  void on_failure(CassandraStore::Operation* op)
+  {
+    _result->complete(false, std::vector<std::string>());
+  }
+
+private:
+  std::shared_ptr<LookupResult> _result;
+};
+
+// Sprout's response to a deregistration doesn't affect the outcome, so is
+// just logged.
+static void on_sprout_deregistration(HTTPCode rc)
+{
+  TRC_DEBUG("Sprout returned %d for bulk deregistration", rc);
+}
+
+BulkDeregistrar::BulkDeregistrar(HttpConnection* http,
+                                 Cache* cache,
+                                 SproutConnection* sprout_conn,
+                                 int max_concurrency,
+                                 int target_latency_ms,
+                                 AdaptiveTimeout* live_latency,
+                                 int lookup_timeout_ms) :
+  _http(http),
+  _cache(cache),
+  _sprout_conn(sprout_conn),
+  _max_concurrency(std::max(max_concurrency, 1)),
+  _target_latency_ms(target_latency_ms),
+  _live_latency(live_latency),
+  _lookup_timeout_ms(lookup_timeout_ms),
+  _in_progress(0),
+  _succeeded(0),
+  _failed(0),
+  _concurrency(1),
+  _terminated(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+BulkDeregistrar::~BulkDeregistrar()
+{
+  stop();
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+
+  delete _http;
+  _http = NULL;
+}
+
+void BulkDeregistrar::add(const std::vector<std::string>& ids)
+{
+  pthread_mutex_lock(&_lock);
+  _queue.insert(_queue.end(), ids.begin(), ids.end());
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+BulkDeregistrar::Progress BulkDeregistrar::progress()
+{
+  Progress progress;
+
+  pthread_mutex_lock(&_lock);
+  progress.queued = _queue.size();
+  progress.in_progress = _in_progress;
+  progress.succeeded = _succeeded;
+  progress.failed = _failed;
+  progress.concurrency = (int)_concurrency;
+  pthread_mutex_unlock(&_lock);
+
+  return progress;
+}
+
+void BulkDeregistrar::start()
+{
+  pthread_mutex_lock(&_lock);
+  _terminated = false;
+
+  for (int ii = 0; ii < _max_concurrency; ii++)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, &BulkDeregistrar::thread_entry_point, this);
+    if (rc == 0)
+    {
+      _threads.push_back(thread);
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start bulk deregistration thread: %s", strerror(rc));
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void BulkDeregistrar::stop()
+{
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_broadcast(&_cond);
+  std::vector<pthread_t> threads;
+  threads.swap(_threads);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::vector<pthread_t>::iterator it = threads.begin();
+       it != threads.end();
+       ++it)
+  {
+    pthread_join(*it, NULL);
+  }
+
+  pthread_mutex_lock(&_lock);
+  if (!_queue.empty())
+  {
+    TRC_WARNING("Discarding %d queued bulk deregistrations", _queue.size());
+    _queue.clear();
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+// Deregisters a single public or private ID, returning whether this
+// succeeded.
+bool BulkDeregistrar::deregister(const std::string& id)
+{
+  SAS::TrailId trail = SAS::new_trail(0);
+
+  if ((id.compare(0, 4, "sip:") == 0) || (id.compare(0, 4, "tel:") == 0))
+  {
+    return deregister_impu(id, "", trail);
+  }
+
+  std::vector<std::string> impus;
+  if (!get_primary_public_ids(id, impus, trail))
+  {
+    return false;
+  }
+
+  bool success = true;
+  for (std::vector<std::string>::iterator it = impus.begin();
+       it != impus.end();
+       ++it)
+  {
+    success = deregister_impu(*it, id, trail) && success;
+  }
+
+  return success;
+}
+
+bool BulkDeregistrar::deregister_impu(const std::string& impu,
+                                      const std::string& impi,
+                                      SAS::TrailId trail)
+{
+  std::string path = "/impu/" + Utils::url_escape(impu) + "/reg-data";
+  if (!impi.empty())
+  {
+    path += "?private_id=" + Utils::url_escape(impi);
+  }
+
+  uint64_t start_ms = now_ms();
+  HTTPCode rc = _http->send_put(path, DEREG_ADMIN_BODY, trail);
+  update_concurrency(now_ms() - start_ms);
+  TRC_DEBUG("Bulk deregistration of %s returned %d", impu.c_str(), rc);
+
+  if (rc != HTTP_OK)
+  {
+    return false;
+  }
+
+  if (_sprout_conn != NULL)
+  {
+    std::vector<std::string> impis;
+    if (!impi.empty())
+    {
+      impis.push_back(impi);
+    }
+    _sprout_conn->deregister_bindings_async(true,
+                                            std::vector<std::string>(1, impu),
+                                            impis,
+                                            trail,
+                                            &on_sprout_deregistration);
+  }
+
+  return true;
+}
+
+bool BulkDeregistrar::get_primary_public_ids(const std::string& impi,
+                                             std::vector<std::string>& impus,
+                                             SAS::TrailId trail)
+{
+  std::shared_ptr<LookupResult> result(new LookupResult());
+  CassandraStore::Operation* get_public_ids =
+    _cache->create_GetAssociatedPrimaryPublicIDs(impi);
+  CassandraStore::Transaction* tsx = new LookupTransaction(trail, result);
+  _cache->do_async(get_public_ids, tsx);
+
+  if (!result->wait(_lookup_timeout_ms))
+  {
+    TRC_WARNING("Timed out looking up public IDs to deregister for %s",
+                impi.c_str());
+    return false;
+  }
+
+  if ((!result->ok) || (result->impus.empty()))
+  {
+    TRC_INFO("No public IDs found to deregister for %s", impi.c_str());
+    return false;
+  }
+
+  impus = result->impus;
+  return true;
+}
+
+// Adjusts the limit on the number of deregistrations in progress at once,
+// based on how long the last one took and how long live SARs are taking.
+// This increases by about one each time a full window of deregistrations
+// completes within the target latency, and halves whenever one doesn't or
+// live SARs are slower than the target.
+void BulkDeregistrar::update_concurrency(uint64_t latency_ms)
+{
+  int live_latency_ms = (_live_latency != NULL) ? _live_latency->percentile_ms() : 0;
+
+  pthread_mutex_lock(&_lock);
+
+  if ((latency_ms > (uint64_t)_target_latency_ms) ||
+      (live_latency_ms > _target_latency_ms))
+  {
+    _concurrency = std::max(_concurrency / 2, 1.0);
+  }
+  else
+  {
+    _concurrency = std::min(_concurrency + (1 / _concurrency),
+                            (double)_max_concurrency);
+  }
+
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+uint64_t BulkDeregistrar::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+void BulkDeregistrar::thread_function()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    if ((_queue.empty()) || (_in_progress >= (uint64_t)_concurrency))
+    {
+      pthread_cond_wait(&_cond, &_lock);
+      continue;
+    }
+
+    std::string id = _queue.front();
+    _queue.pop_front();
+    _in_progress++;
+    pthread_mutex_unlock(&_lock);
+
+    bool success = deregister(id);
+
+    pthread_mutex_lock(&_lock);
+    _in_progress--;
+    if (success)
+    {
+      _succeeded++;
+    }
+    else
+    {
+      _failed++;
+    }
+    pthread_cond_broadcast(&_cond);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void* BulkDeregistrar::thread_entry_point(void* deregistrar)
+{
+  ((BulkDeregistrar*)deregistrar)->thread_function();
+  return NULL;
+}
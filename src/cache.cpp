@@ -34,6 +34,8 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <limits>
+
 #include <boost/format.hpp>
 
 #include "cache.h"
@@ -353,104 +355,110 @@ bool Cache::GetRegData::perform(CassandraStore::Client* client,
   try
   {
     client->ha_get_all_columns(IMPU, _public_id, results, trail);
+    read_columns(results, now);
+  }
+  catch(CassandraStore::RowNotFoundException& rnfe)
+  {
+    // This is a valid state rather than an exceptional one, so we
+    // catch the exception and return success. Values ae left in the
+    // default state (NOT_REGISTERED and empty XML).
+  }
+
 
-    for(std::vector<ColumnOrSuperColumn>::iterator it = results.begin(); it != results.end(); ++it)
+  return true;
+}
+
+
+void Cache::GetRegData::read_columns(const std::vector<ColumnOrSuperColumn>& columns,
+                                     int64_t now)
+{
+  for(std::vector<ColumnOrSuperColumn>::const_iterator it = columns.begin(); it != columns.end(); ++it)
+  {
+    if (it->column.name == IMS_SUB_XML_COLUMN_NAME)
     {
-      if (it->column.name == IMS_SUB_XML_COLUMN_NAME)
-      {
-        _xml = it->column.value;
-
-        // Cassandra timestamps are in microseconds (see
-        // generate_timestamp) but TTLs are in seconds, so divide the
-        // timestamps by a million.
-        if (it->column.ttl > 0)
-        {
-          _xml_ttl = ((it->column.timestamp/1000000) + it->column.ttl) - (now / 1000000);
-        };
-        TRC_DEBUG("Retrieved XML column with TTL %d and value %s", _xml_ttl, _xml.c_str());
-      }
-      else if (it->column.name == REG_STATE_COLUMN_NAME)
+      _xml = it->column.value;
+
+      // Cassandra timestamps are in microseconds (see
+      // generate_timestamp) but TTLs are in seconds, so divide the
+      // timestamps by a million.
+      if (it->column.ttl > 0)
       {
-        if (it->column.ttl > 0)
-        {
-          _reg_state_ttl = ((it->column.timestamp/1000000) + it->column.ttl) - (now / 1000000);
-        };
-        if (it->column.value == CassandraStore::BOOLEAN_TRUE)
-        {
-          _reg_state = RegistrationState::REGISTERED;
-          TRC_DEBUG("Retrieved is_registered column with value True and TTL %d",
-                    _reg_state_ttl);
-        }
-        else if (it->column.value == CassandraStore::BOOLEAN_FALSE)
-        {
-          _reg_state = RegistrationState::UNREGISTERED;
-          TRC_DEBUG("Retrieved is_registered column with value False and TTL %d",
-                    _reg_state_ttl);
-        }
-        else if ((it->column.value == ""))
-        {
-          TRC_DEBUG("Retrieved is_registered column with empty value and TTL %d",
-                    _reg_state_ttl);
-        }
-        else
-        {
-          TRC_WARNING("Registration state column has invalid value %d %s",
-                      it->column.value.c_str()[0],
-                      it->column.value.c_str());
-        };
-      }
-      else if (it->column.name.find(IMPI_COLUMN_PREFIX) == 0)
+        _xml_ttl = ((it->column.timestamp/1000000) + it->column.ttl) - (now / 1000000);
+      };
+      TRC_DEBUG("Retrieved XML column with TTL %d and value %s", _xml_ttl, _xml.c_str());
+    }
+    else if (it->column.name == REG_STATE_COLUMN_NAME)
+    {
+      if (it->column.ttl > 0)
       {
-        std::string impi = it->column.name.substr(IMPI_COLUMN_PREFIX.length());
-        _impis.push_back(impi);
-      }
-      else if ((it->column.name == PRIMARY_CCF_COLUMN_NAME) && (it->column.value != ""))
+        _reg_state_ttl = ((it->column.timestamp/1000000) + it->column.ttl) - (now / 1000000);
+      };
+      if (it->column.value == CassandraStore::BOOLEAN_TRUE)
       {
-        _charging_addrs.ccfs.push_front(it->column.value);
-        TRC_DEBUG("Retrived primary_ccf column with value %s",
-                  it->column.value.c_str());
+        _reg_state = RegistrationState::REGISTERED;
+        TRC_DEBUG("Retrieved is_registered column with value True and TTL %d",
+                  _reg_state_ttl);
       }
-      else if ((it->column.name == SECONDARY_CCF_COLUMN_NAME) && (it->column.value != ""))
+      else if (it->column.value == CassandraStore::BOOLEAN_FALSE)
       {
-        _charging_addrs.ccfs.push_back(it->column.value);
-        TRC_DEBUG("Retrived secondary_ccf column with value %s",
-                  it->column.value.c_str());
+        _reg_state = RegistrationState::UNREGISTERED;
+        TRC_DEBUG("Retrieved is_registered column with value False and TTL %d",
+                  _reg_state_ttl);
       }
-      else if ((it->column.name == PRIMARY_ECF_COLUMN_NAME) && (it->column.value != ""))
+      else if ((it->column.value == ""))
       {
-        _charging_addrs.ecfs.push_front(it->column.value);
-        TRC_DEBUG("Retrived primary_ecf column with value %s",
-                  it->column.value.c_str());
+        TRC_DEBUG("Retrieved is_registered column with empty value and TTL %d",
+                  _reg_state_ttl);
       }
-      else if ((it->column.name == SECONDARY_ECF_COLUMN_NAME) && (it->column.value != ""))
+      else
       {
-        _charging_addrs.ecfs.push_back(it->column.value);
-        TRC_DEBUG("Retrived secondary_ecf column with value %s",
-                  it->column.value.c_str());
-      }
+        TRC_WARNING("Registration state column has invalid value %d %s",
+                    it->column.value.c_str()[0],
+                    it->column.value.c_str());
+      };
     }
-
-    // If we're storing user data for this subscriber (i.e. there is
-    // XML), then by definition they cannot be in NOT_REGISTERED state
-    // - they must be in UNREGISTERED state.
-    if ((_reg_state == RegistrationState::NOT_REGISTERED) && !_xml.empty())
+    else if (it->column.name.find(IMPI_COLUMN_PREFIX) == 0)
     {
-      TRC_DEBUG("Found stored XML for subscriber, treating as UNREGISTERED state");
-      _reg_state = RegistrationState::UNREGISTERED;
+      std::string impi = it->column.name.substr(IMPI_COLUMN_PREFIX.length());
+      _impis.push_back(impi);
+    }
+    else if ((it->column.name == PRIMARY_CCF_COLUMN_NAME) && (it->column.value != ""))
+    {
+      _charging_addrs.ccfs.push_front(it->column.value);
+      TRC_DEBUG("Retrived primary_ccf column with value %s",
+                it->column.value.c_str());
+    }
+    else if ((it->column.name == SECONDARY_CCF_COLUMN_NAME) && (it->column.value != ""))
+    {
+      _charging_addrs.ccfs.push_back(it->column.value);
+      TRC_DEBUG("Retrived secondary_ccf column with value %s",
+                it->column.value.c_str());
+    }
+    else if ((it->column.name == PRIMARY_ECF_COLUMN_NAME) && (it->column.value != ""))
+    {
+      _charging_addrs.ecfs.push_front(it->column.value);
+      TRC_DEBUG("Retrived primary_ecf column with value %s",
+                it->column.value.c_str());
+    }
+    else if ((it->column.name == SECONDARY_ECF_COLUMN_NAME) && (it->column.value != ""))
+    {
+      _charging_addrs.ecfs.push_back(it->column.value);
+      TRC_DEBUG("Retrived secondary_ecf column with value %s",
+                it->column.value.c_str());
     }
-
   }
-  catch(CassandraStore::RowNotFoundException& rnfe)
+
+  // If we're storing user data for this subscriber (i.e. there is
+  // XML), then by definition they cannot be in NOT_REGISTERED state
+  // - they must be in UNREGISTERED state.
+  if ((_reg_state == RegistrationState::NOT_REGISTERED) && !_xml.empty())
   {
-    // This is a valid state rather than an exceptional one, so we
-    // catch the exception and return success. Values ae left in the
-    // default state (NOT_REGISTERED and empty XML).
+    TRC_DEBUG("Found stored XML for subscriber, treating as UNREGISTERED state");
+    _reg_state = RegistrationState::UNREGISTERED;
   }
-
-
-  return true;
 }
 
+
 void Cache::GetRegData::get_xml(std::string& xml, int32_t& ttl)
 {
   xml = _xml;
@@ -501,6 +509,205 @@ void Cache::GetRegData::get_result(Cache::GetRegData::Result& result)
 }
 
 
+//
+// MultiGetRegData methods
+//
+
+Cache::MultiGetRegData::
+MultiGetRegData(const std::vector<std::string>& public_ids) :
+  CassandraStore::Operation(),
+  _public_ids(public_ids),
+  _reg_data()
+{
+  for (std::vector<std::string>::const_iterator it = public_ids.begin();
+       it != public_ids.end();
+       ++it)
+  {
+    if (_reg_data.find(*it) == _reg_data.end())
+    {
+      _reg_data[*it] = new GetRegData(*it);
+    }
+  }
+}
+
+
+Cache::MultiGetRegData::
+~MultiGetRegData()
+{
+  for (std::map<std::string, GetRegData*>::iterator it = _reg_data.begin();
+       it != _reg_data.end();
+       ++it)
+  {
+    delete it->second;
+  }
+}
+
+
+// Reads every column of several IMPU rows in a single multiget. Like the
+// store's ha_ reads, this starts at LOCAL_QUORUM and falls back to weaker
+// consistency levels if there aren't enough replicas available.
+static void ha_multiget_all_columns(CassandraStore::Client* client,
+                                    const std::vector<std::string>& keys,
+                                    std::map<std::string, std::vector<ColumnOrSuperColumn> >& rows)
+{
+  ColumnParent cparent;
+  cparent.column_family = IMPU;
+
+  SliceRange sr;
+  sr.start = "";
+  sr.finish = "";
+  sr.count = std::numeric_limits<int32_t>::max();
+
+  SlicePredicate sp;
+  sp.__set_slice_range(sr);
+
+  try
+  {
+    client->multiget_slice(rows, keys, cparent, sp, ConsistencyLevel::LOCAL_QUORUM);
+  }
+  catch(UnavailableException& ue)
+  {
+    try
+    {
+      client->multiget_slice(rows, keys, cparent, sp, ConsistencyLevel::QUORUM);
+    }
+    catch(UnavailableException& ue2)
+    {
+      client->multiget_slice(rows, keys, cparent, sp, ConsistencyLevel::ONE);
+    }
+  }
+}
+
+bool Cache::MultiGetRegData::perform(CassandraStore::Client* client,
+                                     SAS::TrailId trail)
+{
+  int64_t now = generate_timestamp();
+  TRC_DEBUG("Issuing multiget for %d public IDs", _reg_data.size());
+
+  std::vector<std::string> keys;
+  for (std::map<std::string, GetRegData*>::iterator it = _reg_data.begin();
+       it != _reg_data.end();
+       ++it)
+  {
+    keys.push_back(it->first);
+  }
+
+  std::map<std::string, std::vector<ColumnOrSuperColumn> > rows;
+
+  try
+  {
+    ha_multiget_all_columns(client, keys, rows);
+  }
+  catch(TTransportException& te)
+  {
+    // The connection has failed, so no row can be read on it. Let the store
+    // retry on a new connection.
+    throw;
+  }
+  catch(...)
+  {
+    // Read the rows one at a time instead, so that a problem with one of
+    // them only fails that public ID.
+    TRC_DEBUG("Multiget failed - reading public IDs individually");
+    for (std::map<std::string, GetRegData*>::iterator it = _reg_data.begin();
+         it != _reg_data.end();
+         ++it)
+    {
+      perform_one(client, it->first, it->second, now, trail);
+    }
+    return true;
+  }
+
+  // Any public ID without a row is left in the default state
+  // (NOT_REGISTERED and empty XML), as for GetRegData.
+  for (std::map<std::string, std::vector<ColumnOrSuperColumn> >::iterator it = rows.begin();
+       it != rows.end();
+       ++it)
+  {
+    std::map<std::string, GetRegData*>::iterator reg_data = _reg_data.find(it->first);
+    if (reg_data != _reg_data.end())
+    {
+      reg_data->second->read_columns(it->second, now);
+    }
+  }
+
+  return true;
+}
+
+
+// Reads a single public ID's row, recording any failure against it.
+void Cache::MultiGetRegData::perform_one(CassandraStore::Client* client,
+                                         const std::string& public_id,
+                                         GetRegData* reg_data,
+                                         int64_t now,
+                                         SAS::TrailId trail)
+{
+  std::vector<ColumnOrSuperColumn> results;
+
+  try
+  {
+    client->ha_get_all_columns(IMPU, public_id, results, trail);
+    reg_data->read_columns(results, now);
+  }
+  catch(CassandraStore::RowNotFoundException& rnfe)
+  {
+    TRC_DEBUG("No registration data for %s", public_id.c_str());
+  }
+  catch(TTransportException& te)
+  {
+    throw;
+  }
+  catch(InvalidRequestException& ire)
+  {
+    TRC_DEBUG("Invalid request reading %s: %s", public_id.c_str(), ire.why.c_str());
+    _errors[public_id] = std::make_pair(CassandraStore::INVALID_REQUEST, ire.why);
+  }
+  catch(std::exception& e)
+  {
+    TRC_DEBUG("Failed to read %s: %s", public_id.c_str(), e.what());
+    _errors[public_id] = std::make_pair(CassandraStore::UNKNOWN_ERROR,
+                                        std::string(e.what()));
+  }
+  catch(...)
+  {
+    TRC_DEBUG("Failed to read %s", public_id.c_str());
+    _errors[public_id] = std::make_pair(CassandraStore::UNKNOWN_ERROR,
+                                        std::string("Unknown error"));
+  }
+}
+
+
+Cache::GetRegData* Cache::MultiGetRegData::get_reg_data(const std::string& public_id)
+{
+  if (_errors.find(public_id) != _errors.end())
+  {
+    return NULL;
+  }
+
+  std::map<std::string, GetRegData*>::iterator it = _reg_data.find(public_id);
+  return (it != _reg_data.end()) ? it->second : NULL;
+}
+
+
+void Cache::MultiGetRegData::get_error(const std::string& public_id,
+                                       CassandraStore::ResultCode& error,
+                                       std::string& text)
+{
+  std::map<std::string, std::pair<CassandraStore::ResultCode, std::string> >::iterator it =
+                                                            _errors.find(public_id);
+  if (it != _errors.end())
+  {
+    error = it->second.first;
+    text = it->second.second;
+  }
+  else
+  {
+    error = CassandraStore::NOT_FOUND;
+    text = "No result for " + public_id;
+  }
+}
+
+
 //
 // GetAssociatedPublicIDs methods
 //
@@ -856,6 +1063,39 @@ bool Cache::DeletePrivateIDs::perform(CassandraStore::Client* client,
   return true;
 }
 
+//
+// DeleteAuthVector methods
+//
+
+Cache::DeleteAuthVector::
+DeleteAuthVector(const std::vector<std::string>& private_ids, int64_t timestamp) :
+  CassandraStore::Operation(),
+  _private_ids(private_ids),
+  _timestamp(timestamp)
+{}
+
+bool Cache::DeleteAuthVector::perform(CassandraStore::Client* client,
+                                      SAS::TrailId trail)
+{
+  std::map<std::string, std::string> columns_to_delete;
+  columns_to_delete[DIGEST_HA1_COLUMN_NAME] = "";
+  columns_to_delete[DIGEST_REALM_COLUMN_NAME] = "";
+  columns_to_delete[DIGEST_QOP_COLUMN_NAME] = "";
+  columns_to_delete[KNOWN_PREFERRED_COLUMN_NAME] = "";
+
+  std::vector<CassandraStore::RowColumns> to_delete;
+
+  for (std::vector<std::string>::const_iterator it = _private_ids.begin();
+       it != _private_ids.end();
+       ++it)
+  {
+    to_delete.push_back(CassandraStore::RowColumns(IMPI, *it, columns_to_delete));
+  }
+
+  client->delete_columns(to_delete, _timestamp);
+  return true;
+}
+
 //
 // DeleteIMPIMapping methods
 //
@@ -360,7 +360,8 @@ MultimediaAuthRequest::MultimediaAuthRequest(const Dictionary* dict,
                                              const std::string& impu,
                                              const std::string& server_name,
                                              const std::string& sip_auth_scheme,
-                                             const std::string& sip_authorization) :
+                                             const std::string& sip_authorization,
+                                             const int32_t sip_number_auth_items) :
                                              Diameter::Message(dict, dict->MULTIMEDIA_AUTH_REQUEST, stack)
 {
   TRC_DEBUG("Building Multimedia-Auth request for %s/%s", impi.c_str(), impu.c_str());
@@ -383,7 +384,7 @@ MultimediaAuthRequest::MultimediaAuthRequest(const Dictionary* dict,
     sip_auth_data_item.add(Diameter::AVP(dict->SIP_AUTHORIZATION).val_str(sip_authorization));
   }
   add(sip_auth_data_item);
-  add(Diameter::AVP(dict->SIP_NUMBER_AUTH_ITEMS).val_i32(1));
+  add(Diameter::AVP(dict->SIP_NUMBER_AUTH_ITEMS).val_i32(sip_number_auth_items));
   add(Diameter::AVP(dict->SERVER_NAME).val_str(server_name));
 }
 
@@ -446,6 +447,31 @@ MultimediaAuthAnswer::MultimediaAuthAnswer(const Dictionary* dict,
   add(sip_auth_data_item);
 }
 
+MultimediaAuthAnswer::MultimediaAuthAnswer(const Dictionary* dict,
+                                           Diameter::Stack* stack,
+                                           const int32_t& result_code,
+                                           const std::string& scheme,
+                                           const std::vector<AKAAuthVector>& aka_avs) :
+                                           Diameter::Message(dict, dict->MULTIMEDIA_AUTH_ANSWER, stack)
+{
+  TRC_DEBUG("Building Multimedia-Authorization answer with %d AKA vectors", aka_avs.size());
+
+  // As above, this is only used for testing.
+  add(Diameter::AVP(dict->RESULT_CODE).val_i32(result_code));
+  for (std::vector<AKAAuthVector>::const_iterator it = aka_avs.begin();
+       it != aka_avs.end();
+       ++it)
+  {
+    Diameter::AVP sip_auth_data_item(dict->SIP_AUTH_DATA_ITEM);
+    sip_auth_data_item.add(Diameter::AVP(dict->SIP_AUTH_SCHEME).val_str(scheme));
+    sip_auth_data_item.add(Diameter::AVP(dict->SIP_AUTHENTICATE).val_str(it->challenge));
+    sip_auth_data_item.add(Diameter::AVP(dict->SIP_AUTHORIZATION).val_str(it->response));
+    sip_auth_data_item.add(Diameter::AVP(dict->CONFIDENTIALITY_KEY).val_str(it->crypt_key));
+    sip_auth_data_item.add(Diameter::AVP(dict->INTEGRITY_KEY).val_str(it->integrity_key));
+    add(sip_auth_data_item);
+  }
+}
+
 std::string MultimediaAuthAnswer::sip_auth_scheme() const
 {
   std::string sip_auth_scheme;
@@ -535,43 +561,65 @@ AKAAuthVector MultimediaAuthAnswer::aka_auth_vector() const
   Diameter::AVP::iterator avps = begin(((Cx::Dictionary*)dict())->SIP_AUTH_DATA_ITEM);
   if (avps != end())
   {
-    // Look for the challenge.
-    Diameter::AVP::iterator avps2 = avps->begin(((Cx::Dictionary*)dict())->SIP_AUTHENTICATE);
-    if (avps2 != avps->end())
-    {
-      size_t len;
-      const uint8_t* data = avps2->val_os(len);
-      aka_auth_vector.challenge = base64(data, len);
-      TRC_DEBUG("Found SIP-Authenticate (challenge) %s", aka_auth_vector.challenge.c_str());
-    }
-    // Look for the response.
-    avps2 = avps->begin(((Cx::Dictionary*)dict())->SIP_AUTHORIZATION);
-    if (avps2 != avps->end())
-    {
-      size_t len;
-      const uint8_t* data = avps2->val_os(len);
-      aka_auth_vector.response = hex(data, len);
-      TRC_DEBUG("Found SIP-Authorization (response) %s", aka_auth_vector.response.c_str());
-    }
-    // Look for the encryption key.
-    avps2 = avps->begin(((Cx::Dictionary*)dict())->CONFIDENTIALITY_KEY);
-    if (avps2 != avps->end())
-    {
-      size_t len;
-      const uint8_t* data = avps2->val_os(len);
-      aka_auth_vector.crypt_key = hex(data, len);
-      TRC_DEBUG("Found Confidentiality-Key %s", aka_auth_vector.crypt_key.c_str());
-    }
-    // Look for the integrity key.
-    avps2 = avps->begin(((Cx::Dictionary*)dict())->INTEGRITY_KEY);
-    if (avps2 != avps->end())
-    {
-      size_t len;
-      const uint8_t* data = avps2->val_os(len);
-      aka_auth_vector.integrity_key = hex(data, len);
-      TRC_DEBUG("Found Integrity-Key %s", aka_auth_vector.integrity_key.c_str());
-    }
+    aka_auth_vector = this->aka_auth_vector(avps);
+  }
+  return aka_auth_vector;
+}
+
+std::vector<AKAAuthVector> MultimediaAuthAnswer::aka_auth_vectors() const
+{
+  TRC_DEBUG("Getting AKA authentication vectors from Multimedia-Auth answer");
+  std::vector<AKAAuthVector> aka_auth_vectors;
+  Diameter::AVP::iterator avps = begin(((Cx::Dictionary*)dict())->SIP_AUTH_DATA_ITEM);
+  while (avps != end())
+  {
+    aka_auth_vectors.push_back(aka_auth_vector(avps));
+    avps++;
   }
+  return aka_auth_vectors;
+}
+
+AKAAuthVector MultimediaAuthAnswer::aka_auth_vector(Diameter::AVP::iterator& avps) const
+{
+  AKAAuthVector aka_auth_vector;
+
+  // Look for the challenge.
+  Diameter::AVP::iterator avps2 = avps->begin(((Cx::Dictionary*)dict())->SIP_AUTHENTICATE);
+  if (avps2 != avps->end())
+  {
+    size_t len;
+    const uint8_t* data = avps2->val_os(len);
+    aka_auth_vector.challenge = base64(data, len);
+    TRC_DEBUG("Found SIP-Authenticate (challenge) %s", aka_auth_vector.challenge.c_str());
+  }
+  // Look for the response.
+  avps2 = avps->begin(((Cx::Dictionary*)dict())->SIP_AUTHORIZATION);
+  if (avps2 != avps->end())
+  {
+    size_t len;
+    const uint8_t* data = avps2->val_os(len);
+    aka_auth_vector.response = hex(data, len);
+    TRC_DEBUG("Found SIP-Authorization (response) %s", aka_auth_vector.response.c_str());
+  }
+  // Look for the encryption key.
+  avps2 = avps->begin(((Cx::Dictionary*)dict())->CONFIDENTIALITY_KEY);
+  if (avps2 != avps->end())
+  {
+    size_t len;
+    const uint8_t* data = avps2->val_os(len);
+    aka_auth_vector.crypt_key = hex(data, len);
+    TRC_DEBUG("Found Confidentiality-Key %s", aka_auth_vector.crypt_key.c_str());
+  }
+  // Look for the integrity key.
+  avps2 = avps->begin(((Cx::Dictionary*)dict())->INTEGRITY_KEY);
+  if (avps2 != avps->end())
+  {
+    size_t len;
+    const uint8_t* data = avps2->val_os(len);
+    aka_auth_vector.integrity_key = hex(data, len);
+    TRC_DEBUG("Found Integrity-Key %s", aka_auth_vector.integrity_key.c_str());
+  }
+
   return aka_auth_vector;
 }
 
@@ -612,7 +660,8 @@ ServerAssignmentRequest::ServerAssignmentRequest(const Dictionary* dict,
                                                  const std::string& impi,
                                                  const std::string& impu,
                                                  const std::string& server_name,
-                                                 const Cx::ServerAssignmentType type) :
+                                                 const Cx::ServerAssignmentType type,
+                                                 const bool user_data_already_available) :
                                                  Diameter::Message(dict, dict->SERVER_ASSIGNMENT_REQUEST, stack)
 {
   TRC_DEBUG("Building Server-Assignment request for %s/%s", impi.c_str(), impu.c_str());
@@ -633,7 +682,7 @@ ServerAssignmentRequest::ServerAssignmentRequest(const Dictionary* dict,
   add(Diameter::AVP(dict->PUBLIC_IDENTITY).val_str(impu));
   add(Diameter::AVP(dict->SERVER_NAME).val_str(server_name));
   add(Diameter::AVP(dict->SERVER_ASSIGNMENT_TYPE).val_i32(type));
-  add(Diameter::AVP(dict->USER_DATA_ALREADY_AVAILABLE).val_i32(0));
+  add(Diameter::AVP(dict->USER_DATA_ALREADY_AVAILABLE).val_i32(user_data_already_available ? 1 : 0));
 }
 
 ServerAssignmentAnswer::ServerAssignmentAnswer(const Dictionary* dict,
@@ -648,7 +697,10 @@ ServerAssignmentAnswer::ServerAssignmentAnswer(const Dictionary* dict,
   // This method creates an SAA which is unrealistic for various reasons, but is useful for
   // testing our handlers code, which is currently all it is used for.
   add(Diameter::AVP(dict->RESULT_CODE).val_i32(result_code));
-  add(Diameter::AVP(dict->USER_DATA).val_str(ims_subscription));
+  if (!ims_subscription.empty())
+  {
+    add(Diameter::AVP(dict->USER_DATA).val_str(ims_subscription));
+  }
   if (!charging_addrs.empty())
   {
     Diameter::AVP charging_information(dict->CHARGING_INFORMATION);
@@ -0,0 +1,233 @@
+/**
+ * @file cxcircuitbreaker.cpp Fails Cx requests fast while the HSS is down.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+
+#include <algorithm>
+
+#include "cxcircuitbreaker.h"
+#include "homesteadsasevent.h"
+#include "log.h"
+#include "statisticsmanager.h"
+
+CxCircuitBreaker::CxCircuitBreaker(int failure_percent,
+                                   int min_requests,
+                                   int window_ms,
+                                   int open_ms,
+                                   StatisticsManager* stats) :
+  _failure_percent(std::min(std::max(failure_percent, 1), 100)),
+  _min_requests(std::max(min_requests, 1)),
+  _window_ms(std::max(window_ms, 1)),
+  _open_ms(std::max(open_ms, 0)),
+  _stats(stats),
+  _state(CLOSED),
+  _open_until_ms(0),
+  _probe_sent_ms(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+  reset_counts(now_ms());
+}
+
+CxCircuitBreaker::~CxCircuitBreaker()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+bool CxCircuitBreaker::allow(SAS::TrailId trail)
+{
+  uint64_t now = now_ms();
+  bool allowed = true;
+  bool half_opened = false;
+
+  pthread_mutex_lock(&_lock);
+
+  if ((_state == OPEN) && (now >= _open_until_ms))
+  {
+    TRC_STATUS("Probing HSS to see if it has recovered");
+    _state = HALF_OPEN;
+    _probe_sent_ms = 0;
+    half_opened = true;
+  }
+
+  if (_state == OPEN)
+  {
+    allowed = false;
+  }
+  else if (_state == HALF_OPEN)
+  {
+    // Only let one probe through at a time. If a probe's outcome is never
+    // reported, give up on it after the open time.
+    if ((_probe_sent_ms != 0) && (now < _probe_sent_ms + _open_ms))
+    {
+      allowed = false;
+    }
+    else
+    {
+      _probe_sent_ms = now;
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (half_opened)
+  {
+    report_state(SASEvent::HSS_CIRCUIT_HALF_OPEN, trail);
+  }
+
+  if (!allowed)
+  {
+    TRC_DEBUG("HSS circuit breaker is open - failing request");
+    SAS::Event event(trail, SASEvent::HSS_FAST_FAIL, 0);
+    SAS::report_event(event);
+
+    if (_stats != NULL)
+    {
+      _stats->incr_H_hss_fast_failed();
+    }
+  }
+
+  return allowed;
+}
+
+void CxCircuitBreaker::on_complete(bool failed, SAS::TrailId trail)
+{
+  uint64_t now = now_ms();
+  int event_id = 0;
+
+  pthread_mutex_lock(&_lock);
+
+  if (_state == HALF_OPEN)
+  {
+    if (failed)
+    {
+      TRC_WARNING("HSS probe failed - HSS circuit breaker re-opened");
+      open(now);
+      event_id = SASEvent::HSS_CIRCUIT_OPENED;
+    }
+    else
+    {
+      TRC_STATUS("HSS probe succeeded - HSS circuit breaker closed");
+      _state = CLOSED;
+      reset_counts(now);
+      event_id = SASEvent::HSS_CIRCUIT_CLOSED;
+    }
+  }
+  else if (_state == CLOSED)
+  {
+    if (now - _window_start_ms >= _window_ms)
+    {
+      // Start a new window. If the last one ended more than a window ago,
+      // nothing from it is worth keeping.
+      bool keep = (now - _window_start_ms < 2 * _window_ms);
+      _previous_requests = keep ? _requests : 0;
+      _previous_failures = keep ? _failures : 0;
+      _requests = 0;
+      _failures = 0;
+      _window_start_ms = now;
+    }
+
+    _requests++;
+    if (failed)
+    {
+      _failures++;
+    }
+
+    uint32_t requests = _requests + _previous_requests;
+    uint32_t failures = _failures + _previous_failures;
+    if ((requests >= _min_requests) &&
+        (failures * 100 >= requests * _failure_percent))
+    {
+      TRC_WARNING("%d of the last %d HSS requests failed - HSS circuit breaker opened",
+                  failures, requests);
+      open(now);
+      event_id = SASEvent::HSS_CIRCUIT_OPENED;
+    }
+  }
+
+  // Requests that complete while the breaker is open were sent before it
+  // opened, so tell us nothing new.
+
+  pthread_mutex_unlock(&_lock);
+
+  if (event_id != 0)
+  {
+    report_state(event_id, trail);
+
+    if ((event_id == SASEvent::HSS_CIRCUIT_OPENED) && (_stats != NULL))
+    {
+      _stats->incr_H_hss_circuit_opened();
+    }
+  }
+}
+
+CxCircuitBreaker::State CxCircuitBreaker::state()
+{
+  pthread_mutex_lock(&_lock);
+  State state = _state;
+  pthread_mutex_unlock(&_lock);
+  return state;
+}
+
+uint64_t CxCircuitBreaker::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// Opens the breaker. Must be called with the lock held.
+void CxCircuitBreaker::open(uint64_t now)
+{
+  _state = OPEN;
+  _open_until_ms = now + _open_ms;
+  reset_counts(now);
+}
+
+// Starts counting requests afresh. Must be called with the lock held.
+void CxCircuitBreaker::reset_counts(uint64_t now)
+{
+  _requests = 0;
+  _failures = 0;
+  _previous_requests = 0;
+  _previous_failures = 0;
+  _window_start_ms = now;
+}
+
+void CxCircuitBreaker::report_state(int event_id, SAS::TrailId trail)
+{
+  SAS::Event event(trail, event_id, 0);
+  SAS::report_event(event);
+}
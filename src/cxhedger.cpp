@@ -0,0 +1,211 @@
+/**
+ * @file cxhedger.cpp Sends duplicate Cx requests when the HSS is slow to answer.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "cxhedger.h"
+#include "log.h"
+#include "statisticsmanager.h"
+
+CxHedger::CxHedger(int budget_percent, StatisticsManager* stats) :
+  _budget_percent(std::min(std::max(budget_percent, 0), 100)),
+  _stats(stats),
+  _budget(0),
+  _running(false),
+  _terminated(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+}
+
+CxHedger::~CxHedger()
+{
+  stop();
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+void CxHedger::schedule(int delay_ms, clbk_t clbk)
+{
+  uint64_t due_ms = now_ms() + std::max(delay_ms, 0);
+
+  pthread_mutex_lock(&_lock);
+
+  _budget = std::min(_budget + _budget_percent, MAX_BUDGET * 100);
+
+  // Only wake the thread if this hedge is due before the ones it is already
+  // waiting for.
+  bool earliest = (_pending.empty() || (due_ms < _pending.begin()->first));
+  _pending.insert(std::make_pair(due_ms, clbk));
+  if (earliest)
+  {
+    pthread_cond_signal(&_cond);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+bool CxHedger::try_hedge()
+{
+  pthread_mutex_lock(&_lock);
+  bool allowed = (_budget >= 100);
+  if (allowed)
+  {
+    _budget -= 100;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  if (!allowed)
+  {
+    TRC_DEBUG("Hedge budget used up - not hedging");
+  }
+  else if (_stats != NULL)
+  {
+    _stats->incr_H_hss_hedged();
+  }
+
+  return allowed;
+}
+
+void CxHedger::hedge_won()
+{
+  if (_stats != NULL)
+  {
+    _stats->incr_H_hss_hedge_won();
+  }
+}
+
+void CxHedger::poll()
+{
+  std::vector<clbk_t> due;
+  uint64_t now = now_ms();
+
+  pthread_mutex_lock(&_lock);
+  while ((!_pending.empty()) && (_pending.begin()->first <= now))
+  {
+    due.push_back(_pending.begin()->second);
+    _pending.erase(_pending.begin());
+  }
+  pthread_mutex_unlock(&_lock);
+
+  // Call the hedges back without the lock, as they may schedule more.
+  for (std::vector<clbk_t>::iterator it = due.begin(); it != due.end(); ++it)
+  {
+    (*it)();
+  }
+}
+
+size_t CxHedger::pending()
+{
+  pthread_mutex_lock(&_lock);
+  size_t pending = _pending.size();
+  pthread_mutex_unlock(&_lock);
+  return pending;
+}
+
+void CxHedger::start()
+{
+  _terminated = false;
+
+  int rc = pthread_create(&_thread, NULL, &CxHedger::thread_entry_point, this);
+  if (rc == 0)
+  {
+    _running = true;
+  }
+  else
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start Cx hedging thread: %s", strerror(rc));
+    // LCOV_EXCL_STOP
+  }
+}
+
+void CxHedger::stop()
+{
+  if (_running)
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+
+    pthread_join(_thread, NULL);
+    _running = false;
+  }
+}
+
+uint64_t CxHedger::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+void CxHedger::thread_function()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    uint64_t wake_ms = _pending.empty() ? (now_ms() + IDLE_WAIT_MS) :
+                                          _pending.begin()->first;
+    struct timespec deadline;
+    deadline.tv_sec = wake_ms / 1000;
+    deadline.tv_nsec = (wake_ms % 1000) * 1000000;
+    pthread_cond_timedwait(&_cond, &_lock, &deadline);
+
+    pthread_mutex_unlock(&_lock);
+    poll();
+    pthread_mutex_lock(&_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void* CxHedger::thread_entry_point(void* hedger)
+{
+  ((CxHedger*)hedger)->thread_function();
+  return NULL;
+}
@@ -0,0 +1,304 @@
+/**
+ * @file cxlimiter.cpp Adaptive concurrency limit on Cx requests to the HSS.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "cxlimiter.h"
+#include "log.h"
+#include "statisticsmanager.h"
+
+// Weight given to each new latency sample in the smoothed average (as for
+// the TCP round trip time estimate).
+static const double LATENCY_SAMPLE_WEIGHT = 0.125;
+
+CxLimiter::CxLimiter(int max_window,
+                     int max_queue,
+                     StatisticsManager* stats) :
+  _max_window(std::max(max_window, 1)),
+  _max_queue(std::max(max_queue, 0)),
+  _stats(stats),
+  _window(_max_window),
+  _in_flight(0),
+  _avg_latency_us(0),
+  _last_decrease_us(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+CxLimiter::~CxLimiter()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+void CxLimiter::send(Priority priority,
+                     int timeout_ms,
+                     clbk_t send_clbk,
+                     clbk_t shed_clbk)
+{
+  uint64_t now = now_us();
+  uint64_t timeout_us = (uint64_t)std::max(timeout_ms, 0) * 1000;
+  std::vector<clbk_t> shed;
+  bool send_now = false;
+
+  pthread_mutex_lock(&_lock);
+  expire(now, shed);
+
+  if (_in_flight < limit())
+  {
+    _in_flight++;
+    send_now = true;
+  }
+  else
+  {
+    // Each request queued ahead of this one has to wait for a slot in the
+    // window, and slots free up at a rate of one per average latency divided
+    // by the window.
+    double expected_wait_us =
+      (queued_ahead(priority) + 1) * _avg_latency_us / limit();
+
+    if (expected_wait_us > timeout_us)
+    {
+      TRC_DEBUG("Expected wait of %.0fus exceeds Cx timeout - shed request",
+                expected_wait_us);
+      shed.push_back(shed_clbk);
+    }
+    else if ((queue_length() >= _max_queue) &&
+             (!make_room(priority, shed)))
+    {
+      TRC_DEBUG("Cx request queue is full - shed request");
+      shed.push_back(shed_clbk);
+    }
+    else
+    {
+      Entry entry;
+      entry.send_clbk = send_clbk;
+      entry.shed_clbk = shed_clbk;
+      entry.enqueued_us = now;
+      entry.deadline_us = now + timeout_us;
+      _queues[priority].push_back(entry);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  for (std::vector<clbk_t>::iterator it = shed.begin(); it != shed.end(); ++it)
+  {
+    (*it)();
+  }
+
+  if (send_now)
+  {
+    if (_stats != NULL)
+    {
+      _stats->update_H_hss_queue_wait_us(0);
+    }
+    send_clbk();
+  }
+}
+
+void CxLimiter::on_complete(unsigned long latency_us, bool failed)
+{
+  uint64_t now = now_us();
+  std::vector<clbk_t> shed;
+  std::vector<clbk_t> send;
+  std::vector<unsigned long> waits;
+
+  pthread_mutex_lock(&_lock);
+
+  if (_in_flight > 0)
+  {
+    _in_flight--;
+  }
+
+  if (failed)
+  {
+    // Back off, but only once for each round trip - requests that were
+    // already in flight when we last backed off tell us nothing new.
+    if (now - latency_us > _last_decrease_us)
+    {
+      _window = std::max(_window / 2, 1.0);
+      _last_decrease_us = now;
+      TRC_DEBUG("Cx request failed - reduced window to %d", limit());
+    }
+  }
+  else
+  {
+    _window = std::min(_window + (1.0 / limit()), _max_window);
+    _avg_latency_us = (_avg_latency_us == 0) ?
+                        latency_us :
+                        (((1 - LATENCY_SAMPLE_WEIGHT) * _avg_latency_us) +
+                         (LATENCY_SAMPLE_WEIGHT * latency_us));
+  }
+
+  // Fill the window from the queues, highest priority first.
+  expire(now, shed);
+  for (int priority = HIGH;
+       (priority < NUM_PRIORITIES) && (_in_flight < limit());
+       priority++)
+  {
+    std::deque<Entry>& queue = _queues[priority];
+    while ((!queue.empty()) && (_in_flight < limit()))
+    {
+      _in_flight++;
+      send.push_back(queue.front().send_clbk);
+      waits.push_back(now - queue.front().enqueued_us);
+      queue.pop_front();
+    }
+  }
+  int window = limit();
+
+  pthread_mutex_unlock(&_lock);
+
+  if (_stats != NULL)
+  {
+    _stats->update_H_hss_concurrency_window(window);
+    for (std::vector<unsigned long>::iterator it = waits.begin();
+         it != waits.end();
+         ++it)
+    {
+      _stats->update_H_hss_queue_wait_us(*it);
+    }
+  }
+
+  for (std::vector<clbk_t>::iterator it = shed.begin(); it != shed.end(); ++it)
+  {
+    (*it)();
+  }
+
+  for (std::vector<clbk_t>::iterator it = send.begin(); it != send.end(); ++it)
+  {
+    (*it)();
+  }
+}
+
+int CxLimiter::window()
+{
+  pthread_mutex_lock(&_lock);
+  int window = limit();
+  pthread_mutex_unlock(&_lock);
+  return window;
+}
+
+int CxLimiter::in_flight()
+{
+  pthread_mutex_lock(&_lock);
+  int in_flight = _in_flight;
+  pthread_mutex_unlock(&_lock);
+  return in_flight;
+}
+
+size_t CxLimiter::queued()
+{
+  pthread_mutex_lock(&_lock);
+  size_t queued = queue_length();
+  pthread_mutex_unlock(&_lock);
+  return queued;
+}
+
+uint64_t CxLimiter::now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+// The number of requests that may be outstanding. Must be called with the
+// lock held.
+int CxLimiter::limit()
+{
+  return (int)_window;
+}
+
+// The total number of queued requests. Must be called with the lock held.
+size_t CxLimiter::queue_length()
+{
+  size_t length = 0;
+  for (int priority = HIGH; priority < NUM_PRIORITIES; priority++)
+  {
+    length += _queues[priority].size();
+  }
+  return length;
+}
+
+// The number of queued requests that would be sent before a new request of
+// the given priority. Must be called with the lock held.
+size_t CxLimiter::queued_ahead(Priority priority)
+{
+  size_t ahead = 0;
+  for (int p = HIGH; p <= priority; p++)
+  {
+    ahead += _queues[p].size();
+  }
+  return ahead;
+}
+
+// Makes room in a full queue for a request of the given priority by
+// shedding the newest request of the lowest priority below it. Returns
+// false if there are no lower priority requests. Must be called with the
+// lock held.
+bool CxLimiter::make_room(Priority priority, std::vector<clbk_t>& shed)
+{
+  for (int p = NUM_PRIORITIES - 1; p > priority; p--)
+  {
+    if (!_queues[p].empty())
+    {
+      shed.push_back(_queues[p].back().shed_clbk);
+      _queues[p].pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+// Removes queued requests that have passed their deadline. Requests are
+// checked from the front of each queue, which (as all requests have much
+// the same timeout) is where the oldest are. Must be called with the lock
+// held.
+void CxLimiter::expire(uint64_t now, std::vector<clbk_t>& shed)
+{
+  for (int priority = HIGH; priority < NUM_PRIORITIES; priority++)
+  {
+    std::deque<Entry>& queue = _queues[priority];
+    while ((!queue.empty()) && (queue.front().deadline_us <= now))
+    {
+      shed.push_back(queue.front().shed_clbk);
+      queue.pop_front();
+    }
+  }
+}
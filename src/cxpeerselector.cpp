@@ -0,0 +1,267 @@
+/**
+ * @file cxpeerselector.cpp Chooses which HSS peer to send each Cx request to.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "cxpeerselector.h"
+#include "log.h"
+
+// Weight given to each new sample in the smoothed averages.
+static const double LATENCY_SAMPLE_WEIGHT = 0.125;
+static const double ERROR_SAMPLE_WEIGHT = 0.1;
+
+CxPeerSelector::CxPeerSelector(const std::string& dest_realm,
+                               double latency_factor,
+                               double max_error_rate,
+                               int degraded_time) :
+  _latency_factor(latency_factor),
+  _max_error_rate(max_error_rate),
+  _degraded_time_us((uint64_t)std::max(degraded_time, 0) * 1000000),
+  _dest_realm(dest_realm),
+  _requests(0),
+  _seed(time(NULL))
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+CxPeerSelector::~CxPeerSelector()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+std::string CxPeerSelector::choose(const std::string& avoid)
+{
+  uint64_t now = now_us();
+  std::string chosen;
+
+  pthread_mutex_lock(&_lock);
+
+  std::vector<std::map<std::string, Peer>::iterator> candidates;
+  for (std::set<std::string>::iterator host = _connected.begin();
+       host != _connected.end();
+       ++host)
+  {
+    std::map<std::string, Peer>::iterator it =
+                         _peers.insert(std::make_pair(*host, Peer())).first;
+    if (!is_degraded(it->second, now))
+    {
+      candidates.push_back(it);
+    }
+  }
+
+  if (candidates.size() > 1)
+  {
+    for (size_t ii = 0; ii < candidates.size(); ii++)
+    {
+      if (candidates[ii]->first == avoid)
+      {
+        candidates.erase(candidates.begin() + ii);
+        break;
+      }
+    }
+  }
+
+  if ((!candidates.empty()) && (++_requests % EXPLORE_INTERVAL != 0))
+  {
+    // Pick two different peers at random, and use the cheaper.
+    size_t num = candidates.size();
+    size_t first = rand_r(&_seed) % num;
+    size_t second = (num > 1) ? ((first + 1 + rand_r(&_seed) % (num - 1)) % num) :
+                                first;
+    std::map<std::string, Peer>::iterator a = candidates[first];
+    std::map<std::string, Peer>::iterator b = candidates[second];
+    double cost_a = (a->second.latency_us + 1) * (a->second.outstanding + 1);
+    double cost_b = (b->second.latency_us + 1) * (b->second.outstanding + 1);
+    std::map<std::string, Peer>::iterator best = (cost_b < cost_a) ? b : a;
+
+    best->second.outstanding++;
+    chosen = best->first;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return chosen;
+}
+
+void CxPeerSelector::peer_connection_cb(bool connected,
+                                        const std::string& host,
+                                        const std::string& realm)
+{
+  pthread_mutex_lock(&_lock);
+
+  if ((connected) && (realm == _dest_realm))
+  {
+    _connected.insert(host);
+  }
+  else
+  {
+    _connected.erase(host);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void CxPeerSelector::on_complete(const std::string& chosen,
+                                 const std::string& answered_by,
+                                 unsigned long latency_us,
+                                 bool failed)
+{
+  uint64_t now = now_us();
+
+  pthread_mutex_lock(&_lock);
+
+  // Charge the request to the peer it was sent to if we chose one, and
+  // otherwise to the peer that answered it (if any).
+  const std::string& host = chosen.empty() ? answered_by : chosen;
+  if (!host.empty())
+  {
+    Peer& peer = _peers[host];
+
+    if ((!chosen.empty()) && (peer.outstanding > 0))
+    {
+      peer.outstanding--;
+    }
+
+    if (peer.samples == 0)
+    {
+      peer.latency_us = latency_us;
+    }
+    else
+    {
+      peer.latency_us += LATENCY_SAMPLE_WEIGHT * ((double)latency_us - peer.latency_us);
+    }
+    peer.error_rate += ERROR_SAMPLE_WEIGHT * ((failed ? 1.0 : 0.0) - peer.error_rate);
+    peer.samples++;
+
+    check_degraded(host, peer, now);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+std::vector<CxPeerSelector::PeerStats> CxPeerSelector::peer_stats()
+{
+  uint64_t now = now_us();
+  std::vector<PeerStats> stats;
+
+  pthread_mutex_lock(&_lock);
+  for (std::map<std::string, Peer>::iterator it = _peers.begin();
+       it != _peers.end();
+       ++it)
+  {
+    PeerStats peer_stats;
+    peer_stats.host = it->first;
+    peer_stats.latency_us = (unsigned long)it->second.latency_us;
+    peer_stats.error_rate = it->second.error_rate;
+    peer_stats.outstanding = it->second.outstanding;
+    peer_stats.degraded = is_degraded(it->second, now);
+    stats.push_back(peer_stats);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return stats;
+}
+
+uint64_t CxPeerSelector::now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+// Returns whether the peer is currently degraded. A peer that has served
+// its time is given a fresh start. Must be called with the lock held.
+bool CxPeerSelector::is_degraded(Peer& peer, uint64_t now)
+{
+  if (peer.degraded_until_us == 0)
+  {
+    return false;
+  }
+  else if (now < peer.degraded_until_us)
+  {
+    return true;
+  }
+
+  peer.latency_us = 0;
+  peer.error_rate = 0;
+  peer.samples = 0;
+  peer.degraded_until_us = 0;
+  return false;
+}
+
+// Marks the peer as degraded if it is doing badly, either on its own or
+// compared to the best of the other peers. Must be called with the lock
+// held.
+void CxPeerSelector::check_degraded(const std::string& host,
+                                    Peer& peer,
+                                    uint64_t now)
+{
+  if ((peer.samples < MIN_SAMPLES) || (is_degraded(peer, now)))
+  {
+    return;
+  }
+
+  double best_latency_us = 0;
+  for (std::map<std::string, Peer>::iterator it = _peers.begin();
+       it != _peers.end();
+       ++it)
+  {
+    if ((it->first != host) &&
+        (it->second.samples >= MIN_SAMPLES) &&
+        (!is_degraded(it->second, now)) &&
+        ((best_latency_us == 0) || (it->second.latency_us < best_latency_us)))
+    {
+      best_latency_us = it->second.latency_us;
+    }
+  }
+
+  if (peer.error_rate > _max_error_rate)
+  {
+    TRC_WARNING("HSS peer %s is failing %.0f%% of requests - avoiding it for %d seconds",
+                host.c_str(), peer.error_rate * 100, (int)(_degraded_time_us / 1000000));
+    peer.degraded_until_us = now + _degraded_time_us;
+  }
+  else if ((best_latency_us > 0) &&
+           (peer.latency_us > _latency_factor * best_latency_us))
+  {
+    TRC_WARNING("HSS peer %s latency is %.0fus against %.0fus for the best peer - avoiding it for %d seconds",
+                host.c_str(), peer.latency_us, best_latency_us, (int)(_degraded_time_us / 1000000));
+    peer.degraded_until_us = now + _degraded_time_us;
+  }
+}
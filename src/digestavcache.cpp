@@ -0,0 +1,180 @@
+/**
+ * @file digestavcache.cpp Short-lived cache of digest authentication vectors.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#include "digestavcache.h"
+#include "log.h"
+
+// Approximate per-entry overhead of the list node, index node and vector
+// object, on top of the string contents.
+static const size_t ENTRY_OVERHEAD_BYTES = 256;
+
+DigestAvCache::DigestAvCache(int ttl, size_t max_bytes, bool use_cassandra) :
+  _ttl(ttl),
+  _max_bytes(max_bytes),
+  _use_cassandra(use_cassandra),
+  _bytes(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+DigestAvCache::~DigestAvCache()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+bool DigestAvCache::get(const std::string& impi,
+                        const std::string& impu,
+                        DigestAuthVector& av)
+{
+  bool found = false;
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, Entries::iterator>::iterator it =
+                                                 _index.find(make_key(impi, impu));
+  if (it != _index.end())
+  {
+    if (it->second->expiry > now())
+    {
+      // Move the entry to the front of the LRU list.
+      _lru.splice(_lru.begin(), _lru, it->second);
+      av = it->second->av;
+      found = true;
+    }
+    else
+    {
+      remove(it);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  TRC_DEBUG("%s cached digest AV for %s/%s",
+            found ? "Found" : "No", impi.c_str(), impu.c_str());
+  return found;
+}
+
+void DigestAvCache::put(const std::string& impi,
+                        const std::string& impu,
+                        const DigestAuthVector& av)
+{
+  Entry entry;
+  entry.key = make_key(impi, impu);
+  entry.av = av;
+  entry.expiry = now() + _ttl;
+  entry.bytes = ENTRY_OVERHEAD_BYTES + (2 * entry.key.size()) +
+                av.ha1.size() + av.realm.size() + av.qop.size();
+
+  if (entry.bytes > _max_bytes)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, Entries::iterator>::iterator it = _index.find(entry.key);
+  if (it != _index.end())
+  {
+    remove(it);
+  }
+
+  // Evict from the back of the LRU list until the new entry fits.
+  while ((!_lru.empty()) && (_bytes + entry.bytes > _max_bytes))
+  {
+    TRC_DEBUG("Digest AV cache full - evicting least recently used entry");
+    remove(_index.find(_lru.back().key));
+  }
+
+  _lru.push_front(entry);
+  _index[entry.key] = _lru.begin();
+  _bytes += entry.bytes;
+
+  pthread_mutex_unlock(&_lock);
+
+  TRC_DEBUG("Cached digest AV for %s/%s", impi.c_str(), impu.c_str());
+}
+
+void DigestAvCache::invalidate(const std::string& impi)
+{
+  TRC_DEBUG("Discarding cached digest AVs for %s", impi.c_str());
+
+  pthread_mutex_lock(&_lock);
+
+  std::string prefix = make_key(impi, "");
+  std::map<std::string, Entries::iterator>::iterator it = _index.lower_bound(prefix);
+  while ((it != _index.end()) &&
+         (it->first.compare(0, prefix.size(), prefix) == 0))
+  {
+    remove(it++);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+size_t DigestAvCache::size_bytes()
+{
+  pthread_mutex_lock(&_lock);
+  size_t bytes = _bytes;
+  pthread_mutex_unlock(&_lock);
+  return bytes;
+}
+
+// The private ID can't contain a NUL, so use it to separate the IDs.
+std::string DigestAvCache::make_key(const std::string& impi,
+                                    const std::string& impu)
+{
+  std::string key = impi;
+  key.push_back('\0');
+  key.append(impu);
+  return key;
+}
+
+time_t DigestAvCache::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+// Removes an entry from both the index and the LRU list. Must be called with
+// the lock held.
+void DigestAvCache::remove(std::map<std::string, Entries::iterator>::iterator it)
+{
+  _bytes -= it->second->bytes;
+  _lru.erase(it->second);
+  _index.erase(it);
+}
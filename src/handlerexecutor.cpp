@@ -0,0 +1,203 @@
+/**
+ * @file handlerexecutor.cpp Runs handler work off the Diameter threads.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "handlerexecutor.h"
+#include "log.h"
+
+HandlerExecutor::HandlerExecutor(int num_threads, StatisticsManager* stats) :
+  _num_threads(num_threads),
+  _stats(stats),
+  _terminated(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+HandlerExecutor::~HandlerExecutor()
+{
+  stop();
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+void HandlerExecutor::start()
+{
+  pthread_mutex_lock(&_lock);
+  _terminated = false;
+
+  for (int ii = 0; ii < _num_threads; ii++)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, &HandlerExecutor::thread_entry_point, this);
+    if (rc == 0)
+    {
+      _threads.push_back(thread);
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start handler thread: %s", strerror(rc));
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void HandlerExecutor::stop()
+{
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_broadcast(&_cond);
+  std::vector<pthread_t> threads;
+  threads.swap(_threads);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::vector<pthread_t>::iterator it = threads.begin();
+       it != threads.end();
+       ++it)
+  {
+    pthread_join(*it, NULL);
+  }
+}
+
+void HandlerExecutor::submit(Stage stage, work_t work)
+{
+  pthread_mutex_lock(&_lock);
+
+  if (_threads.empty())
+  {
+    // Nothing to pass the work to, so just run it now.
+    pthread_mutex_unlock(&_lock);
+    work();
+    return;
+  }
+
+  Item item;
+  item.stage = stage;
+  item.work = work;
+  item.queued_us = now_us();
+  _queue.push_back(item);
+  size_t depth = _queue.size();
+
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  if (_stats != NULL)
+  {
+    _stats->update_H_handler_queue_depth(depth);
+  }
+}
+
+size_t HandlerExecutor::depth()
+{
+  pthread_mutex_lock(&_lock);
+  size_t depth = _queue.size();
+  pthread_mutex_unlock(&_lock);
+  return depth;
+}
+
+uint64_t HandlerExecutor::now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+// Runs a piece of work, reporting how long it queued for and how long it
+// took.
+void HandlerExecutor::run(Item& item)
+{
+  uint64_t start_us = now_us();
+  item.work();
+  uint64_t end_us = now_us();
+
+  if (_stats != NULL)
+  {
+    _stats->update_H_handler_queue_wait_us(start_us - item.queued_us);
+
+    unsigned long run_us = end_us - start_us;
+    switch (item.stage)
+    {
+    case CX_ANSWER:
+      _stats->update_H_handler_cx_answer_us(run_us);
+      break;
+
+    case RTR:
+      _stats->update_H_handler_rtr_us(run_us);
+      break;
+
+    case PPR:
+      _stats->update_H_handler_ppr_us(run_us);
+      break;
+    }
+  }
+}
+
+void HandlerExecutor::thread_function()
+{
+  pthread_mutex_lock(&_lock);
+
+  // Keep going until there's nothing left to do, even once we've been told
+  // to stop, so that no work is dropped.
+  while ((!_terminated) || (!_queue.empty()))
+  {
+    if (_queue.empty())
+    {
+      pthread_cond_wait(&_cond, &_lock);
+      continue;
+    }
+
+    Item item = _queue.front();
+    _queue.pop_front();
+    pthread_mutex_unlock(&_lock);
+
+    run(item);
+
+    pthread_mutex_lock(&_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void* HandlerExecutor::thread_entry_point(void* executor)
+{
+  ((HandlerExecutor*)executor)->thread_function();
+  return NULL;
+}
@@ -34,6 +34,12 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+#include <sstream>
+
 #include "handlers.h"
 #include "xmlutils.h"
 #include "servercapabilities.h"
@@ -45,6 +51,9 @@
 #include "rapidjson/stringbuffer.h"
 #include "rapidxml/rapidxml.hpp"
 #include "boost/algorithm/string/join.hpp"
+#include "boost/algorithm/string/trim.hpp"
+#include "boost/algorithm/string/split.hpp"
+#include "boost/algorithm/string/classification.hpp"
 
 const std::string SIP_URI_PRE = "sip:";
 
@@ -56,6 +65,49 @@ Cx::Dictionary* HssCacheTask::_dict;
 Cache* HssCacheTask::_cache = NULL;
 StatisticsManager* HssCacheTask::_stats_manager = NULL;
 HealthChecker* HssCacheTask::_health_checker = NULL;
+HotKeyTracker* HssCacheTask::_hot_key_tracker = NULL;
+IcscfCache* HssCacheTask::_icscf_cache = NULL;
+bool HssCacheTask::_coalesce_requests = false;
+CxLimiter* HssCacheTask::_cx_limiter = NULL;
+CxHedger* HssCacheTask::_cx_hedger = NULL;
+CxPeerSelector* HssCacheTask::_cx_peer_selector = NULL;
+CxCircuitBreaker* HssCacheTask::_cx_circuit_breaker = NULL;
+int HssCacheTask::_default_deadline_ms = 0;
+HandlerExecutor* HssCacheTask::_handler_executor = NULL;
+
+const std::string HssCacheTask::DEADLINE_HEADER = "X-Request-Timeout";
+
+static const std::string ETAG_HEADER = "ETag";
+static const std::string IF_NONE_MATCH_HEADER = "If-None-Match";
+static const std::string AUTHORIZATION_HEADER = "Authorization";
+static const std::string ACCEPT_ENCODING_HEADER = "Accept-Encoding";
+static const std::string CONTENT_ENCODING_HEADER = "Content-Encoding";
+static const std::string VARY_HEADER = "Vary";
+
+AdaptiveTimeout* HssCacheTask::_mar_hedge_delay = NULL;
+AdaptiveTimeout* HssCacheTask::_uar_hedge_delay = NULL;
+AdaptiveTimeout* HssCacheTask::_lir_hedge_delay = NULL;
+AdaptiveTimeout* HssCacheTask::_mar_timeout = NULL;
+AdaptiveTimeout* HssCacheTask::_sar_timeout = NULL;
+AdaptiveTimeout* HssCacheTask::_uar_timeout = NULL;
+AdaptiveTimeout* HssCacheTask::_lir_timeout = NULL;
+
+AkaVectorPool* ImpiTask::_aka_vector_pool = NULL;
+DigestAvCache* ImpiTask::_digest_av_cache = NULL;
+TokenBucket* ImpuRegDataTask::_rereg_sar_bucket = NULL;
+pthread_mutex_t ImpuRegDataTask::_rereg_sar_lock = PTHREAD_MUTEX_INITIALIZER;
+bool ImpuRegDataTask::_serialize_reg_data = false;
+std::map<std::string, std::deque<ImpuRegDataTask*>> ImpuRegDataTask::_impu_queues;
+pthread_mutex_t ImpuRegDataTask::_impu_queues_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread std::deque<ImpuRegDataTask::HandOff>* ImpuRegDataTask::_pending_hand_offs = NULL;
+bool ImpuRegDataTask::_incremental_irs_updates = false;
+ResponseCompressor* ImpuRegDataTask::_response_compressor = NULL;
+RegDataCache* ImpuRegDataTask::_reg_data_cache = NULL;
+bool ImpuRegDataTask::_stream_reg_data = false;
+bool PushProfileTask::_batch_pprs = false;
+bool PushProfileTask::_incremental_irs_updates = false;
+std::map<std::string, std::vector<PushProfileTask*>> PushProfileTask::_waiting_pprs;
+pthread_mutex_t PushProfileTask::_waiting_pprs_lock = PTHREAD_MUTEX_INITIALIZER;
 
 const static HssCacheTask::StatsFlags DIGEST_STATS =
   static_cast<HssCacheTask::StatsFlags>(
@@ -67,6 +119,121 @@ const static HssCacheTask::StatsFlags SUBSCRIPTION_STATS =
     HssCacheTask::STAT_HSS_LATENCY |
     HssCacheTask::STAT_HSS_SUBSCRIPTION_LATENCY);
 
+// Returns a per-subscriber offset in the range [0, max_jitter) seconds. This
+// is a hash of the key (rather than a random number) so that every Homestead
+// node picks the same offset for the same subscriber.
+static int jitter_for_key(const std::string& key, int max_jitter)
+{
+  if (max_jitter <= 0)
+  {
+    return 0;
+  }
+
+  // FNV-1a.
+  uint32_t hash = 2166136261u;
+  for (std::string::const_iterator it = key.begin(); it != key.end(); ++it)
+  {
+    hash ^= (uint8_t)*it;
+    hash *= 16777619u;
+  }
+
+  return hash % max_jitter;
+}
+
+// 64-bit FNV-1a.
+static uint64_t hash_string(const std::string& str)
+{
+  uint64_t hash = 14695981039346656037ull;
+  for (std::string::const_iterator it = str.begin(); it != str.end(); ++it)
+  {
+    hash ^= (uint8_t)*it;
+    hash *= 1099511628211ull;
+  }
+
+  return hash;
+}
+
+// Appends a length-prefixed part to a string made up of several parts.
+static void append_part(std::string& str, const std::string& part)
+{
+  str.append(std::to_string(part.length()));
+  str.push_back(':');
+  str.append(part);
+}
+
+// Builds the key under which a Cx request is tracked while it's in flight,
+// from the command and the parameters that determine the answer.
+static std::string in_flight_key(const std::string& command,
+                                 const std::vector<std::string>& params)
+{
+  std::string key = command;
+  for (std::vector<std::string>::const_iterator it = params.begin();
+       it != params.end();
+       ++it)
+  {
+    key.push_back('\0');
+    key.append(*it);
+  }
+  return key;
+}
+
+// Deletes the cached rows for public IDs that have been removed from an IRS.
+// If the IRS's default public ID has gone, it is also dissociated from the
+// given private IDs.
+static void delete_removed_public_ids(Cache* cache,
+                                      const XmlUtils::IrsDiff& diff,
+                                      const std::vector<std::string>& impis,
+                                      SAS::TrailId trail)
+{
+  std::vector<std::string> dissociated_impis;
+  if (diff.default_id_removed)
+  {
+    dissociated_impis = impis;
+  }
+
+  TRC_DEBUG("Deleting %d public IDs removed from IRS", diff.removed.size());
+  SAS::Event event(trail, SASEvent::CACHE_DELETE_IMPUS, 0);
+  std::string public_ids_str = boost::algorithm::join(diff.removed, ", ");
+  event.add_var_param(public_ids_str);
+  std::string impis_str = boost::algorithm::join(dissociated_impis, ", ");
+  event.add_var_param(impis_str);
+  SAS::report_event(event);
+
+  CassandraStore::Operation* delete_public_ids =
+    cache->create_DeletePublicIDs(diff.removed,
+                                  dissociated_impis,
+                                  Cache::generate_timestamp());
+  CassandraStore::Transaction* tsx =
+    new HssCacheTask::CacheTransaction<HssCacheTask>;
+  cache->do_async(delete_public_ids, tsx);
+}
+
+static uint64_t monotonic_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+HssCacheTask::HssCacheTask(HttpStack::Request& req, SAS::TrailId trail) :
+  HttpStackUtils::Task(req, trail),
+  _deadline_ms(0)
+{
+  int budget_ms = atoi(_req.header(DEADLINE_HEADER).c_str());
+  if (budget_ms <= 0)
+  {
+    budget_ms = _default_deadline_ms;
+  }
+
+  if (budget_ms > 0)
+  {
+    // The requester's clock started when the request arrived, so take off
+    // any time it has spent queued since then.
+    unsigned long queued_us = 0;
+    _req.get_latency(queued_us);
+    _deadline_ms = monotonic_ms() + budget_ms - (queued_us / 1000);
+  }
+}
 
 void HssCacheTask::configure_diameter(Diameter::Stack* diameter_stack,
                                       const std::string& dest_realm,
@@ -100,10 +267,197 @@ void HssCacheTask::configure_stats(StatisticsManager* stats_manager)
   _stats_manager = stats_manager;
 }
 
+void HssCacheTask::configure_hot_key_tracker(HotKeyTracker* tracker)
+{
+  _hot_key_tracker = tracker;
+}
+
+void HssCacheTask::configure_icscf_cache(IcscfCache* icscf_cache)
+{
+  _icscf_cache = icscf_cache;
+}
+
+void HssCacheTask::configure_request_coalescing(bool enabled)
+{
+  _coalesce_requests = enabled;
+}
+
+void HssCacheTask::configure_cx_limiter(CxLimiter* cx_limiter)
+{
+  _cx_limiter = cx_limiter;
+}
+
+void HssCacheTask::configure_adaptive_timeouts(AdaptiveTimeout* mar_timeout,
+                                               AdaptiveTimeout* sar_timeout,
+                                               AdaptiveTimeout* uar_timeout,
+                                               AdaptiveTimeout* lir_timeout)
+{
+  _mar_timeout = mar_timeout;
+  _sar_timeout = sar_timeout;
+  _uar_timeout = uar_timeout;
+  _lir_timeout = lir_timeout;
+}
+
+void HssCacheTask::configure_hedging(CxHedger* cx_hedger,
+                                     AdaptiveTimeout* mar_hedge_delay,
+                                     AdaptiveTimeout* uar_hedge_delay,
+                                     AdaptiveTimeout* lir_hedge_delay)
+{
+  _cx_hedger = cx_hedger;
+  _mar_hedge_delay = mar_hedge_delay;
+  _uar_hedge_delay = uar_hedge_delay;
+  _lir_hedge_delay = lir_hedge_delay;
+}
+
+void HssCacheTask::configure_cx_peer_selector(CxPeerSelector* cx_peer_selector)
+{
+  _cx_peer_selector = cx_peer_selector;
+}
+
+void HssCacheTask::configure_cx_circuit_breaker(CxCircuitBreaker* cx_circuit_breaker)
+{
+  _cx_circuit_breaker = cx_circuit_breaker;
+}
+
+void HssCacheTask::configure_default_deadline(int default_deadline_ms)
+{
+  _default_deadline_ms = default_deadline_ms;
+}
+
+void HssCacheTask::configure_handler_executor(HandlerExecutor* handler_executor)
+{
+  _handler_executor = handler_executor;
+}
+
+void HssCacheTask::dispatch(HandlerExecutor::Stage stage,
+                            HandlerExecutor::work_t work)
+{
+  if (_handler_executor != NULL)
+  {
+    _handler_executor->submit(stage, work);
+  }
+  else
+  {
+    work();
+  }
+}
+
+void HssCacheTask::invalidate_icscf_answers(const std::vector<std::string>& impis,
+                                            const std::vector<std::string>& impus)
+{
+  if (_icscf_cache == NULL)
+  {
+    return;
+  }
+
+  for (std::vector<std::string>::const_iterator it = impis.begin();
+       it != impis.end();
+       ++it)
+  {
+    _icscf_cache->invalidate_impi(*it);
+  }
+
+  for (std::vector<std::string>::const_iterator it = impus.begin();
+       it != impus.end();
+       ++it)
+  {
+    _icscf_cache->invalidate_impu(*it);
+  }
+}
+
+// Replies with a cached answer to an I-CSCF query if there is one. Returns
+// true if a reply was sent.
+bool HssCacheTask::reply_from_icscf_cache(const std::string& key)
+{
+  if (_icscf_cache == NULL)
+  {
+    return false;
+  }
+
+  std::string answer;
+  bool found = _icscf_cache->get(key, answer);
+
+  if (_stats_manager != NULL)
+  {
+    if (found)
+    {
+      _stats_manager->incr_H_icscf_cache_hits();
+    }
+    else
+    {
+      _stats_manager->incr_H_icscf_cache_misses();
+    }
+  }
+
+  if (found)
+  {
+    TRC_DEBUG("Using cached answer to I-CSCF query");
+    SAS::Event event(this->trail(), SASEvent::ICSCF_CACHE_HIT, 0);
+    SAS::report_event(event);
+    _req.add_content(answer);
+    send_http_reply(HTTP_OK);
+  }
+
+  return found;
+}
+
+// Called once this task has replied and has nothing more to do.
+void HssCacheTask::finish_task()
+{
+  delete this;
+}
+
 void HssCacheTask::on_diameter_timeout()
 {
   send_http_reply(HTTP_GATEWAY_TIMEOUT);
-  delete this;
+  finish_task();
+}
+
+// Called instead of sending a request to the HSS while the HSS circuit
+// breaker is open. Sprout can retry the request on another Homestead.
+void HssCacheTask::on_hss_unavailable()
+{
+  send_http_reply(HTTP_SERVER_UNAVAILABLE);
+  finish_task();
+}
+
+bool HssCacheTask::past_deadline() const
+{
+  return ((_deadline_ms != 0) && (monotonic_ms() >= _deadline_ms));
+}
+
+// Called instead of doing more work on a request whose requester has already
+// given up on it. We still have to reply, but nobody will be listening.
+void HssCacheTask::on_deadline_expired()
+{
+  TRC_DEBUG("Abandoning request past its deadline");
+  SAS::Event event(this->trail(), SASEvent::DEADLINE_EXPIRED, 0);
+  SAS::report_event(event);
+
+  if (_stats_manager != NULL)
+  {
+    _stats_manager->incr_H_deadline_expired();
+  }
+
+  send_http_reply(HTTP_GATEWAY_TIMEOUT);
+  finish_task();
+}
+
+void HssCacheTask::clear_deadline()
+{
+  _deadline_ms = 0;
+}
+
+int HssCacheTask::remaining_timeout_ms(int timeout_ms) const
+{
+  if (_deadline_ms == 0)
+  {
+    return timeout_ms;
+  }
+
+  uint64_t now_ms = monotonic_ms();
+  int remaining_ms = (now_ms < _deadline_ms) ? (int)(_deadline_ms - now_ms) : 0;
+  return std::min(timeout_ms, remaining_ms);
 }
 
 // Common SAS log function
@@ -132,6 +486,39 @@ static void sas_log_get_reg_data_success(Cache::GetRegData* get_reg_data, SAS::T
 
 // General IMPI handling.
 
+void ImpiTask::configure_aka_vector_pool(AkaVectorPool* pool)
+{
+  _aka_vector_pool = pool;
+}
+
+void ImpiTask::configure_digest_av_cache(DigestAvCache* cache)
+{
+  _digest_av_cache = cache;
+}
+
+void ImpiTask::invalidate_digest_avs(const std::vector<std::string>& impis)
+{
+  if (_digest_av_cache == NULL)
+  {
+    return;
+  }
+
+  for (std::vector<std::string>::const_iterator it = impis.begin();
+       it != impis.end();
+       ++it)
+  {
+    _digest_av_cache->invalidate(*it);
+  }
+
+  if (_digest_av_cache->use_cassandra())
+  {
+    CassandraStore::Operation* delete_avs =
+      _cache->create_DeleteAuthVector(impis, Cache::generate_timestamp());
+    CassandraStore::Transaction* tsx = new CacheTransaction;
+    _cache->do_async(delete_avs, tsx);
+  }
+}
+
 void ImpiTask::run()
 {
   if (parse_request())
@@ -157,6 +544,12 @@ void ImpiTask::run()
 
 void ImpiTask::query_cache_av()
 {
+  if (past_deadline())
+  {
+    on_deadline_expired();
+    return;
+  }
+
   TRC_DEBUG("Querying cache for authentication vector for %s/%s", _impi.c_str(), _impu.c_str());
   SAS::Event event(this->trail(), SASEvent::CACHE_GET_AV, 0);
   event.add_var_param(_impi);
@@ -232,14 +625,193 @@ void ImpiTask::get_av()
       query_cache_impu();
     }
   }
+  else if (get_pooled_aka_vector())
+  {
+    delete this;
+  }
   else
   {
-    send_mar();
+    query_digest_av_cache();
+  }
+}
+
+// Whether AKA vectors for this request can come from (and go into) the
+// pool. Resynchronization requests (which carry an AUTN) always go to the
+// HSS.
+bool ImpiTask::use_aka_vector_pool()
+{
+  return ((_aka_vector_pool != NULL) &&
+          (_scheme == _cfg->scheme_aka) &&
+          (_authorization.empty()));
+}
+
+// Replies with a pooled AKA vector if there is one, refilling the pool if
+// it's running low. Returns true if a reply was sent.
+bool ImpiTask::get_pooled_aka_vector()
+{
+  if ((_aka_vector_pool != NULL) &&
+      (_scheme == _cfg->scheme_aka) &&
+      (!_authorization.empty()))
+  {
+    // The client is resynchronizing its sequence number, so any vectors
+    // we're holding for it will now be rejected.
+    _aka_vector_pool->flush(_impi);
+  }
+
+  if (!use_aka_vector_pool())
+  {
+    return false;
+  }
+
+  AKAAuthVector av;
+  bool needs_refill = false;
+  if (!_aka_vector_pool->get(_impi, av, needs_refill))
+  {
+    return false;
+  }
+
+  TRC_DEBUG("Using pooled AKA vector for %s", _impi.c_str());
+  SAS::Event event(this->trail(), SASEvent::AKA_AV_POOL_HIT, 0);
+  event.add_var_param(_impi);
+  SAS::report_event(event);
+  send_reply(av);
+
+  if (needs_refill)
+  {
+    refill_aka_vector_pool();
+  }
+
+  return true;
+}
+
+// Diameter transaction for a MAR that refills the AKA vector pool in the
+// background. No HTTP request is waiting on it, so it has no handler, but it
+// still goes through the Cx concurrency limiter and circuit breaker like any
+// other MAR. If it doesn't refill the pool (because it fails, times out, or
+// is never sent) the refill is marked as failed when it is deleted.
+class AkaVectorRefillTransaction : public ImpiTask::DiameterTransaction
+{
+public:
+  AkaVectorRefillTransaction(Cx::Dictionary* dict,
+                             Diameter::Stack* diameter_stack,
+                             AkaVectorPool* pool,
+                             const std::string& dest_realm,
+                             const std::string& dest_host,
+                             const std::string& impi,
+                             const std::string& impu,
+                             const std::string& server_name,
+                             const std::string& scheme,
+                             SAS::TrailId trail) :
+    ImpiTask::DiameterTransaction(dict, DIGEST_STATS, trail),
+    _diameter_stack(diameter_stack),
+    _pool(pool),
+    _dest_realm(dest_realm),
+    _dest_host(dest_host),
+    _impi(impi),
+    _impu(impu),
+    _server_name(server_name),
+    _scheme(scheme),
+    _refilled(false)
+  {};
+
+  virtual ~AkaVectorRefillTransaction()
+  {
+    if (!_refilled)
+    {
+      _pool->refill_failed(_impi);
+    }
+  }
+
+  void transmit_mar(int timeout_ms)
+  {
+    Cx::MultimediaAuthRequest mar(_cx_dict,
+                                  _diameter_stack,
+                                  _dest_realm,
+                                  choose_dest_host(_dest_host),
+                                  _impi,
+                                  _impu,
+                                  _server_name,
+                                  _scheme,
+                                  "",
+                                  _pool->batch_size());
+    mar.send(this, timeout_ms);
+  }
+
+protected:
+  void on_response(Diameter::Message& rsp)
+  {
+    ImpiTask::DiameterTransaction::on_response(rsp);
+
+    Cx::MultimediaAuthAnswer maa(rsp);
+    int32_t result_code = 0;
+    maa.result_code(result_code);
+
+    if ((result_code == DIAMETER_SUCCESS) &&
+        (maa.sip_auth_scheme() == _scheme))
+    {
+      _pool->add(_impi, maa.aka_auth_vectors());
+      _refilled = true;
+    }
+    else
+    {
+      TRC_INFO("Failed to refill AKA vectors for %s - result code %d",
+               _impi.c_str(), result_code);
+    }
+  }
+
+  void on_timeout()
+  {
+    ImpiTask::DiameterTransaction::on_timeout();
+    TRC_INFO("Timed out refilling AKA vectors for %s", _impi.c_str());
   }
+
+private:
+  Diameter::Stack* _diameter_stack;
+  AkaVectorPool* _pool;
+  std::string _dest_realm;
+  std::string _dest_host;
+  std::string _impi;
+  std::string _impu;
+  std::string _server_name;
+  std::string _scheme;
+  bool _refilled;
+};
+
+void ImpiTask::refill_aka_vector_pool()
+{
+  TRC_DEBUG("Refilling AKA vector pool for %s", _impi.c_str());
+  AkaVectorRefillTransaction* tsx =
+    new AkaVectorRefillTransaction(_dict,
+                                   _diameter_stack,
+                                   _aka_vector_pool,
+                                   _dest_realm,
+                                   _dest_host,
+                                   _impi,
+                                   _impu,
+                                   _server_name,
+                                   _scheme,
+                                   trail());
+
+  // Refills are background work, so they give way to requests that
+  // someone is waiting for.
+  int timeout_ms = tsx->choose_timeout(_mar_timeout,
+                                       &StatisticsManager::update_H_hss_mar_timeout_ms,
+                                       _cfg->diameter_timeout_ms);
+  tsx->send_limited(CxLimiter::LOW,
+                    timeout_ms,
+                    boost::bind(&AkaVectorRefillTransaction::transmit_mar,
+                                tsx,
+                                _2));
 }
 
 void ImpiTask::query_cache_impu()
 {
+  if (past_deadline())
+  {
+    on_deadline_expired();
+    return;
+  }
+
   TRC_DEBUG("Querying cache to find public IDs associated with %s", _impi.c_str());
   SAS::Event event(this->trail(), SASEvent::CACHE_GET_ASSOC_IMPU, 0);
   event.add_var_param(_impi);
@@ -265,7 +837,7 @@ void ImpiTask::on_get_impu_success(CassandraStore::Operation* op)
     SAS::report_event(event);
     TRC_DEBUG("Found cached public ID %s for private ID %s - now send Multimedia-Auth request",
               _impu.c_str(), _impi.c_str());
-    send_mar();
+    query_digest_av_cache();
   }
   else
   {
@@ -304,36 +876,185 @@ void ImpiTask::on_get_impu_failure(CassandraStore::Operation* op, CassandraStore
   delete this;
 }
 
-void ImpiTask::send_mar()
+// Looks for a digest vector that we got from the HSS recently, first in
+// memory and then (if enabled) in Cassandra, and only sends a MAR if there
+// isn't one.
+void ImpiTask::query_digest_av_cache()
 {
-  Cx::MultimediaAuthRequest mar(_dict,
-                                _diameter_stack,
-                                _dest_realm,
-                                _dest_host,
-                                _impi,
-                                _impu,
-                                _server_name,
-                                _scheme,
-                                _authorization);
-  DiameterTransaction* tsx =
-    new DiameterTransaction(_dict, this, DIGEST_STATS, &ImpiTask::on_mar_response);
-  mar.send(tsx, _cfg->diameter_timeout_ms);
-}
+  if ((_digest_av_cache == NULL) || (_scheme != _cfg->scheme_digest))
+  {
+    send_mar();
+    return;
+  }
 
-void ImpiTask::on_mar_response(Diameter::Message& rsp)
-{
-  Cx::MultimediaAuthAnswer maa(rsp);
-  int32_t result_code = 0;
-  maa.result_code(result_code);
-  TRC_DEBUG("Received Multimedia-Auth answer with result code %d", result_code);
-  switch (result_code)
+  DigestAuthVector av;
+  if (_digest_av_cache->get(_impi, _impu, av))
   {
-    case 2001:
-    {
+    TRC_DEBUG("Using cached digest AV for %s/%s", _impi.c_str(), _impu.c_str());
+    SAS::Event event(this->trail(), SASEvent::DIGEST_AV_CACHE_HIT, 0);
+    event.add_var_param(_impi);
+    event.add_var_param(_impu);
+    SAS::report_event(event);
+    send_reply(av);
+    delete this;
+  }
+  else if (past_deadline())
+  {
+    on_deadline_expired();
+  }
+  else if (_digest_av_cache->use_cassandra())
+  {
+    TRC_DEBUG("Querying cache for digest AV for %s/%s", _impi.c_str(), _impu.c_str());
+    SAS::Event event(this->trail(), SASEvent::CACHE_GET_AV, 0);
+    event.add_var_param(_impi);
+    event.add_var_param(_impu);
+    SAS::report_event(event);
+    CassandraStore::Operation* get_av = _cache->create_GetAuthVector(_impi, _impu);
+    CassandraStore::Transaction* tsx =
+      new CacheTransaction(this,
+                           &ImpiTask::on_get_cached_digest_av_success,
+                           &ImpiTask::on_get_cached_digest_av_failure);
+    _cache->do_async(get_av, tsx);
+  }
+  else
+  {
+    send_mar();
+  }
+}
+
+void ImpiTask::on_get_cached_digest_av_success(CassandraStore::Operation* op)
+{
+  Cache::GetAuthVector* get_av = (Cache::GetAuthVector*)op;
+  DigestAuthVector av;
+  get_av->get_result(av);
+
+  if (av.ha1.empty())
+  {
+    // The row exists (for example because it holds the associated public
+    // IDs) but the vector has expired.
+    TRC_DEBUG("No cached digest AV for %s/%s - query HSS", _impi.c_str(), _impu.c_str());
+    send_mar();
+  }
+  else
+  {
+    TRC_DEBUG("Got digest AV for %s/%s from cache", _impi.c_str(), _impu.c_str());
+    SAS::Event event(this->trail(), SASEvent::DIGEST_AV_CACHE_HIT, 0);
+    event.add_var_param(_impi);
+    event.add_var_param(_impu);
+    SAS::report_event(event);
+    _digest_av_cache->put(_impi, _impu, av);
+    send_reply(av);
+    delete this;
+  }
+}
+
+void ImpiTask::on_get_cached_digest_av_failure(CassandraStore::Operation* op,
+                                               CassandraStore::ResultCode error,
+                                               std::string& text)
+{
+  // Whatever went wrong, the HSS can still give us the vector.
+  TRC_DEBUG("Digest AV cache query failed with rc %d - query HSS", error);
+  send_mar();
+}
+
+// Remembers a digest vector from the HSS for the configured time.
+void ImpiTask::cache_digest_av(const DigestAuthVector& av)
+{
+  if (_digest_av_cache == NULL)
+  {
+    return;
+  }
+
+  _digest_av_cache->put(_impi, _impu, av);
+
+  if (_digest_av_cache->use_cassandra())
+  {
+    TRC_DEBUG("Caching digest AV for %s in Cassandra", _impi.c_str());
+    int64_t timestamp = Cache::generate_timestamp();
+    CassandraStore::Operation* put_av =
+      _cache->create_PutAuthVector(_impi, av, timestamp, _digest_av_cache->ttl());
+    CassandraStore::Transaction* tsx = new CacheTransaction;
+    _cache->do_async(put_av, tsx);
+
+    if (_cfg->impu_cache_ttl == 0)
+    {
+      // Lookups check that the public ID is associated with the private ID,
+      // so store the association for as long as the vector.
+      CassandraStore::Operation* put_public_id =
+        _cache->create_PutAssociatedPublicID(_impi,
+                                             _impu,
+                                             timestamp,
+                                             _digest_av_cache->ttl());
+      tsx = new CacheTransaction;
+      _cache->do_async(put_public_id, tsx);
+    }
+  }
+}
+
+void ImpiTask::send_mar()
+{
+  DiameterTransaction* tsx =
+    new DiameterTransaction(_dict, this, DIGEST_STATS, &ImpiTask::on_mar_response);
+
+  // Identical digest requests can share an answer, but each AKA vector must
+  // only be used once so AKA requests are never shared.
+  if ((_scheme == _cfg->scheme_digest) &&
+      (tsx->join_in_flight(in_flight_key("MAR", {_impi, _impu, _scheme, _authorization}))))
+  {
+    TRC_DEBUG("Identical Multimedia-Auth request already in flight - wait for its answer");
+    delete tsx;
+    return;
+  }
+
+  int timeout_ms = tsx->choose_timeout(_mar_timeout,
+                                       &StatisticsManager::update_H_hss_mar_timeout_ms,
+                                       _cfg->diameter_timeout_ms);
+  tsx->send_limited(CxLimiter::MEDIUM,
+                    timeout_ms,
+                    boost::bind(&ImpiTask::transmit_mar, this, _1, _2));
+}
+
+void ImpiTask::transmit_mar(DiameterTransaction* tsx, int timeout_ms)
+{
+  Cx::MultimediaAuthRequest mar(_dict,
+                                _diameter_stack,
+                                _dest_realm,
+                                tsx->choose_dest_host(_dest_host),
+                                _impi,
+                                _impu,
+                                _server_name,
+                                _scheme,
+                                _authorization,
+                                use_aka_vector_pool() ?
+                                  _aka_vector_pool->batch_size() : 1);
+
+  // Digest requests can safely be sent twice, but AKA requests can't, as
+  // each one uses up a sequence number.
+  if (_scheme == _cfg->scheme_digest)
+  {
+    tsx->hedge(_mar_hedge_delay,
+               timeout_ms,
+               boost::bind(&ImpiTask::transmit_mar, this, _1, _2));
+  }
+  mar.send(tsx, timeout_ms);
+}
+
+void ImpiTask::on_mar_response(Diameter::Message& rsp)
+{
+  Cx::MultimediaAuthAnswer maa(rsp);
+  int32_t result_code = 0;
+  maa.result_code(result_code);
+  TRC_DEBUG("Received Multimedia-Auth answer with result code %d", result_code);
+  switch (result_code)
+  {
+    case 2001:
+    {
       std::string sip_auth_scheme = maa.sip_auth_scheme();
       if (sip_auth_scheme == _cfg->scheme_digest)
       {
-        send_reply(maa.digest_auth_vector());
+        DigestAuthVector av = maa.digest_auth_vector();
+        send_reply(av);
+        cache_digest_av(av);
         if (_cfg->impu_cache_ttl != 0)
         {
           TRC_DEBUG("Caching that private ID %s includes public ID %s",
@@ -354,6 +1075,18 @@ void ImpiTask::on_mar_response(Diameter::Message& rsp)
       else if (sip_auth_scheme == _cfg->scheme_aka)
       {
         send_reply(maa.aka_auth_vector());
+
+        // If we asked for a batch of vectors, keep the rest for later
+        // requests.
+        if (use_aka_vector_pool())
+        {
+          std::vector<AKAAuthVector> avs = maa.aka_auth_vectors();
+          if (avs.size() > 1)
+          {
+            avs.erase(avs.begin());
+            _aka_vector_pool->add(_impi, avs);
+          }
+        }
       }
       else
       {
@@ -532,20 +1265,38 @@ void ImpiRegistrationStatusTask::run()
     TRC_DEBUG("Parsed HTTP request: private ID %s, public ID %s, visited network %s, authorization type %s",
               _impi.c_str(), _impu.c_str(), _visited_network.c_str(), _authorization_type.c_str());
 
-    Cx::UserAuthorizationRequest uar(_dict,
-                                     _diameter_stack,
-                                     _dest_host,
-                                     _dest_realm,
-                                     _impi,
-                                     _impu,
-                                     _visited_network,
-                                     _authorization_type);
+    if (reply_from_icscf_cache(IcscfCache::uar_key(_impi,
+                                                   _impu,
+                                                   _visited_network,
+                                                   _authorization_type)))
+    {
+      // A cached answer says nothing about whether the HSS can be reached,
+      // so doesn't count towards the health check.
+      delete this;
+      return;
+    }
+
     DiameterTransaction* tsx =
       new DiameterTransaction(_dict,
                               this,
                               SUBSCRIPTION_STATS,
                               &ImpiRegistrationStatusTask::on_uar_response);
-    uar.send(tsx, _cfg->diameter_timeout_ms);
+    if (tsx->join_in_flight(in_flight_key("UAR", {_impi,
+                                                  _impu,
+                                                  _visited_network,
+                                                  _authorization_type})))
+    {
+      TRC_DEBUG("Identical User-Authorization request already in flight - wait for its answer");
+      delete tsx;
+      return;
+    }
+
+    int timeout_ms = tsx->choose_timeout(_uar_timeout,
+                                         &StatisticsManager::update_H_hss_uar_timeout_ms,
+                                         _cfg->diameter_timeout_ms);
+    tsx->send_limited(CxLimiter::LOW,
+                      timeout_ms,
+                      boost::bind(&ImpiRegistrationStatusTask::transmit_uar, this, _1, _2));
   }
   else
   {
@@ -570,6 +1321,23 @@ void ImpiRegistrationStatusTask::run()
   }
 }
 
+void ImpiRegistrationStatusTask::transmit_uar(DiameterTransaction* tsx,
+                                              int timeout_ms)
+{
+  Cx::UserAuthorizationRequest uar(_dict,
+                                   _diameter_stack,
+                                   tsx->choose_dest_host(_dest_host),
+                                   _dest_realm,
+                                   _impi,
+                                   _impu,
+                                   _visited_network,
+                                   _authorization_type);
+  tsx->hedge(_uar_hedge_delay,
+             timeout_ms,
+             boost::bind(&ImpiRegistrationStatusTask::transmit_uar, this, _1, _2));
+  uar.send(tsx, timeout_ms);
+}
+
 void ImpiRegistrationStatusTask::on_uar_response(Diameter::Message& rsp)
 {
   Cx::UserAuthorizationAnswer uaa(rsp);
@@ -582,12 +1350,13 @@ void ImpiRegistrationStatusTask::on_uar_response(Diameter::Message& rsp)
       (experimental_result_code == DIAMETER_FIRST_REGISTRATION) ||
       (experimental_result_code == DIAMETER_SUBSEQUENT_REGISTRATION))
   {
-   // rapidjson::StringBuffer sb ;
-   //  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
     writer.StartObject();
     writer.String(JSON_RC.c_str());
     writer.Int(result_code ? result_code : experimental_result_code);
     std::string server_name;
+    bool server_assigned = false;
     // If the HSS returned a server_name, return that. If not, return the
     // server capabilities, even if none are returned by the HSS.
     if (uaa.server_name(server_name))
@@ -595,6 +1364,7 @@ void ImpiRegistrationStatusTask::on_uar_response(Diameter::Message& rsp)
       TRC_DEBUG("Got Server-Name %s", server_name.c_str());
       writer.String(JSON_SCSCF.c_str());
       writer.String(server_name.c_str());
+      server_assigned = true;
     }
     else
     {
@@ -617,6 +1387,20 @@ void ImpiRegistrationStatusTask::on_uar_response(Diameter::Message& rsp)
     {
       _health_checker->health_check_passed();
     }
+
+    // Only cache answers that name an assigned S-CSCF. Capabilities are
+    // returned while the subscriber isn't registered, which can change at
+    // any time.
+    if ((_icscf_cache != NULL) && (server_assigned))
+    {
+      _icscf_cache->put(IcscfCache::uar_key(_impi,
+                                            _impu,
+                                            _visited_network,
+                                            _authorization_type),
+                        _impi,
+                        _impu,
+                        sb.GetString());
+    }
   }
   else if ((experimental_result_code == DIAMETER_ERROR_USER_UNKNOWN) ||
            (experimental_result_code == DIAMETER_ERROR_IDENTITIES_DONT_MATCH))
@@ -671,19 +1455,34 @@ void ImpuLocationInfoTask::run()
     TRC_DEBUG("Parsed HTTP request: public ID %s, originating %s, authorization type %s",
               _impu.c_str(), _originating.c_str(), _authorization_type.c_str());
 
-    Cx::LocationInfoRequest lir(_dict,
-                                _diameter_stack,
-                                _dest_host,
-                                _dest_realm,
-                                _originating,
-                                _impu,
-                                _authorization_type);
+    if (reply_from_icscf_cache(IcscfCache::lir_key(_impu,
+                                                   _originating,
+                                                   _authorization_type)))
+    {
+      delete this;
+      return;
+    }
+
     DiameterTransaction* tsx =
       new DiameterTransaction(_dict,
                               this,
                               SUBSCRIPTION_STATS,
                               &ImpuLocationInfoTask::on_lir_response);
-    lir.send(tsx, _cfg->diameter_timeout_ms);
+    if (tsx->join_in_flight(in_flight_key("LIR", {_impu,
+                                                  _originating,
+                                                  _authorization_type})))
+    {
+      TRC_DEBUG("Identical Location-Info request already in flight - wait for its answer");
+      delete tsx;
+      return;
+    }
+
+    int timeout_ms = tsx->choose_timeout(_lir_timeout,
+                                         &StatisticsManager::update_H_hss_lir_timeout_ms,
+                                         _cfg->diameter_timeout_ms);
+    tsx->send_limited(CxLimiter::LOW,
+                      timeout_ms,
+                      boost::bind(&ImpuLocationInfoTask::transmit_lir, this, _1, _2));
   }
   else
   {
@@ -694,6 +1493,22 @@ void ImpuLocationInfoTask::run()
   }
 }
 
+void ImpuLocationInfoTask::transmit_lir(DiameterTransaction* tsx,
+                                        int timeout_ms)
+{
+  Cx::LocationInfoRequest lir(_dict,
+                              _diameter_stack,
+                              tsx->choose_dest_host(_dest_host),
+                              _dest_realm,
+                              _originating,
+                              _impu,
+                              _authorization_type);
+  tsx->hedge(_lir_hedge_delay,
+             timeout_ms,
+             boost::bind(&ImpuLocationInfoTask::transmit_lir, this, _1, _2));
+  lir.send(tsx, timeout_ms);
+}
+
 void ImpuLocationInfoTask::on_lir_response(Diameter::Message& rsp)
 {
   Cx::LocationInfoAnswer lia(rsp);
@@ -706,12 +1521,13 @@ void ImpuLocationInfoTask::on_lir_response(Diameter::Message& rsp)
       (experimental_result_code == DIAMETER_UNREGISTERED_SERVICE) ||
       (experimental_result_code == DIAMETER_ERROR_IDENTITY_NOT_REGISTERED))
   {
-    //rapidjson::StringBuffer sb;
-    //rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
     writer.StartObject();
     writer.String(JSON_RC.c_str());
     writer.Int(result_code ? result_code : experimental_result_code);
     std::string server_name;
+    bool server_assigned = false;
 
     // If the HSS returned a server_name, return that. If not, return the
     // server capabilities, even if none are returned by the HSS.
@@ -720,6 +1536,7 @@ void ImpuLocationInfoTask::on_lir_response(Diameter::Message& rsp)
       TRC_DEBUG("Got Server-Name %s", server_name.c_str());
       writer.String(JSON_SCSCF.c_str());
       writer.String(server_name.c_str());
+      server_assigned = true;
     }
     else
     {
@@ -738,6 +1555,17 @@ void ImpuLocationInfoTask::on_lir_response(Diameter::Message& rsp)
     writer.EndObject();
     _req.add_content(sb.GetString());
     send_http_reply(HTTP_OK);
+
+    // As for UARs, only cache answers that name an assigned S-CSCF.
+    if ((_icscf_cache != NULL) && (server_assigned))
+    {
+      _icscf_cache->put(IcscfCache::lir_key(_impu,
+                                            _originating,
+                                            _authorization_type),
+                        "",
+                        _impu,
+                        sb.GetString());
+    }
   }
   else if ((experimental_result_code == DIAMETER_ERROR_USER_UNKNOWN) ||
            (experimental_result_code == DIAMETER_ERROR_IDENTITY_NOT_REGISTERED))
@@ -770,6 +1598,12 @@ void ImpuLocationInfoTask::sas_log_hss_failure(int32_t result_code)
 
 void ImpuLocationInfoTask::query_cache_reg_data()
 {
+  if (past_deadline())
+  {
+    on_deadline_expired();
+    return;
+  }
+
   TRC_DEBUG("Querying cache for registration data for %s", _impu.c_str());
   SAS::Event event(this->trail(), SASEvent::CACHE_GET_REG_DATA, 0);
   event.add_var_param(_impu);
@@ -793,8 +1627,8 @@ void ImpuLocationInfoTask::on_get_reg_data_success(CassandraStore::Operation* op
   if (!xml.empty())
   {
     TRC_DEBUG("Got IMS subscription XML from cache - fake response for server %s", _server_name.c_str());
-    //rapidjson::StringBuffer sb;
-    //rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
     writer.StartObject();
     writer.String(JSON_RC.c_str());
     writer.Int(DIAMETER_SUCCESS);
@@ -900,7 +1734,6 @@ Cx::ServerAssignmentType ImpuRegDataTask::sar_type_for_request(RequestType type)
 ImpuRegDataTask::RequestType ImpuRegDataTask::request_type_from_body(std::string body)
 {
   TRC_DEBUG("Determining request type from '%s'", body.c_str());
-  RequestType ret = RequestType::UNKNOWN;
 
   std::string reqtype;
   rapidjson::Document document;
@@ -915,6 +1748,13 @@ ImpuRegDataTask::RequestType ImpuRegDataTask::request_type_from_body(std::string
     reqtype = document["reqtype"].GetString();
   }
 
+  return request_type_from_name(reqtype);
+}
+
+ImpuRegDataTask::RequestType ImpuRegDataTask::request_type_from_name(const std::string& reqtype)
+{
+  RequestType ret = RequestType::UNKNOWN;
+
   if (reqtype == "reg")
   {
     ret = RequestType::REG;
@@ -957,7 +1797,18 @@ void ImpuRegDataTask::run()
   TRC_DEBUG("Parsed HTTP request: private ID %s, public ID %s",
             _impi.c_str(), _impu.c_str());
 
-  htp_method method = _req.method();
+  if (_hot_key_tracker != NULL)
+  {
+    _hot_key_tracker->record(_impu);
+  }
+
+  htp_method method = _method;
+
+  if ((_response_compressor != NULL) &&
+      (ResponseCompressor::accepts_gzip(_req.header(ACCEPT_ENCODING_HEADER))))
+  {
+    _accept_encoding = ResponseCompressor::GZIP;
+  }
 
   // Police preconditions:
   //    - Method must either be GET or PUT
@@ -974,25 +1825,54 @@ void ImpuRegDataTask::run()
       SAS::Event event(this->trail(), SASEvent::INVALID_REG_TYPE, 0);
       SAS::report_event(event);
       send_http_reply(HTTP_BAD_REQUEST);
-      delete this;
+      finish_task();
       return;
     }
+
+    // Deregistrations must reach the HSS and the cache even if the
+    // requester gives up waiting - only lookups and (re)registrations,
+    // which Sprout retries, can safely be abandoned.
+    if ((is_deregistration_request(_type)) ||
+        (is_auth_failure_request(_type)))
+    {
+      clear_deadline();
+    }
   }
   else if (method == htp_method_GET)
   {
     _type = RequestType::UNKNOWN;
+    _if_none_match = _req.header(IF_NONE_MATCH_HEADER);
   }
   else
   {
     send_http_reply(HTTP_BADMETHOD);
-    delete this;
+    finish_task();
     return;
   }
 
+  // PUTs can change the subscriber's state, so only run one at a time for
+  // each public ID. If there's one already in progress, this request is
+  // resumed when it finishes.
+  if ((method == htp_method_PUT) && (!join_impu_queue()))
+  {
+    return;
+  }
+
+  get_reg_data();
+}
+
+void ImpuRegDataTask::get_reg_data()
+{
   // We must always get the data from the cache - even if we're doing
   // a deregistration, we'll need to use the existing private ID, and
   // need to return the iFCs to Sprout.
 
+  if (past_deadline())
+  {
+    on_deadline_expired();
+    return;
+  }
+
   TRC_DEBUG ("Try to find IMS Subscription information in the cache");
   SAS::Event event(this->trail(), SASEvent::CACHE_GET_REG_DATA, 0);
   event.add_var_param(_impu);
@@ -1005,93 +1885,409 @@ void ImpuRegDataTask::run()
   _cache->do_async(get_reg_data, tsx);
 }
 
-std::string regstate_to_str(RegistrationState state)
+void ImpuRegDataTask::configure_reg_data_serialization(bool enabled)
 {
-  switch (state)
-  {
-  case REGISTERED:
-    return "REGISTERED";
-  case UNREGISTERED:
-    return "UNREGISTERED";
-  case NOT_REGISTERED:
-    return "NOT_REGISTERED";
-  default:
-    return "???"; // LCOV_EXCL_LINE - unreachable
-  }
+  _serialize_reg_data = enabled;
 }
 
-void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
+void ImpuRegDataTask::configure_incremental_irs_updates(bool enabled)
 {
-  TRC_DEBUG("Got IMS subscription from cache");
-  Cache::GetRegData* get_reg_data = (Cache::GetRegData*)op;
-  sas_log_get_reg_data_success(get_reg_data, trail());
+  _incremental_irs_updates = enabled;
+}
 
-  RegistrationState old_state;
-  std::vector<std::string> associated_impis;
-  int32_t ttl = 0;
-  get_reg_data->get_xml(_xml, ttl);
-  get_reg_data->get_registration_state(old_state, ttl);
-  get_reg_data->get_associated_impis(associated_impis);
-  get_reg_data->get_charging_addrs(_charging_addrs);
-  bool new_binding = false;
-  TRC_DEBUG("TTL for this database record is %d, IMS Subscription XML is %s, registration state is %s, and the charging addresses are %s",
-            ttl,
-            _xml.empty() ? "empty" : "not empty",
-            regstate_to_str(old_state).c_str(),
-            _charging_addrs.empty() ? "empty" : _charging_addrs.log_string().c_str());
+void ImpuRegDataTask::configure_response_compression(ResponseCompressor* compressor)
+{
+  _response_compressor = compressor;
+}
 
-  // By default, we should remain in the existing state.
-  _new_state = old_state;
+void ImpuRegDataTask::configure_reg_data_cache(RegDataCache* reg_data_cache)
+{
+  _reg_data_cache = reg_data_cache;
+}
 
-  // GET requests shouldn't change the state - just respond with what
-  // we have in the database
-  if (_req.method() == htp_method_GET)
+void ImpuRegDataTask::configure_reg_data_streaming(bool enabled)
+{
+  _stream_reg_data = enabled;
+}
+
+// Adds this request to the queue for its public ID, returning true if it is
+// at the front of the queue and so can run now.
+bool ImpuRegDataTask::join_impu_queue()
+{
+  if (!_serialize_reg_data)
+  {
+    return true;
+  }
+
+  pthread_mutex_lock(&_impu_queues_lock);
+  std::deque<ImpuRegDataTask*>& queue = _impu_queues[_impu];
+  queue.push_back(this);
+  int position = queue.size() - 1;
+  pthread_mutex_unlock(&_impu_queues_lock);
+  _queued = true;
+
+  if (position > 0)
+  {
+    TRC_DEBUG("Queueing request for %s behind %d others", _impu.c_str(), position);
+    SAS::Event event(this->trail(), SASEvent::REG_DATA_QUEUED, 0);
+    event.add_var_param(_impu);
+    event.add_static_param(position);
+    SAS::report_event(event);
+  }
+
+  return (position == 0);
+}
+
+// Once this request has finished, starts the next request queued behind it
+// (if any) and deletes this one.
+void ImpuRegDataTask::finish_task()
+{
+  ImpuRegDataTask* next = leave_impu_queue();
+
+  if (next == NULL)
   {
-    send_reply();
     delete this;
     return;
   }
 
-  // If Sprout didn't specify a private Id on the request, we may
-  // have one embedded in the cached User-Data which we can retrieve.
-  // If Sprout did specify a private Id on the request, check whether
-  // we have a record of this binding.
-  if (_impi.empty())
+  // Take a copy of what we're handing on before deleting ourselves.
+  HandOff hand_off;
+  hand_off.next = next;
+  hand_off.has_outcome = _has_outcome;
+  hand_off.outcome = _outcome;
+  delete this;
+
+  run_hand_off(hand_off);
+}
+
+// Removes this request from the front of the queue for its public ID, and
+// returns the next request in the queue (if any).
+ImpuRegDataTask* ImpuRegDataTask::leave_impu_queue()
+{
+  if (!_queued)
   {
-    _impi = XmlUtils::get_private_id(_xml);
+    return NULL;
   }
-  else if ((!_xml.empty()) &&
-           ((associated_impis.empty()) ||
-            (std::find(associated_impis.begin(), associated_impis.end(), _impi) == associated_impis.end())))
+
+  ImpuRegDataTask* next = NULL;
+  pthread_mutex_lock(&_impu_queues_lock);
+  std::map<std::string, std::deque<ImpuRegDataTask*>>::iterator it =
+    _impu_queues.find(_impu);
+  it->second.pop_front();
+  if (it->second.empty())
   {
-    TRC_DEBUG("Subscriber registering with new binding");
-    new_binding = true;
+    _impu_queues.erase(it);
   }
+  else
+  {
+    next = it->second.front();
+  }
+  pthread_mutex_unlock(&_impu_queues_lock);
+  _queued = false;
 
-  // Split the processing depending on whether an HSS is configured.
-  if (_cfg->hss_configured)
+  return next;
+}
+
+// Resumes the next request in a queue, handing on what the previous request
+// left in the cache if it's known. That saves the next request reading the
+// cache before our writes have landed, and lets it see the outcome of our
+// SAR - so a CALL or REG following a REG that has just registered the
+// subscriber doesn't send a second SAR.
+//
+// A resumed request may finish straight away and hand on to the request
+// after it. Those hand-offs are run in turn from here, rather than nested,
+// so a long queue can't use up the stack.
+void ImpuRegDataTask::run_hand_off(const HandOff& hand_off)
+{
+  if (_pending_hand_offs != NULL)
   {
-    // If the subscriber is registering with a new binding, store
-    // the private Id in the cache.
-    if (new_binding)
-    {
-      TRC_DEBUG("Associating private identity %s to IRS for %s",
-                _impi.c_str(),
-                _impu.c_str());
-      std::vector<std::string> public_ids = XmlUtils::get_public_ids(_xml);
-      CassandraStore::Operation* put_associated_private_id =
-        _cache->create_PutAssociatedPrivateID(public_ids,
-                                              _impi,
-                                              Cache::generate_timestamp(),
-                                              (2 * _cfg->hss_reregistration_time));
-      CassandraStore::Transaction* tsx = new CacheTransaction;
-      _cache->do_async(put_associated_private_id, tsx);
-    }
+    _pending_hand_offs->push_back(hand_off);
+    return;
+  }
 
-    if (_type == RequestType::REG)
-    {
-      // This message was based on a REGISTER request from Sprout. Check
-      // the subscriber's state in Cassandra to determine whether this
+  std::deque<HandOff> pending(1, hand_off);
+  _pending_hand_offs = &pending;
+
+  while (!pending.empty())
+  {
+    HandOff next = pending.front();
+    pending.pop_front();
+    next.next->resume(next.has_outcome ? &next.outcome : NULL);
+  }
+
+  _pending_hand_offs = NULL;
+}
+
+// Runs a request that was queued behind another for the same public ID.
+void ImpuRegDataTask::resume(const RegData* reg_data)
+{
+  if (past_deadline())
+  {
+    on_deadline_expired();
+    return;
+  }
+
+  if (reg_data == NULL)
+  {
+    get_reg_data();
+    return;
+  }
+
+  // The TTL was right when the previous request read or wrote it, so take
+  // off the time that has passed since. If that means the data has expired,
+  // read what's in the cache now instead.
+  RegData current = *reg_data;
+  if (current.ttl > 0)
+  {
+    int32_t elapsed = (monotonic_ms() - current.ttl_updated_ms) / 1000;
+    current.ttl -= elapsed;
+
+    if (current.ttl <= 0)
+    {
+      get_reg_data();
+      return;
+    }
+  }
+
+  TRC_DEBUG("Using registration data for %s from the previous request",
+            _impu.c_str());
+  process_reg_data(current);
+}
+
+void ImpuRegDataTask::configure_reregistration_sar_rate(float max_rate)
+{
+  pthread_mutex_lock(&_rereg_sar_lock);
+  delete _rereg_sar_bucket;
+  _rereg_sar_bucket = NULL;
+
+  if (max_rate > 0)
+  {
+    // Allow up to a second's worth of SARs in a burst.
+    _rereg_sar_bucket = new TokenBucket(std::max((int)max_rate, 1), max_rate);
+  }
+  pthread_mutex_unlock(&_rereg_sar_lock);
+}
+
+bool ImpuRegDataTask::admit_reregistration_sar()
+{
+  bool admit = true;
+
+  pthread_mutex_lock(&_rereg_sar_lock);
+  if (_rereg_sar_bucket != NULL)
+  {
+    admit = _rereg_sar_bucket->get_token();
+  }
+  pthread_mutex_unlock(&_rereg_sar_lock);
+
+  return admit;
+}
+
+// The TTL to write cached registration data with. This is twice the HSS
+// re-registration time, plus a per-subscriber jitter so that subscribers
+// who registered at the same moment don't all fall due for a
+// RE_REGISTRATION SAR at the same moment too.
+int ImpuRegDataTask::reg_data_ttl()
+{
+  return (2 * _cfg->hss_reregistration_time) + reregistration_jitter();
+}
+
+// The remaining TTL below which a re-registration is passed on to the HSS.
+int ImpuRegDataTask::reregistration_threshold()
+{
+  return _cfg->hss_reregistration_time + (reregistration_jitter() / 2);
+}
+
+int ImpuRegDataTask::reregistration_jitter()
+{
+  if (_cfg->hss_reregistration_jitter <= 0)
+  {
+    return 0;
+  }
+
+  // Key the jitter on the default public ID, so that every IMPU in the
+  // implicit registration set gets the same value.
+  const std::vector<std::string>& public_ids = _subscription->public_ids();
+  return jitter_for_key(public_ids.empty() ? _impu : public_ids[0],
+                        _cfg->hss_reregistration_jitter);
+}
+
+// Transaction for warm-up reads, which primes the reg-data body cache with
+// the result.
+class ImpuRegDataTask::WarmUpTransaction : public CassandraStore::Transaction
+{
+public:
+  WarmUpTransaction() : CassandraStore::Transaction(0) {}
+
+protected:
+  void on_success(CassandraStore::Operation* op)
+  {
+    ImpuRegDataTask::prime_reg_data_cache((Cache::GetRegData*)op);
+  }
+
+  void on_failure(CassandraStore::Operation* op)
+  {
+    TRC_DEBUG("Failed to warm up registration data");
+  }
+};
+
+// Reads the registration data for a public ID that was hot before a restart.
+//
+// If reg-data bodies are cached, the body a GET would return is built and
+// cached, so the first requests after the restart needn't build it.
+// Otherwise the read just warms Cassandra's own caches - nothing is kept in
+// this process.
+void ImpuRegDataTask::warm_up(const std::string& impu)
+{
+  TRC_DEBUG("Warming up registration data for %s", impu.c_str());
+  CassandraStore::Operation* get_reg_data = _cache->create_GetRegData(impu);
+  CassandraStore::Transaction* tsx = new WarmUpTransaction;
+  _cache->do_async(get_reg_data, tsx);
+}
+
+void ImpuRegDataTask::prime_reg_data_cache(Cache::GetRegData* get_reg_data)
+{
+  if (_reg_data_cache == NULL)
+  {
+    return;
+  }
+
+  std::string xml;
+  int32_t ttl;
+  RegistrationState state;
+  ChargingAddresses charging_addrs;
+  get_reg_data->get_xml(xml, ttl);
+  get_reg_data->get_registration_state(state, ttl);
+  get_reg_data->get_charging_addrs(charging_addrs);
+
+  if (xml.empty())
+  {
+    return;
+  }
+
+  std::string inputs = reg_data_inputs(state, xml, charging_addrs);
+  std::string xml_str;
+  if (render_reg_data(state,
+                      *ImsSubscription::create(xml),
+                      charging_addrs,
+                      xml_str) == HTTP_OK)
+  {
+    _reg_data_cache->put(reg_data_etag(inputs), inputs, xml_str);
+    if (_stats_manager != NULL)
+    {
+      _stats_manager->update_H_reg_data_cache_bytes(_reg_data_cache->bytes());
+    }
+  }
+}
+
+std::string regstate_to_str(RegistrationState state)
+{
+  switch (state)
+  {
+  case REGISTERED:
+    return "REGISTERED";
+  case UNREGISTERED:
+    return "UNREGISTERED";
+  case NOT_REGISTERED:
+    return "NOT_REGISTERED";
+  default:
+    return "???"; // LCOV_EXCL_LINE - unreachable
+  }
+}
+
+void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
+{
+  TRC_DEBUG("Got IMS subscription from cache");
+  Cache::GetRegData* get_reg_data = (Cache::GetRegData*)op;
+  sas_log_get_reg_data_success(get_reg_data, trail());
+
+  RegData reg_data;
+  std::string xml;
+  get_reg_data->get_xml(xml, reg_data.ttl);
+  reg_data.subscription = ImsSubscription::create(xml);
+  get_reg_data->get_registration_state(reg_data.state, reg_data.ttl);
+  reg_data.ttl_updated_ms = monotonic_ms();
+  get_reg_data->get_associated_impis(reg_data.impis);
+  get_reg_data->get_charging_addrs(reg_data.charging_addrs);
+  process_reg_data(reg_data);
+}
+
+void ImpuRegDataTask::process_reg_data(const RegData& reg_data)
+{
+  RegistrationState old_state = reg_data.state;
+  const std::vector<std::string>& associated_impis = reg_data.impis;
+  int32_t ttl = reg_data.ttl;
+  _subscription = reg_data.subscription;
+  _charging_addrs = reg_data.charging_addrs;
+  bool new_binding = false;
+
+  // Unless we change the cache below, this is what we leave in it for the
+  // next request for this public ID.
+  _outcome = reg_data;
+  _has_outcome = true;
+  TRC_DEBUG("TTL for this database record is %d, IMS Subscription XML is %s, registration state is %s, and the charging addresses are %s",
+            ttl,
+            _subscription->empty() ? "empty" : "not empty",
+            regstate_to_str(old_state).c_str(),
+            _charging_addrs.empty() ? "empty" : _charging_addrs.log_string().c_str());
+
+  // By default, we should remain in the existing state.
+  _new_state = old_state;
+
+  // If the HSS has already assigned this subscriber to us, the cached
+  // User-Data is current (the HSS would have sent a PPR otherwise), so any
+  // SAR we send needn't ask for it again.
+  _profile_cached = ((!_subscription->empty()) &&
+                     (old_state != RegistrationState::NOT_REGISTERED));
+
+  // GET requests shouldn't change the state - just respond with what
+  // we have in the database
+  if (_method == htp_method_GET)
+  {
+    send_reply();
+    finish_task();
+    return;
+  }
+
+  // If Sprout didn't specify a private Id on the request, we may
+  // have one embedded in the cached User-Data which we can retrieve.
+  // If Sprout did specify a private Id on the request, check whether
+  // we have a record of this binding.
+  if (_impi.empty())
+  {
+    _impi = _subscription->private_id();
+  }
+  else if ((!_subscription->empty()) &&
+           ((associated_impis.empty()) ||
+            (std::find(associated_impis.begin(), associated_impis.end(), _impi) == associated_impis.end())))
+  {
+    TRC_DEBUG("Subscriber registering with new binding");
+    new_binding = true;
+  }
+
+  // Split the processing depending on whether an HSS is configured.
+  if (_cfg->hss_configured)
+  {
+    // If the subscriber is registering with a new binding, store
+    // the private Id in the cache.
+    if (new_binding)
+    {
+      TRC_DEBUG("Associating private identity %s to IRS for %s",
+                _impi.c_str(),
+                _impu.c_str());
+      _outcome.impis.push_back(_impi);
+      CassandraStore::Operation* put_associated_private_id =
+        _cache->create_PutAssociatedPrivateID(_subscription->public_ids(),
+                                              _impi,
+                                              Cache::generate_timestamp(),
+                                              reg_data_ttl());
+      CassandraStore::Transaction* tsx = new CacheTransaction;
+      _cache->do_async(put_associated_private_id, tsx);
+    }
+
+    if (_type == RequestType::REG)
+    {
+      // This message was based on a REGISTER request from Sprout. Check
+      // the subscriber's state in Cassandra to determine whether this
       // is an initial registration or a re-registration. If this subscriber
       // is already registered but is registering with a new binding, we
       // still need to tell the HSS.
@@ -1101,9 +2297,12 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
         _new_state = RegistrationState::REGISTERED;
 
         // We set the record's TTL to be double the --hss-reregistration-time
-        // option - once half that time has elapsed, it's time to
-        // re-notify the HSS.
-        if (ttl < _cfg->hss_reregistration_time)
+        // option (plus jitter) - once half that time has elapsed, it's time
+        // to re-notify the HSS. If we're over the RE_REGISTRATION SAR budget
+        // we can put this off, but only until the record is close to expiry.
+        if ((ttl < reregistration_threshold()) &&
+            ((ttl < _cfg->hss_reregistration_time / 2) ||
+             (admit_reregistration_sar())))
         {
           TRC_DEBUG("Sending re-registration to HSS as %d seconds have passed",
                     _cfg->hss_reregistration_time);
@@ -1114,7 +2313,7 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
           // No state changes are required for a re-register if we're
           // not notifying a HSS - just respond.
           send_reply();
-          delete this;
+          finish_task();
           return;
         }
       }
@@ -1146,7 +2345,7 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
         // We're already assigned to handle this subscriber - respond
         // with the iFCs anfd whether they're in registered state or not.
         send_reply();
-        delete this;
+        finish_task();
         return;
       }
     }
@@ -1171,7 +2370,7 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
         SAS::Event event(this->trail(), SASEvent::SUB_NOT_REG, 0);
         SAS::report_event(event);
         send_http_reply(HTTP_BAD_REQUEST);
-        delete this;
+        finish_task();
         return;
       }
     }
@@ -1190,7 +2389,7 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
     {
       // LCOV_EXCL_START - unreachable
       TRC_ERROR("Invalid type %d", _type);
-      delete this;
+      finish_task();
       return;
       // LCOV_EXCL_STOP - unreachable
     }
@@ -1288,26 +2487,70 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
       TRC_ERROR("Invalid type %d", _type);
       // LCOV_EXCL_STOP - unreachable
     }
-    delete this;
+    finish_task();
   }
 }
 
 void ImpuRegDataTask::send_reply()
 {
+  // The ETag covers everything the body is built from, so if the requester
+  // already has the current version we needn't build the body at all.
+  std::string inputs = reg_data_inputs(_new_state, _subscription->xml(), _charging_addrs);
+  std::string etag = reg_data_etag(inputs);
+  if ((!_if_none_match.empty()) && (etag_matches(_if_none_match, etag)))
+  {
+    TRC_DEBUG("Registration data for %s is unchanged (ETag %s)",
+              _impu.c_str(), etag.c_str());
+
+    // Return the ETag of whichever version of the body the requester has.
+    std::string gz_etag = gzip_etag(etag);
+    if ((!_accept_encoding.empty()) &&
+        (_if_none_match.find(gz_etag) != std::string::npos))
+    {
+      add_header(ETAG_HEADER, gz_etag);
+    }
+    else
+    {
+      add_header(ETAG_HEADER, etag);
+    }
+    send_http_reply(EVHTP_RES_NOTMOD);
+    return;
+  }
+
+  // The body is built from the same things as the ETag, so if it has been
+  // compressed before we can send that without building it again.
+  std::string compressed;
+  if ((!_accept_encoding.empty()) &&
+      (_response_compressor->lookup(etag, inputs, compressed)))
+  {
+    send_compressed_reply(etag, compressed);
+    return;
+  }
+
   std::string xml_str;
-  int rc = XmlUtils::build_ClearwaterRegData_xml(_new_state,
-                                                 _xml,
-                                                 _charging_addrs,
-                                                 xml_str);
+  int rc = build_reg_data_body(etag, inputs, xml_str);
+
+  if ((rc == HTTP_OK) &&
+      (!_accept_encoding.empty()) &&
+      (_response_compressor->compress(etag, inputs, xml_str, compressed)))
+  {
+    send_compressed_reply(etag, compressed);
+    return;
+  }
 
   if (rc == HTTP_OK)
   {
-    _req.add_content(xml_str);
+    add_content(xml_str);
+    add_header(ETAG_HEADER, etag);
+    if (_response_compressor != NULL)
+    {
+      add_header(VARY_HEADER, ACCEPT_ENCODING_HEADER);
+    }
   }
   else
   {
     SAS::Event event(this->trail(), SASEvent::REG_DATA_HSS_INVALID, 0);
-    event.add_compressed_param(_xml, &SASEvent::PROFILE_SERVICE_PROFILE);
+    event.add_compressed_param(_subscription->xml(), &SASEvent::PROFILE_SERVICE_PROFILE);
     SAS::report_event(event);
   }
 
@@ -1315,6 +2558,147 @@ void ImpuRegDataTask::send_reply()
   send_http_reply(rc);
 }
 
+int ImpuRegDataTask::render_reg_data(RegistrationState state,
+                                     const ImsSubscription& subscription,
+                                     const ChargingAddresses& charging_addrs,
+                                     std::string& xml_str)
+{
+  if (_stream_reg_data)
+  {
+    return XmlUtils::stream_ClearwaterRegData_xml(state,
+                                                  subscription.xml(),
+                                                  charging_addrs,
+                                                  xml_str);
+  }
+  else
+  {
+    return XmlUtils::build_ClearwaterRegData_xml(state,
+                                                 subscription,
+                                                 charging_addrs,
+                                                 xml_str);
+  }
+}
+
+// Builds the ClearwaterRegData body, or copies it from the cache if the same
+// body has been sent recently.
+int ImpuRegDataTask::build_reg_data_body(const std::string& etag,
+                                         const std::string& inputs,
+                                         std::string& xml_str)
+{
+  if (_reg_data_cache == NULL)
+  {
+    return render_reg_data(_new_state, *_subscription, _charging_addrs, xml_str);
+  }
+
+  if (_reg_data_cache->get(etag, inputs, xml_str))
+  {
+    TRC_DEBUG("Using cached registration data body for %s", _impu.c_str());
+    if (_stats_manager != NULL)
+    {
+      _stats_manager->incr_H_reg_data_cache_hits();
+    }
+    return HTTP_OK;
+  }
+
+  if (_stats_manager != NULL)
+  {
+    _stats_manager->incr_H_reg_data_cache_misses();
+  }
+
+  int rc = render_reg_data(_new_state, *_subscription, _charging_addrs, xml_str);
+  if (rc == HTTP_OK)
+  {
+    _reg_data_cache->put(etag, inputs, xml_str);
+    if (_stats_manager != NULL)
+    {
+      _stats_manager->update_H_reg_data_cache_bytes(_reg_data_cache->bytes());
+    }
+  }
+
+  return rc;
+}
+
+void ImpuRegDataTask::send_compressed_reply(const std::string& etag,
+                                            const std::string& compressed)
+{
+  TRC_DEBUG("Sending 200 response with %d byte %s body",
+            compressed.length(), _accept_encoding.c_str());
+  add_content(compressed);
+  add_header(CONTENT_ENCODING_HEADER, _accept_encoding);
+  add_header(VARY_HEADER, ACCEPT_ENCODING_HEADER);
+  add_header(ETAG_HEADER, gzip_etag(etag));
+  send_http_reply(HTTP_OK);
+}
+
+std::string ImpuRegDataTask::reg_data_inputs(RegistrationState state,
+                                             const std::string& xml,
+                                             const ChargingAddresses& charging_addrs)
+{
+  std::string inputs;
+  append_part(inputs, std::to_string(state));
+  append_part(inputs, xml);
+
+  for (std::deque<std::string>::const_iterator it = charging_addrs.ccfs.begin();
+       it != charging_addrs.ccfs.end();
+       ++it)
+  {
+    append_part(inputs, "ccf:" + *it);
+  }
+
+  for (std::deque<std::string>::const_iterator it = charging_addrs.ecfs.begin();
+       it != charging_addrs.ecfs.end();
+       ++it)
+  {
+    append_part(inputs, "ecf:" + *it);
+  }
+
+  return inputs;
+}
+
+std::string ImpuRegDataTask::reg_data_etag(const std::string& inputs)
+{
+  uint64_t hash = hash_string(inputs);
+
+  char etag[19];
+  snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)hash);
+  return etag;
+}
+
+std::string ImpuRegDataTask::gzip_etag(const std::string& etag)
+{
+  // Add the suffix inside the closing quote.
+  return etag.substr(0, etag.length() - 1) + "-gz\"";
+}
+
+bool ImpuRegDataTask::etag_matches(const std::string& if_none_match,
+                                   const std::string& etag)
+{
+  // If-None-Match is either "*" or a list of ETags, any of which may be weak
+  // (If-None-Match uses the weak comparison). The requester may have either
+  // the identity or the gzipped body - both are current.
+  std::string gz_etag = gzip_etag(etag);
+  std::vector<std::string> tags;
+  boost::split(tags, if_none_match, boost::is_any_of(","));
+
+  for (std::vector<std::string>::iterator it = tags.begin();
+       it != tags.end();
+       ++it)
+  {
+    std::string tag = boost::algorithm::trim_copy(*it);
+    if (tag.compare(0, 2, "W/") == 0)
+    {
+      tag = tag.substr(2);
+    }
+
+    if ((tag == "*") || (tag == etag) || (tag == gz_etag))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 void ImpuRegDataTask::on_get_reg_data_failure(CassandraStore::Operation* op,
                                               CassandraStore::ResultCode error,
                                               std::string& text)
@@ -1343,25 +2727,45 @@ void ImpuRegDataTask::on_get_reg_data_failure(CassandraStore::Operation* op,
     send_http_reply(HTTP_GATEWAY_TIMEOUT);
   }
 
-  delete this;
+  finish_task();
 }
 
 void ImpuRegDataTask::send_server_assignment_request(Cx::ServerAssignmentType type)
 {
-  Cx::ServerAssignmentRequest sar(_dict,
-                                  _diameter_stack,
-                                  _dest_host,
-                                  _dest_realm,
-                                  _impi,
-                                  _impu,
-                                  _server_name,
-                                  type);
   DiameterTransaction* tsx =
     new DiameterTransaction(_dict,
                             this,
                             SUBSCRIPTION_STATS,
                             &ImpuRegDataTask::on_sar_response);
-  sar.send(tsx, _cfg->diameter_timeout_ms);
+
+  // Deregistrations free up state in the HSS, so are sent ahead of other
+  // requests if the HSS is busy.
+  int timeout_ms = tsx->choose_timeout(_sar_timeout,
+                                       &StatisticsManager::update_H_hss_sar_timeout_ms,
+                                       _cfg->diameter_timeout_ms);
+  tsx->send_limited(is_deregistration_request(_type) ? CxLimiter::HIGH : CxLimiter::MEDIUM,
+                    timeout_ms,
+                    boost::bind(&ImpuRegDataTask::transmit_sar, this, _1, type, _2));
+}
+
+void ImpuRegDataTask::transmit_sar(DiameterTransaction* tsx,
+                                   Cx::ServerAssignmentType type,
+                                   int timeout_ms)
+{
+  // The SAR always goes to the configured host (if any) and otherwise to
+  // whichever HSS realm routing picks - it changes the registration state
+  // on the HSS, so it mustn't be steered to a different HSS from the one
+  // holding the registration.
+  Cx::ServerAssignmentRequest sar(_dict,
+                                  _diameter_stack,
+                                  _dest_host,
+                                  _dest_realm,
+                                  _impi,
+                                  _impu,
+                                  _server_name,
+                                  type,
+                                  _profile_cached);
+  sar.send(tsx, timeout_ms);
 }
 
 std::vector<std::string> ImpuRegDataTask::get_associated_private_ids()
@@ -1372,7 +2776,7 @@ std::vector<std::string> ImpuRegDataTask::get_associated_private_ids()
     TRC_DEBUG("Associated private ID %s", _impi.c_str());
     private_ids.push_back(_impi);
   }
-  std::string xml_impi = XmlUtils::get_private_id(_xml);
+  const std::string& xml_impi = _subscription->private_id();
   if ((!xml_impi.empty()) && (xml_impi != _impi))
   {
     TRC_DEBUG("Associated private ID %s", xml_impi.c_str());
@@ -1392,7 +2796,7 @@ void ImpuRegDataTask::put_in_cache()
     // setting the TTL to be the registration time, as it means there
     // are no gaps where the data has expired but we haven't received
     // a REGISTER yet.
-    ttl = (2 * _cfg->hss_reregistration_time);
+    ttl = reg_data_ttl();
   }
   else
   {
@@ -1402,11 +2806,11 @@ void ImpuRegDataTask::put_in_cache()
   }
 
   TRC_DEBUG("Attempting to cache IMS subscription for public IDs");
-  std::vector<std::string> public_ids = XmlUtils::get_public_ids(_xml);
+  const std::vector<std::string>& public_ids = _subscription->public_ids();
   if (!public_ids.empty())
   {
     TRC_DEBUG("Got public IDs to cache against - doing it");
-    for (std::vector<std::string>::iterator i = public_ids.begin();
+    for (std::vector<std::string>::const_iterator i = public_ids.begin();
          i != public_ids.end();
          i++)
     {
@@ -1420,7 +2824,7 @@ void ImpuRegDataTask::put_in_cache()
     {
       bool found_sip_uri = false;
 
-      for (std::vector<std::string>::iterator it = public_ids.begin();
+      for (std::vector<std::string>::const_iterator it = public_ids.begin();
            (it != public_ids.end()) && (!found_sip_uri);
            ++it)
       {
@@ -1435,7 +2839,7 @@ void ImpuRegDataTask::put_in_cache()
         // LCOV_EXCL_START - This is essentially tested in the PPR UTs
         TRC_ERROR("No SIP URI in Implicit Registration Set");
         SAS::Event event(this->trail(), SASEvent::NO_SIP_URI_IN_IRS, 0);
-        event.add_compressed_param(_xml, &SASEvent::PROFILE_SERVICE_PROFILE);
+        event.add_compressed_param(_subscription->xml(), &SASEvent::PROFILE_SERVICE_PROFILE);
         SAS::report_event(event);
         // LCOV_EXCL_STOP
       }
@@ -1447,10 +2851,25 @@ void ImpuRegDataTask::put_in_cache()
       associated_private_ids = get_associated_private_ids();
     }
 
+    // If the HSS has sent a new IMS subscription, clean up any public IDs
+    // that are no longer in it. The rest of the IRS is still rewritten in
+    // full below, as that also refreshes the TTL on the cached data.
+    if ((_incremental_irs_updates) &&
+        (_replaced_subscription != NULL) &&
+        (!_replaced_subscription->empty()))
+    {
+      XmlUtils::IrsDiff diff =
+        XmlUtils::diff_ims_subscriptions(*_replaced_subscription, *_subscription);
+      if (!diff.removed.empty())
+      {
+        delete_removed_public_ids(_cache, diff, associated_private_ids, trail());
+      }
+    }
+
     SAS::Event event(this->trail(), SASEvent::CACHE_PUT_REG_DATA, 0);
     std::string public_ids_str = boost::algorithm::join(public_ids, ", ");
     event.add_var_param(public_ids_str);
-    event.add_compressed_param(_xml, &SASEvent::PROFILE_SERVICE_PROFILE);
+    event.add_compressed_param(_subscription->xml(), &SASEvent::PROFILE_SERVICE_PROFILE);
     event.add_static_param(_new_state);
     std::string associated_private_ids_str = boost::algorithm::join(associated_private_ids, ", ");
     event.add_var_param(associated_private_ids_str);
@@ -1460,7 +2879,7 @@ void ImpuRegDataTask::put_in_cache()
     Cache::PutRegData* put_reg_data = _cache->create_PutRegData(public_ids,
                                                                 Cache::generate_timestamp(),
                                                                 ttl);
-    put_reg_data->with_xml(_xml);
+    put_reg_data->with_xml(_subscription->xml());
 
     if (_new_state != RegistrationState::UNCHANGED)
     {
@@ -1481,6 +2900,26 @@ void ImpuRegDataTask::put_in_cache()
     CassandraStore::Transaction* tsx = new CacheTransaction;
     CassandraStore::Operation*& op = (CassandraStore::Operation*&)put_reg_data;
     _cache->do_async(op, tsx);
+
+    // Keep track of what we've written, for the next request for this
+    // public ID.
+    _outcome.subscription = _subscription;
+    _outcome.ttl = ttl;
+    _outcome.ttl_updated_ms = monotonic_ms();
+    _outcome.charging_addrs = _charging_addrs;
+    if (_new_state != RegistrationState::UNCHANGED)
+    {
+      _outcome.state = _new_state;
+    }
+    for (std::vector<std::string>::iterator i = associated_private_ids.begin();
+         i != associated_private_ids.end();
+         i++)
+    {
+      if (std::find(_outcome.impis.begin(), _outcome.impis.end(), *i) == _outcome.impis.end())
+      {
+        _outcome.impis.push_back(*i);
+      }
+    }
   }
 }
 
@@ -1498,11 +2937,11 @@ void ImpuRegDataTask::on_sar_response(Diameter::Message& rsp)
   {
     SAS::Event event(this->trail(), SASEvent::REG_DATA_HSS_SUCCESS, 0);
     SAS::report_event(event);
-    std::vector<std::string> public_ids = XmlUtils::get_public_ids(_xml);
+    const std::vector<std::string>& public_ids = _subscription->public_ids();
     if (!public_ids.empty())
     {
       TRC_DEBUG("Got public IDs to delete from cache - doing it");
-      for (std::vector<std::string>::iterator i = public_ids.begin();
+      for (std::vector<std::string>::const_iterator i = public_ids.begin();
            i != public_ids.end();
            i++)
       {
@@ -1522,26 +2961,46 @@ void ImpuRegDataTask::on_sar_response(Diameter::Message& rsp)
                                        Cache::generate_timestamp());
       CassandraStore::Transaction* tsx = new CacheTransaction;
       _cache->do_async(delete_public_id, tsx);
+      _outcome = RegData();
     }
   }
 
   switch (result_code)
   {
     case 2001:
-      // Get the charging addresses.
-      saa.charging_addrs(_charging_addrs);
+    {
+      // Get the charging addresses. If the SAA doesn't include any, keep
+      // the ones we have cached.
+      ChargingAddresses charging_addrs;
+      saa.charging_addrs(charging_addrs);
+      if (!charging_addrs.empty())
+      {
+        _charging_addrs = charging_addrs;
+      }
 
       // If we expect this request to assign the user to us (i.e. it
       // isn't triggered by a deregistration or a failure) we should
-      // cache the User-Data.
+      // cache the User-Data. If we told the HSS we already had the
+      // User-Data it may not have sent it, in which case we keep the
+      // cached copy.
       if (!is_deregistration_request(_type) && !is_auth_failure_request(_type))
       {
-        TRC_DEBUG("Getting User-Data from SAA for cache");
-        saa.user_data(_xml);
+        std::string user_data;
+        if (saa.user_data(user_data))
+        {
+          TRC_DEBUG("Getting User-Data from SAA for cache");
+          _replaced_subscription = _subscription;
+          _subscription = ImsSubscription::create(user_data);
+        }
+        else if (_profile_cached)
+        {
+          TRC_DEBUG("No User-Data in SAA - using cached User-Data");
+        }
         put_in_cache();
       }
       send_reply();
-      break;
+    }
+    break;
     case 5001:
     {
       TRC_INFO("Server-Assignment answer with result code %d - reject", result_code);
@@ -1557,59 +3016,563 @@ void ImpuRegDataTask::on_sar_response(Diameter::Message& rsp)
       send_http_reply(HTTP_SERVER_ERROR);
       break;
   }
+  finish_task();
+  return;
+}
+
+//
+// IMPU IMS Subscription handling for URLs of the form
+// "/impu/<public ID>". Deprecated.
+//
+
+void ImpuIMSSubscriptionTask::run()
+{
+  const std::string prefix = "/impu/";
+  std::string path = _req.full_path();
+
+  _impu = path.substr(prefix.length());
+  _impi = _req.param("private_id");
+  TRC_DEBUG("Parsed HTTP request: private ID %s, public ID %s",
+            _impi.c_str(), _impu.c_str());
+
+  if (_impi.empty())
+  {
+    _type = RequestType::CALL;
+  }
+  else
+  {
+    _type = RequestType::REG;
+  }
+
+  if (past_deadline())
+  {
+    on_deadline_expired();
+    return;
+  }
+
+  TRC_DEBUG("Try to find IMS Subscription information in the cache");
+  CassandraStore::Operation* get_reg_data = _cache->create_GetRegData(_impu);
+  CassandraStore::Transaction* tsx =
+    new CacheTransaction(this,
+                         &ImpuRegDataTask::on_get_reg_data_success,
+                         &ImpuRegDataTask::on_get_reg_data_failure);
+  _cache->do_async(get_reg_data, tsx);
+}
+
+void ImpuIMSSubscriptionTask::send_reply()
+{
+  if (!_subscription->empty())
+  {
+    TRC_DEBUG("Building 200 OK response to send");
+    _req.add_content(_subscription->xml());
+    send_http_reply(HTTP_OK);
+  }
+  else
+  {
+    TRC_DEBUG("No XML User-Data available, returning 404");
+    send_http_reply(HTTP_NOT_FOUND);
+  }
+}
+
+//
+// Batched IMPU registration data handling for the URL "/impu/batch/reg-data".
+//
+
+// One entry in a batch. This runs through the same logic as a reg-data
+// request, but hands its reply back to the batch rather than sending it.
+class ImpuRegDataBatchTask::Entry : public ImpuRegDataTask
+{
+public:
+  Entry(HttpStack::Request& req,
+        const Config* cfg,
+        SAS::TrailId trail,
+        ImpuRegDataBatchTask* batch,
+        size_t index) :
+    ImpuRegDataTask(req, cfg, trail),
+    _batch(batch),
+    _index(index),
+    _body()
+  {}
+
+  // Reads the entry's parameters from the batch, returning false if they
+  // aren't valid.
+  bool parse(const rapidjson::Value& value)
+  {
+    if ((!value.IsObject()) ||
+        (!value.HasMember(JSON_IMPU.c_str())) ||
+        (!value[JSON_IMPU.c_str()].IsString()))
+    {
+      TRC_INFO("Batch entry %d doesn't have a public ID", _index);
+      return false;
+    }
+    _impu = value[JSON_IMPU.c_str()].GetString();
+
+    if (value.HasMember(JSON_PRIVATE_ID.c_str()))
+    {
+      if (!value[JSON_PRIVATE_ID.c_str()].IsString())
+      {
+        TRC_INFO("Batch entry %d has an invalid private ID", _index);
+        return false;
+      }
+      _impi = value[JSON_PRIVATE_ID.c_str()].GetString();
+    }
+
+    // Entries with a request type behave like PUTs, and the rest like GETs.
+    if (value.HasMember(JSON_REQTYPE.c_str()))
+    {
+      if (value[JSON_REQTYPE.c_str()].IsString())
+      {
+        _type = request_type_from_name(value[JSON_REQTYPE.c_str()].GetString());
+      }
+      else
+      {
+        _type = RequestType::UNKNOWN;
+      }
+
+      if (_type == RequestType::UNKNOWN)
+      {
+        TRC_INFO("Batch entry %d has an invalid request type", _index);
+        SAS::Event event(this->trail(), SASEvent::INVALID_REG_TYPE, 0);
+        SAS::report_event(event);
+        return false;
+      }
+      _method = htp_method_PUT;
+
+      // As for a single request, deregistrations must be finished even if
+      // the requester gives up waiting.
+      if ((is_deregistration_request(_type)) ||
+          (is_auth_failure_request(_type)))
+      {
+        clear_deadline();
+      }
+    }
+    else
+    {
+      _type = RequestType::UNKNOWN;
+      _method = htp_method_GET;
+    }
+
+    TRC_DEBUG("Parsed batch entry %d: private ID %s, public ID %s",
+              _index, _impi.c_str(), _impu.c_str());
+    return true;
+  }
+
+  const std::string& impu() const
+  {
+    return _impu;
+  }
+
+  // Starts the entry, returning true if it should be passed the registration
+  // data that the batch reads. Otherwise the entry is queued behind another
+  // request for the same public ID, and is resumed when that finishes.
+  bool start()
+  {
+    if (_hot_key_tracker != NULL)
+    {
+      _hot_key_tracker->record(_impu);
+    }
+
+    return ((_method != htp_method_PUT) || (join_impu_queue()));
+  }
+
+protected:
+  void add_content(const std::string& content)
+  {
+    _body = content;
+  }
+
+  // Batch responses don't carry headers for the individual entries.
+  void add_header(const std::string& name, const std::string& value) {}
+
+  void send_http_reply(int status_code)
+  {
+    _batch->on_entry_complete(_index, status_code, _body);
+  }
+
+private:
+  ImpuRegDataBatchTask* _batch;
+  size_t _index;
+  std::string _body;
+};
+
+ImpuRegDataBatchTask::ImpuRegDataBatchTask(HttpStack::Request& req,
+                                           const Config* cfg,
+                                           SAS::TrailId trail) :
+  HssCacheTask(req, trail),
+  _cfg(cfg),
+  _reading(),
+  _responses(),
+  _outstanding(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+ImpuRegDataBatchTask::~ImpuRegDataBatchTask()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+void ImpuRegDataBatchTask::run()
+{
+  if (_req.method() != htp_method_POST)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
+  }
+
+  rapidjson::Document document;
+  document.Parse<0>(_req.get_rx_body().c_str());
+
+  if ((!document.IsArray()) ||
+      (document.Size() == 0) ||
+      (document.Size() > MAX_ENTRIES))
+  {
+    TRC_INFO("Batch reg-data request isn't a JSON array of 1 to %d entries",
+             MAX_ENTRIES);
+    send_http_reply(HTTP_BAD_REQUEST);
+    delete this;
+    return;
+  }
+
+  // Check all the entries before starting any of them, so that an invalid
+  // batch is rejected without changing anything.
+  std::vector<Entry*> entries;
+  bool valid = true;
+  for (rapidjson::SizeType ii = 0; (ii < document.Size()) && (valid); ii++)
+  {
+    Entry* entry = new Entry(_req, _cfg, trail(), this, ii);
+    valid = entry->parse(document[ii]);
+    entries.push_back(entry);
+  }
+
+  if (!valid)
+  {
+    for (std::vector<Entry*>::iterator it = entries.begin();
+         it != entries.end();
+         ++it)
+    {
+      delete *it;
+    }
+    send_http_reply(HTTP_BAD_REQUEST);
+    delete this;
+    return;
+  }
+
+  SAS::Event event(this->trail(), SASEvent::REG_DATA_BATCH, 0);
+  event.add_static_param(entries.size());
+  SAS::report_event(event);
+
+  // Entries queued behind other requests can finish at any point from here
+  // on, so hold a reference for this method as well as one for each entry.
+  _responses.resize(entries.size());
+  for (size_t ii = 0; ii < entries.size(); ii++)
+  {
+    _responses[ii].impu = entries[ii]->impu();
+  }
+  _outstanding = entries.size() + 1;
+
+  std::vector<std::string> impus;
+  for (std::vector<Entry*>::iterator it = entries.begin();
+       it != entries.end();
+       ++it)
+  {
+    if ((*it)->start())
+    {
+      _reading.push_back(*it);
+      impus.push_back((*it)->impu());
+    }
+  }
+
+  if ((!_reading.empty()) && (past_deadline()))
+  {
+    // Abandon the entries that can be abandoned, but carry on with any that
+    // no longer have a deadline (such as deregistrations).
+    std::vector<Entry*> reading;
+    reading.swap(_reading);
+    impus.clear();
+    for (std::vector<Entry*>::iterator it = reading.begin();
+         it != reading.end();
+         ++it)
+    {
+      if ((*it)->past_deadline())
+      {
+        (*it)->on_deadline_expired();
+      }
+      else
+      {
+        _reading.push_back(*it);
+        impus.push_back((*it)->impu());
+      }
+    }
+  }
+
+  if (!_reading.empty())
+  {
+    TRC_DEBUG("Try to find IMS Subscription information for %d public IDs in the cache",
+              impus.size());
+    SAS::Event event(this->trail(), SASEvent::CACHE_GET_REG_DATA, 0);
+    std::string impus_str = boost::algorithm::join(impus, ", ");
+    event.add_var_param(impus_str);
+    SAS::report_event(event);
+    CassandraStore::Operation* get_reg_data = _cache->create_MultiGetRegData(impus);
+    CassandraStore::Transaction* tsx =
+      new CacheTransaction(this,
+                           &ImpuRegDataBatchTask::on_get_reg_data_success,
+                           &ImpuRegDataBatchTask::on_get_reg_data_failure);
+    _cache->do_async(get_reg_data, tsx);
+  }
+
+  release();
+}
+
+void ImpuRegDataBatchTask::on_get_reg_data_success(CassandraStore::Operation* op)
+{
+  Cache::MultiGetRegData* get_reg_data = (Cache::MultiGetRegData*)op;
+  std::vector<Entry*> reading;
+  reading.swap(_reading);
+
+  // The last entry to finish deletes this task, so don't touch any members
+  // from here on. Only the entries whose own rows couldn't be read fail.
+  for (std::vector<Entry*>::iterator it = reading.begin();
+       it != reading.end();
+       ++it)
+  {
+    Cache::GetRegData* reg_data = get_reg_data->get_reg_data((*it)->impu());
+    if (reg_data != NULL)
+    {
+      (*it)->on_get_reg_data_success(reg_data);
+    }
+    else
+    {
+      CassandraStore::ResultCode error;
+      std::string text;
+      get_reg_data->get_error((*it)->impu(), error, text);
+      (*it)->on_get_reg_data_failure(op, error, text);
+    }
+  }
+}
+
+void ImpuRegDataBatchTask::on_get_reg_data_failure(CassandraStore::Operation* op,
+                                                   CassandraStore::ResultCode error,
+                                                   std::string& text)
+{
+  std::vector<Entry*> reading;
+  reading.swap(_reading);
+
+  for (std::vector<Entry*>::iterator it = reading.begin();
+       it != reading.end();
+       ++it)
+  {
+    (*it)->on_get_reg_data_failure(op, error, text);
+  }
+}
+
+void ImpuRegDataBatchTask::on_entry_complete(size_t index,
+                                             int status_code,
+                                             const std::string& body)
+{
+  TRC_DEBUG("Batch entry %d for %s completed with %d",
+            index, _responses[index].impu.c_str(), status_code);
+
+  pthread_mutex_lock(&_lock);
+  _responses[index].status_code = status_code;
+  _responses[index].body = body;
+  pthread_mutex_unlock(&_lock);
+
+  release();
+}
+
+// Drops a reference to the batch, replying once there are none left.
+void ImpuRegDataBatchTask::release()
+{
+  pthread_mutex_lock(&_lock);
+  bool done = (--_outstanding == 0);
+  pthread_mutex_unlock(&_lock);
+
+  if (done)
+  {
+    send_reply();
+    delete this;
+  }
+}
+
+void ImpuRegDataBatchTask::send_reply()
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  writer.String(JSON_RESPONSES.c_str());
+  writer.StartArray();
+  for (std::vector<Response>::iterator it = _responses.begin();
+       it != _responses.end();
+       ++it)
+  {
+    writer.StartObject();
+    writer.String(JSON_IMPU.c_str());
+    writer.String(it->impu.c_str());
+    writer.String(JSON_STATUS.c_str());
+    writer.Int(it->status_code);
+    if (!it->body.empty())
+    {
+      writer.String(JSON_BODY.c_str());
+      writer.String(it->body.c_str());
+    }
+    writer.EndObject();
+  }
+  writer.EndArray();
+  writer.EndObject();
+
+  _req.add_content(sb.GetString());
+  send_http_reply(HTTP_OK);
+}
+
+//
+// HSS peer status handling for the URL "/peers".
+//
+
+void PeerStatusTask::run()
+{
+  if (_req.method() != htp_method_GET)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
+  }
+
+  if (_cx_peer_selector == NULL)
+  {
+    TRC_DEBUG("HSS peer selection isn't enabled");
+    send_http_reply(HTTP_NOT_FOUND);
+    delete this;
+    return;
+  }
+
+  std::vector<CxPeerSelector::PeerStats> peers = _cx_peer_selector->peer_stats();
+
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  writer.StartObject();
+  writer.String(JSON_PEERS.c_str());
+  writer.StartArray();
+  for (std::vector<CxPeerSelector::PeerStats>::iterator it = peers.begin();
+       it != peers.end();
+       ++it)
+  {
+    writer.StartObject();
+    writer.String(JSON_HOST.c_str());
+    writer.String(it->host.c_str());
+    writer.String(JSON_LATENCY_US.c_str());
+    writer.Uint64(it->latency_us);
+    writer.String(JSON_ERROR_RATE.c_str());
+    writer.Double(it->error_rate);
+    writer.String(JSON_OUTSTANDING.c_str());
+    writer.Int(it->outstanding);
+    writer.String(JSON_DEGRADED.c_str());
+    writer.Bool(it->degraded);
+    writer.EndObject();
+  }
+  writer.EndArray();
+  writer.EndObject();
+
+  _req.add_content(sb.GetString());
+  send_http_reply(HTTP_OK);
   delete this;
-  return;
 }
 
-//
-// IMPU IMS Subscription handling for URLs of the form
-// "/impu/<public ID>". Deprecated.
-//
-
-void ImpuIMSSubscriptionTask::run()
+// Checks the request carries the configured secret. The comparison takes
+// the same time wherever the first difference is, so the secret can't be
+// guessed a character at a time.
+bool BulkDeregistrationTask::authorized()
 {
-  const std::string prefix = "/impu/";
-  std::string path = _req.full_path();
-
-  _impu = path.substr(prefix.length());
-  _impi = _req.param("private_id");
-  TRC_DEBUG("Parsed HTTP request: private ID %s, public ID %s",
-            _impi.c_str(), _impu.c_str());
+  const std::string expected = "Bearer " + _cfg->secret;
+  std::string actual = _req.header(AUTHORIZATION_HEADER);
 
-  if (_impi.empty())
+  if ((_cfg->secret.empty()) || (actual.length() != expected.length()))
   {
-    _type = RequestType::CALL;
+    return false;
   }
-  else
+
+  unsigned char diff = 0;
+  for (size_t ii = 0; ii < expected.length(); ii++)
   {
-    _type = RequestType::REG;
+    diff |= (unsigned char)(actual[ii] ^ expected[ii]);
   }
 
-  TRC_DEBUG("Try to find IMS Subscription information in the cache");
-  CassandraStore::Operation* get_reg_data = _cache->create_GetRegData(_impu);
-  CassandraStore::Transaction* tsx =
-    new CacheTransaction(this,
-                         &ImpuRegDataTask::on_get_reg_data_success,
-                         &ImpuRegDataTask::on_get_reg_data_failure);
-  _cache->do_async(get_reg_data, tsx);
+  return (diff == 0);
 }
 
-void ImpuIMSSubscriptionTask::send_reply()
+void BulkDeregistrationTask::run()
 {
-  if (_xml != "")
+  if (!authorized())
   {
-    TRC_DEBUG("Building 200 OK response to send");
-    _req.add_content(_xml);
-    send_http_reply(HTTP_OK);
+    TRC_WARNING("Rejecting unauthorized bulk deregistration request");
+    send_http_reply(HTTP_FORBIDDEN);
+    delete this;
+    return;
   }
-  else
+
+  htp_method method = _req.method();
+
+  if (method == htp_method_POST)
   {
-    TRC_DEBUG("No XML User-Data available, returning 404");
-    send_http_reply(HTTP_NOT_FOUND);
+    // Queue each identity in the body, ignoring blank lines.
+    std::vector<std::string> ids;
+    std::istringstream body(_req.get_rx_body());
+    std::string id;
+    while (std::getline(body, id))
+    {
+      boost::algorithm::trim(id);
+      if (!id.empty())
+      {
+        ids.push_back(id);
+      }
+    }
+
+    TRC_INFO("Queueing %d identities for bulk deregistration", ids.size());
+    SAS::Event event(this->trail(), SASEvent::BULK_DEREGISTRATION_QUEUED, 0);
+    event.add_static_param(ids.size());
+    SAS::report_event(event);
+    _cfg->deregistrar->add(ids);
+  }
+  else if (method != htp_method_GET)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
   }
+
+  BulkDeregistrar::Progress progress = _cfg->deregistrar->progress();
+
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  writer.StartObject();
+  writer.String(JSON_QUEUED.c_str());
+  writer.Uint64(progress.queued);
+  writer.String(JSON_IN_PROGRESS.c_str());
+  writer.Uint64(progress.in_progress);
+  writer.String(JSON_SUCCEEDED.c_str());
+  writer.Uint64(progress.succeeded);
+  writer.String(JSON_FAILED.c_str());
+  writer.Uint64(progress.failed);
+  writer.String(JSON_CONCURRENCY.c_str());
+  writer.Int(progress.concurrency);
+  writer.EndObject();
+
+  _req.add_content(sb.GetString());
+  send_http_reply(HTTP_OK);
+  delete this;
 }
 
 void RegistrationTerminationTask::run()
+{
+  // This is called on a Diameter thread, so do the real work elsewhere.
+  HssCacheTask::dispatch(HandlerExecutor::RTR,
+                         boost::bind(&RegistrationTerminationTask::handle_rtr, this));
+}
+
+void RegistrationTerminationTask::handle_rtr()
 {
   // Save off the deregistration reason and all private and public
   // identities on the request.
@@ -1636,6 +3599,9 @@ void RegistrationTerminationTask::run()
   rtr_received.add_static_param(associated_identities.size());
   SAS::report_event(rtr_received);
 
+  ImpiTask::invalidate_digest_avs(_impis);
+  HssCacheTask::invalidate_icscf_answers(_impis, _impus);
+
   if ((_impus.empty()) && ((_deregistration_reason == PERMANENT_TERMINATION) ||
                            (_deregistration_reason == REMOVE_SCSCF) ||
                            (_deregistration_reason == SERVER_CHANGE) ||
@@ -1806,7 +3772,6 @@ void RegistrationTerminationTask::get_registration_set_failure(CassandraStore::O
 
 void RegistrationTerminationTask::delete_registrations()
 {
-  HTTPCode ret_code = 0;
   std::vector<std::string> empty_vector;
   std::vector<std::string> default_public_identities;
 
@@ -1817,41 +3782,55 @@ void RegistrationTerminationTask::delete_registrations()
        i++)
   {
     default_public_identities.push_back((*i)[0]);
+
+    // The S-CSCF serving these public identities is changing, so any cached
+    // I-CSCF answers for them are now stale.
+    HssCacheTask::invalidate_icscf_answers(empty_vector, *i);
   }
 
   // We need to notify sprout of the deregistrations. What we send to sprout depends
-  // on the deregistration reason.
+  // on the deregistration reason. We carry on once sprout has answered.
+  SproutConnection::deregister_clbk_t clbk =
+    boost::bind(&RegistrationTerminationTask::on_delete_registrations_complete, this, _1);
+
   switch (_deregistration_reason)
   {
   case PERMANENT_TERMINATION:
-    ret_code = _cfg->sprout_conn->deregister_bindings(false,
-                                                      default_public_identities,
-                                                      _impis,
-                                                      this->trail());
+    _cfg->sprout_conn->deregister_bindings_async(false,
+                                                 default_public_identities,
+                                                 _impis,
+                                                 this->trail(),
+                                                 clbk);
     break;
 
   case REMOVE_SCSCF:
   case SERVER_CHANGE:
-    ret_code = _cfg->sprout_conn->deregister_bindings(true,
-                                                      default_public_identities,
-                                                      empty_vector,
-                                                      this->trail());
+    _cfg->sprout_conn->deregister_bindings_async(true,
+                                                 default_public_identities,
+                                                 empty_vector,
+                                                 this->trail(),
+                                                 clbk);
     break;
 
   case NEW_SERVER_ASSIGNED:
-    ret_code = _cfg->sprout_conn->deregister_bindings(false,
-                                                      default_public_identities,
-                                                      empty_vector,
-                                                      this->trail());
+    _cfg->sprout_conn->deregister_bindings_async(false,
+                                                 default_public_identities,
+                                                 empty_vector,
+                                                 this->trail(),
+                                                 clbk);
     break;
 
   default:
     // LCOV_EXCL_START - We can't get here because we've already filtered these out.
     TRC_ERROR("Unexpected deregistration reason %d on RTR", _deregistration_reason);
+    on_delete_registrations_complete(0);
     break;
     // LCOV_EXCL_STOP
   }
+}
 
+void RegistrationTerminationTask::on_delete_registrations_complete(HTTPCode ret_code)
+{
   switch (ret_code)
   {
   case HTTP_OK:
@@ -1948,15 +3927,153 @@ void RegistrationTerminationTask::send_rta(const std::string result_code)
 }
 
 void PushProfileTask::run()
+{
+  // This is called on a Diameter thread, so do the real work elsewhere.
+  HssCacheTask::dispatch(HandlerExecutor::PPR,
+                         boost::bind(&PushProfileTask::handle_ppr, this));
+}
+
+void PushProfileTask::handle_ppr()
 {
   SAS::Event ppr_received(trail(), SASEvent::PPR_RECEIVED, 0);
   SAS::report_event(ppr_received);
 
+  // The PPR may carry a new password, so stop using any digest vectors we've
+  // cached for this private ID.
+  ImpiTask::invalidate_digest_avs(std::vector<std::string>(1, _ppr.impi()));
+
   // Received a Push Profile Request. We may need to update an IMS
   // subscription or charging address information in the cache.
-  _ims_sub_present = _ppr.user_data(_ims_subscription);
+  std::string user_data;
+  _ims_sub_present = _ppr.user_data(user_data);
+  _ims_subscription = ImsSubscription::create(user_data);
   _charging_addrs_present = _ppr.charging_addrs(_charging_addrs);
 
+  _batch_key = _ppr.impi();
+  if ((_ims_sub_present) && (!_ims_subscription->public_ids().empty()))
+  {
+    _batch_key.push_back('\0');
+    _batch_key.append(_ims_subscription->public_ids()[0]);
+  }
+
+  if (!join_irs_batch())
+  {
+    // This PPR will be applied, and answered, along with any others that
+    // arrive while an earlier update for the same IRS completes.
+    return;
+  }
+
+  apply_update();
+}
+
+void PushProfileTask::configure_ppr_batching(bool enabled)
+{
+  _batch_pprs = enabled;
+}
+
+// Returns true if no update is in progress for this PPR's IRS, in which
+// case this PPR can be applied now. Otherwise this PPR waits to be batched
+// up with any others for the IRS. PPRs without User-Data are batched on the
+// private ID alone.
+bool PushProfileTask::join_irs_batch()
+{
+  if (!_batch_pprs)
+  {
+    return true;
+  }
+
+  std::string impi = _ppr.impi();
+  int position = 0;
+  pthread_mutex_lock(&_waiting_pprs_lock);
+  std::map<std::string, std::vector<PushProfileTask*>>::iterator it =
+    _waiting_pprs.find(_batch_key);
+  if (it == _waiting_pprs.end())
+  {
+    _waiting_pprs[_batch_key];
+  }
+  else
+  {
+    it->second.push_back(this);
+    position = it->second.size();
+  }
+  pthread_mutex_unlock(&_waiting_pprs_lock);
+
+  if (position > 0)
+  {
+    TRC_DEBUG("Batching PPR for %s with %d others", impi.c_str(), position - 1);
+    SAS::Event event(this->trail(), SASEvent::PPR_BATCHED, 0);
+    event.add_var_param(impi);
+    event.add_static_param(position);
+    SAS::report_event(event);
+  }
+
+  return (position == 0);
+}
+
+// Called once this PPR's update is complete. If more PPRs have arrived for
+// the IRS in the meantime, applies the latest IMS subscription and charging
+// addresses from them in a single update, led by the most recent.
+void PushProfileTask::leave_irs_batch()
+{
+  if (!_batch_pprs)
+  {
+    return;
+  }
+
+  std::vector<PushProfileTask*> waiting;
+  pthread_mutex_lock(&_waiting_pprs_lock);
+  std::map<std::string, std::vector<PushProfileTask*>>::iterator it =
+    _waiting_pprs.find(_batch_key);
+  if (it == _waiting_pprs.end())
+  {
+    // LCOV_EXCL_START - every applied PPR has joined a batch.
+    TRC_ERROR("No PPR batch for %s", _ppr.impi().c_str());
+    // LCOV_EXCL_STOP
+  }
+  else if (it->second.empty())
+  {
+    _waiting_pprs.erase(it);
+  }
+  else
+  {
+    // Leave the entry in place, as the next update is now in progress.
+    waiting.swap(it->second);
+  }
+  pthread_mutex_unlock(&_waiting_pprs_lock);
+
+  if (waiting.empty())
+  {
+    return;
+  }
+
+  PushProfileTask* next = waiting.back();
+  waiting.pop_back();
+
+  for (std::vector<PushProfileTask*>::reverse_iterator jt = waiting.rbegin();
+       jt != waiting.rend();
+       ++jt)
+  {
+    if ((!next->_ims_sub_present) && ((*jt)->_ims_sub_present))
+    {
+      next->_ims_sub_present = true;
+      next->_ims_subscription = (*jt)->_ims_subscription;
+    }
+
+    if ((!next->_charging_addrs_present) && ((*jt)->_charging_addrs_present))
+    {
+      next->_charging_addrs_present = true;
+      next->_charging_addrs = (*jt)->_charging_addrs;
+    }
+  }
+
+  TRC_DEBUG("Applying %d batched PPRs for %s",
+            waiting.size() + 1, _ppr.impi().c_str());
+  next->_batched_pprs = waiting;
+  next->apply_update();
+}
+
+void PushProfileTask::apply_update()
+{
   // If we have charging addresses but no IMS subscription, we need
   // to lookup which public IDs need updating based on the private ID
   // specified in the PPR.
@@ -1987,6 +4104,7 @@ void PushProfileTask::on_get_impus_success(CassandraStore::Operation* op)
   get_public_ids->get_result(_impus);
   if (!_impus.empty())
   {
+    _impus_from_impi = true;
     SAS::Event event(this->trail(), SASEvent::CACHE_GET_ASSOC_IMPU_SUCCESS, 0);
     event.add_var_param(_impus[0]);
     SAS::report_event(event);
@@ -2029,7 +4147,7 @@ void PushProfileTask::update_reg_data()
     // out of the IMS subscription.
     if (_impus.empty())
     {
-      _impus = XmlUtils::get_public_ids(_ims_subscription);
+      _impus = _ims_subscription->public_ids();
 
       // We should check the IRS contains a SIP URI and throw an error log if
       // it doesn't. We continue as normal even if it doesn't.
@@ -2049,55 +4167,166 @@ void PushProfileTask::update_reg_data()
       {
         TRC_ERROR("No SIP URI in Implicit Registration Set");
         SAS::Event event(this->trail(), SASEvent::NO_SIP_URI_IN_IRS, 0);
-        event.add_compressed_param(_ims_subscription, &SASEvent::PROFILE_SERVICE_PROFILE);
+        event.add_compressed_param(_ims_subscription->xml(), &SASEvent::PROFILE_SERVICE_PROFILE);
         SAS::report_event(event);
       }
     }
 
-    // Create the cache request object and a SAS event simultaneously.
-    Cache::PutRegData* put_reg_data =
-      _cfg->cache->create_PutRegData(_impus,
-                                     Cache::generate_timestamp(),
-                                     (2 * _cfg->hss_reregistration_time));
-    SAS::Event event(this->trail(), SASEvent::CACHE_PUT_REG_DATA, 0);
-
-    std::string impus_str = boost::algorithm::join(_impus, ", ");
-    event.add_var_param(impus_str);
-
-    if (_ims_sub_present)
+    if ((_incremental_irs_updates) && (_ims_sub_present) && (!_impus.empty()))
     {
-      TRC_INFO("Updating IMS subscription from PPR");
-      put_reg_data->with_xml(_ims_subscription);
-      event.add_compressed_param(_ims_subscription, &SASEvent::PROFILE_SERVICE_PROFILE);
+      // Read the IMS subscription we have cached for this IRS, so we can
+      // work out what has actually changed. The new default public ID may
+      // not be cached yet, so start from the default public IDs the cache
+      // has for the private ID.
+      _impi = _ppr.impi();
+      TRC_DEBUG("Querying cache to find public IDs associated with %s", _impi.c_str());
+      SAS::Event event(this->trail(), SASEvent::CACHE_GET_ASSOC_IMPU, 0);
+      event.add_var_param(_impi);
+      SAS::report_event(event);
+      CassandraStore::Operation* get_public_ids =
+        _cfg->cache->create_GetAssociatedPublicIDs(_impi);
+      CassandraStore::Transaction* tsx =
+        new CacheTransaction(this,
+                             &PushProfileTask::on_get_irs_keys_success,
+                             &PushProfileTask::on_get_irs_keys_failure);
+      _cfg->cache->do_async(get_public_ids, tsx);
     }
     else
     {
-      event.add_compressed_param("IMS subscription unchanged", &SASEvent::PROFILE_SERVICE_PROFILE);
+      write_reg_data();
     }
+  }
+  else
+  {
+    send_ppa(DIAMETER_REQ_SUCCESS);
+  }
+}
 
-    event.add_static_param(RegistrationState::UNCHANGED);
-    event.add_var_param("");
+void PushProfileTask::configure_incremental_irs_updates(bool enabled)
+{
+  _incremental_irs_updates = enabled;
+}
 
-    if (_charging_addrs_present)
+void PushProfileTask::on_get_irs_keys_success(CassandraStore::Operation* op)
+{
+  Cache::GetAssociatedPublicIDs* get_public_ids = (Cache::GetAssociatedPublicIDs*)op;
+  std::vector<std::string> default_ids;
+  get_public_ids->get_result(default_ids);
+
+  // Try the private ID's default public IDs that are still in the IRS
+  // first, then the others (one of which may be the IRS's old default
+  // public ID), and finally the new default public ID.
+  for (std::vector<std::string>::iterator it = default_ids.begin();
+       it != default_ids.end();
+       ++it)
+  {
+    if (std::find(_impus.begin(), _impus.end(), *it) != _impus.end())
     {
-      TRC_INFO("Updating charging addresses from PPR");
-      event.add_var_param(_charging_addrs.log_string());
-      put_reg_data->with_charging_addrs(_charging_addrs);
+      _cached_irs_keys.push_back(*it);
     }
-    else
+  }
+
+  for (std::vector<std::string>::iterator it = default_ids.begin();
+       it != default_ids.end();
+       ++it)
+  {
+    if (std::find(_impus.begin(), _impus.end(), *it) == _impus.end())
     {
-      event.add_var_param("Charging addresses unchanged");
+      _cached_irs_keys.push_back(*it);
     }
+  }
 
-    CassandraStore::Transaction* tsx =
-      new CacheTransaction(this,
-                           &PushProfileTask::update_reg_data_success,
-                           &PushProfileTask::update_reg_data_failure);
-    CassandraStore::Operation*& op = (CassandraStore::Operation*&)put_reg_data;
-    _cfg->cache->do_async(op, tsx);
+  if (std::find(_cached_irs_keys.begin(), _cached_irs_keys.end(), _impus[0]) ==
+      _cached_irs_keys.end())
+  {
+    _cached_irs_keys.push_back(_impus[0]);
+  }
 
-    SAS::report_event(event);
+  get_cached_irs();
+}
+
+void PushProfileTask::on_get_irs_keys_failure(CassandraStore::Operation* op,
+                                              CassandraStore::ResultCode error,
+                                              std::string& text)
+{
+  TRC_DEBUG("Cache query failed with rc %d", error);
+  _cached_irs_keys.push_back(_impus[0]);
+  get_cached_irs();
+}
+
+// Looks up the cached IMS subscription for the next candidate public ID, or
+// writes the whole IRS if there are none left.
+void PushProfileTask::get_cached_irs()
+{
+  if (_next_cached_irs_key >= _cached_irs_keys.size())
+  {
+    TRC_DEBUG("No cached IMS subscription found for the IRS");
+    write_reg_data();
+    return;
+  }
+
+  const std::string& impu = _cached_irs_keys[_next_cached_irs_key++];
+  TRC_DEBUG("Looking up cached IMS subscription for %s", impu.c_str());
+  SAS::Event event(this->trail(), SASEvent::CACHE_GET_REG_DATA, 0);
+  event.add_var_param(impu);
+  SAS::report_event(event);
+  CassandraStore::Operation* get_reg_data =
+    _cfg->cache->create_GetRegData(impu);
+  CassandraStore::Transaction* tsx =
+    new CacheTransaction(this,
+                         &PushProfileTask::on_get_cached_irs_success,
+                         &PushProfileTask::on_get_cached_irs_failure);
+  _cfg->cache->do_async(get_reg_data, tsx);
+}
+
+void PushProfileTask::on_get_cached_irs_success(CassandraStore::Operation* op)
+{
+  Cache::GetRegData* get_reg_data = (Cache::GetRegData*)op;
+  std::string cached_xml;
+  int32_t ttl;
+  std::vector<std::string> impis;
+  get_reg_data->get_xml(cached_xml, ttl);
+  get_reg_data->get_associated_impis(impis);
+
+  if (cached_xml.empty())
+  {
+    get_cached_irs();
+    return;
+  }
+
+  ImsSubscription cached_subscription(cached_xml);
+  XmlUtils::IrsDiff diff =
+    XmlUtils::diff_ims_subscriptions(cached_subscription, *_ims_subscription);
+
+  if (diff.unchanged.empty())
+  {
+    // This is a different IRS for the same private ID.
+    get_cached_irs();
+    return;
+  }
 
+  TRC_DEBUG("IRS for %s has %d added, %d removed and %d unchanged public IDs",
+            _impus[0].c_str(),
+            diff.added.size(),
+            diff.removed.size(),
+            diff.unchanged.size());
+
+  if (!diff.removed.empty())
+  {
+    delete_removed_public_ids(_cfg->cache, diff, impis, trail());
+  }
+
+  if (!diff.service_profiles_changed)
+  {
+    // The cached IMS subscription is already up to date, so leave it
+    // alone.
+    TRC_DEBUG("IMS subscription unchanged");
+    _ims_sub_present = false;
+  }
+
+  if ((_ims_sub_present) || (_charging_addrs_present))
+  {
+    write_reg_data();
   }
   else
   {
@@ -2105,10 +4334,93 @@ void PushProfileTask::update_reg_data()
   }
 }
 
+void PushProfileTask::on_get_cached_irs_failure(CassandraStore::Operation* op,
+                                                CassandraStore::ResultCode error,
+                                                std::string& text)
+{
+  TRC_DEBUG("No cached IMS subscription found (%d, %s)", error, text.c_str());
+  get_cached_irs();
+}
+
+void PushProfileTask::write_reg_data()
+{
+  // Key the TTL jitter on the default public ID of the IRS, so that it
+  // matches the jitter used when the IRS is written on reregistration.
+  if (_impus_from_impi)
+  {
+    // Each public ID associated with the private ID is the default public ID
+    // of a different IRS, so write them one at a time.
+    std::vector<std::string> impus(1, _impus[_next_irs]);
+    write_irs(impus, _impus[_next_irs]);
+  }
+  else
+  {
+    const std::vector<std::string>& public_ids = _ims_subscription->public_ids();
+    write_irs(_impus, public_ids.empty() ? "" : public_ids[0]);
+  }
+}
+
+void PushProfileTask::write_irs(const std::vector<std::string>& impus,
+                                const std::string& default_id)
+{
+  // Create the cache request object and a SAS event simultaneously.
+  Cache::PutRegData* put_reg_data =
+    _cfg->cache->create_PutRegData(impus,
+                                   Cache::generate_timestamp(),
+                                   (2 * _cfg->hss_reregistration_time) +
+                                   jitter_for_key(default_id,
+                                                  _cfg->hss_reregistration_jitter));
+  SAS::Event event(this->trail(), SASEvent::CACHE_PUT_REG_DATA, 0);
+
+  std::string impus_str = boost::algorithm::join(impus, ", ");
+  event.add_var_param(impus_str);
+
+  if (_ims_sub_present)
+  {
+    TRC_INFO("Updating IMS subscription from PPR");
+    put_reg_data->with_xml(_ims_subscription->xml());
+    event.add_compressed_param(_ims_subscription->xml(), &SASEvent::PROFILE_SERVICE_PROFILE);
+  }
+  else
+  {
+    event.add_compressed_param("IMS subscription unchanged", &SASEvent::PROFILE_SERVICE_PROFILE);
+  }
+
+  event.add_static_param(RegistrationState::UNCHANGED);
+  event.add_var_param("");
+
+  if (_charging_addrs_present)
+  {
+    TRC_INFO("Updating charging addresses from PPR");
+    event.add_var_param(_charging_addrs.log_string());
+    put_reg_data->with_charging_addrs(_charging_addrs);
+  }
+  else
+  {
+    event.add_var_param("Charging addresses unchanged");
+  }
+
+  CassandraStore::Transaction* tsx =
+    new CacheTransaction(this,
+                         &PushProfileTask::update_reg_data_success,
+                         &PushProfileTask::update_reg_data_failure);
+  CassandraStore::Operation*& op = (CassandraStore::Operation*&)put_reg_data;
+  _cfg->cache->do_async(op, tsx);
+
+  SAS::report_event(event);
+}
+
 void PushProfileTask::update_reg_data_success(CassandraStore::Operation* op)
 {
   SAS::Event event(this->trail(), SASEvent::UPDATED_REG_DATA, 0);
   SAS::report_event(event);
+
+  if ((_impus_from_impi) && (++_next_irs < _impus.size()))
+  {
+    write_reg_data();
+    return;
+  }
+
   send_ppa(DIAMETER_REQ_SUCCESS);
 }
 
@@ -2121,6 +4433,23 @@ void PushProfileTask::update_reg_data_failure(CassandraStore::Operation* op,
 }
 
 void PushProfileTask::send_ppa(const std::string result_code)
+{
+  // The PPRs batched with this one share its result.
+  for (std::vector<PushProfileTask*>::iterator it = _batched_pprs.begin();
+       it != _batched_pprs.end();
+       ++it)
+  {
+    (*it)->answer(result_code);
+    delete *it;
+  }
+
+  answer(result_code);
+  leave_irs_batch();
+
+  delete this;
+}
+
+void PushProfileTask::answer(const std::string& result_code)
 {
   // Use our Cx layer to create a PPA object and add the correct AVPs. The PPA is
   // created from the PPR.
@@ -2132,6 +4461,4 @@ void PushProfileTask::send_ppa(const std::string result_code)
   // Send the PPA back to the HSS.
   TRC_INFO("Ready to send PPA");
   ppa.send(trail());
-
-  delete this;
 }
@@ -0,0 +1,337 @@
+/**
+ * @file hotkeytracker.cpp Tracks the most frequently requested keys.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+
+#include "hotkeytracker.h"
+#include "log.h"
+
+HotKeyTracker::HotKeyTracker(const std::string& snapshot_file,
+                             int max_keys,
+                             int snapshot_interval) :
+  _snapshot_file(snapshot_file),
+  _max_keys(max_keys),
+  _snapshot_interval_ms(snapshot_interval * 1000),
+  _warm_up_rate(0),
+  _running(false),
+  _terminated(false)
+{
+  memset(_sketch, 0, sizeof(_sketch));
+  pthread_mutex_init(&_lock, NULL);
+  pthread_mutex_init(&_thread_lock, NULL);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_thread_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+}
+
+HotKeyTracker::~HotKeyTracker()
+{
+  stop();
+  pthread_cond_destroy(&_thread_cond);
+  pthread_mutex_destroy(&_thread_lock);
+  pthread_mutex_destroy(&_lock);
+}
+
+void HotKeyTracker::record(const std::string& key)
+{
+  pthread_mutex_lock(&_lock);
+
+  uint32_t count = estimate(key, true);
+
+  std::map<std::string, uint32_t>::iterator it = _top_keys.find(key);
+  if (it != _top_keys.end())
+  {
+    // Already a hot key - just update its position.
+    _top_keys_by_count.erase(std::make_pair(it->second, key));
+    it->second = count;
+    _top_keys_by_count.insert(std::make_pair(count, key));
+  }
+  else if (_top_keys.size() < _max_keys)
+  {
+    _top_keys[key] = count;
+    _top_keys_by_count.insert(std::make_pair(count, key));
+  }
+  else if ((!_top_keys_by_count.empty()) &&
+           (count > _top_keys_by_count.begin()->first))
+  {
+    // This key is now hotter than the coldest hot key, so replace it.
+    _top_keys.erase(_top_keys_by_count.begin()->second);
+    _top_keys_by_count.erase(_top_keys_by_count.begin());
+    _top_keys[key] = count;
+    _top_keys_by_count.insert(std::make_pair(count, key));
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+std::vector<std::string> HotKeyTracker::hot_keys()
+{
+  std::vector<std::string> keys;
+
+  pthread_mutex_lock(&_lock);
+  for (std::set<std::pair<uint32_t, std::string>>::reverse_iterator it = _top_keys_by_count.rbegin();
+       it != _top_keys_by_count.rend();
+       ++it)
+  {
+    keys.push_back(it->second);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return keys;
+}
+
+bool HotKeyTracker::save_snapshot()
+{
+  if (_snapshot_file.empty())
+  {
+    return false;
+  }
+
+  std::vector<std::string> keys = hot_keys();
+  age();
+
+  // Write to a temporary file and rename it into place, so that we never
+  // leave a partially written snapshot behind.
+  std::string tmp_file = _snapshot_file + ".tmp";
+  std::ofstream out(tmp_file.c_str(), std::ios::out | std::ios::trunc);
+  if (!out.is_open())
+  {
+    TRC_WARNING("Failed to open hot key snapshot file %s", tmp_file.c_str());
+    return false;
+  }
+
+  for (std::vector<std::string>::iterator it = keys.begin();
+       it != keys.end();
+       ++it)
+  {
+    out << *it << "\n";
+  }
+  out.close();
+
+  if ((out.fail()) ||
+      (rename(tmp_file.c_str(), _snapshot_file.c_str()) != 0))
+  {
+    TRC_WARNING("Failed to write hot key snapshot file %s", _snapshot_file.c_str());
+    return false;
+  }
+
+  TRC_DEBUG("Wrote %d hot keys to %s", keys.size(), _snapshot_file.c_str());
+  return true;
+}
+
+std::vector<std::string> HotKeyTracker::load_snapshot()
+{
+  std::vector<std::string> keys;
+
+  if (!_snapshot_file.empty())
+  {
+    std::ifstream in(_snapshot_file.c_str());
+    std::string key;
+    while ((keys.size() < _max_keys) && (std::getline(in, key)))
+    {
+      if (!key.empty())
+      {
+        keys.push_back(key);
+      }
+    }
+  }
+
+  TRC_DEBUG("Read %d hot keys from %s", keys.size(), _snapshot_file.c_str());
+  return keys;
+}
+
+void HotKeyTracker::start(warm_up_clbk_t warm_up_clbk, int warm_up_rate)
+{
+  _warm_up_clbk = warm_up_clbk;
+  _warm_up_rate = warm_up_rate;
+  _terminated = false;
+
+  int rc = pthread_create(&_thread, NULL, &HotKeyTracker::thread_entry_point, this);
+  if (rc == 0)
+  {
+    _running = true;
+  }
+  else
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start hot key tracker thread: %s", strerror(rc));
+    // LCOV_EXCL_STOP
+  }
+}
+
+void HotKeyTracker::stop()
+{
+  if (_running)
+  {
+    pthread_mutex_lock(&_thread_lock);
+    _terminated = true;
+    pthread_cond_signal(&_thread_cond);
+    pthread_mutex_unlock(&_thread_lock);
+
+    pthread_join(_thread, NULL);
+    _running = false;
+
+    save_snapshot();
+  }
+}
+
+// Estimates the count for a key as the minimum over all rows of the sketch,
+// optionally incrementing the key's counters first. Must be called with the
+// lock held.
+uint32_t HotKeyTracker::estimate(const std::string& key, bool increment)
+{
+  // Derive the row hashes from a single 64-bit hash (as in Kirsch and
+  // Mitzenmacher) rather than hashing the key once per row.
+  uint64_t hash = std::hash<std::string>()(key);
+  uint32_t h1 = (uint32_t)hash;
+  uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+
+  uint32_t count = UINT32_MAX;
+  for (int row = 0; row < SKETCH_DEPTH; row++)
+  {
+    uint32_t& counter = _sketch[row][(h1 + row * h2) % SKETCH_WIDTH];
+    if ((increment) && (counter < UINT32_MAX))
+    {
+      counter++;
+    }
+    count = std::min(count, counter);
+  }
+
+  return count;
+}
+
+// Halves every count, so that keys which have gone cold eventually drop out
+// of the hot set.
+void HotKeyTracker::age()
+{
+  pthread_mutex_lock(&_lock);
+
+  for (int row = 0; row < SKETCH_DEPTH; row++)
+  {
+    for (int col = 0; col < SKETCH_WIDTH; col++)
+    {
+      _sketch[row][col] >>= 1;
+    }
+  }
+
+  _top_keys_by_count.clear();
+  for (std::map<std::string, uint32_t>::iterator it = _top_keys.begin();
+       it != _top_keys.end();
+       ++it)
+  {
+    it->second >>= 1;
+    _top_keys_by_count.insert(std::make_pair(it->second, it->first));
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+// Waits for the specified time, returning false if the tracker is being
+// stopped.
+bool HotKeyTracker::wait_for(long ms)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += ms / 1000;
+  deadline.tv_nsec += (ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&_thread_lock);
+  while (!_terminated)
+  {
+    if (pthread_cond_timedwait(&_thread_cond, &_thread_lock, &deadline) == ETIMEDOUT)
+    {
+      break;
+    }
+  }
+  bool running = !_terminated;
+  pthread_mutex_unlock(&_thread_lock);
+
+  return running;
+}
+
+void HotKeyTracker::thread_function()
+{
+  // Replay the last snapshot first.  This runs alongside live traffic, so
+  // pace it to avoid competing with real requests.
+  if ((_warm_up_clbk) && (_warm_up_rate > 0))
+  {
+    std::vector<std::string> keys = load_snapshot();
+    TRC_STATUS("Warming up %d hot keys at %d per second", keys.size(), _warm_up_rate);
+    long interval_ms = std::max(1000 / _warm_up_rate, 1);
+    int warmed = 0;
+
+    for (std::vector<std::string>::iterator it = keys.begin();
+         it != keys.end();
+         ++it)
+    {
+      _warm_up_clbk(*it);
+      warmed++;
+
+      if (!wait_for(interval_ms))
+      {
+        break;
+      }
+    }
+
+    TRC_STATUS("Warmed up %d hot keys", warmed);
+  }
+
+  while (wait_for(_snapshot_interval_ms))
+  {
+    save_snapshot();
+  }
+}
+
+void* HotKeyTracker::thread_entry_point(void* tracker)
+{
+  ((HotKeyTracker*)tracker)->thread_function();
+  return NULL;
+}
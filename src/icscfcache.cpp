@@ -0,0 +1,201 @@
+/**
+ * @file icscfcache.cpp Short-lived cache of answers to I-CSCF queries.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "icscfcache.h"
+#include "log.h"
+
+IcscfCache::IcscfCache(int ttl, size_t max_entries) :
+  _ttl(ttl),
+  _max_entries(max_entries)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+IcscfCache::~IcscfCache()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+// The request parameters can't contain a NUL, so use it to separate them.
+std::string IcscfCache::uar_key(const std::string& impi,
+                                const std::string& impu,
+                                const std::string& visited_network,
+                                const std::string& authorization_type)
+{
+  std::string key = "UAR";
+  key.push_back('\0'); key.append(impi);
+  key.push_back('\0'); key.append(impu);
+  key.push_back('\0'); key.append(visited_network);
+  key.push_back('\0'); key.append(authorization_type);
+  return key;
+}
+
+std::string IcscfCache::lir_key(const std::string& impu,
+                                const std::string& originating,
+                                const std::string& authorization_type)
+{
+  std::string key = "LIR";
+  key.push_back('\0'); key.append(impu);
+  key.push_back('\0'); key.append(originating);
+  key.push_back('\0'); key.append(authorization_type);
+  return key;
+}
+
+bool IcscfCache::get(const std::string& key, std::string& answer)
+{
+  bool found = false;
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, Entries::iterator>::iterator it = _index.find(key);
+  if (it != _index.end())
+  {
+    if (it->second->expiry > now())
+    {
+      // Move the entry to the front of the LRU list.
+      _lru.splice(_lru.begin(), _lru, it->second);
+      answer = it->second->answer;
+      found = true;
+    }
+    else
+    {
+      remove(key);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return found;
+}
+
+void IcscfCache::put(const std::string& key,
+                     const std::string& impi,
+                     const std::string& impu,
+                     const std::string& answer)
+{
+  if (_max_entries == 0)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&_lock);
+
+  remove(key);
+
+  // Evict from the back of the LRU list to make room for the new entry.
+  while (_lru.size() >= _max_entries)
+  {
+    TRC_DEBUG("I-CSCF answer cache full - evicting least recently used entry");
+    remove(_lru.back().key);
+  }
+
+  Entry entry;
+  entry.key = key;
+  entry.impi = impi;
+  entry.impu = impu;
+  entry.answer = answer;
+  entry.expiry = now() + _ttl;
+  _lru.push_front(entry);
+  _index[key] = _lru.begin();
+  if (!impi.empty())
+  {
+    _impi_index.insert(std::make_pair(impi, key));
+  }
+  _impu_index.insert(std::make_pair(impu, key));
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void IcscfCache::invalidate_impi(const std::string& impi)
+{
+  TRC_DEBUG("Discarding cached I-CSCF answers for %s", impi.c_str());
+  pthread_mutex_lock(&_lock);
+  remove_all(_impi_index, impi);
+  pthread_mutex_unlock(&_lock);
+}
+
+void IcscfCache::invalidate_impu(const std::string& impu)
+{
+  TRC_DEBUG("Discarding cached I-CSCF answers for %s", impu.c_str());
+  pthread_mutex_lock(&_lock);
+  remove_all(_impu_index, impu);
+  pthread_mutex_unlock(&_lock);
+}
+
+size_t IcscfCache::size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _lru.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+time_t IcscfCache::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+// Removes the entry with the given key (if there is one) from the LRU list
+// and all the indexes. Must be called with the lock held.
+void IcscfCache::remove(const std::string& key)
+{
+  std::map<std::string, Entries::iterator>::iterator it = _index.find(key);
+  if (it != _index.end())
+  {
+    Entries::iterator entry = it->second;
+    _impi_index.erase(std::make_pair(entry->impi, key));
+    _impu_index.erase(std::make_pair(entry->impu, key));
+    _index.erase(it);
+    _lru.erase(entry);
+  }
+}
+
+// Removes all the entries for an ID in one of the ID indexes. Must be called
+// with the lock held.
+void IcscfCache::remove_all(IdIndex& index, const std::string& id)
+{
+  IdIndex::iterator it = index.lower_bound(std::make_pair(id, std::string()));
+  while ((it != index.end()) && (it->first == id))
+  {
+    // Removing the entry also removes it from this index, so take a copy of
+    // the key and move on first.
+    std::string key = it->second;
+    ++it;
+    remove(key);
+  }
+}
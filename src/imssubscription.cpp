@@ -0,0 +1,140 @@
+/**
+ * @file imssubscription.cpp A parsed IMS subscription.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "imssubscription.h"
+#include "xmlutils.h"
+
+ImsSubscriptionPtr ImsSubscription::create(const std::string& xml)
+{
+  // Most tasks start off with no User-Data, so don't allocate anything for
+  // that.
+  static const ImsSubscriptionPtr no_subscription(new ImsSubscription(""));
+
+  if (xml.empty())
+  {
+    return no_subscription;
+  }
+
+  return ImsSubscriptionPtr(new ImsSubscription(xml));
+}
+
+ImsSubscription::ImsSubscription(const std::string& xml) :
+  _xml(xml),
+  _parsed(false),
+  _valid(false),
+  _rendered(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+ImsSubscription::~ImsSubscription()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+bool ImsSubscription::valid() const
+{
+  parse();
+  return _valid;
+}
+
+const std::string& ImsSubscription::private_id() const
+{
+  parse();
+  return _private_id;
+}
+
+const std::vector<std::string>& ImsSubscription::public_ids() const
+{
+  parse();
+  return _public_ids;
+}
+
+const std::string& ImsSubscription::reg_data_element() const
+{
+  render();
+  return _reg_data_element;
+}
+
+void ImsSubscription::parse() const
+{
+  // The parsed fields never change once they have been filled in, so
+  // callers can carry on using them after the lock is released.
+  pthread_mutex_lock(&_lock);
+
+  if (!_parsed)
+  {
+    _parsed = true;
+
+    if (_xml.empty())
+    {
+      _valid = true;
+    }
+    else
+    {
+      _valid = XmlUtils::parse_ims_subscription(_xml,
+                                                _private_id,
+                                                _public_ids);
+      if (!_valid)
+      {
+        // Don't leave anything behind from a partial parse.
+        _private_id.clear();
+        _public_ids.clear();
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void ImsSubscription::render() const
+{
+  // As for parse(), the element never changes once it has been printed.
+  pthread_mutex_lock(&_lock);
+
+  if (!_rendered)
+  {
+    _rendered = true;
+
+    if ((!_xml.empty()) &&
+        (!XmlUtils::render_reg_data_element(_xml, _reg_data_element)))
+    {
+      _reg_data_element.clear();
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
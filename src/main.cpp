@@ -37,7 +37,11 @@
 #include <getopt.h>
 #include <signal.h>
 #include <semaphore.h>
+#include <unistd.h>
 #include <boost/filesystem.hpp>
+#include <boost/bind.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <fstream>
 
 #include "accesslogger.h"
 #include "log.h"
@@ -100,6 +104,47 @@ struct options
   int exception_max_ttl;
   int http_blacklist_duration;
   int diameter_blacklist_duration;
+  std::string hot_key_snapshot_file;
+  int hot_key_count;
+  int hot_key_snapshot_interval;
+  int warm_up_rate;
+  int hss_reregistration_jitter;
+  float max_reregistration_sar_rate;
+  int aka_vector_batch_size;
+  int aka_vector_low_water;
+  int aka_vector_ttl;
+  int digest_av_cache_ttl;
+  int digest_av_cache_size;
+  bool digest_av_cache_cassandra;
+  int icscf_cache_ttl;
+  int icscf_cache_size;
+  bool coalesce_hss_requests;
+  bool serialize_reg_data;
+  int hss_concurrency_limit;
+  int hss_queue_size;
+  bool adaptive_diameter_timeout;
+  int diameter_timeout_floor_ms;
+  int diameter_timeout_ceiling_ms;
+  float diameter_timeout_factor;
+  int hedge_percentile;
+  int hedge_budget_percent;
+  bool hss_peer_selection;
+  float hss_peer_latency_factor;
+  int hss_peer_degraded_time;
+  int hss_circuit_breaker_percent;
+  int hss_circuit_breaker_min_requests;
+  int hss_circuit_breaker_open_ms;
+  int default_request_timeout_ms;
+  int max_sprout_deregistrations;
+  bool offload_diameter_handlers;
+  bool batch_pprs;
+  bool incremental_irs_updates;
+  int bulk_deregistration_concurrency;
+  int bulk_deregistration_target_latency_ms;
+  std::string bulk_deregistration_secret_file;
+  int reg_data_compression_threshold;
+  int reg_data_cache_mb;
+  bool stream_reg_data;
 };
 
 // Enum for option types not assigned short-forms
@@ -118,7 +163,48 @@ enum OptionTypes
   MIN_TOKEN_RATE,
   EXCEPTION_MAX_TTL,
   HTTP_BLACKLIST_DURATION,
-  DIAMETER_BLACKLIST_DURATION
+  DIAMETER_BLACKLIST_DURATION,
+  HOT_KEY_SNAPSHOT_FILE,
+  HOT_KEY_COUNT,
+  HOT_KEY_SNAPSHOT_INTERVAL,
+  WARM_UP_RATE,
+  HSS_REREGISTRATION_JITTER,
+  MAX_REREGISTRATION_SAR_RATE,
+  AKA_VECTOR_BATCH_SIZE,
+  AKA_VECTOR_LOW_WATER,
+  AKA_VECTOR_TTL,
+  DIGEST_AV_CACHE_TTL,
+  DIGEST_AV_CACHE_SIZE,
+  DIGEST_AV_CACHE_CASSANDRA,
+  ICSCF_CACHE_TTL,
+  ICSCF_CACHE_SIZE,
+  COALESCE_HSS_REQUESTS,
+  SERIALIZE_REG_DATA,
+  HSS_CONCURRENCY_LIMIT,
+  HSS_QUEUE_SIZE,
+  ADAPTIVE_DIAMETER_TIMEOUT,
+  DIAMETER_TIMEOUT_FLOOR_MS,
+  DIAMETER_TIMEOUT_CEILING_MS,
+  DIAMETER_TIMEOUT_FACTOR,
+  HEDGE_PERCENTILE,
+  HEDGE_BUDGET_PERCENT,
+  HSS_PEER_SELECTION,
+  HSS_PEER_LATENCY_FACTOR,
+  HSS_PEER_DEGRADED_TIME,
+  HSS_CIRCUIT_BREAKER_PERCENT,
+  HSS_CIRCUIT_BREAKER_MIN_REQUESTS,
+  HSS_CIRCUIT_BREAKER_OPEN_MS,
+  DEFAULT_REQUEST_TIMEOUT_MS,
+  MAX_SPROUT_DEREGISTRATIONS,
+  OFFLOAD_DIAMETER_HANDLERS,
+  BATCH_PPRS,
+  INCREMENTAL_IRS_UPDATES,
+  BULK_DEREGISTRATION_CONCURRENCY,
+  BULK_DEREGISTRATION_TARGET_LATENCY_MS,
+  BULK_DEREGISTRATION_SECRET_FILE,
+  REG_DATA_COMPRESSION_THRESHOLD,
+  REG_DATA_CACHE_MB,
+  STREAM_REG_DATA
 };
 
 const static struct option long_opt[] =
@@ -155,6 +241,47 @@ const static struct option long_opt[] =
   {"exception-max-ttl",           required_argument, NULL, EXCEPTION_MAX_TTL},
   {"http-blacklist-duration",     required_argument, NULL, HTTP_BLACKLIST_DURATION},
   {"diameter-blacklist-duration", required_argument, NULL, DIAMETER_BLACKLIST_DURATION},
+  {"hot-key-snapshot-file",       required_argument, NULL, HOT_KEY_SNAPSHOT_FILE},
+  {"hot-key-count",               required_argument, NULL, HOT_KEY_COUNT},
+  {"hot-key-snapshot-interval",   required_argument, NULL, HOT_KEY_SNAPSHOT_INTERVAL},
+  {"warm-up-rate",                required_argument, NULL, WARM_UP_RATE},
+  {"hss-reregistration-jitter",   required_argument, NULL, HSS_REREGISTRATION_JITTER},
+  {"max-reregistration-sar-rate", required_argument, NULL, MAX_REREGISTRATION_SAR_RATE},
+  {"aka-vector-batch-size",       required_argument, NULL, AKA_VECTOR_BATCH_SIZE},
+  {"aka-vector-low-water",        required_argument, NULL, AKA_VECTOR_LOW_WATER},
+  {"aka-vector-ttl",              required_argument, NULL, AKA_VECTOR_TTL},
+  {"digest-av-cache-ttl",         required_argument, NULL, DIGEST_AV_CACHE_TTL},
+  {"digest-av-cache-size",        required_argument, NULL, DIGEST_AV_CACHE_SIZE},
+  {"digest-av-cache-cassandra",   no_argument,       NULL, DIGEST_AV_CACHE_CASSANDRA},
+  {"icscf-cache-ttl",             required_argument, NULL, ICSCF_CACHE_TTL},
+  {"icscf-cache-size",            required_argument, NULL, ICSCF_CACHE_SIZE},
+  {"coalesce-hss-requests",       no_argument,       NULL, COALESCE_HSS_REQUESTS},
+  {"serialize-reg-data",          no_argument,       NULL, SERIALIZE_REG_DATA},
+  {"hss-concurrency-limit",       required_argument, NULL, HSS_CONCURRENCY_LIMIT},
+  {"hss-queue-size",              required_argument, NULL, HSS_QUEUE_SIZE},
+  {"adaptive-diameter-timeout",   no_argument,       NULL, ADAPTIVE_DIAMETER_TIMEOUT},
+  {"diameter-timeout-floor-ms",   required_argument, NULL, DIAMETER_TIMEOUT_FLOOR_MS},
+  {"diameter-timeout-ceiling-ms", required_argument, NULL, DIAMETER_TIMEOUT_CEILING_MS},
+  {"diameter-timeout-factor",     required_argument, NULL, DIAMETER_TIMEOUT_FACTOR},
+  {"hedge-percentile",            required_argument, NULL, HEDGE_PERCENTILE},
+  {"hedge-budget-percent",        required_argument, NULL, HEDGE_BUDGET_PERCENT},
+  {"hss-peer-selection",          no_argument,       NULL, HSS_PEER_SELECTION},
+  {"hss-peer-latency-factor",     required_argument, NULL, HSS_PEER_LATENCY_FACTOR},
+  {"hss-peer-degraded-time",      required_argument, NULL, HSS_PEER_DEGRADED_TIME},
+  {"hss-circuit-breaker-percent", required_argument, NULL, HSS_CIRCUIT_BREAKER_PERCENT},
+  {"hss-circuit-breaker-min-requests", required_argument, NULL, HSS_CIRCUIT_BREAKER_MIN_REQUESTS},
+  {"hss-circuit-breaker-open-ms", required_argument, NULL, HSS_CIRCUIT_BREAKER_OPEN_MS},
+  {"default-request-timeout-ms",  required_argument, NULL, DEFAULT_REQUEST_TIMEOUT_MS},
+  {"max-sprout-deregistrations",  required_argument, NULL, MAX_SPROUT_DEREGISTRATIONS},
+  {"offload-diameter-handlers",   no_argument,       NULL, OFFLOAD_DIAMETER_HANDLERS},
+  {"batch-pprs",                  no_argument,       NULL, BATCH_PPRS},
+  {"incremental-irs-updates",     no_argument,       NULL, INCREMENTAL_IRS_UPDATES},
+  {"bulk-deregistration-concurrency", required_argument, NULL, BULK_DEREGISTRATION_CONCURRENCY},
+  {"bulk-deregistration-target-latency-ms", required_argument, NULL, BULK_DEREGISTRATION_TARGET_LATENCY_MS},
+  {"bulk-deregistration-secret-file", required_argument, NULL, BULK_DEREGISTRATION_SECRET_FILE},
+  {"reg-data-compression-threshold", required_argument, NULL, REG_DATA_COMPRESSION_THRESHOLD},
+  {"reg-data-cache-mb",           required_argument, NULL, REG_DATA_CACHE_MB},
+  {"stream-reg-data",             no_argument,       NULL, STREAM_REG_DATA},
   {NULL,                          0,                 NULL, 0},
 };
 
@@ -212,6 +339,127 @@ void usage(void)
        "                            The amount of time to blacklist an HTTP peer when it is unresponsive.\n"
        " --diameter-blacklist-duration <secs>\n"
        "                            The amount of time to blacklist a Diameter peer when it is unresponsive.\n"
+       "     --hot-key-snapshot-file <file>\n"
+       "                            File in which to periodically save the most frequently requested\n"
+       "                            public IDs, used to warm up the cache after a restart (default: none)\n"
+       "     --hot-key-count N      Number of public IDs to save in the hot key snapshot (default: 1000)\n"
+       "     --hot-key-snapshot-interval <secs>\n"
+       "                            How often to save the hot key snapshot (default: 300)\n"
+       "     --warm-up-rate N       Maximum number of hot public IDs to prefetch per second at startup\n"
+       "                            (default: 50, 0 disables warm-up)\n"
+       "     --hss-reregistration-jitter <secs>\n"
+       "                            Maximum per-subscriber offset added to the RE_REGISTRATION SAR interval,\n"
+       "                            to spread SARs out over time (default: 0)\n"
+       "     --max-reregistration-sar-rate N\n"
+       "                            Maximum number of RE_REGISTRATION SARs to send to the HSS per second.\n"
+       "                            Re-registrations over this rate are deferred (default: 0, unlimited)\n"
+       "     --aka-vector-batch-size N\n"
+       "                            Number of AKA vectors to request from the HSS in each Multimedia-Auth\n"
+       "                            request, keeping the unused ones for later requests (default: 1)\n"
+       "     --aka-vector-low-water N\n"
+       "                            Request more AKA vectors from the HSS when fewer than this many are\n"
+       "                            held for a private ID (default: 1)\n"
+       "     --aka-vector-ttl <secs>\n"
+       "                            How long an unused AKA vector may be held for (default: 30)\n"
+       "     --digest-av-cache-ttl <secs>\n"
+       "                            When using an HSS, how long to cache digest vectors from Multimedia-Auth\n"
+       "                            answers for, rather than querying the HSS each time (default: 0, disabled)\n"
+       "     --digest-av-cache-size <KB>\n"
+       "                            Memory budget for cached digest vectors (default: 10240)\n"
+       "     --digest-av-cache-cassandra\n"
+       "                            Also store cached digest vectors in Cassandra, so that they are shared\n"
+       "                            between Homestead nodes\n"
+       "     --icscf-cache-ttl <secs>\n"
+       "                            When using an HSS, how long to cache the S-CSCF assigned in User-Authorization\n"
+       "                            and Location-Info answers for (default: 0, disabled)\n"
+       "     --icscf-cache-size N\n"
+       "                            Maximum number of cached User-Authorization and Location-Info answers\n"
+       "                            (default: 10000)\n"
+       "     --coalesce-hss-requests\n"
+       "                            Send only one of any identical User-Authorization, Location-Info or\n"
+       "                            digest Multimedia-Auth requests that are in flight at the same time,\n"
+       "                            and give its answer to all of them\n"
+       "     --serialize-reg-data\n"
+       "                            Process registration data updates for each public ID one at a time, so\n"
+       "                            that overlapping requests from Sprout don't send duplicate\n"
+       "                            Server-Assignment requests\n"
+       "     --hss-concurrency-limit N\n"
+       "                            When using an HSS, the most Cx requests to have outstanding to it at\n"
+       "                            once. The limit adapts downwards when the HSS is slow or busy, and\n"
+       "                            requests over it are queued (default: 0, unlimited)\n"
+       "     --hss-queue-size N\n"
+       "                            How many Cx requests can be queued when the HSS concurrency limit is\n"
+       "                            reached (default: 100)\n"
+       "     --adaptive-diameter-timeout\n"
+       "                            Time out each type of Diameter request to the HSS based on the recent\n"
+       "                            latency of that type of request, rather than after --diameter-timeout-ms\n"
+       "     --diameter-timeout-floor-ms <msecs>\n"
+       "                            The shortest adaptive Diameter timeout (default: 20)\n"
+       "     --diameter-timeout-ceiling-ms <msecs>\n"
+       "                            The longest adaptive Diameter timeout (default: 2000)\n"
+       "     --diameter-timeout-factor N\n"
+       "                            The adaptive Diameter timeout is this multiple of the 99th percentile\n"
+       "                            latency (default: 2.0)\n"
+       "     --hedge-percentile N\n"
+       "                            Send a second copy of a UAR, LIR or digest MAR to the HSS if it hasn't been\n"
+       "                            answered within this percentile of recent latency for that type of\n"
+       "                            request (default: 0, meaning never)\n"
+       "     --hedge-budget-percent N\n"
+       "                            The most hedged requests to send, as a percentage of the requests that\n"
+       "                            could be hedged (default: 5)\n"
+       "     --hss-peer-selection\n"
+       "                            Send each Cx request to the HSS peer that is answering fastest, rather\n"
+       "                            than leaving it to realm routing (ignored if --dest-host is set)\n"
+       "     --hss-peer-latency-factor N\n"
+       "                            Stop using an HSS peer for a while if its latency is more than this\n"
+       "                            multiple of the fastest peer's (default: 4.0)\n"
+       "     --hss-peer-degraded-time <secs>\n"
+       "                            How long to stop using a slow or failing HSS peer for (default: 30)\n"
+       "     --hss-circuit-breaker-percent N\n"
+       "                            Stop sending Cx requests for a while, and fail them straight away, if\n"
+       "                            this percentage of recent requests to the HSS failed (default: 0, disabled)\n"
+       "     --hss-circuit-breaker-min-requests N\n"
+       "                            The number of recent Cx requests needed before the HSS circuit breaker\n"
+       "                            can open (default: 20)\n"
+       "     --hss-circuit-breaker-open-ms <ms>\n"
+       "                            How long the HSS circuit breaker stays open before probing the HSS\n"
+       "                            again (default: 5000)\n"
+       "     --default-request-timeout-ms <ms>\n"
+       "                            How long to assume the requester will wait for an answer, if it doesn't\n"
+       "                            say in an X-Request-Timeout header. Work on requests that have run out of\n"
+       "                            time is abandoned (default: 0, no limit)\n"
+       "     --max-sprout-deregistrations N\n"
+       "                            The number of deregistration requests that can be outstanding to Sprout\n"
+       "                            at once. Deregistrations queued behind them are combined into fewer\n"
+       "                            requests. 0 sends each one synchronously (default: 4)\n"
+       "     --offload-diameter-handlers\n"
+       "                            Process Diameter requests and answers on a pool of handler threads (one\n"
+       "                            per core), so that the Diameter threads only decode and queue them\n"
+       "     --batch-pprs\n"
+       "                            Apply Push-Profile requests that arrive for a private ID while an\n"
+       "                            earlier one is being applied in a single cache update\n"
+       "     --incremental-irs-updates\n"
+       "                            Compare new IMS subscriptions from the HSS with the cached ones, removing\n"
+       "                            public IDs that have left the IRS and skipping unchanged subscriptions\n"
+       "     --bulk-deregistration-concurrency N\n"
+       "                            Enable the /admin/deregister interface, running up to N deregistrations\n"
+       "                            from it at once (default: 0, disabled)\n"
+       "     --bulk-deregistration-target-latency-ms N\n"
+       "                            Back off bulk deregistrations when each takes longer than N ms\n"
+       "                            (default: 100)\n"
+       "     --bulk-deregistration-secret-file <file>\n"
+       "                            File holding the secret that /admin/deregister requests must present\n"
+       "                            as \"Authorization: Bearer <secret>\" (required with\n"
+       "                            --bulk-deregistration-concurrency)\n"
+       "     --reg-data-compression-threshold N\n"
+       "                            Gzip reg-data responses of at least N bytes for clients that accept\n"
+       "                            it (default: 0, disabled)\n"
+       "     --reg-data-cache-mb N\n"
+       "                            Cache up to N MB of recently sent reg-data response bodies\n"
+       "                            (default: 0, disabled)\n"
+       "     --stream-reg-data\n"
+       "                            Build reg-data responses by copying the IMS subscription into them,\n"
+       "                            rather than parsing it and printing it again\n"
        " -F, --log-file <directory>\n"
        "                            Log to file in specified directory\n"
        " -L, --log-level N          Set log level to N (default: 4)\n"
@@ -438,6 +686,244 @@ int init_options(int argc, char**argv, struct options& options)
                options.diameter_blacklist_duration);
       break;
 
+    case HOT_KEY_SNAPSHOT_FILE:
+      TRC_INFO("Hot key snapshot file: %s", optarg);
+      options.hot_key_snapshot_file = std::string(optarg);
+      break;
+
+    case HOT_KEY_COUNT:
+      options.hot_key_count = atoi(optarg);
+      if (options.hot_key_count <= 0)
+      {
+        TRC_ERROR("Invalid --hot-key-count option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case HOT_KEY_SNAPSHOT_INTERVAL:
+      options.hot_key_snapshot_interval = atoi(optarg);
+      if (options.hot_key_snapshot_interval <= 0)
+      {
+        TRC_ERROR("Invalid --hot-key-snapshot-interval option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case WARM_UP_RATE:
+      options.warm_up_rate = atoi(optarg);
+      TRC_INFO("Warm-up rate set to %d", options.warm_up_rate);
+      break;
+
+    case HSS_REREGISTRATION_JITTER:
+      options.hss_reregistration_jitter = atoi(optarg);
+      TRC_INFO("HSS re-registration jitter set to %d", options.hss_reregistration_jitter);
+      break;
+
+    case MAX_REREGISTRATION_SAR_RATE:
+      options.max_reregistration_sar_rate = atof(optarg);
+      TRC_INFO("Maximum RE_REGISTRATION SAR rate set to %f", options.max_reregistration_sar_rate);
+      break;
+
+    case AKA_VECTOR_BATCH_SIZE:
+      options.aka_vector_batch_size = atoi(optarg);
+      if (options.aka_vector_batch_size <= 0)
+      {
+        TRC_ERROR("Invalid --aka-vector-batch-size option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("AKA vector batch size set to %d", options.aka_vector_batch_size);
+      break;
+
+    case AKA_VECTOR_LOW_WATER:
+      options.aka_vector_low_water = atoi(optarg);
+      TRC_INFO("AKA vector low-water mark set to %d", options.aka_vector_low_water);
+      break;
+
+    case AKA_VECTOR_TTL:
+      options.aka_vector_ttl = atoi(optarg);
+      TRC_INFO("AKA vector TTL set to %d", options.aka_vector_ttl);
+      break;
+
+    case DIGEST_AV_CACHE_TTL:
+      options.digest_av_cache_ttl = atoi(optarg);
+      TRC_INFO("Digest AV cache TTL set to %d", options.digest_av_cache_ttl);
+      break;
+
+    case DIGEST_AV_CACHE_SIZE:
+      options.digest_av_cache_size = atoi(optarg);
+      TRC_INFO("Digest AV cache size set to %dKB", options.digest_av_cache_size);
+      break;
+
+    case DIGEST_AV_CACHE_CASSANDRA:
+      TRC_INFO("Digest vectors will also be cached in Cassandra");
+      options.digest_av_cache_cassandra = true;
+      break;
+
+    case ICSCF_CACHE_TTL:
+      options.icscf_cache_ttl = atoi(optarg);
+      TRC_INFO("I-CSCF answer cache TTL set to %d", options.icscf_cache_ttl);
+      break;
+
+    case ICSCF_CACHE_SIZE:
+      options.icscf_cache_size = atoi(optarg);
+      TRC_INFO("I-CSCF answer cache size set to %d", options.icscf_cache_size);
+      break;
+
+    case COALESCE_HSS_REQUESTS:
+      TRC_INFO("Identical HSS requests will be coalesced");
+      options.coalesce_hss_requests = true;
+      break;
+
+    case SERIALIZE_REG_DATA:
+      TRC_INFO("Registration data updates will be serialized");
+      options.serialize_reg_data = true;
+      break;
+
+    case HSS_CONCURRENCY_LIMIT:
+      options.hss_concurrency_limit = atoi(optarg);
+      TRC_INFO("HSS concurrency limit set to %d", options.hss_concurrency_limit);
+      break;
+
+    case HSS_QUEUE_SIZE:
+      options.hss_queue_size = atoi(optarg);
+      TRC_INFO("HSS queue size set to %d", options.hss_queue_size);
+      break;
+
+    case ADAPTIVE_DIAMETER_TIMEOUT:
+      TRC_INFO("Diameter timeouts will adapt to HSS latency");
+      options.adaptive_diameter_timeout = true;
+      break;
+
+    case DIAMETER_TIMEOUT_FLOOR_MS:
+      options.diameter_timeout_floor_ms = atoi(optarg);
+      if (options.diameter_timeout_floor_ms <= 0)
+      {
+        TRC_ERROR("Invalid --diameter-timeout-floor-ms option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Diameter timeout floor set to %d", options.diameter_timeout_floor_ms);
+      break;
+
+    case DIAMETER_TIMEOUT_CEILING_MS:
+      options.diameter_timeout_ceiling_ms = atoi(optarg);
+      if (options.diameter_timeout_ceiling_ms <= 0)
+      {
+        TRC_ERROR("Invalid --diameter-timeout-ceiling-ms option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Diameter timeout ceiling set to %d", options.diameter_timeout_ceiling_ms);
+      break;
+
+    case DIAMETER_TIMEOUT_FACTOR:
+      options.diameter_timeout_factor = atof(optarg);
+      if (options.diameter_timeout_factor <= 0)
+      {
+        TRC_ERROR("Invalid --diameter-timeout-factor option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Diameter timeout factor set to %f", options.diameter_timeout_factor);
+      break;
+
+    case HEDGE_PERCENTILE:
+      options.hedge_percentile = atoi(optarg);
+      TRC_INFO("Hedge percentile set to %d", options.hedge_percentile);
+      break;
+
+    case HEDGE_BUDGET_PERCENT:
+      options.hedge_budget_percent = atoi(optarg);
+      TRC_INFO("Hedge budget set to %d%%", options.hedge_budget_percent);
+      break;
+
+    case HSS_PEER_SELECTION:
+      TRC_INFO("HSS peers will be chosen by latency");
+      options.hss_peer_selection = true;
+      break;
+
+    case HSS_PEER_LATENCY_FACTOR:
+      options.hss_peer_latency_factor = atof(optarg);
+      TRC_INFO("HSS peer latency factor set to %f", options.hss_peer_latency_factor);
+      break;
+
+    case HSS_PEER_DEGRADED_TIME:
+      options.hss_peer_degraded_time = atoi(optarg);
+      TRC_INFO("HSS peer degraded time set to %d", options.hss_peer_degraded_time);
+      break;
+
+    case HSS_CIRCUIT_BREAKER_PERCENT:
+      options.hss_circuit_breaker_percent = atoi(optarg);
+      TRC_INFO("HSS circuit breaker failure percentage set to %d", options.hss_circuit_breaker_percent);
+      break;
+
+    case HSS_CIRCUIT_BREAKER_MIN_REQUESTS:
+      options.hss_circuit_breaker_min_requests = atoi(optarg);
+      TRC_INFO("HSS circuit breaker minimum requests set to %d", options.hss_circuit_breaker_min_requests);
+      break;
+
+    case HSS_CIRCUIT_BREAKER_OPEN_MS:
+      options.hss_circuit_breaker_open_ms = atoi(optarg);
+      TRC_INFO("HSS circuit breaker open time set to %d", options.hss_circuit_breaker_open_ms);
+      break;
+
+    case DEFAULT_REQUEST_TIMEOUT_MS:
+      options.default_request_timeout_ms = atoi(optarg);
+      TRC_INFO("Default request timeout set to %d", options.default_request_timeout_ms);
+      break;
+
+    case MAX_SPROUT_DEREGISTRATIONS:
+      options.max_sprout_deregistrations = atoi(optarg);
+      TRC_INFO("Maximum outstanding Sprout deregistrations set to %d", options.max_sprout_deregistrations);
+      break;
+
+    case OFFLOAD_DIAMETER_HANDLERS:
+      TRC_INFO("Diameter handlers will run on handler threads");
+      options.offload_diameter_handlers = true;
+      break;
+
+    case BATCH_PPRS:
+      TRC_INFO("Push-Profile requests will be batched");
+      options.batch_pprs = true;
+      break;
+
+    case INCREMENTAL_IRS_UPDATES:
+      TRC_INFO("IMS subscription updates will be incremental");
+      options.incremental_irs_updates = true;
+      break;
+
+    case BULK_DEREGISTRATION_CONCURRENCY:
+      options.bulk_deregistration_concurrency = atoi(optarg);
+      TRC_INFO("Bulk deregistration concurrency set to %d",
+               options.bulk_deregistration_concurrency);
+      break;
+
+    case BULK_DEREGISTRATION_TARGET_LATENCY_MS:
+      options.bulk_deregistration_target_latency_ms = atoi(optarg);
+      TRC_INFO("Bulk deregistration target latency set to %dms",
+               options.bulk_deregistration_target_latency_ms);
+      break;
+
+    case BULK_DEREGISTRATION_SECRET_FILE:
+      options.bulk_deregistration_secret_file = std::string(optarg);
+      TRC_INFO("Bulk deregistration secret file set to %s",
+               options.bulk_deregistration_secret_file.c_str());
+      break;
+
+    case REG_DATA_COMPRESSION_THRESHOLD:
+      options.reg_data_compression_threshold = atoi(optarg);
+      TRC_INFO("Reg-data compression threshold set to %d bytes",
+               options.reg_data_compression_threshold);
+      break;
+
+    case REG_DATA_CACHE_MB:
+      options.reg_data_cache_mb = atoi(optarg);
+      TRC_INFO("Reg-data body cache size set to %dMB",
+               options.reg_data_cache_mb);
+      break;
+
+    case STREAM_REG_DATA:
+      TRC_INFO("Reg-data responses will be streamed");
+      options.stream_reg_data = true;
+      break;
+
     case 'F':
     case 'L':
       // Ignore F and L - these are handled by init_logging_options
@@ -454,6 +940,23 @@ int init_options(int argc, char**argv, struct options& options)
     }
   }
 
+  if (options.diameter_timeout_floor_ms > options.diameter_timeout_ceiling_ms)
+  {
+    TRC_ERROR("--diameter-timeout-floor-ms (%d) is greater than --diameter-timeout-ceiling-ms (%d)",
+              options.diameter_timeout_floor_ms,
+              options.diameter_timeout_ceiling_ms);
+    return -1;
+  }
+
+  // The bulk deregistration interface is on the same HTTP listener as
+  // Sprout's requests, so it mustn't be enabled without a secret.
+  if ((options.bulk_deregistration_concurrency > 0) &&
+      (options.bulk_deregistration_secret_file.empty()))
+  {
+    TRC_ERROR("--bulk-deregistration-concurrency requires --bulk-deregistration-secret-file");
+    return -1;
+  }
+
   return 0;
 }
 
@@ -536,6 +1039,47 @@ int main(int argc, char**argv)
   options.exception_max_ttl = 600;
   options.http_blacklist_duration = HttpResolver::DEFAULT_BLACKLIST_DURATION;
   options.diameter_blacklist_duration = DiameterResolver::DEFAULT_BLACKLIST_DURATION;
+  options.hot_key_snapshot_file = "";
+  options.hot_key_count = 1000;
+  options.hot_key_snapshot_interval = 300;
+  options.warm_up_rate = 50;
+  options.hss_reregistration_jitter = 0;
+  options.max_reregistration_sar_rate = 0;
+  options.aka_vector_batch_size = 1;
+  options.aka_vector_low_water = 1;
+  options.aka_vector_ttl = 30;
+  options.digest_av_cache_ttl = 0;
+  options.digest_av_cache_size = 10240;
+  options.digest_av_cache_cassandra = false;
+  options.icscf_cache_ttl = 0;
+  options.icscf_cache_size = 10000;
+  options.coalesce_hss_requests = false;
+  options.serialize_reg_data = false;
+  options.hss_concurrency_limit = 0;
+  options.hss_queue_size = 100;
+  options.adaptive_diameter_timeout = false;
+  options.diameter_timeout_floor_ms = 20;
+  options.diameter_timeout_ceiling_ms = 2000;
+  options.diameter_timeout_factor = 2.0;
+  options.hedge_percentile = 0;
+  options.hedge_budget_percent = 5;
+  options.hss_peer_selection = false;
+  options.hss_peer_latency_factor = 4.0;
+  options.hss_peer_degraded_time = 30;
+  options.hss_circuit_breaker_percent = 0;
+  options.hss_circuit_breaker_min_requests = 20;
+  options.hss_circuit_breaker_open_ms = 5000;
+  options.default_request_timeout_ms = 0;
+  options.max_sprout_deregistrations = 4;
+  options.offload_diameter_handlers = false;
+  options.batch_pprs = false;
+  options.incremental_irs_updates = false;
+  options.bulk_deregistration_concurrency = 0;
+  options.bulk_deregistration_target_latency_ms = 100;
+  options.bulk_deregistration_secret_file = "";
+  options.reg_data_compression_threshold = 0;
+  options.reg_data_cache_mb = 0;
+  options.stream_reg_data = false;
 
   boost::filesystem::path p = argv[0];
   // Copy the filename to a string so that we can be sure of its lifespan -
@@ -683,6 +1227,10 @@ int main(int argc, char**argv)
                                             SASEvent::HttpLogLevel::PROTOCOL,
                                             NULL);
   SproutConnection* sprout_conn = new SproutConnection(http);
+  if (options.max_sprout_deregistrations > 0)
+  {
+    sprout_conn->start(options.max_sprout_deregistrations);
+  }
 
   RegistrationTerminationTask::Config* rtr_config = NULL;
   PushProfileTask::Config* ppr_config = NULL;
@@ -703,7 +1251,7 @@ int main(int argc, char**argv)
     dict = new Cx::Dictionary();
 
     rtr_config = new RegistrationTerminationTask::Config(cache, dict, sprout_conn, options.hss_reregistration_time);
-    ppr_config = new PushProfileTask::Config(cache, dict, options.impu_cache_ttl, options.hss_reregistration_time);
+    ppr_config = new PushProfileTask::Config(cache, dict, options.impu_cache_ttl, options.hss_reregistration_time, options.hss_reregistration_jitter);
     rtr_task = new Diameter::SpawningHandler<RegistrationTerminationTask, RegistrationTerminationTask::Config>(dict, rtr_config);
     ppr_task = new Diameter::SpawningHandler<PushProfileTask, PushProfileTask::Config>(dict, ppr_config);
 
@@ -733,6 +1281,16 @@ int main(int argc, char**argv)
   HssCacheTask::configure_health_checker(hc);
   HssCacheTask::configure_stats(stats_manager);
 
+  // Track the hottest public IDs so we can warm up quickly after a restart.
+  HotKeyTracker* hot_key_tracker = NULL;
+  if (!options.hot_key_snapshot_file.empty())
+  {
+    hot_key_tracker = new HotKeyTracker(options.hot_key_snapshot_file,
+                                        options.hot_key_count,
+                                        options.hot_key_snapshot_interval);
+    HssCacheTask::configure_hot_key_tracker(hot_key_tracker);
+  }
+
   // We should only query the cache for AV information if there is no HSS.  If there is an HSS, we
   // should always hit it.  If there is not, the AV information must have been provisioned in the
   // "cache" (which becomes persistent).
@@ -746,8 +1304,180 @@ int main(int argc, char**argv)
                                        options.diameter_timeout_ms);
   ImpiRegistrationStatusTask::Config registration_status_handler_config(hss_configured, options.diameter_timeout_ms);
   ImpuLocationInfoTask::Config location_info_handler_config(hss_configured, options.diameter_timeout_ms);
-  ImpuRegDataTask::Config impu_handler_config(hss_configured, options.hss_reregistration_time, options.diameter_timeout_ms);
-  ImpuIMSSubscriptionTask::Config impu_handler_config_old(hss_configured, options.hss_reregistration_time, options.diameter_timeout_ms);
+  ImpuRegDataTask::Config impu_handler_config(hss_configured, options.hss_reregistration_time, options.diameter_timeout_ms, options.hss_reregistration_jitter);
+  ImpuIMSSubscriptionTask::Config impu_handler_config_old(hss_configured, options.hss_reregistration_time, options.diameter_timeout_ms, options.hss_reregistration_jitter);
+  ImpuRegDataTask::configure_reregistration_sar_rate(options.max_reregistration_sar_rate);
+
+  // If we're asking the HSS for more than one AKA vector at a time, pool the
+  // ones we don't use straight away.
+  AkaVectorPool* aka_vector_pool = NULL;
+  if ((hss_configured) && (options.aka_vector_batch_size > 1))
+  {
+    aka_vector_pool = new AkaVectorPool(options.aka_vector_batch_size,
+                                        options.aka_vector_low_water,
+                                        options.aka_vector_ttl);
+    ImpiTask::configure_aka_vector_pool(aka_vector_pool);
+  }
+
+  // Optionally cache digest vectors from the HSS for a short time, so that
+  // frequent re-registrations don't each need a Multimedia-Auth request.
+  DigestAvCache* digest_av_cache = NULL;
+  if ((hss_configured) && (options.digest_av_cache_ttl > 0))
+  {
+    digest_av_cache = new DigestAvCache(options.digest_av_cache_ttl,
+                                        (size_t)options.digest_av_cache_size * 1024,
+                                        options.digest_av_cache_cassandra);
+    ImpiTask::configure_digest_av_cache(digest_av_cache);
+  }
+
+  // Optionally cache the S-CSCF the HSS assigns in answers to I-CSCF queries.
+  IcscfCache* icscf_cache = NULL;
+  if ((hss_configured) && (options.icscf_cache_ttl > 0))
+  {
+    icscf_cache = new IcscfCache(options.icscf_cache_ttl,
+                                 options.icscf_cache_size);
+    HssCacheTask::configure_icscf_cache(icscf_cache);
+  }
+
+  HssCacheTask::configure_request_coalescing(options.coalesce_hss_requests);
+  ImpuRegDataTask::configure_reg_data_serialization(options.serialize_reg_data);
+  PushProfileTask::configure_ppr_batching(options.batch_pprs);
+  ImpuRegDataTask::configure_incremental_irs_updates(options.incremental_irs_updates);
+  ImpuRegDataTask::configure_reg_data_streaming(options.stream_reg_data);
+  PushProfileTask::configure_incremental_irs_updates(options.incremental_irs_updates);
+  HssCacheTask::configure_default_deadline(options.default_request_timeout_ms);
+
+  // Optionally compress large reg-data responses.
+  ResponseCompressor* response_compressor = NULL;
+  if (options.reg_data_compression_threshold > 0)
+  {
+    response_compressor = new ResponseCompressor(options.reg_data_compression_threshold);
+    ImpuRegDataTask::configure_response_compression(response_compressor);
+  }
+
+  // Optionally cache the reg-data response bodies, to save rebuilding them.
+  RegDataCache* reg_data_cache = NULL;
+  if (options.reg_data_cache_mb > 0)
+  {
+    reg_data_cache = new RegDataCache((size_t)options.reg_data_cache_mb * 1024 * 1024);
+    ImpuRegDataTask::configure_reg_data_cache(reg_data_cache);
+  }
+
+  // Optionally move handler work off the Diameter threads.
+  HandlerExecutor* handler_executor = NULL;
+  if (options.offload_diameter_handlers)
+  {
+    handler_executor = new HandlerExecutor(sysconf(_SC_NPROCESSORS_ONLN),
+                                           stats_manager);
+    handler_executor->start();
+    HssCacheTask::configure_handler_executor(handler_executor);
+  }
+
+  // Optionally limit the number of Cx requests outstanding to the HSS.
+  CxLimiter* cx_limiter = NULL;
+  if ((hss_configured) && (options.hss_concurrency_limit > 0))
+  {
+    cx_limiter = new CxLimiter(options.hss_concurrency_limit,
+                               options.hss_queue_size,
+                               stats_manager);
+    HssCacheTask::configure_cx_limiter(cx_limiter);
+  }
+
+  // Optionally adapt the timeout for each type of Cx request to the HSS's
+  // recent latency for it.
+  AdaptiveTimeout* mar_timeout = NULL;
+  AdaptiveTimeout* sar_timeout = NULL;
+  AdaptiveTimeout* uar_timeout = NULL;
+  AdaptiveTimeout* lir_timeout = NULL;
+  if ((hss_configured) && (options.adaptive_diameter_timeout))
+  {
+    mar_timeout = new AdaptiveTimeout(options.diameter_timeout_ms,
+                                      options.diameter_timeout_floor_ms,
+                                      options.diameter_timeout_ceiling_ms,
+                                      options.diameter_timeout_factor);
+    sar_timeout = new AdaptiveTimeout(options.diameter_timeout_ms,
+                                      options.diameter_timeout_floor_ms,
+                                      options.diameter_timeout_ceiling_ms,
+                                      options.diameter_timeout_factor);
+    uar_timeout = new AdaptiveTimeout(options.diameter_timeout_ms,
+                                      options.diameter_timeout_floor_ms,
+                                      options.diameter_timeout_ceiling_ms,
+                                      options.diameter_timeout_factor);
+    lir_timeout = new AdaptiveTimeout(options.diameter_timeout_ms,
+                                      options.diameter_timeout_floor_ms,
+                                      options.diameter_timeout_ceiling_ms,
+                                      options.diameter_timeout_factor);
+    HssCacheTask::configure_adaptive_timeouts(mar_timeout,
+                                              sar_timeout,
+                                              uar_timeout,
+                                              lir_timeout);
+  }
+
+  // Optionally hedge idempotent Cx requests that the HSS is slow to answer.
+  // The hedge delay for each type of request tracks a percentile of its
+  // recent latency.
+  CxHedger* cx_hedger = NULL;
+  AdaptiveTimeout* mar_hedge_delay = NULL;
+  AdaptiveTimeout* uar_hedge_delay = NULL;
+  AdaptiveTimeout* lir_hedge_delay = NULL;
+  if ((hss_configured) && (options.hedge_percentile > 0))
+  {
+    cx_hedger = new CxHedger(options.hedge_budget_percent, stats_manager);
+    mar_hedge_delay = new AdaptiveTimeout(options.diameter_timeout_ms,
+                                          1,
+                                          options.diameter_timeout_ms,
+                                          1.0,
+                                          60,
+                                          options.hedge_percentile);
+    uar_hedge_delay = new AdaptiveTimeout(options.diameter_timeout_ms,
+                                          1,
+                                          options.diameter_timeout_ms,
+                                          1.0,
+                                          60,
+                                          options.hedge_percentile);
+    lir_hedge_delay = new AdaptiveTimeout(options.diameter_timeout_ms,
+                                          1,
+                                          options.diameter_timeout_ms,
+                                          1.0,
+                                          60,
+                                          options.hedge_percentile);
+    HssCacheTask::configure_hedging(cx_hedger,
+                                    mar_hedge_delay,
+                                    uar_hedge_delay,
+                                    lir_hedge_delay);
+    cx_hedger->start();
+  }
+
+  // Optionally choose which HSS peer to send each Cx request to.
+  CxPeerSelector* cx_peer_selector = NULL;
+  if ((hss_configured) && (options.hss_peer_selection))
+  {
+    cx_peer_selector = new CxPeerSelector(options.dest_realm.empty() ?
+                                            options.home_domain : options.dest_realm,
+                                          options.hss_peer_latency_factor,
+                                          0.5,
+                                          options.hss_peer_degraded_time);
+    diameter_stack->register_peer_hook_hdlr("cxpeerselector",
+                                            boost::bind(&CxPeerSelector::peer_connection_cb,
+                                                        cx_peer_selector,
+                                                        _1,
+                                                        _2,
+                                                        _3));
+    HssCacheTask::configure_cx_peer_selector(cx_peer_selector);
+  }
+
+  // Optionally fail Cx requests straight away while the HSS is failing most
+  // of them, rather than queueing more work up behind it.
+  CxCircuitBreaker* cx_circuit_breaker = NULL;
+  if ((hss_configured) && (options.hss_circuit_breaker_percent > 0))
+  {
+    cx_circuit_breaker = new CxCircuitBreaker(options.hss_circuit_breaker_percent,
+                                              options.hss_circuit_breaker_min_requests,
+                                              10000,
+                                              options.hss_circuit_breaker_open_ms,
+                                              stats_manager);
+    HssCacheTask::configure_cx_circuit_breaker(cx_circuit_breaker);
+  }
 
   HttpStackUtils::PingHandler ping_handler;
   HttpStackUtils::SpawningHandler<ImpiDigestTask, ImpiTask::Config> impi_digest_handler(&impi_handler_config);
@@ -755,7 +1485,55 @@ int main(int argc, char**argv)
   HttpStackUtils::SpawningHandler<ImpiRegistrationStatusTask, ImpiRegistrationStatusTask::Config> impi_reg_status_handler(&registration_status_handler_config);
   HttpStackUtils::SpawningHandler<ImpuLocationInfoTask, ImpuLocationInfoTask::Config> impu_loc_info_handler(&location_info_handler_config);
   HttpStackUtils::SpawningHandler<ImpuRegDataTask, ImpuRegDataTask::Config> impu_reg_data_handler(&impu_handler_config);
+  HttpStackUtils::SpawningHandler<ImpuRegDataBatchTask, ImpuRegDataBatchTask::Config> impu_reg_data_batch_handler(&impu_handler_config);
   HttpStackUtils::SpawningHandler<ImpuIMSSubscriptionTask, ImpuIMSSubscriptionTask::Config> impu_ims_sub_handler(&impu_handler_config_old);
+  PeerStatusTask::Config peer_status_handler_config;
+  HttpStackUtils::SpawningHandler<PeerStatusTask, PeerStatusTask::Config> peer_status_handler(&peer_status_handler_config);
+
+  // Optionally allow subscribers to be deregistered in bulk. Each
+  // deregistration is sent back into our own HTTP interface, so it's handled
+  // in just the same way as one from Sprout.
+  BulkDeregistrar* bulk_deregistrar = NULL;
+  std::string bulk_deregistration_secret;
+  if (options.bulk_deregistration_concurrency > 0)
+  {
+    std::ifstream secret_file(options.bulk_deregistration_secret_file.c_str());
+    std::getline(secret_file, bulk_deregistration_secret);
+    boost::algorithm::trim(bulk_deregistration_secret);
+    if (bulk_deregistration_secret.empty())
+    {
+      TRC_ERROR("Failed to read bulk deregistration secret from %s",
+                options.bulk_deregistration_secret_file.c_str());
+      TRC_STATUS("Homestead is shutting down");
+      exit(2);
+    }
+
+    std::string local_address = options.http_address;
+    if ((local_address == "0.0.0.0") || (local_address == "::"))
+    {
+      local_address = "127.0.0.1";
+    }
+    else if (local_address.find(':') != std::string::npos)
+    {
+      local_address = "[" + local_address + "]";
+    }
+
+    HttpConnection* local_http =
+      new HttpConnection(local_address + ":" + std::to_string(options.http_port),
+                         false,
+                         http_resolver,
+                         SASEvent::HttpLogLevel::PROTOCOL,
+                         NULL);
+    bulk_deregistrar = new BulkDeregistrar(local_http,
+                                           cache,
+                                           sprout_conn,
+                                           options.bulk_deregistration_concurrency,
+                                           options.bulk_deregistration_target_latency_ms,
+                                           sar_timeout);
+  }
+  BulkDeregistrationTask::Config bulk_dereg_handler_config(bulk_deregistrar,
+                                                          bulk_deregistration_secret);
+  HttpStackUtils::SpawningHandler<BulkDeregistrationTask, BulkDeregistrationTask::Config> bulk_dereg_handler(&bulk_dereg_handler_config);
 
   try
   {
@@ -777,10 +1555,21 @@ int main(int argc, char**argv)
                                     &impi_reg_status_handler);
     http_stack->register_handler("^/impu/[^/]*/location$",
                                     &impu_loc_info_handler);
+    // The batch URL would also match the reg-data one, so must be
+    // registered first.
+    http_stack->register_handler("^/impu/batch/reg-data$",
+                                    &impu_reg_data_batch_handler);
     http_stack->register_handler("^/impu/[^/]*/reg-data$",
                                     &impu_reg_data_handler);
     http_stack->register_handler("^/impu/",
                                     &impu_ims_sub_handler);
+    http_stack->register_handler("^/peers$",
+                                    &peer_status_handler);
+    if (bulk_deregistrar != NULL)
+    {
+      http_stack->register_handler("^/admin/deregister$",
+                                      &bulk_dereg_handler);
+    }
     http_stack->start();
   }
   catch (HttpStack::Exception& e)
@@ -792,6 +1581,18 @@ int main(int argc, char**argv)
     exit(2);
   }
 
+  if (bulk_deregistrar != NULL)
+  {
+    bulk_deregistrar->start();
+  }
+
+  // Start warming up the cache now we're taking traffic - the warm-up is
+  // throttled so it won't compete with real requests.
+  if (hot_key_tracker != NULL)
+  {
+    hot_key_tracker->start(&ImpuRegDataTask::warm_up, options.warm_up_rate);
+  }
+
   DiameterResolver* diameter_resolver = NULL;
   RealmManager* realm_manager = NULL;
   
@@ -814,6 +1615,13 @@ int main(int argc, char**argv)
   TRC_STATUS("Termination signal received - terminating");
   CL_HOMESTEAD_ENDED.log();
 
+  // Bulk deregistrations go through the HTTP stack, so stop them first.
+  if (bulk_deregistrar != NULL)
+  {
+    bulk_deregistrar->stop();
+    delete bulk_deregistrar; bulk_deregistrar = NULL;
+  }
+
   try
   {
     http_stack->stop();
@@ -825,6 +1633,36 @@ int main(int argc, char**argv)
     TRC_ERROR("Failed to stop HttpStack stack - function %s, rc %d", e._func, e._rc);
   }
 
+  if (hot_key_tracker != NULL)
+  {
+    // Stopping the tracker saves a final snapshot for the next startup.
+    hot_key_tracker->stop();
+    HssCacheTask::configure_hot_key_tracker(NULL);
+    delete hot_key_tracker; hot_key_tracker = NULL;
+  }
+
+  ImpuRegDataTask::configure_reregistration_sar_rate(0);
+
+  if (response_compressor != NULL)
+  {
+    ImpuRegDataTask::configure_response_compression(NULL);
+    delete response_compressor; response_compressor = NULL;
+  }
+
+  if (reg_data_cache != NULL)
+  {
+    ImpuRegDataTask::configure_reg_data_cache(NULL);
+    delete reg_data_cache; reg_data_cache = NULL;
+  }
+
+  // Finish off any handler work and deregistrations before the cache and
+  // Diameter stack that they need go away.
+  if (handler_executor != NULL)
+  {
+    handler_executor->stop();
+  }
+  sprout_conn->stop();
+
   cache->stop();
   cache->wait_stopped();
 
@@ -838,6 +1676,38 @@ int main(int argc, char**argv)
     CL_HOMESTEAD_DIAMETER_STOP_FAIL.log(e._func, e._rc);
     TRC_ERROR("Failed to stop Diameter stack - function %s, rc %d", e._func, e._rc);
   }
+  ImpiTask::configure_aka_vector_pool(NULL);
+  delete aka_vector_pool; aka_vector_pool = NULL;
+  ImpiTask::configure_digest_av_cache(NULL);
+  delete digest_av_cache; digest_av_cache = NULL;
+  HssCacheTask::configure_icscf_cache(NULL);
+  delete icscf_cache; icscf_cache = NULL;
+  HssCacheTask::configure_cx_limiter(NULL);
+  delete cx_limiter; cx_limiter = NULL;
+  HssCacheTask::configure_adaptive_timeouts(NULL, NULL, NULL, NULL);
+  delete mar_timeout; mar_timeout = NULL;
+  delete sar_timeout; sar_timeout = NULL;
+  delete uar_timeout; uar_timeout = NULL;
+  delete lir_timeout; lir_timeout = NULL;
+  if (cx_hedger != NULL)
+  {
+    cx_hedger->stop();
+  }
+  HssCacheTask::configure_hedging(NULL, NULL, NULL, NULL);
+  delete cx_hedger; cx_hedger = NULL;
+  delete mar_hedge_delay; mar_hedge_delay = NULL;
+  delete uar_hedge_delay; uar_hedge_delay = NULL;
+  delete lir_hedge_delay; lir_hedge_delay = NULL;
+  if (cx_peer_selector != NULL)
+  {
+    diameter_stack->unregister_peer_hook_hdlr("cxpeerselector");
+  }
+  HssCacheTask::configure_cx_peer_selector(NULL);
+  delete cx_peer_selector; cx_peer_selector = NULL;
+  HssCacheTask::configure_cx_circuit_breaker(NULL);
+  delete cx_circuit_breaker; cx_circuit_breaker = NULL;
+  HssCacheTask::configure_handler_executor(NULL);
+  delete handler_executor; handler_executor = NULL;
   delete dict; dict = NULL;
   delete ppr_config; ppr_config = NULL;
   delete rtr_config; rtr_config = NULL;
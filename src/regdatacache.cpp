@@ -0,0 +1,148 @@
+/**
+ * @file regdatacache.cpp Caches rendered registration data bodies.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "regdatacache.h"
+#include "log.h"
+
+RegDataCache::RegDataCache(size_t max_bytes) :
+  _max_bytes(max_bytes),
+  _bytes(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+RegDataCache::~RegDataCache()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+bool RegDataCache::get(const std::string& key,
+                       const std::string& inputs,
+                       std::string& body)
+{
+  bool found = false;
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, Entries::iterator>::iterator it = _index.find(key);
+  if ((it != _index.end()) && (it->second->inputs == inputs))
+  {
+    // Move the entry to the front of the LRU list.
+    _lru.splice(_lru.begin(), _lru, it->second);
+    body = it->second->body;
+    found = true;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return found;
+}
+
+void RegDataCache::put(const std::string& key,
+                       const std::string& inputs,
+                       const std::string& body)
+{
+  Entry entry;
+  entry.key = key;
+  entry.inputs = inputs;
+  entry.body = body;
+  size_t bytes = entry_bytes(entry);
+
+  if (bytes > _max_bytes)
+  {
+    TRC_DEBUG("Not caching %d byte registration data body", body.length());
+    return;
+  }
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, Entries::iterator>::iterator it = _index.find(key);
+  if ((it != _index.end()) && (it->second->inputs != inputs))
+  {
+    // Different registration data with the same hash. Keep the newer.
+    TRC_DEBUG("Replacing registration data body for %s", key.c_str());
+    remove(it->second);
+    it = _index.end();
+  }
+
+  if (it == _index.end())
+  {
+    _lru.push_front(entry);
+    _index[key] = _lru.begin();
+    _bytes += bytes;
+
+    while (_bytes > _max_bytes)
+    {
+      TRC_DEBUG("Registration data cache full - discarding %s",
+                _lru.back().key.c_str());
+      remove(--_lru.end());
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+// Removes an entry. Must be called with the lock held.
+void RegDataCache::remove(Entries::iterator entry)
+{
+  _bytes -= entry_bytes(*entry);
+  _index.erase(entry->key);
+  _lru.erase(entry);
+}
+
+size_t RegDataCache::size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _lru.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+size_t RegDataCache::bytes()
+{
+  pthread_mutex_lock(&_lock);
+  size_t bytes = _bytes;
+  pthread_mutex_unlock(&_lock);
+  return bytes;
+}
+
+size_t RegDataCache::entry_bytes(const Entry& entry)
+{
+  return (entry.key.length() +
+          entry.inputs.length() +
+          entry.body.length() +
+          ENTRY_OVERHEAD);
+}
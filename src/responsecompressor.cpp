@@ -0,0 +1,227 @@
+/**
+ * @file responsecompressor.cpp Compresses large HTTP response bodies.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdlib.h>
+#include <zlib.h>
+
+#include <vector>
+
+#include "boost/algorithm/string.hpp"
+
+#include "log.h"
+#include "responsecompressor.h"
+
+const std::string ResponseCompressor::GZIP = "gzip";
+
+// Adding 16 to the window bits makes zlib write a gzip header and trailer.
+static const int GZIP_WINDOW_BITS = 15 + 16;
+static const int MEM_LEVEL = 8;
+
+ResponseCompressor::ResponseCompressor(size_t threshold,
+                                       size_t cache_bytes,
+                                       int level) :
+  _threshold(threshold),
+  _level(level),
+  _cache(cache_bytes)
+{
+  // The streams are freed by the destructor rather than when their threads
+  // exit, so that none is left behind whichever goes first.
+  pthread_key_create(&_stream_key, NULL);
+  pthread_mutex_init(&_lock, NULL);
+}
+
+ResponseCompressor::~ResponseCompressor()
+{
+  // Free every thread's stream, not just this one's.
+  for (std::vector<z_stream*>::iterator it = _streams.begin();
+       it != _streams.end();
+       ++it)
+  {
+    free_stream(*it);
+  }
+  pthread_key_delete(_stream_key);
+  pthread_mutex_destroy(&_lock);
+}
+
+bool ResponseCompressor::accepts_gzip(const std::string& accept_encoding)
+{
+  // An explicit entry for gzip takes precedence over "*", and either is
+  // refused by a quality value of zero.
+  bool gzip_listed = false;
+  bool gzip_accepted = false;
+  bool any_accepted = false;
+
+  std::vector<std::string> codings;
+  boost::split(codings, accept_encoding, boost::is_any_of(","));
+
+  for (std::vector<std::string>::iterator it = codings.begin();
+       it != codings.end();
+       ++it)
+  {
+    std::vector<std::string> params;
+    boost::split(params, *it, boost::is_any_of(";"));
+    std::string coding = boost::algorithm::trim_copy(params[0]);
+
+    bool accepted = true;
+    for (size_t ii = 1; ii < params.size(); ii++)
+    {
+      std::string param = boost::algorithm::trim_copy(params[ii]);
+      if ((param.compare(0, 2, "q=") == 0) &&
+          (atof(param.substr(2).c_str()) <= 0))
+      {
+        accepted = false;
+      }
+    }
+
+    if ((boost::iequals(coding, GZIP)) || (boost::iequals(coding, "x-gzip")))
+    {
+      gzip_listed = true;
+      gzip_accepted = accepted;
+    }
+    else if (coding == "*")
+    {
+      any_accepted = accepted;
+    }
+  }
+
+  return gzip_listed ? gzip_accepted : any_accepted;
+}
+
+bool ResponseCompressor::lookup(const std::string& key,
+                                const std::string& inputs,
+                                std::string& compressed)
+{
+  bool found = _cache.get(key, inputs, compressed);
+
+  if (found)
+  {
+    TRC_DEBUG("Using cached compressed body for %s", key.c_str());
+  }
+
+  return found;
+}
+
+bool ResponseCompressor::compress(const std::string& key,
+                                  const std::string& inputs,
+                                  const std::string& body,
+                                  std::string& compressed)
+{
+  if (body.length() < _threshold)
+  {
+    return false;
+  }
+
+  if ((!key.empty()) && (lookup(key, inputs, compressed)))
+  {
+    return true;
+  }
+
+  if (!deflate_body(body, compressed))
+  {
+    return false;
+  }
+
+  TRC_DEBUG("Compressed %d byte body to %d bytes",
+            body.length(), compressed.length());
+
+  if (!key.empty())
+  {
+    _cache.put(key, inputs, compressed);
+  }
+
+  return true;
+}
+
+bool ResponseCompressor::deflate_body(const std::string& body,
+                                      std::string& compressed)
+{
+  z_stream* stream = (z_stream*)pthread_getspecific(_stream_key);
+  if (stream == NULL)
+  {
+    stream = new z_stream();
+    if (deflateInit2(stream,
+                     _level,
+                     Z_DEFLATED,
+                     GZIP_WINDOW_BITS,
+                     MEM_LEVEL,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to initialize zlib stream");
+      delete stream;
+      return false;
+      // LCOV_EXCL_STOP
+    }
+    pthread_setspecific(_stream_key, stream);
+
+    pthread_mutex_lock(&_lock);
+    _streams.push_back(stream);
+    pthread_mutex_unlock(&_lock);
+  }
+  else
+  {
+    deflateReset(stream);
+  }
+
+  std::vector<char> buffer(deflateBound(stream, body.length()));
+  stream->next_in = (Bytef*)body.data();
+  stream->avail_in = body.length();
+  stream->next_out = (Bytef*)buffer.data();
+  stream->avail_out = buffer.size();
+
+  if (deflate(stream, Z_FINISH) != Z_STREAM_END)
+  {
+    // LCOV_EXCL_START - deflateBound leaves enough room.
+    TRC_WARNING("Failed to compress %d byte body", body.length());
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  // Don't bother if compression hasn't made the body any smaller.
+  if (stream->total_out >= body.length())
+  {
+    return false;
+  }
+
+  compressed.assign(buffer.data(), stream->total_out);
+  return true;
+}
+
+void ResponseCompressor::free_stream(z_stream* stream)
+{
+  deflateEnd(stream);
+  delete stream;
+}
@@ -34,6 +34,8 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <string.h>
+
 #include "log.h"
 #include "sproutconnection.h"
 
@@ -45,12 +47,20 @@ const std::string SproutConnection::JSON_REGISTRATIONS = "registrations";
 const std::string SproutConnection::JSON_PRIMARY_IMPU = "primary-impu";
 const std::string SproutConnection::JSON_IMPI = "impi";
 
-SproutConnection::SproutConnection(HttpConnection* http) : _http(http)
+SproutConnection::SproutConnection(HttpConnection* http) :
+  _http(http),
+  _terminated(false)
 {
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
 }
 
 SproutConnection::~SproutConnection()
 {
+  stop();
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+
   delete _http;
   _http = NULL;
 }
@@ -59,17 +69,149 @@ HTTPCode SproutConnection::deregister_bindings(const bool& send_notifications,
                                                const std::vector<std::string>& default_public_ids,
                                                const std::vector<std::string>& impis,
                                                SAS::TrailId trail)
+{
+  return send_delete(send_notifications,
+                     create_body(default_public_ids, impis),
+                     trail);
+}
+
+void SproutConnection::deregister_bindings_async(bool send_notifications,
+                                                 const std::vector<std::string>& default_public_ids,
+                                                 const std::vector<std::string>& impis,
+                                                 SAS::TrailId trail,
+                                                 deregister_clbk_t clbk)
+{
+  pthread_mutex_lock(&_lock);
+
+  if (_threads.empty())
+  {
+    // No background threads, so just send the request now.
+    pthread_mutex_unlock(&_lock);
+    clbk(deregister_bindings(send_notifications,
+                             default_public_ids,
+                             impis,
+                             trail));
+    return;
+  }
+
+  Deregistration dereg;
+  dereg.send_notifications = send_notifications;
+  dereg.default_public_ids = default_public_ids;
+  dereg.impis = impis;
+  dereg.trail = trail;
+  dereg.clbk = clbk;
+  _queue.push_back(dereg);
+
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+void SproutConnection::start(int max_outstanding)
+{
+  pthread_mutex_lock(&_lock);
+  _terminated = false;
+
+  for (int ii = 0; ii < max_outstanding; ii++)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, &SproutConnection::thread_entry_point, this);
+    if (rc == 0)
+    {
+      _threads.push_back(thread);
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start Sprout connection thread: %s", strerror(rc));
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void SproutConnection::stop()
+{
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_broadcast(&_cond);
+  std::vector<pthread_t> threads;
+  threads.swap(_threads);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::vector<pthread_t>::iterator it = threads.begin();
+       it != threads.end();
+       ++it)
+  {
+    pthread_join(*it, NULL);
+  }
+
+  // Fail anything the threads didn't get round to sending.
+  pthread_mutex_lock(&_lock);
+  std::deque<Deregistration> queue;
+  queue.swap(_queue);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::deque<Deregistration>::iterator it = queue.begin();
+       it != queue.end();
+       ++it)
+  {
+    it->clbk(HTTP_SERVER_UNAVAILABLE);
+  }
+}
+
+HTTPCode SproutConnection::send_delete(bool send_notifications,
+                                       const std::string& body,
+                                       SAS::TrailId trail)
 {
   std::string path = "/registrations?send-notifications=";
   path += send_notifications ? "true" : "false";
 
-  std::string body = create_body(default_public_ids, impis);
-
   HTTPCode ret_code = _http->send_delete(path, trail, body);
   TRC_DEBUG("HTTP return code from Sprout: %d", ret_code);
   return ret_code;
 }
 
+// Adds the registrations to deregister to the JSON body being built.
+static void write_registrations(rapidjson::Writer<rapidjson::StringBuffer>& writer,
+                                const std::vector<std::string>& default_public_ids,
+                                const std::vector<std::string>& impis)
+{
+  for (std::vector<std::string>::const_iterator i = default_public_ids.begin();
+       i != default_public_ids.end();
+       i++)
+  {
+    // If we have any IMPIs specified, we need to send pairs of
+    // default public IDs and private IDs. Otherwise just send a list
+    // of private IDs.
+    if (impis.empty())
+    {
+      writer.StartObject();
+      {
+        writer.String(SproutConnection::JSON_PRIMARY_IMPU.c_str());
+        writer.String((*i).c_str());
+      }
+      writer.EndObject();
+    }
+    else
+    {
+      for (std::vector<std::string>::const_iterator j = impis.begin();
+           j != impis.end();
+           j++)
+      {
+        writer.StartObject();
+        {
+          writer.String(SproutConnection::JSON_PRIMARY_IMPU.c_str());
+          writer.String((*i).c_str());
+          writer.String(SproutConnection::JSON_IMPI.c_str());
+          writer.String((*j).c_str());
+        }
+        writer.EndObject();
+      }
+    }
+  }
+}
+
 std::string SproutConnection::create_body(const std::vector<std::string>& default_public_ids,
                                           const std::vector<std::string>& impis)
 {
@@ -82,41 +224,88 @@ std::string SproutConnection::create_body(const std::vector<std::string>& defaul
   {
     writer.String(JSON_REGISTRATIONS.c_str());
     writer.StartArray();
-    for (std::vector<std::string>::const_iterator i = default_public_ids.begin();
-         i != default_public_ids.end();
-         i++)
+    write_registrations(writer, default_public_ids, impis);
+    writer.EndArray();
+  }
+  writer.EndObject();
+  return sb.GetString();
+}
+
+std::string SproutConnection::create_body(const std::vector<Deregistration>& batch)
+{
+  // As above, but combining the registrations from several
+  // Registration-Termination requests into one body.
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  {
+    writer.String(JSON_REGISTRATIONS.c_str());
+    writer.StartArray();
+    for (std::vector<Deregistration>::const_iterator it = batch.begin();
+         it != batch.end();
+         ++it)
+    {
+      write_registrations(writer, it->default_public_ids, it->impis);
+    }
+    writer.EndArray();
+  }
+  writer.EndObject();
+  return sb.GetString();
+}
+
+void SproutConnection::thread_function()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    if (_queue.empty())
     {
-      // If we have any IMPIs specified, we need to send pairs of
-      // default public IDs and private IDs. Otherwise just send a list
-      // of private IDs.
-      if (impis.empty())
+      pthread_cond_wait(&_cond, &_lock);
+      continue;
+    }
+
+    // Take the oldest deregistration, along with any others queued behind it
+    // that can go in the same request.
+    std::vector<Deregistration> batch;
+    bool send_notifications = _queue.front().send_notifications;
+    std::deque<Deregistration>::iterator it = _queue.begin();
+    while ((it != _queue.end()) && (batch.size() < MAX_BATCH))
+    {
+      if (it->send_notifications == send_notifications)
       {
-        writer.StartObject();
-        {
-          writer.String(JSON_PRIMARY_IMPU.c_str());
-          writer.String((*i).c_str());
-        }
-        writer.EndObject();
+        batch.push_back(*it);
+        it = _queue.erase(it);
       }
       else
       {
-        for (std::vector<std::string>::const_iterator j = impis.begin();
-             j != impis.end();
-             j++)
-        {
-          writer.StartObject();
-          {
-            writer.String(JSON_PRIMARY_IMPU.c_str());
-            writer.String((*i).c_str());
-            writer.String(JSON_IMPI.c_str());
-            writer.String((*j).c_str());
-          }
-          writer.EndObject();
-        }
+        ++it;
       }
     }
-    writer.EndArray();
+
+    pthread_mutex_unlock(&_lock);
+
+    TRC_DEBUG("Sending %d deregistrations to Sprout", batch.size());
+    HTTPCode ret_code = send_delete(send_notifications,
+                                    create_body(batch),
+                                    batch.front().trail);
+
+    for (std::vector<Deregistration>::iterator jt = batch.begin();
+         jt != batch.end();
+         ++jt)
+    {
+      jt->clbk(ret_code);
+    }
+
+    pthread_mutex_lock(&_lock);
   }
-  writer.EndObject();
-  return sb.GetString();
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void* SproutConnection::thread_entry_point(void* sprout_conn)
+{
+  ((SproutConnection*)sprout_conn)->thread_function();
+  return NULL;
 }
@@ -52,6 +52,48 @@ StatisticsManager::StatisticsManager()
                                                    ".1.2.826.0.1.1578918.9.5.6");
   H_rejected_overload = SNMP::CounterTable::create("H_rejected_overload",
                                                    ".1.2.826.0.1.1578918.9.5.7");
+  H_icscf_cache_hits = SNMP::CounterTable::create("H_icscf_cache_hits",
+                                                  ".1.2.826.0.1.1578918.9.5.8");
+  H_icscf_cache_misses = SNMP::CounterTable::create("H_icscf_cache_misses",
+                                                    ".1.2.826.0.1.1578918.9.5.9");
+  H_hss_concurrency_window = SNMP::EventAccumulatorTable::create("H_hss_concurrency_window",
+                                                                 ".1.2.826.0.1.1578918.9.5.10");
+  H_hss_queue_wait_us = SNMP::EventAccumulatorTable::create("H_hss_queue_wait_us",
+                                                            ".1.2.826.0.1.1578918.9.5.11");
+  H_hss_mar_timeout_ms = SNMP::EventAccumulatorTable::create("H_hss_mar_timeout_ms",
+                                                             ".1.2.826.0.1.1578918.9.5.12");
+  H_hss_hedged = SNMP::CounterTable::create("H_hss_hedged",
+                                            ".1.2.826.0.1.1578918.9.5.13");
+  H_hss_hedge_won = SNMP::CounterTable::create("H_hss_hedge_won",
+                                               ".1.2.826.0.1.1578918.9.5.14");
+  H_hss_circuit_opened = SNMP::CounterTable::create("H_hss_circuit_opened",
+                                                    ".1.2.826.0.1.1578918.9.5.15");
+  H_hss_fast_failed = SNMP::CounterTable::create("H_hss_fast_failed",
+                                                 ".1.2.826.0.1.1578918.9.5.16");
+  H_deadline_expired = SNMP::CounterTable::create("H_deadline_expired",
+                                                  ".1.2.826.0.1.1578918.9.5.17");
+  H_handler_queue_depth = SNMP::EventAccumulatorTable::create("H_handler_queue_depth",
+                                                              ".1.2.826.0.1.1578918.9.5.18");
+  H_handler_queue_wait_us = SNMP::EventAccumulatorTable::create("H_handler_queue_wait_us",
+                                                                ".1.2.826.0.1.1578918.9.5.19");
+  H_handler_cx_answer_us = SNMP::EventAccumulatorTable::create("H_handler_cx_answer_us",
+                                                               ".1.2.826.0.1.1578918.9.5.20");
+  H_handler_rtr_us = SNMP::EventAccumulatorTable::create("H_handler_rtr_us",
+                                                         ".1.2.826.0.1.1578918.9.5.21");
+  H_handler_ppr_us = SNMP::EventAccumulatorTable::create("H_handler_ppr_us",
+                                                         ".1.2.826.0.1.1578918.9.5.22");
+  H_reg_data_cache_hits = SNMP::CounterTable::create("H_reg_data_cache_hits",
+                                                     ".1.2.826.0.1.1578918.9.5.23");
+  H_reg_data_cache_misses = SNMP::CounterTable::create("H_reg_data_cache_misses",
+                                                       ".1.2.826.0.1.1578918.9.5.24");
+  H_reg_data_cache_bytes = SNMP::EventAccumulatorTable::create("H_reg_data_cache_bytes",
+                                                               ".1.2.826.0.1.1578918.9.5.25");
+  H_hss_sar_timeout_ms = SNMP::EventAccumulatorTable::create("H_hss_sar_timeout_ms",
+                                                             ".1.2.826.0.1.1578918.9.5.26");
+  H_hss_uar_timeout_ms = SNMP::EventAccumulatorTable::create("H_hss_uar_timeout_ms",
+                                                             ".1.2.826.0.1.1578918.9.5.27");
+  H_hss_lir_timeout_ms = SNMP::EventAccumulatorTable::create("H_hss_lir_timeout_ms",
+                                                             ".1.2.826.0.1.1578918.9.5.28");
 }
 
 StatisticsManager::~StatisticsManager()
@@ -63,4 +105,25 @@ StatisticsManager::~StatisticsManager()
   delete H_hss_subscription_latency_us; H_hss_subscription_latency_us = NULL;
   delete H_incoming_requests; H_incoming_requests = NULL;
   delete H_rejected_overload; H_rejected_overload = NULL;
+  delete H_icscf_cache_hits; H_icscf_cache_hits = NULL;
+  delete H_icscf_cache_misses; H_icscf_cache_misses = NULL;
+  delete H_hss_concurrency_window; H_hss_concurrency_window = NULL;
+  delete H_hss_queue_wait_us; H_hss_queue_wait_us = NULL;
+  delete H_hss_mar_timeout_ms; H_hss_mar_timeout_ms = NULL;
+  delete H_hss_sar_timeout_ms; H_hss_sar_timeout_ms = NULL;
+  delete H_hss_uar_timeout_ms; H_hss_uar_timeout_ms = NULL;
+  delete H_hss_lir_timeout_ms; H_hss_lir_timeout_ms = NULL;
+  delete H_hss_hedged; H_hss_hedged = NULL;
+  delete H_hss_hedge_won; H_hss_hedge_won = NULL;
+  delete H_hss_circuit_opened; H_hss_circuit_opened = NULL;
+  delete H_hss_fast_failed; H_hss_fast_failed = NULL;
+  delete H_deadline_expired; H_deadline_expired = NULL;
+  delete H_handler_queue_depth; H_handler_queue_depth = NULL;
+  delete H_handler_queue_wait_us; H_handler_queue_wait_us = NULL;
+  delete H_handler_cx_answer_us; H_handler_cx_answer_us = NULL;
+  delete H_handler_rtr_us; H_handler_rtr_us = NULL;
+  delete H_handler_ppr_us; H_handler_ppr_us = NULL;
+  delete H_reg_data_cache_hits; H_reg_data_cache_hits = NULL;
+  delete H_reg_data_cache_misses; H_reg_data_cache_misses = NULL;
+  delete H_reg_data_cache_bytes; H_reg_data_cache_bytes = NULL;
 }
@@ -0,0 +1,133 @@
+/**
+ * @file adaptivetimeout_test.cpp UT for adaptive Diameter timeouts.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include "adaptivetimeout.h"
+#include "test_interposer.hpp"
+
+/// Fixture for AdaptiveTimeoutTest.
+class AdaptiveTimeoutTest : public testing::Test
+{
+public:
+  AdaptiveTimeoutTest() { cwtest_completely_control_time(); }
+  virtual ~AdaptiveTimeoutTest() { cwtest_reset_time(); }
+
+  static void record(AdaptiveTimeout& timeout, int count, unsigned long latency_us)
+  {
+    for (int ii = 0; ii < count; ii++)
+    {
+      timeout.record(latency_us);
+    }
+  }
+};
+
+TEST_F(AdaptiveTimeoutTest, InitialTimeout)
+{
+  AdaptiveTimeout timeout(200, 50, 2000);
+  EXPECT_EQ(200, timeout.timeout_ms());
+  EXPECT_EQ(0, timeout.percentile_ms());
+
+  // A handful of samples isn't enough to go on.
+  record(timeout, 50, 10000);
+  EXPECT_EQ(200, timeout.timeout_ms());
+  EXPECT_EQ(0, timeout.percentile_ms());
+}
+
+TEST_F(AdaptiveTimeoutTest, AdaptsToLatency)
+{
+  AdaptiveTimeout timeout(200, 10, 2000);
+
+  // Requests taking 30ms give a 99th percentile of 31ms (the top of the
+  // bucket), so a timeout of twice that.
+  record(timeout, 100, 30500);
+  EXPECT_EQ(62, timeout.timeout_ms());
+  EXPECT_EQ(31, timeout.percentile_ms());
+
+  // A slow tail pushes the timeout out.
+  record(timeout, 10, 400000);
+  EXPECT_EQ(802, timeout.timeout_ms());
+  EXPECT_EQ(401, timeout.percentile_ms());
+}
+
+TEST_F(AdaptiveTimeoutTest, Factor)
+{
+  AdaptiveTimeout timeout(200, 10, 2000, 1.5);
+  record(timeout, 100, 39000);
+  EXPECT_EQ(60, timeout.timeout_ms());
+}
+
+TEST_F(AdaptiveTimeoutTest, Floor)
+{
+  AdaptiveTimeout timeout(200, 50, 2000);
+  record(timeout, 100, 1000);
+  EXPECT_EQ(50, timeout.timeout_ms());
+}
+
+TEST_F(AdaptiveTimeoutTest, Ceiling)
+{
+  AdaptiveTimeout timeout(200, 50, 1000);
+
+  // Requests that timed out are recorded with the timeout as their latency,
+  // and can't push the timeout beyond the ceiling.
+  record(timeout, 100, 5000000);
+  EXPECT_EQ(1000, timeout.timeout_ms());
+}
+
+TEST_F(AdaptiveTimeoutTest, ForgetsOldLatency)
+{
+  AdaptiveTimeout timeout(200, 10, 2000, 2.0, 60);
+  record(timeout, 100, 400000);
+  EXPECT_EQ(802, timeout.timeout_ms());
+
+  // Once the slow period has rotated out, only recent latency counts.
+  cwtest_advance_time_ms(61000);
+  record(timeout, 100, 30500);
+  EXPECT_EQ(802, timeout.timeout_ms());
+  cwtest_advance_time_ms(61000);
+  record(timeout, 100, 30500);
+  EXPECT_EQ(62, timeout.timeout_ms());
+}
+
+TEST_F(AdaptiveTimeoutTest, Percentile)
+{
+  // Using the 90th percentile, a slow tenth of requests is ignored.
+  AdaptiveTimeout timeout(200, 1, 2000, 1.0, 60, 90);
+  record(timeout, 90, 9500);
+  record(timeout, 10, 400000);
+  EXPECT_EQ(10, timeout.timeout_ms());
+}
@@ -0,0 +1,167 @@
+/**
+ * @file akavectorpool_test.cpp UT for the AKA vector pool.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include "akavectorpool.h"
+
+/// Fixture for AkaVectorPoolTest.
+class AkaVectorPoolTest : public testing::Test
+{
+public:
+  static const std::string IMPI;
+
+  static AKAAuthVector make_av(const std::string& challenge)
+  {
+    AKAAuthVector av;
+    av.challenge = challenge;
+    av.response = "response";
+    av.crypt_key = "crypt_key";
+    av.integrity_key = "integrity_key";
+    return av;
+  }
+
+  static std::vector<AKAAuthVector> make_avs(int count)
+  {
+    std::vector<AKAAuthVector> avs;
+    for (int ii = 0; ii < count; ii++)
+    {
+      avs.push_back(make_av("challenge" + std::to_string(ii)));
+    }
+    return avs;
+  }
+};
+
+const std::string AkaVectorPoolTest::IMPI = "_impi@example.com";
+
+TEST_F(AkaVectorPoolTest, EmptyPool)
+{
+  AkaVectorPool pool(5);
+  AKAAuthVector av;
+  bool needs_refill;
+
+  EXPECT_FALSE(pool.get(IMPI, av, needs_refill));
+  EXPECT_FALSE(needs_refill);
+}
+
+TEST_F(AkaVectorPoolTest, VectorsUsedOnceInOrder)
+{
+  AkaVectorPool pool(5, 0);
+  AKAAuthVector av;
+  bool needs_refill;
+
+  pool.add(IMPI, make_avs(2));
+  EXPECT_EQ(2u, pool.count(IMPI));
+
+  EXPECT_TRUE(pool.get(IMPI, av, needs_refill));
+  EXPECT_EQ("challenge0", av.challenge);
+  EXPECT_TRUE(pool.get(IMPI, av, needs_refill));
+  EXPECT_EQ("challenge1", av.challenge);
+  EXPECT_FALSE(pool.get(IMPI, av, needs_refill));
+  EXPECT_EQ(0u, pool.count(IMPI));
+}
+
+TEST_F(AkaVectorPoolTest, RefillBelowLowWater)
+{
+  AkaVectorPool pool(5, 2);
+  AKAAuthVector av;
+  bool needs_refill;
+
+  pool.add(IMPI, make_avs(4));
+
+  // 3 left - no refill needed.
+  EXPECT_TRUE(pool.get(IMPI, av, needs_refill));
+  EXPECT_FALSE(needs_refill);
+
+  // 2 left - still no refill needed.
+  EXPECT_TRUE(pool.get(IMPI, av, needs_refill));
+  EXPECT_FALSE(needs_refill);
+
+  // 1 left - refill, but only once.
+  EXPECT_TRUE(pool.get(IMPI, av, needs_refill));
+  EXPECT_TRUE(needs_refill);
+  EXPECT_TRUE(pool.get(IMPI, av, needs_refill));
+  EXPECT_FALSE(needs_refill);
+
+  // Once the refill completes, another can be started.
+  pool.add(IMPI, make_avs(2));
+  EXPECT_TRUE(pool.get(IMPI, av, needs_refill));
+  EXPECT_TRUE(needs_refill);
+
+  // Likewise if it fails.
+  pool.refill_failed(IMPI);
+  EXPECT_TRUE(pool.get(IMPI, av, needs_refill));
+  EXPECT_TRUE(needs_refill);
+}
+
+TEST_F(AkaVectorPoolTest, ExpiredVectorsDiscarded)
+{
+  AkaVectorPool pool(5, 1, 0);
+  AKAAuthVector av;
+  bool needs_refill;
+
+  pool.add(IMPI, make_avs(3));
+  EXPECT_EQ(0u, pool.count(IMPI));
+  EXPECT_FALSE(pool.get(IMPI, av, needs_refill));
+}
+
+TEST_F(AkaVectorPoolTest, Flush)
+{
+  AkaVectorPool pool(5);
+  AKAAuthVector av;
+  bool needs_refill;
+
+  pool.add(IMPI, make_avs(3));
+  pool.add("other@example.com", make_avs(3));
+  pool.flush(IMPI);
+  EXPECT_FALSE(pool.get(IMPI, av, needs_refill));
+  EXPECT_EQ(3u, pool.count("other@example.com"));
+}
+
+TEST_F(AkaVectorPoolTest, PoolFull)
+{
+  AkaVectorPool pool(5, 1, 30, 1);
+
+  pool.add(IMPI, make_avs(3));
+  pool.add("other@example.com", make_avs(3));
+  EXPECT_EQ(3u, pool.count(IMPI));
+  EXPECT_EQ(0u, pool.count("other@example.com"));
+
+  // More vectors for an IMPI that's already pooled are still accepted.
+  pool.add(IMPI, make_avs(1));
+  EXPECT_EQ(4u, pool.count(IMPI));
+}
@@ -0,0 +1,277 @@
+/**
+ * @file bulkderegistrar_test.cpp UT for the bulk deregistrar.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include <unistd.h>
+
+#include "bulkderegistrar.h"
+#include "mockcache.hpp"
+#include "mockhttpconnection.hpp"
+#include "fakehttpresolver.hpp"
+
+using ::testing::_;
+using ::testing::HasSubstr;
+using ::testing::Invoke;
+using ::testing::InvokeWithoutArgs;
+using ::testing::Return;
+using ::testing::SetArgReferee;
+
+const std::string IMPI = "impi@example.com";
+const std::string IMPU = "sip:impu@example.com";
+const std::string DEREG_ADMIN_BODY = "{\"reqtype\": \"dereg-admin\"}";
+
+/// Fixture for BulkDeregistrarTest.
+class BulkDeregistrarTest : public testing::Test
+{
+public:
+  FakeHttpResolver _resolver;
+  MockHttpConnection* _http;
+  MockCache _cache;
+
+  BulkDeregistrarTest() :
+    _resolver("1.2.3.4"),
+    _http(new MockHttpConnection(&_resolver))
+  {}
+
+  virtual ~BulkDeregistrarTest() {}
+
+  // Waits for the given number of deregistrations to complete.
+  static void wait_for_completed(BulkDeregistrar& deregistrar, uint64_t count)
+  {
+    for (int ii = 0; ii < 500; ii++)
+    {
+      BulkDeregistrar::Progress progress = deregistrar.progress();
+      if (progress.succeeded + progress.failed >= count)
+      {
+        return;
+      }
+      usleep(10000);
+    }
+  }
+
+  // Stands in for the cache, completing the operation straight away.
+  static void complete_async(CassandraStore::Operation*& op,
+                             CassandraStore::Transaction*& trx)
+  {
+    trx->on_success(op);
+    delete trx; trx = NULL;
+  }
+
+  // Stands in for a cache that doesn't complete the operation until told
+  // to.
+  static void hold_async(CassandraStore::Operation*& op,
+                         CassandraStore::Transaction*& trx)
+  {
+    _held_op = op;
+    _held_trx = trx;
+  }
+
+  static long slow_put()
+  {
+    usleep(20000);
+    return HTTP_OK;
+  }
+
+  static CassandraStore::Operation* _held_op;
+  static CassandraStore::Transaction* _held_trx;
+};
+
+CassandraStore::Operation* BulkDeregistrarTest::_held_op = NULL;
+CassandraStore::Transaction* BulkDeregistrarTest::_held_trx = NULL;
+
+// Identities are just queued until the deregistrar is started.
+TEST_F(BulkDeregistrarTest, NotStarted)
+{
+  BulkDeregistrar deregistrar(_http, &_cache, NULL, 4, 100);
+  deregistrar.add({IMPU, "sip:impu2@example.com", IMPI});
+
+  BulkDeregistrar::Progress progress = deregistrar.progress();
+  EXPECT_EQ(3u, progress.queued);
+  EXPECT_EQ(0u, progress.in_progress);
+  EXPECT_EQ(0u, progress.succeeded);
+  EXPECT_EQ(0u, progress.failed);
+  EXPECT_EQ(1, progress.concurrency);
+}
+
+// Each public ID is deregistered with a dereg-admin PUT.
+TEST_F(BulkDeregistrarTest, PublicIds)
+{
+  BulkDeregistrar deregistrar(_http, &_cache, NULL, 4, 1000);
+
+  EXPECT_CALL(*_http, send_put(HasSubstr("impu%40example.com/reg-data"), DEREG_ADMIN_BODY, _))
+    .WillOnce(Return(HTTP_OK));
+  EXPECT_CALL(*_http, send_put(HasSubstr("impu2%40example.com/reg-data"), DEREG_ADMIN_BODY, _))
+    .WillOnce(Return(HTTP_SERVER_ERROR));
+
+  deregistrar.start();
+  deregistrar.add({IMPU, "sip:impu2@example.com"});
+  wait_for_completed(deregistrar, 2);
+  deregistrar.stop();
+
+  BulkDeregistrar::Progress progress = deregistrar.progress();
+  EXPECT_EQ(0u, progress.queued);
+  EXPECT_EQ(1u, progress.succeeded);
+  EXPECT_EQ(1u, progress.failed);
+}
+
+// A private ID is deregistered from each IRS it is registered with.
+TEST_F(BulkDeregistrarTest, PrivateId)
+{
+  BulkDeregistrar deregistrar(_http, &_cache, NULL, 4, 1000);
+
+  MockCache::MockGetAssociatedPrimaryPublicIDs mock_op;
+  EXPECT_CALL(_cache, create_GetAssociatedPrimaryPublicIDs(IMPI))
+    .WillOnce(Return(&mock_op));
+  EXPECT_CALL(_cache, do_async(_, _))
+    .WillOnce(Invoke(&BulkDeregistrarTest::complete_async));
+  EXPECT_CALL(mock_op, get_result(_))
+    .WillOnce(SetArgReferee<0>(std::vector<std::string>({IMPU})));
+  EXPECT_CALL(*_http, send_put(HasSubstr("reg-data?private_id=impi%40example.com"), DEREG_ADMIN_BODY, _))
+    .WillOnce(Return(HTTP_OK));
+
+  deregistrar.start();
+  deregistrar.add({IMPI});
+  wait_for_completed(deregistrar, 1);
+  deregistrar.stop();
+
+  EXPECT_EQ(1u, deregistrar.progress().succeeded);
+}
+
+// The number of deregistrations run at once grows while they complete
+// quickly...
+TEST_F(BulkDeregistrarTest, ConcurrencyGrows)
+{
+  BulkDeregistrar deregistrar(_http, &_cache, NULL, 4, 1000);
+
+  EXPECT_CALL(*_http, send_put(_, DEREG_ADMIN_BODY, _))
+    .Times(20)
+    .WillRepeatedly(Return(HTTP_OK));
+
+  std::vector<std::string> impus;
+  for (int ii = 0; ii < 20; ii++)
+  {
+    impus.push_back("sip:impu" + std::to_string(ii) + "@example.com");
+  }
+
+  deregistrar.start();
+  deregistrar.add(impus);
+  wait_for_completed(deregistrar, 20);
+  deregistrar.stop();
+
+  EXPECT_LT(1, deregistrar.progress().concurrency);
+}
+
+// ...but not while they are slower than the target latency.
+TEST_F(BulkDeregistrarTest, ConcurrencyBacksOff)
+{
+  BulkDeregistrar deregistrar(_http, &_cache, NULL, 4, 5);
+
+  EXPECT_CALL(*_http, send_put(_, DEREG_ADMIN_BODY, _))
+    .Times(5)
+    .WillRepeatedly(InvokeWithoutArgs(&BulkDeregistrarTest::slow_put));
+
+  std::vector<std::string> impus;
+  for (int ii = 0; ii < 5; ii++)
+  {
+    impus.push_back("sip:impu" + std::to_string(ii) + "@example.com");
+  }
+
+  deregistrar.start();
+  deregistrar.add(impus);
+  wait_for_completed(deregistrar, 5);
+  deregistrar.stop();
+
+  EXPECT_EQ(1, deregistrar.progress().concurrency);
+}
+
+// A private ID whose public IDs the cache doesn't return in time counts as
+// a failure, rather than holding up the deregistrar.
+TEST_F(BulkDeregistrarTest, LookupTimeout)
+{
+  BulkDeregistrar deregistrar(_http, &_cache, NULL, 4, 1000, NULL, 10);
+
+  MockCache::MockGetAssociatedPrimaryPublicIDs mock_op;
+  EXPECT_CALL(_cache, create_GetAssociatedPrimaryPublicIDs(IMPI))
+    .WillOnce(Return(&mock_op));
+  EXPECT_CALL(_cache, do_async(_, _))
+    .WillOnce(Invoke(&BulkDeregistrarTest::hold_async));
+  EXPECT_CALL(*_http, send_put(_, _, _)).Times(0);
+
+  deregistrar.start();
+  deregistrar.add({IMPI});
+  wait_for_completed(deregistrar, 1);
+  deregistrar.stop();
+
+  EXPECT_EQ(1u, deregistrar.progress().failed);
+
+  // The lookup completing late is harmless.
+  EXPECT_CALL(mock_op, get_result(_))
+    .WillOnce(SetArgReferee<0>(std::vector<std::string>({IMPU})));
+  _held_trx->on_success(_held_op);
+  delete _held_trx; _held_trx = NULL;
+}
+
+// The deregistrations also back off while live SARs are slower than the
+// target latency, even if the deregistrations themselves are quick.
+TEST_F(BulkDeregistrarTest, ConcurrencyBacksOffForLiveTraffic)
+{
+  AdaptiveTimeout live_latency(200, 10, 2000);
+  for (int ii = 0; ii < 100; ii++)
+  {
+    live_latency.record(500000);
+  }
+
+  BulkDeregistrar deregistrar(_http, &_cache, NULL, 4, 100, &live_latency);
+
+  EXPECT_CALL(*_http, send_put(_, DEREG_ADMIN_BODY, _))
+    .Times(20)
+    .WillRepeatedly(Return(HTTP_OK));
+
+  std::vector<std::string> impus;
+  for (int ii = 0; ii < 20; ii++)
+  {
+    impus.push_back("sip:impu" + std::to_string(ii) + "@example.com");
+  }
+
+  deregistrar.start();
+  deregistrar.add(impus);
+  wait_for_completed(deregistrar, 20);
+  deregistrar.stop();
+
+  EXPECT_EQ(1, deregistrar.progress().concurrency);
+}
@@ -749,6 +749,32 @@ TEST_F(CacheRequestTest, DeleteIMPIMappings)
   execute_trx(op, trx);
 }
 
+TEST_F(CacheRequestTest, DeleteAuthVectors)
+{
+  std::vector<std::string> ids;
+  ids.push_back("kermit");
+  ids.push_back("gonzo");
+
+  TestTransaction *trx = make_trx();
+  CassandraStore::Operation* op =
+    _cache.create_DeleteAuthVector(ids, 1000);
+
+  // Only the digest columns are deleted - the associated public IDs stay.
+  std::map<std::string, std::string> deleted_columns;
+  deleted_columns["digest_ha1"] = "";
+  deleted_columns["digest_realm"] = "";
+  deleted_columns["digest_qop"] = "";
+  deleted_columns["known_preferred"] = "";
+
+  std::vector<CassandraStore::RowColumns> expected;
+  expected.push_back(CassandraStore::RowColumns("impi", "kermit", deleted_columns));
+  expected.push_back(CassandraStore::RowColumns("impi", "gonzo", deleted_columns));
+
+  EXPECT_CALL(_client, batch_mutate(DeletionMap(expected), _));
+  EXPECT_CALL(*trx, on_success(_));
+
+  execute_trx(op, trx);
+}
 
 
 TEST_F(CacheRequestTest, DeletesHaveConsistencyLevelOne)
@@ -948,6 +974,127 @@ TEST_F(CacheRequestTest, GetRegDataNotFound)
   EXPECT_EQ(EMPTY_IMPIS, rec.result.impis);
 }
 
+// Records the results of a MultiGetRegData for each public ID.
+class MultiGetRegDataRecorder : public ResultRecorderInterface
+{
+public:
+  MultiGetRegDataRecorder(const std::vector<std::string>& public_ids) :
+    _public_ids(public_ids)
+  {}
+
+  void save(CassandraStore::Operation* op)
+  {
+    Cache::MultiGetRegData* multi_get = (Cache::MultiGetRegData*)op;
+    for (std::vector<std::string>::iterator it = _public_ids.begin();
+         it != _public_ids.end();
+         ++it)
+    {
+      Cache::GetRegData* reg_data = multi_get->get_reg_data(*it);
+      if (reg_data != NULL)
+      {
+        reg_data->get_result(results[*it]);
+      }
+      else
+      {
+        std::string text;
+        multi_get->get_error(*it, errors[*it], text);
+      }
+    }
+  }
+
+  std::map<std::string, Cache::GetRegData::Result> results;
+  std::map<std::string, CassandraStore::ResultCode> errors;
+
+private:
+  std::vector<std::string> _public_ids;
+};
+
+TEST_F(CacheRequestTest, MultiGetRegData)
+{
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+  columns["is_registered"] = "\x01";
+  columns["associated_impi__somebody@example.com"] = "";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  // Ask for kermit twice - it should only be read once.
+  std::vector<std::string> public_ids = {"kermit", "gonzo", "kermit"};
+  MultiGetRegDataRecorder rec(public_ids);
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_MultiGetRegData(public_ids);
+
+  // Both rows are read in a single multiget. Gonzo has no row, so isn't in
+  // the results.
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > rows;
+  rows["kermit"] = slice;
+  std::vector<std::string> keys = {"gonzo", "kermit"};
+
+  EXPECT_CALL(_client, multiget_slice(_,
+                                      keys,
+                                      ColumnPathForTable("impu"),
+                                      AllColumns(),
+                                      _))
+    .WillOnce(SetArgReferee<0>(rows));
+
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ(RegistrationState::REGISTERED, rec.results["kermit"].state);
+  EXPECT_EQ("<howdy>", rec.results["kermit"].xml);
+  EXPECT_EQ(IMPIS, rec.results["kermit"].impis);
+  EXPECT_EQ(RegistrationState::NOT_REGISTERED, rec.results["gonzo"].state);
+  EXPECT_EQ("", rec.results["gonzo"].xml);
+  EXPECT_EQ(EMPTY_IMPIS, rec.results["gonzo"].impis);
+  EXPECT_TRUE(rec.errors.empty());
+}
+
+// If the multiget fails, the rows are read individually and only the public
+// IDs whose own read fails are reported as errors.
+TEST_F(CacheRequestTest, MultiGetRegDataPartialFailure)
+{
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+  columns["is_registered"] = "\x01";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  std::vector<std::string> public_ids = {"kermit", "gonzo"};
+  MultiGetRegDataRecorder rec(public_ids);
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_MultiGetRegData(public_ids);
+
+  cass::TimedOutException toe;
+  EXPECT_CALL(_client, multiget_slice(_, _, ColumnPathForTable("impu"), AllColumns(), _))
+    .WillOnce(Throw(toe));
+
+  cass::InvalidRequestException ire;
+  EXPECT_CALL(_client, get_slice(_,
+                                 "gonzo",
+                                 ColumnPathForTable("impu"),
+                                 AllColumns(),
+                                 _))
+    .WillOnce(Throw(ire));
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 ColumnPathForTable("impu"),
+                                 AllColumns(),
+                                 _))
+    .WillOnce(SetArgReferee<0>(slice));
+
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ(RegistrationState::REGISTERED, rec.results["kermit"].state);
+  EXPECT_EQ("<howdy>", rec.results["kermit"].xml);
+  EXPECT_TRUE(rec.results.find("gonzo") == rec.results.end());
+  EXPECT_EQ(CassandraStore::INVALID_REQUEST, rec.errors["gonzo"]);
+}
+
 TEST_F(CacheRequestTest, GetAuthVectorAllColsReturned)
 {
   std::vector<std::string> requested_columns;
@@ -73,6 +73,7 @@ public:
   static const std::vector<std::string> IMPIS;
   static const Cx::ServerAssignmentType TIMEOUT_DEREGISTRATION;
   static const Cx::ServerAssignmentType UNREGISTERED_USER;
+  static const Cx::ServerAssignmentType RE_REGISTRATION;
   static std::vector<std::string> IMPUS;
   static std::vector<std::string> ASSOCIATED_IDENTITIES;
   static const ServerCapabilities CAPABILITIES;
@@ -200,6 +201,7 @@ const int32_t CxTest::AUTH_SESSION_STATE = 1;
 const std::vector<std::string> CxTest::IMPIS {"private_id1", "private_id2"};
 const Cx::ServerAssignmentType CxTest::TIMEOUT_DEREGISTRATION = Cx::TIMEOUT_DEREGISTRATION;
 const Cx::ServerAssignmentType CxTest::UNREGISTERED_USER = Cx::UNREGISTERED_USER;
+const Cx::ServerAssignmentType CxTest::RE_REGISTRATION = Cx::RE_REGISTRATION;
 std::vector<std::string> CxTest::IMPUS {"public_id1", "public_id2"};
 std::vector<std::string> CxTest::ASSOCIATED_IDENTITIES {"associated_id1", "associated_id2", "associated_id3"};
 const std::vector<int32_t> mandatory_capabilities = {1, 3};
@@ -310,6 +312,50 @@ TEST_F(CxTest, MAATest)
   EXPECT_EQ("696e746567726974795f6b6579", maa_aka.integrity_key);
 }
 
+TEST_F(CxTest, MARBatchTest)
+{
+  Cx::MultimediaAuthRequest mar(_cx_dict,
+                                _mock_stack,
+                                DEST_REALM,
+                                DEST_HOST,
+                                IMPI,
+                                IMPU,
+                                SERVER_NAME,
+                                SIP_AUTH_SCHEME_AKA,
+                                "",
+                                5);
+  launder_message(mar);
+  EXPECT_EQ(SIP_AUTH_SCHEME_AKA, mar.sip_auth_scheme());
+  EXPECT_TRUE(mar.sip_number_auth_items(test_i32));
+  EXPECT_EQ(5, test_i32);
+}
+
+TEST_F(CxTest, MAAMultipleAKATest)
+{
+  std::vector<AKAAuthVector> avs(2);
+  avs[0].challenge = "sure.";
+  avs[0].response = "response";
+  avs[1].challenge = "other";
+  avs[1].crypt_key = "crypt_key";
+  Cx::MultimediaAuthAnswer maa(_cx_dict,
+                               _mock_stack,
+                               RESULT_CODE_SUCCESS,
+                               SIP_AUTH_SCHEME_AKA,
+                               avs);
+  launder_message(maa);
+  EXPECT_EQ(SIP_AUTH_SCHEME_AKA, maa.sip_auth_scheme());
+
+  std::vector<AKAAuthVector> maa_avs = maa.aka_auth_vectors();
+  ASSERT_EQ(2u, maa_avs.size());
+  EXPECT_EQ("c3VyZS4=", maa_avs[0].challenge);
+  EXPECT_EQ("726573706f6e7365", maa_avs[0].response);
+  EXPECT_EQ("b3RoZXI=", maa_avs[1].challenge);
+  EXPECT_EQ("63727970745f6b6579", maa_avs[1].crypt_key);
+
+  // The single vector accessor returns the first.
+  EXPECT_EQ("c3VyZS4=", maa.aka_auth_vector().challenge);
+}
+
 //
 // Server Assignment Requests
 //
@@ -358,6 +404,25 @@ TEST_F(CxTest, SARNoImpiTest)
   EXPECT_EQ(0, test_i32);
 }
 
+TEST_F(CxTest, SARUserDataAlreadyAvailableTest)
+{
+  Cx::ServerAssignmentRequest sar(_cx_dict,
+                                  _mock_stack,
+                                  DEST_HOST,
+                                  DEST_REALM,
+                                  IMPI,
+                                  IMPU,
+                                  SERVER_NAME,
+                                  RE_REGISTRATION,
+                                  true);
+  launder_message(sar);
+  check_common_request_fields(sar);
+  EXPECT_TRUE(sar.server_assignment_type(test_i32));
+  EXPECT_EQ(RE_REGISTRATION, test_i32);
+  EXPECT_TRUE(sar.user_data_already_available(test_i32));
+  EXPECT_EQ(1, test_i32);
+}
+
 //
 // Server Assignment Answers
 //
@@ -0,0 +1,157 @@
+/**
+ * @file cxcircuitbreaker_test.cpp UT for the HSS circuit breaker.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include "cxcircuitbreaker.h"
+#include "mockstatisticsmanager.hpp"
+#include "test_interposer.hpp"
+
+/// Fixture for CxCircuitBreakerTest.
+class CxCircuitBreakerTest : public testing::Test
+{
+public:
+  CxCircuitBreakerTest() { cwtest_completely_control_time(); }
+  virtual ~CxCircuitBreakerTest() { cwtest_reset_time(); }
+
+  static void complete(CxCircuitBreaker& breaker, int count, bool failed)
+  {
+    for (int ii = 0; ii < count; ii++)
+    {
+      ASSERT_TRUE(breaker.allow(0));
+      breaker.on_complete(failed, 0);
+    }
+  }
+};
+
+TEST_F(CxCircuitBreakerTest, StaysClosed)
+{
+  CxCircuitBreaker breaker(50, 20);
+  complete(breaker, 11, false);
+  complete(breaker, 9, true);
+  EXPECT_EQ(CxCircuitBreaker::CLOSED, breaker.state());
+  EXPECT_TRUE(breaker.allow(0));
+}
+
+TEST_F(CxCircuitBreakerTest, Opens)
+{
+  CxCircuitBreaker breaker(50, 20);
+  complete(breaker, 10, false);
+  complete(breaker, 10, true);
+  EXPECT_EQ(CxCircuitBreaker::OPEN, breaker.state());
+  EXPECT_FALSE(breaker.allow(0));
+}
+
+TEST_F(CxCircuitBreakerTest, MinRequests)
+{
+  // A few failures aren't enough to go on.
+  CxCircuitBreaker breaker(50, 20);
+  complete(breaker, 19, true);
+  EXPECT_EQ(CxCircuitBreaker::CLOSED, breaker.state());
+  complete(breaker, 1, true);
+  EXPECT_EQ(CxCircuitBreaker::OPEN, breaker.state());
+}
+
+TEST_F(CxCircuitBreakerTest, OldFailuresForgotten)
+{
+  CxCircuitBreaker breaker(50, 20, 10000);
+  complete(breaker, 15, true);
+
+  cwtest_advance_time_ms(20000);
+  complete(breaker, 5, true);
+  EXPECT_EQ(CxCircuitBreaker::CLOSED, breaker.state());
+}
+
+TEST_F(CxCircuitBreakerTest, ProbeSucceeds)
+{
+  CxCircuitBreaker breaker(50, 20, 10000, 5000);
+  complete(breaker, 20, true);
+  EXPECT_FALSE(breaker.allow(0));
+
+  // After the open time, one probe is let through at a time.
+  cwtest_advance_time_ms(5000);
+  EXPECT_TRUE(breaker.allow(0));
+  EXPECT_EQ(CxCircuitBreaker::HALF_OPEN, breaker.state());
+  EXPECT_FALSE(breaker.allow(0));
+
+  breaker.on_complete(false, 0);
+  EXPECT_EQ(CxCircuitBreaker::CLOSED, breaker.state());
+  EXPECT_TRUE(breaker.allow(0));
+  EXPECT_TRUE(breaker.allow(0));
+}
+
+TEST_F(CxCircuitBreakerTest, ProbeFails)
+{
+  CxCircuitBreaker breaker(50, 20, 10000, 5000);
+  complete(breaker, 20, true);
+
+  cwtest_advance_time_ms(5000);
+  EXPECT_TRUE(breaker.allow(0));
+  breaker.on_complete(true, 0);
+  EXPECT_EQ(CxCircuitBreaker::OPEN, breaker.state());
+  EXPECT_FALSE(breaker.allow(0));
+
+  cwtest_advance_time_ms(5000);
+  EXPECT_TRUE(breaker.allow(0));
+}
+
+TEST_F(CxCircuitBreakerTest, LostProbe)
+{
+  // If a probe's outcome never arrives, another one is sent eventually.
+  CxCircuitBreaker breaker(50, 20, 10000, 5000);
+  complete(breaker, 20, true);
+
+  cwtest_advance_time_ms(5000);
+  EXPECT_TRUE(breaker.allow(0));
+  cwtest_advance_time_ms(4999);
+  EXPECT_FALSE(breaker.allow(0));
+  cwtest_advance_time_ms(1);
+  EXPECT_TRUE(breaker.allow(0));
+}
+
+TEST_F(CxCircuitBreakerTest, Stats)
+{
+  MockStatisticsManager stats;
+  CxCircuitBreaker breaker(50, 2, 10000, 5000, &stats);
+  complete(breaker, 1, true);
+
+  EXPECT_CALL(stats, incr_H_hss_circuit_opened());
+  complete(breaker, 1, true);
+
+  EXPECT_CALL(stats, incr_H_hss_fast_failed());
+  EXPECT_FALSE(breaker.allow(0));
+}
@@ -0,0 +1,143 @@
+/**
+ * @file cxhedger_test.cpp UT for the Cx request hedger.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include <boost/bind.hpp>
+
+#include "cxhedger.h"
+#include "mockstatisticsmanager.hpp"
+#include "test_interposer.hpp"
+
+/// Fixture for CxHedgerTest. Records the order in which hedges are called
+/// back.
+class CxHedgerTest : public testing::Test
+{
+public:
+  std::vector<std::string> _fired;
+
+  CxHedgerTest() { cwtest_completely_control_time(); }
+  virtual ~CxHedgerTest() { cwtest_reset_time(); }
+
+  void record_fire(std::string name) { _fired.push_back(name); }
+
+  void schedule(CxHedger& hedger, int delay_ms, const std::string& name)
+  {
+    hedger.schedule(delay_ms,
+                    boost::bind(&CxHedgerTest::record_fire, this, name));
+  }
+};
+
+TEST_F(CxHedgerTest, FiresWhenDue)
+{
+  CxHedger hedger(100);
+  schedule(hedger, 20, "b");
+  schedule(hedger, 10, "a");
+  schedule(hedger, 30, "c");
+  EXPECT_EQ(3u, hedger.pending());
+
+  hedger.poll();
+  EXPECT_TRUE(_fired.empty());
+
+  cwtest_advance_time_ms(20);
+  hedger.poll();
+  ASSERT_EQ(2u, _fired.size());
+  EXPECT_EQ("a", _fired[0]);
+  EXPECT_EQ("b", _fired[1]);
+  EXPECT_EQ(1u, hedger.pending());
+}
+
+TEST_F(CxHedgerTest, Budget)
+{
+  // A 10% budget allows one hedge for every ten scheduled.
+  CxHedger hedger(10);
+  for (int ii = 0; ii < 9; ii++)
+  {
+    schedule(hedger, 10, "a");
+  }
+  EXPECT_FALSE(hedger.try_hedge());
+
+  schedule(hedger, 10, "a");
+  EXPECT_TRUE(hedger.try_hedge());
+  EXPECT_FALSE(hedger.try_hedge());
+}
+
+TEST_F(CxHedgerTest, BudgetCapped)
+{
+  // Unused budget can only be saved up so far.
+  CxHedger hedger(100);
+  for (int ii = 0; ii < 100; ii++)
+  {
+    schedule(hedger, 10, "a");
+  }
+
+  int hedges = 0;
+  while (hedger.try_hedge())
+  {
+    hedges++;
+  }
+  EXPECT_EQ(10, hedges);
+}
+
+TEST_F(CxHedgerTest, NoBudget)
+{
+  CxHedger hedger(0);
+  schedule(hedger, 10, "a");
+  EXPECT_FALSE(hedger.try_hedge());
+}
+
+TEST_F(CxHedgerTest, Stats)
+{
+  MockStatisticsManager stats;
+  CxHedger hedger(100, &stats);
+  schedule(hedger, 10, "a");
+
+  EXPECT_CALL(stats, incr_H_hss_hedged());
+  EXPECT_TRUE(hedger.try_hedge());
+
+  EXPECT_CALL(stats, incr_H_hss_hedge_won());
+  hedger.hedge_won();
+}
+
+TEST_F(CxHedgerTest, StartStop)
+{
+  CxHedger hedger(100);
+  hedger.start();
+  schedule(hedger, 10000, "a");
+  hedger.stop();
+  EXPECT_TRUE(_fired.empty());
+}
@@ -0,0 +1,205 @@
+/**
+ * @file cxlimiter_test.cpp UT for the Cx concurrency limiter.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include <boost/bind.hpp>
+
+#include "cxlimiter.h"
+#include "mockstatisticsmanager.hpp"
+#include "test_interposer.hpp"
+
+using ::testing::_;
+
+/// Fixture for CxLimiterTest. Records the order in which requests are sent
+/// and shed.
+class CxLimiterTest : public testing::Test
+{
+public:
+  std::vector<std::string> _sent;
+  std::vector<std::string> _shed;
+
+  CxLimiterTest() { cwtest_completely_control_time(); }
+  virtual ~CxLimiterTest() { cwtest_reset_time(); }
+
+  void record_send(std::string name) { _sent.push_back(name); }
+  void record_shed(std::string name) { _shed.push_back(name); }
+
+  void send(CxLimiter& limiter,
+            CxLimiter::Priority priority,
+            const std::string& name,
+            int timeout_ms = 200)
+  {
+    limiter.send(priority,
+                 timeout_ms,
+                 boost::bind(&CxLimiterTest::record_send, this, name),
+                 boost::bind(&CxLimiterTest::record_shed, this, name));
+  }
+};
+
+TEST_F(CxLimiterTest, SendsWithinWindow)
+{
+  CxLimiter limiter(2);
+  send(limiter, CxLimiter::MEDIUM, "a");
+  send(limiter, CxLimiter::MEDIUM, "b");
+  send(limiter, CxLimiter::MEDIUM, "c");
+  EXPECT_EQ(2u, _sent.size());
+  EXPECT_EQ(2, limiter.in_flight());
+  EXPECT_EQ(1u, limiter.queued());
+
+  // When a request completes, the queued one is sent.
+  limiter.on_complete(1000, false);
+  ASSERT_EQ(3u, _sent.size());
+  EXPECT_EQ("c", _sent[2]);
+  EXPECT_EQ(2, limiter.in_flight());
+  EXPECT_EQ(0u, limiter.queued());
+  EXPECT_TRUE(_shed.empty());
+}
+
+TEST_F(CxLimiterTest, PriorityOrder)
+{
+  CxLimiter limiter(1);
+  send(limiter, CxLimiter::LOW, "first");
+  send(limiter, CxLimiter::LOW, "uar");
+  send(limiter, CxLimiter::MEDIUM, "mar");
+  send(limiter, CxLimiter::HIGH, "dereg");
+  ASSERT_EQ(1u, _sent.size());
+
+  limiter.on_complete(1000, false);
+  limiter.on_complete(1000, false);
+  limiter.on_complete(1000, false);
+  ASSERT_EQ(4u, _sent.size());
+  EXPECT_EQ("dereg", _sent[1]);
+  EXPECT_EQ("mar", _sent[2]);
+  EXPECT_EQ("uar", _sent[3]);
+}
+
+TEST_F(CxLimiterTest, ShedWhenQueueFull)
+{
+  CxLimiter limiter(1, 1);
+  send(limiter, CxLimiter::MEDIUM, "a");
+  send(limiter, CxLimiter::LOW, "b");
+  send(limiter, CxLimiter::LOW, "c");
+  ASSERT_EQ(1u, _shed.size());
+  EXPECT_EQ("c", _shed[0]);
+
+  // A higher priority request displaces a lower priority one.
+  send(limiter, CxLimiter::HIGH, "d");
+  ASSERT_EQ(2u, _shed.size());
+  EXPECT_EQ("b", _shed[1]);
+
+  limiter.on_complete(1000, false);
+  ASSERT_EQ(2u, _sent.size());
+  EXPECT_EQ("d", _sent[1]);
+}
+
+TEST_F(CxLimiterTest, ShedOnExpectedWait)
+{
+  CxLimiter limiter(1);
+
+  // Requests are taking 100ms, so a request that has to wait for the one in
+  // flight won't make a 50ms timeout.
+  send(limiter, CxLimiter::MEDIUM, "a");
+  limiter.on_complete(100000, false);
+  send(limiter, CxLimiter::MEDIUM, "b");
+  send(limiter, CxLimiter::MEDIUM, "c", 50);
+  ASSERT_EQ(1u, _shed.size());
+  EXPECT_EQ("c", _shed[0]);
+
+  // It would make a 200ms one.
+  send(limiter, CxLimiter::MEDIUM, "d", 200);
+  EXPECT_EQ(1u, _shed.size());
+  EXPECT_EQ(1u, limiter.queued());
+}
+
+TEST_F(CxLimiterTest, ShedExpiredFromQueue)
+{
+  CxLimiter limiter(1);
+  send(limiter, CxLimiter::MEDIUM, "a");
+  send(limiter, CxLimiter::MEDIUM, "b", 1);
+  send(limiter, CxLimiter::MEDIUM, "c", 1000);
+  cwtest_advance_time_ms(5);
+
+  limiter.on_complete(1000, false);
+  ASSERT_EQ(1u, _shed.size());
+  EXPECT_EQ("b", _shed[0]);
+  ASSERT_EQ(2u, _sent.size());
+  EXPECT_EQ("c", _sent[1]);
+}
+
+TEST_F(CxLimiterTest, BackOffOnFailure)
+{
+  CxLimiter limiter(8);
+  EXPECT_EQ(8, limiter.window());
+
+  for (int ii = 0; ii < 8; ii++)
+  {
+    send(limiter, CxLimiter::MEDIUM, "a");
+  }
+
+  // The first failure halves the window.
+  limiter.on_complete(200000, true);
+  EXPECT_EQ(4, limiter.window());
+
+  // Failures of requests sent before then don't reduce it again.
+  limiter.on_complete(200000, true);
+  EXPECT_EQ(4, limiter.window());
+
+  // But later failures do.
+  cwtest_advance_time_ms(1);
+  limiter.on_complete(0, true);
+  EXPECT_EQ(2, limiter.window());
+
+  // The window grows back by one for each window's worth of successes.
+  limiter.on_complete(1000, false);
+  limiter.on_complete(1000, false);
+  EXPECT_EQ(3, limiter.window());
+}
+
+TEST_F(CxLimiterTest, Stats)
+{
+  MockStatisticsManager stats;
+  CxLimiter limiter(1, 100, &stats);
+
+  EXPECT_CALL(stats, update_H_hss_queue_wait_us(0));
+  send(limiter, CxLimiter::MEDIUM, "a");
+  send(limiter, CxLimiter::MEDIUM, "b");
+
+  EXPECT_CALL(stats, update_H_hss_concurrency_window(1));
+  EXPECT_CALL(stats, update_H_hss_queue_wait_us(_));
+  limiter.on_complete(1000, false);
+}
@@ -0,0 +1,206 @@
+/**
+ * @file cxpeerselector_test.cpp UT for the HSS peer selector.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include "cxpeerselector.h"
+#include "test_interposer.hpp"
+
+static const std::string REALM = "hss.example.com";
+
+/// Fixture for CxPeerSelectorTest.
+class CxPeerSelectorTest : public testing::Test
+{
+public:
+  CxPeerSelectorTest() { cwtest_completely_control_time(); }
+  virtual ~CxPeerSelectorTest() { cwtest_reset_time(); }
+
+  // Connects the peer (if it isn't already) and reports answers from it.
+  static void answer(CxPeerSelector& selector,
+                     const std::string& host,
+                     int count,
+                     unsigned long latency_us,
+                     bool failed = false)
+  {
+    selector.peer_connection_cb(true, host, REALM);
+    for (int ii = 0; ii < count; ii++)
+    {
+      selector.on_complete("", host, latency_us, failed);
+    }
+  }
+
+  static CxPeerSelector::PeerStats stats_for(CxPeerSelector& selector,
+                                             const std::string& host)
+  {
+    std::vector<CxPeerSelector::PeerStats> stats = selector.peer_stats();
+    for (size_t ii = 0; ii < stats.size(); ii++)
+    {
+      if (stats[ii].host == host)
+      {
+        return stats[ii];
+      }
+    }
+    return CxPeerSelector::PeerStats();
+  }
+};
+
+TEST_F(CxPeerSelectorTest, NoPeers)
+{
+  // With no peers known, requests are left to realm routing.
+  CxPeerSelector selector(REALM);
+  EXPECT_EQ("", selector.choose());
+  EXPECT_TRUE(selector.peer_stats().empty());
+}
+
+TEST_F(CxPeerSelectorTest, LearnsPeers)
+{
+  CxPeerSelector selector(REALM);
+  answer(selector, "hss1", 1, 1000);
+  EXPECT_EQ("hss1", selector.choose());
+  EXPECT_EQ(1, stats_for(selector, "hss1").outstanding);
+
+  selector.on_complete("hss1", "hss1", 3000, false);
+  CxPeerSelector::PeerStats stats = stats_for(selector, "hss1");
+  EXPECT_EQ(0, stats.outstanding);
+  EXPECT_EQ(1250u, stats.latency_us);
+  EXPECT_FALSE(stats.degraded);
+}
+
+TEST_F(CxPeerSelectorTest, LeastLoaded)
+{
+  // The faster peer gets requests until it has enough outstanding to make
+  // the slower one cheaper.
+  CxPeerSelector selector(REALM);
+  answer(selector, "hss1", 10, 1000);
+  answer(selector, "hss2", 10, 3000);
+  EXPECT_EQ("hss1", selector.choose());
+  EXPECT_EQ("hss1", selector.choose());
+  EXPECT_EQ("hss2", selector.choose());
+}
+
+TEST_F(CxPeerSelectorTest, Avoid)
+{
+  CxPeerSelector selector(REALM);
+  answer(selector, "hss1", 10, 1000);
+  answer(selector, "hss2", 10, 3000);
+  EXPECT_EQ("hss2", selector.choose("hss1"));
+
+  // If there's no choice, the peer to avoid is used anyway.
+  CxPeerSelector single(REALM);
+  answer(single, "hss1", 1, 1000);
+  EXPECT_EQ("hss1", single.choose("hss1"));
+}
+
+TEST_F(CxPeerSelectorTest, Explore)
+{
+  // Every so often a request is left to realm routing so that other peers
+  // can be found.
+  CxPeerSelector selector(REALM);
+  answer(selector, "hss1", 1, 1000);
+
+  int unrouted = 0;
+  for (int ii = 0; ii < 40; ii++)
+  {
+    if (selector.choose().empty())
+    {
+      unrouted++;
+    }
+  }
+  EXPECT_EQ(2, unrouted);
+}
+
+TEST_F(CxPeerSelectorTest, DegradedOnErrors)
+{
+  CxPeerSelector selector(REALM, 4.0, 0.5, 30);
+  answer(selector, "hss1", 10, 1000, true);
+  answer(selector, "hss2", 10, 1000);
+  EXPECT_TRUE(stats_for(selector, "hss1").degraded);
+  EXPECT_FALSE(stats_for(selector, "hss2").degraded);
+
+  for (int ii = 0; ii < 5; ii++)
+  {
+    EXPECT_EQ("hss2", selector.choose());
+  }
+
+  // The peer is given another chance once its time is up.
+  cwtest_advance_time_ms(30000);
+  EXPECT_FALSE(stats_for(selector, "hss1").degraded);
+  EXPECT_EQ(0.0, stats_for(selector, "hss1").error_rate);
+}
+
+TEST_F(CxPeerSelectorTest, DegradedOnLatency)
+{
+  CxPeerSelector selector(REALM, 4.0, 0.5, 30);
+  answer(selector, "hss1", 10, 1000);
+  answer(selector, "hss2", 10, 5000);
+  EXPECT_FALSE(stats_for(selector, "hss1").degraded);
+  EXPECT_TRUE(stats_for(selector, "hss2").degraded);
+}
+
+TEST_F(CxPeerSelectorTest, TimeoutsCountAgainstChosenPeer)
+{
+  CxPeerSelector selector(REALM, 4.0, 0.5, 30);
+  answer(selector, "hss1", 1, 1000);
+
+  for (int ii = 0; ii < 10; ii++)
+  {
+    std::string host = selector.choose();
+    selector.on_complete(host, "", 200000, true);
+  }
+  EXPECT_TRUE(stats_for(selector, "hss1").degraded);
+  EXPECT_EQ("", selector.choose());
+}
+
+TEST_F(CxPeerSelectorTest, OnlyConnectedPeers)
+{
+  // A peer that has answered but isn't directly connected (e.g. it is
+  // behind a relay) is never chosen.
+  CxPeerSelector selector(REALM);
+  selector.on_complete("", "hss1", 1000, false);
+  EXPECT_EQ("", selector.choose());
+
+  // Neither is a connected peer for another realm.
+  selector.peer_connection_cb(true, "hss1", "other.example.com");
+  EXPECT_EQ("", selector.choose());
+
+  // A connected peer for the realm is chosen even before it has answered,
+  // until it disconnects.
+  selector.peer_connection_cb(true, "hss2", REALM);
+  EXPECT_EQ("hss2", selector.choose());
+  selector.peer_connection_cb(false, "hss2", REALM);
+  EXPECT_EQ("", selector.choose());
+}
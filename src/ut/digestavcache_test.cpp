@@ -0,0 +1,147 @@
+/**
+ * @file digestavcache_test.cpp UT for the digest AV cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include "digestavcache.h"
+
+/// Fixture for DigestAvCacheTest.
+class DigestAvCacheTest : public testing::Test
+{
+public:
+  static const std::string IMPI;
+  static const std::string IMPU;
+
+  static DigestAuthVector make_av(const std::string& ha1)
+  {
+    DigestAuthVector av;
+    av.ha1 = ha1;
+    av.realm = "example.com";
+    av.qop = "auth";
+    av.preferred = true;
+    return av;
+  }
+};
+
+const std::string DigestAvCacheTest::IMPI = "_impi@example.com";
+const std::string DigestAvCacheTest::IMPU = "sip:impu@example.com";
+
+TEST_F(DigestAvCacheTest, Miss)
+{
+  DigestAvCache cache(30, 10000);
+  DigestAuthVector av;
+  EXPECT_FALSE(cache.get(IMPI, IMPU, av));
+}
+
+TEST_F(DigestAvCacheTest, PutAndGet)
+{
+  DigestAvCache cache(30, 10000);
+  cache.put(IMPI, IMPU, make_av("ha1"));
+
+  DigestAuthVector av;
+  EXPECT_TRUE(cache.get(IMPI, IMPU, av));
+  EXPECT_EQ("ha1", av.ha1);
+  EXPECT_EQ("example.com", av.realm);
+  EXPECT_EQ("auth", av.qop);
+
+  // Vectors are keyed on the public ID as well as the private ID.
+  EXPECT_FALSE(cache.get(IMPI, "sip:other@example.com", av));
+
+  // Replacing a vector doesn't leak its memory.
+  size_t bytes = cache.size_bytes();
+  cache.put(IMPI, IMPU, make_av("ha2"));
+  EXPECT_EQ(bytes, cache.size_bytes());
+  EXPECT_TRUE(cache.get(IMPI, IMPU, av));
+  EXPECT_EQ("ha2", av.ha1);
+}
+
+TEST_F(DigestAvCacheTest, Expiry)
+{
+  DigestAvCache cache(0, 10000);
+  cache.put(IMPI, IMPU, make_av("ha1"));
+
+  DigestAuthVector av;
+  EXPECT_FALSE(cache.get(IMPI, IMPU, av));
+  EXPECT_EQ(0u, cache.size_bytes());
+}
+
+TEST_F(DigestAvCacheTest, Invalidate)
+{
+  DigestAvCache cache(30, 10000);
+  cache.put(IMPI, IMPU, make_av("ha1"));
+  cache.put(IMPI, "sip:other@example.com", make_av("ha1"));
+  cache.put(IMPI + "2", IMPU, make_av("ha1"));
+
+  cache.invalidate(IMPI);
+
+  DigestAuthVector av;
+  EXPECT_FALSE(cache.get(IMPI, IMPU, av));
+  EXPECT_FALSE(cache.get(IMPI, "sip:other@example.com", av));
+  EXPECT_TRUE(cache.get(IMPI + "2", IMPU, av));
+}
+
+TEST_F(DigestAvCacheTest, LruEviction)
+{
+  // Size the cache to hold exactly two entries.
+  DigestAvCache probe(30, 10000);
+  probe.put("impi1", IMPU, make_av("ha1"));
+  DigestAvCache cache(30, 2 * probe.size_bytes());
+
+  cache.put("impi1", IMPU, make_av("ha1"));
+  cache.put("impi2", IMPU, make_av("ha1"));
+
+  // Use impi1 so that impi2 is the least recently used.
+  DigestAuthVector av;
+  EXPECT_TRUE(cache.get("impi1", IMPU, av));
+
+  cache.put("impi3", IMPU, make_av("ha1"));
+  EXPECT_TRUE(cache.get("impi1", IMPU, av));
+  EXPECT_FALSE(cache.get("impi2", IMPU, av));
+  EXPECT_TRUE(cache.get("impi3", IMPU, av));
+  EXPECT_EQ(2 * probe.size_bytes(), cache.size_bytes());
+}
+
+TEST_F(DigestAvCacheTest, NoMemoryBudget)
+{
+  DigestAvCache cache(30, 0, true);
+  cache.put(IMPI, IMPU, make_av("ha1"));
+
+  DigestAuthVector av;
+  EXPECT_FALSE(cache.get(IMPI, IMPU, av));
+  EXPECT_TRUE(cache.use_cassandra());
+}
@@ -0,0 +1,125 @@
+/**
+ * @file handlerexecutor_test.cpp UT for the handler executor.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+
+#include "handlerexecutor.h"
+#include "mockstatisticsmanager.hpp"
+
+using ::testing::_;
+
+/// Fixture for HandlerExecutorTest. Records the threads that work runs on.
+class HandlerExecutorTest : public testing::Test
+{
+public:
+  pthread_mutex_t _lock;
+  std::vector<pthread_t> _ran_on;
+
+  HandlerExecutorTest() { pthread_mutex_init(&_lock, NULL); }
+  virtual ~HandlerExecutorTest() { pthread_mutex_destroy(&_lock); }
+
+  void work(int sleep_ms)
+  {
+    usleep(sleep_ms * 1000);
+    pthread_mutex_lock(&_lock);
+    _ran_on.push_back(pthread_self());
+    pthread_mutex_unlock(&_lock);
+  }
+
+  void submit(HandlerExecutor& executor, int sleep_ms = 0)
+  {
+    executor.submit(HandlerExecutor::CX_ANSWER,
+                    boost::bind(&HandlerExecutorTest::work, this, sleep_ms));
+  }
+};
+
+// Before the executor is started, work runs straight away on the caller's
+// thread.
+TEST_F(HandlerExecutorTest, NotStarted)
+{
+  HandlerExecutor executor(2);
+  submit(executor);
+  ASSERT_EQ(1u, _ran_on.size());
+  EXPECT_TRUE(pthread_equal(pthread_self(), _ran_on[0]));
+}
+
+// Once started, work runs on the worker threads.
+TEST_F(HandlerExecutorTest, RunsOnWorkers)
+{
+  HandlerExecutor executor(2);
+  executor.start();
+  submit(executor);
+  submit(executor);
+  executor.stop();
+
+  ASSERT_EQ(2u, _ran_on.size());
+  EXPECT_FALSE(pthread_equal(pthread_self(), _ran_on[0]));
+  EXPECT_FALSE(pthread_equal(pthread_self(), _ran_on[1]));
+}
+
+// Stopping the executor runs everything that was queued first.
+TEST_F(HandlerExecutorTest, StopDrains)
+{
+  HandlerExecutor executor(1);
+  executor.start();
+  submit(executor, 10);
+  submit(executor);
+  submit(executor);
+  submit(executor);
+  executor.stop();
+
+  EXPECT_EQ(4u, _ran_on.size());
+  EXPECT_EQ(0u, executor.depth());
+}
+
+TEST_F(HandlerExecutorTest, Stats)
+{
+  MockStatisticsManager stats;
+  HandlerExecutor executor(1, &stats);
+  executor.start();
+
+  EXPECT_CALL(stats, update_H_handler_queue_depth(1));
+  EXPECT_CALL(stats, update_H_handler_queue_wait_us(_));
+  EXPECT_CALL(stats, update_H_handler_rtr_us(_));
+  executor.submit(HandlerExecutor::RTR,
+                  boost::bind(&HandlerExecutorTest::work, this, 0));
+  executor.stop();
+}
@@ -82,6 +82,8 @@ using ::testing::NiceMock;
 using ::testing::StrictMock;
 using ::testing::Mock;
 using ::testing::AtLeast;
+using ::testing::SaveArg;
+using ::testing::HasSubstr;
 
 const SAS::TrailId FAKE_TRAIL_ID = 0x12345678;
 
@@ -228,6 +230,11 @@ public:
     _caught_fd_msg = msg;
   }
 
+  static void free_msg(struct msg* msg)
+  {
+    fd_msg_free(msg);
+  }
+
   // Helper functions to build the expected json responses in our tests.
   static std::string build_digest_json(DigestAuthVector digest)
   {
@@ -444,6 +451,11 @@ public:
     // Check that the SAR has the type expected by the caller.
     EXPECT_EQ(expected_type, test_i32);
 
+    // We only ask the HSS not to send the User-Data if we've already been
+    // assigned this subscriber.
+    EXPECT_TRUE(sar.user_data_already_available(test_i32));
+    EXPECT_EQ((db_regstate == RegistrationState::NOT_REGISTERED) ? 0 : 1, test_i32);
+
     Cx::ServerAssignmentAnswer saa(_cx_dict,
                                    _mock_stack,
                                    DIAMETER_SUCCESS,
@@ -2018,6 +2030,359 @@ TEST_F(HandlersTest, AvNoPublicIDHSSAKA)
   EXPECT_EQ(build_aka_json(encoded_aka), req.content());
 }
 
+// With an AKA vector pool configured, the MAR asks for a batch of vectors
+// and the spare ones are used for later requests, with the pool refilled in
+// the background once it runs low.
+
+TEST_F(HandlersTest, AkaHSSVectorPool)
+{
+  AkaVectorPool pool(3, 1);
+  ImpiTask::configure_aka_vector_pool(&pool);
+  ImpiTask::Config cfg(true, 300, SCHEME_UNKNOWN, SCHEME_DIGEST, SCHEME_AKA);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI,
+                             "aka",
+                             "?impu=" + IMPU);
+  ImpiAvTask* task = new ImpiAvTask(req, &cfg, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::MultimediaAuthRequest mar(msg);
+  EXPECT_EQ(SCHEME_AKA, mar.sip_auth_scheme());
+  EXPECT_TRUE(mar.sip_number_auth_items(test_i32));
+  EXPECT_EQ(3, test_i32);
+
+  std::vector<AKAAuthVector> avs(3);
+  for (int ii = 0; ii < 3; ii++)
+  {
+    avs[ii].challenge = "challenge" + std::to_string(ii);
+    avs[ii].response = "response";
+    avs[ii].crypt_key = "crypt_key";
+    avs[ii].integrity_key = "integrity_key";
+  }
+  Cx::MultimediaAuthAnswer maa(_cx_dict,
+                               _mock_stack,
+                               DIAMETER_SUCCESS,
+                               SCHEME_AKA,
+                               avs);
+  std::vector<AKAAuthVector> encoded_avs = maa.aka_auth_vectors();
+  ASSERT_EQ(3u, encoded_avs.size());
+
+  // The first vector is returned, and the others are pooled.
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(maa);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  EXPECT_EQ(build_aka_json(encoded_avs[0]), req.content());
+  EXPECT_EQ(2u, pool.count(IMPI));
+
+  // The next request is served from the pool without going to the HSS.
+  MockHttpStack::Request req2(_httpstack,
+                              "/impi/" + IMPI,
+                              "aka",
+                              "?impu=" + IMPU);
+  task = new ImpiAvTask(req2, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  task->run();
+  EXPECT_EQ(build_aka_json(encoded_avs[1]), req2.content());
+
+  // The one after that empties the pool, so a refill is sent to the HSS.
+  MockHttpStack::Request req3(_httpstack,
+                              "/impi/" + IMPI,
+                              "aka",
+                              "?impu=" + IMPU);
+  task = new ImpiAvTask(req3, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  EXPECT_EQ(build_aka_json(encoded_avs[2]), req3.content());
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  Diameter::Message msg2(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::MultimediaAuthRequest mar2(msg2);
+  EXPECT_EQ(IMPI, mar2.impi());
+  EXPECT_EQ(IMPU, mar2.impu());
+  EXPECT_TRUE(mar2.sip_number_auth_items(test_i32));
+  EXPECT_EQ(3, test_i32);
+
+  // The whole of the refill is pooled.
+  _caught_diam_tsx->on_response(maa);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  EXPECT_EQ(3u, pool.count(IMPI));
+
+  ImpiTask::configure_aka_vector_pool(NULL);
+}
+
+// The background refill goes through the Cx concurrency limiter like any
+// other MAR, and if it times out the pool can be refilled again later.
+
+TEST_F(HandlersTest, AkaHSSVectorPoolRefillLimited)
+{
+  CxLimiter limiter(1, 1);
+  HssCacheTask::configure_cx_limiter(&limiter);
+  AkaVectorPool pool(3, 1);
+  std::vector<AKAAuthVector> avs(1);
+  pool.add(IMPI, avs);
+  ImpiTask::configure_aka_vector_pool(&pool);
+  ImpiTask::Config cfg(true, 300, SCHEME_UNKNOWN, SCHEME_DIGEST, SCHEME_AKA);
+
+  // The request empties the pool, so a refill is sent to the HSS.
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI,
+                             "aka",
+                             "?impu=" + IMPU);
+  ImpiAvTask* task = new ImpiAvTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  EXPECT_EQ(1, limiter.in_flight());
+
+  // The refill times out, which frees its slot in the limiter.
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
+  _caught_diam_tsx->on_timeout();
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  EXPECT_EQ(0, limiter.in_flight());
+  EXPECT_EQ(0u, pool.count(IMPI));
+
+  // The refill is no longer in progress, so the next request that empties
+  // the pool tries again.
+  pool.add(IMPI, avs);
+  MockHttpStack::Request req2(_httpstack,
+                              "/impi/" + IMPI,
+                              "aka",
+                              "?impu=" + IMPU);
+  task = new ImpiAvTask(req2, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
+  _caught_diam_tsx->on_timeout();
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  ImpiTask::configure_aka_vector_pool(NULL);
+  HssCacheTask::configure_cx_limiter(NULL);
+}
+
+// A resynchronization request discards any pooled vectors, and goes to the
+// HSS for a single vector.
+
+TEST_F(HandlersTest, AkaHSSVectorPoolResync)
+{
+  AkaVectorPool pool(3, 1);
+  std::vector<AKAAuthVector> avs(2);
+  pool.add(IMPI, avs);
+  ImpiTask::configure_aka_vector_pool(&pool);
+  ImpiTask::Config cfg(true, 300, SCHEME_UNKNOWN, SCHEME_DIGEST, SCHEME_AKA);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI,
+                             "aka",
+                             "?impu=" + IMPU + "&autn=" + SIP_AUTHORIZATION);
+  ImpiAvTask* task = new ImpiAvTask(req, &cfg, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  EXPECT_EQ(0u, pool.count(IMPI));
+
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::MultimediaAuthRequest mar(msg);
+  EXPECT_EQ(SIP_AUTHORIZATION, mar.sip_authorization());
+  EXPECT_TRUE(mar.sip_number_auth_items(test_i32));
+  EXPECT_EQ(1, test_i32);
+
+  // The response isn't pooled.
+  avs.resize(3);
+  Cx::MultimediaAuthAnswer maa(_cx_dict,
+                               _mock_stack,
+                               DIAMETER_SUCCESS,
+                               SCHEME_AKA,
+                               avs);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(maa);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  EXPECT_EQ(0u, pool.count(IMPI));
+
+  ImpiTask::configure_aka_vector_pool(NULL);
+}
+
+TEST_F(HandlersTest, DigestHSSAVCache)
+{
+  DigestAvCache av_cache(30, 10000);
+  ImpiTask::configure_digest_av_cache(&av_cache);
+  ImpiTask::Config cfg(true, 0, SCHEME_UNKNOWN, SCHEME_DIGEST, SCHEME_AKA);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI,
+                             "digest",
+                             "?public_id=" + IMPU);
+  ImpiDigestTask* task = new ImpiDigestTask(req, &cfg, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  DigestAuthVector digest;
+  digest.ha1 = "ha1";
+  digest.realm = "realm";
+  digest.qop = "qop";
+  AKAAuthVector aka;
+  Cx::MultimediaAuthAnswer maa(_cx_dict,
+                               _mock_stack,
+                               DIAMETER_SUCCESS,
+                               SCHEME_DIGEST,
+                               digest,
+                               aka);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(maa);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  EXPECT_EQ(build_digest_json(digest), req.content());
+
+  // The next request is answered from the cache without going to the HSS.
+  MockHttpStack::Request req2(_httpstack,
+                              "/impi/" + IMPI,
+                              "digest",
+                              "?public_id=" + IMPU);
+  task = new ImpiDigestTask(req2, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  task->run();
+  EXPECT_EQ(build_digest_json(digest), req2.content());
+
+  // Once the vector has been invalidated (as happens on a PPR or RTR), the
+  // HSS is queried again.
+  ImpiTask::invalidate_digest_avs(std::vector<std::string>(1, IMPI));
+
+  MockHttpStack::Request req3(_httpstack,
+                              "/impi/" + IMPI,
+                              "digest",
+                              "?public_id=" + IMPU);
+  task = new ImpiDigestTask(req3, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  _caught_diam_tsx->on_timeout();
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  ImpiTask::configure_digest_av_cache(NULL);
+}
+
+TEST_F(HandlersTest, DigestHSSAVCacheCassandra)
+{
+  // Use no memory budget, so that vectors only go to Cassandra.
+  DigestAvCache av_cache(30, 0, true);
+  ImpiTask::configure_digest_av_cache(&av_cache);
+  ImpiTask::Config cfg(true, 0, SCHEME_UNKNOWN, SCHEME_DIGEST, SCHEME_AKA);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI,
+                             "digest",
+                             "?public_id=" + IMPU);
+  ImpiDigestTask* task = new ImpiDigestTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // The vector isn't in Cassandra, so the HSS is queried.
+  MockCache::MockGetAuthVector mock_get_op;
+  EXPECT_CALL(*_cache, create_GetAuthVector(IMPI, IMPU))
+    .WillOnce(Return(&mock_get_op));
+  EXPECT_DO_ASYNC(*_cache, mock_get_op);
+  task->run();
+
+  CassandraStore::Transaction* t = mock_get_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  mock_get_op._cass_status = CassandraStore::NOT_FOUND;
+  mock_get_op._cass_error_text = "error";
+  t->on_failure(&mock_get_op);
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  DigestAuthVector digest;
+  digest.ha1 = "ha1";
+  digest.realm = "realm";
+  digest.qop = "qop";
+  AKAAuthVector aka;
+  Cx::MultimediaAuthAnswer maa(_cx_dict,
+                               _mock_stack,
+                               DIAMETER_SUCCESS,
+                               SCHEME_DIGEST,
+                               digest,
+                               aka);
+
+  // The vector from the MAA is written to Cassandra along with the public
+  // ID it was requested for, both with the digest cache TTL.
+  MockCache::MockPutAuthVector mock_put_av_op;
+  EXPECT_CALL(*_cache, create_PutAuthVector(IMPI, _, _, 30))
+    .WillOnce(Return(&mock_put_av_op));
+  EXPECT_DO_ASYNC(*_cache, mock_put_av_op);
+  MockCache::MockPutAssociatedPublicID mock_put_impu_op;
+  EXPECT_CALL(*_cache, create_PutAssociatedPublicID(IMPI, IMPU, _, 30))
+    .WillOnce(Return(&mock_put_impu_op));
+  EXPECT_DO_ASYNC(*_cache, mock_put_impu_op);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(maa);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  EXPECT_EQ(build_digest_json(digest), req.content());
+
+  // The next request finds the vector in Cassandra.
+  MockHttpStack::Request req2(_httpstack,
+                              "/impi/" + IMPI,
+                              "digest",
+                              "?public_id=" + IMPU);
+  task = new ImpiDigestTask(req2, &cfg, FAKE_TRAIL_ID);
+  MockCache::MockGetAuthVector mock_get_op2;
+  EXPECT_CALL(*_cache, create_GetAuthVector(IMPI, IMPU))
+    .WillOnce(Return(&mock_get_op2));
+  EXPECT_DO_ASYNC(*_cache, mock_get_op2);
+  task->run();
+
+  t = mock_get_op2.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_get_op2, get_result(_))
+    .WillRepeatedly(SetArgReferee<0>(digest));
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  t->on_success(&mock_get_op2);
+  EXPECT_EQ(build_digest_json(digest), req2.content());
+
+  // Invalidating the private ID deletes the vector from Cassandra.
+  MockCache::MockDeleteAuthVector mock_delete_op;
+  EXPECT_CALL(*_cache, create_DeleteAuthVector(std::vector<std::string>(1, IMPI), _))
+    .WillOnce(Return(&mock_delete_op));
+  EXPECT_DO_ASYNC(*_cache, mock_delete_op);
+  ImpiTask::invalidate_digest_avs(std::vector<std::string>(1, IMPI));
+
+  ImpiTask::configure_digest_av_cache(NULL);
+}
+
 TEST_F(HandlersTest, AuthInvalidScheme)
 {
   // This test tests an Impi Av task case with an invalid scheme on the HTTP
@@ -2100,33 +2465,197 @@ TEST_F(HandlersTest, IMSSubscriptionHSS_ReregWithoutSAR)
   reg_data_template_no_sar("reg", true, RegistrationState::REGISTERED);
 }
 
-// Call to a registered subscriber
+// Re-registration where the HSS doesn't resend the User-Data we already
+// have cached.
 
-TEST_F(HandlersTest, IMSSubscriptionCallHSS)
+TEST_F(HandlersTest, IMSSubscriptionHSS_ReregCachedUserData)
 {
-  reg_data_template_no_sar("call", true, RegistrationState::REGISTERED);
-}
-
-// Call to an unregistered subscriber (one whose data is already
-// stored in the cache)
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "?private_id=" + IMPI,
+                             "{\"reqtype\": \"reg\"}",
+                             htp_method_PUT);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
 
-TEST_F(HandlersTest, IMSSubscriptionCallHSSUnregisteredService)
-{
-  reg_data_template_no_sar("call", true, RegistrationState::UNREGISTERED, 3600, REGDATA_RESULT_UNREG);
-}
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
 
-// Call to a not-registered subscriber (one whose data is not already
-// stored in the cache)
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(DoAll(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION), SetArgReferee<1>(500)));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(DoAll(SetArgReferee<0>(RegistrationState::REGISTERED), SetArgReferee<1>(500)));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPI_IN_VECTOR));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(FULL_CHARGING_ADDRESSES));
 
-TEST_F(HandlersTest, IMSSubscriptionCallHSSNewUnregisteredService)
-{
-  reg_data_template("call", true, false, RegistrationState::NOT_REGISTERED, 3, 0, REGDATA_RESULT_UNREG, RegistrationState::UNREGISTERED);
-}
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  t->on_success(&mock_op);
 
-// Test the three types of deregistration flows
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::ServerAssignmentRequest sar(msg);
+  EXPECT_TRUE(sar.user_data_already_available(test_i32));
+  EXPECT_EQ(1, test_i32);
 
-TEST_F(HandlersTest, IMSSubscriptionDeregHSS)
-{
+  // The SAA has neither User-Data nor charging addresses, so the cached
+  // values are written back with a refreshed TTL.
+  Cx::ServerAssignmentAnswer saa(_cx_dict,
+                                 _mock_stack,
+                                 DIAMETER_SUCCESS,
+                                 "",
+                                 NO_CHARGING_ADDRESSES);
+
+  MockCache::MockPutRegData mock_op2;
+  EXPECT_CALL(*_cache, create_PutRegData(IMPU_REG_SET, _, 7200))
+    .WillOnce(Return(&mock_op2));
+  EXPECT_CALL(mock_op2, with_xml(IMPU_IMS_SUBSCRIPTION))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_CALL(mock_op2, with_reg_state(RegistrationState::REGISTERED))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_CALL(mock_op2, with_associated_impis(IMPI_IN_VECTOR))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_CALL(mock_op2, with_charging_addrs(_))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_DO_ASYNC(*_cache, mock_op2);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(saa);
+
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+}
+
+// Re-registrations over the RE_REGISTRATION SAR budget are answered from
+// the cache, until the record gets close to expiry.
+
+TEST_F(HandlersTest, IMSSubscriptionHSS_ReregPacedSAR)
+{
+  ImpuRegDataTask::configure_reregistration_sar_rate(0.001);
+
+  // The first re-registration uses up the budget, so the second is deferred.
+  reg_data_template("reg", true, false, RegistrationState::REGISTERED, 2, 3000);
+  reg_data_template_no_sar("reg", true, RegistrationState::REGISTERED, 3000);
+
+  // Once less than half the re-registration time is left, send the SAR
+  // anyway.
+  reg_data_template("reg", true, false, RegistrationState::REGISTERED, 2, 1000);
+
+  ImpuRegDataTask::configure_reregistration_sar_rate(0);
+}
+
+// With jitter configured, registration data is cached with a TTL somewhere
+// between twice the re-registration time and that plus the jitter, and the
+// same TTL is used for every row written for the subscriber.
+
+TEST_F(HandlersTest, IMSSubscriptionHSS_JitteredTTL)
+{
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "?private_id=" + IMPI,
+                             "{\"reqtype\": \"reg\"}",
+                             htp_method_PUT);
+  ImpuRegDataTask::Config cfg(true, 3600, 200, 600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(DoAll(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION), SetArgReferee<1>(0)));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(DoAll(SetArgReferee<0>(RegistrationState::NOT_REGISTERED), SetArgReferee<1>(0)));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(ASSOCIATED_IDENTITIES));
+
+  // This is a new binding, so the IMPI is associated with the IRS.
+  int assoc_ttl = 0;
+  MockCache::MockPutAssociatedPrivateID mock_op2;
+  EXPECT_CALL(*_cache, create_PutAssociatedPrivateID(IMPU_REG_SET, IMPI, _, _))
+    .WillOnce(DoAll(SaveArg<3>(&assoc_ttl), Return(&mock_op2)));
+  EXPECT_DO_ASYNC(*_cache, mock_op2);
+
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  t->on_success(&mock_op);
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  Cx::ServerAssignmentAnswer saa(_cx_dict,
+                                 _mock_stack,
+                                 DIAMETER_SUCCESS,
+                                 IMPU_IMS_SUBSCRIPTION,
+                                 NO_CHARGING_ADDRESSES);
+
+  int reg_data_ttl = 0;
+  MockCache::MockPutRegData mock_op3;
+  EXPECT_CALL(*_cache, create_PutRegData(IMPU_REG_SET, _, _))
+    .WillOnce(DoAll(SaveArg<2>(&reg_data_ttl), Return(&mock_op3)));
+  EXPECT_CALL(mock_op3, with_xml(IMPU_IMS_SUBSCRIPTION))
+    .WillOnce(ReturnRef(mock_op3));
+  EXPECT_CALL(mock_op3, with_reg_state(RegistrationState::REGISTERED))
+    .WillOnce(ReturnRef(mock_op3));
+  EXPECT_CALL(mock_op3, with_associated_impis(IMPI_IN_VECTOR))
+    .WillOnce(ReturnRef(mock_op3));
+  EXPECT_CALL(mock_op3, with_charging_addrs(_))
+    .WillOnce(ReturnRef(mock_op3));
+  EXPECT_DO_ASYNC(*_cache, mock_op3);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(saa);
+
+  EXPECT_LE(7200, reg_data_ttl);
+  EXPECT_GT(7800, reg_data_ttl);
+  EXPECT_EQ(reg_data_ttl, assoc_ttl);
+
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+}
+
+// Call to a registered subscriber
+
+TEST_F(HandlersTest, IMSSubscriptionCallHSS)
+{
+  reg_data_template_no_sar("call", true, RegistrationState::REGISTERED);
+}
+
+// Call to an unregistered subscriber (one whose data is already
+// stored in the cache)
+
+TEST_F(HandlersTest, IMSSubscriptionCallHSSUnregisteredService)
+{
+  reg_data_template_no_sar("call", true, RegistrationState::UNREGISTERED, 3600, REGDATA_RESULT_UNREG);
+}
+
+// Call to a not-registered subscriber (one whose data is not already
+// stored in the cache)
+
+TEST_F(HandlersTest, IMSSubscriptionCallHSSNewUnregisteredService)
+{
+  reg_data_template("call", true, false, RegistrationState::NOT_REGISTERED, 3, 0, REGDATA_RESULT_UNREG, RegistrationState::UNREGISTERED);
+}
+
+// Test the three types of deregistration flows
+
+TEST_F(HandlersTest, IMSSubscriptionDeregHSS)
+{
   reg_data_template_with_deletion("dereg-user", true, RegistrationState::REGISTERED, 5);
 }
 
@@ -2467,56 +2996,22 @@ TEST_F(HandlersTest, IMSSubscriptionGet)
   EXPECT_EQ(REGDATA_RESULT, req.content());
 }
 
-// Test error handling
-
-// If we don't recognise the body, we should reject the request
-
-TEST_F(HandlersTest, IMSSubscriptionInvalidType)
+// When streaming is enabled, the IMS subscription is copied into the
+// response as it is, rather than being reformatted.
+TEST_F(HandlersTest, IMSSubscriptionGetStreamed)
 {
-  MockHttpStack::Request req(_httpstack,
-                             "/impu/" + IMPU + "/reg-data",
-                             "",
-                             "",
-                             "invalid",
-                             htp_method_PUT);
-  ImpuRegDataTask::Config cfg(false, 3600);
-  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
-
-  EXPECT_CALL(*_httpstack, send_reply(_, 400, _));
-  task->run();
-}
+  ImpuRegDataTask::configure_reg_data_streaming(true);
 
-// If we don't get a PUT or GET, we should reject the request
-
-TEST_F(HandlersTest, IMSSubscriptionWrongMethod)
-{
   MockHttpStack::Request req(_httpstack,
                              "/impu/" + IMPU + "/reg-data",
                              "",
                              "",
-                             "{\"reqtype\": \"reg\"}",
-                             htp_method_DELETE);
-  ImpuRegDataTask::Config cfg(false, 3600);
-  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
-
-  EXPECT_CALL(*_httpstack, send_reply(_, 405, _));
-  task->run();
-}
-
-// HSS USER_UNKNOWN errors should translate into a 404
-
-TEST_F(HandlersTest, IMSSubscriptionUserUnknownDereg)
-{
-  MockHttpStack::Request req(_httpstack,
-                             "/impu/" + IMPU + "/reg-data",
                              "",
-                             "?private_id=" + ASSOCIATED_IDENTITY1,
-                             "{\"reqtype\": \"dereg-timeout\"}",
-                             htp_method_PUT);
+                             htp_method_GET);
   ImpuRegDataTask::Config cfg(true, 3600);
   ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
-  MockCache::MockGetRegData mock_op;
 
+  MockCache::MockGetRegData mock_op;
   EXPECT_CALL(*_cache, create_GetRegData(IMPU))
     .WillOnce(Return(&mock_op));
   EXPECT_DO_ASYNC(*_cache, mock_op);
@@ -2528,53 +3023,36 @@ TEST_F(HandlersTest, IMSSubscriptionUserUnknownDereg)
     .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
   EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
     .WillRepeatedly(SetArgReferee<0>(RegistrationState::REGISTERED));
-  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1))
-    .WillRepeatedly(SetArgReferee<0>(ASSOCIATED_IDENTITY1_IN_VECTOR));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1));
   EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
     .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
 
-  MockCache::MockDeletePublicIDs mock_op2;
-  EXPECT_CALL(*_cache, create_DeletePublicIDs(IMPU_REG_SET, _, _))
-    .WillOnce(Return(&mock_op2));
-  EXPECT_DO_ASYNC(*_cache, mock_op2);
-
-  EXPECT_CALL(*_mock_stack, send(_, _, 200))
-    .Times(1)
-    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
-  std::string error_text = "error";
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
   t->on_success(&mock_op);
 
-  ASSERT_FALSE(_caught_diam_tsx == NULL);
-  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
-  Cx::ServerAssignmentRequest sar(msg);
-
-  Cx::ServerAssignmentAnswer saa(_cx_dict,
-                                 _mock_stack,
-                                 DIAMETER_ERROR_USER_UNKNOWN,
-                                 "",
-                                 NO_CHARGING_ADDRESSES);
-
-  EXPECT_CALL(*_httpstack, send_reply(_, 404, _));
-  _caught_diam_tsx->on_response(saa);
-
-  CassandraStore::Transaction* t2 = mock_op2.get_trx();
-  ASSERT_FALSE(t2 == NULL);
+  EXPECT_EQ("<ClearwaterRegData>\n\t<RegistrationState>REGISTERED</RegistrationState>\n\t"
+            "<IMSSubscription><PrivateID>" + IMPI + "</PrivateID><ServiceProfile>"
+            "<PublicIdentity><Identity>" + IMPU + "</Identity></PublicIdentity>"
+            "<PublicIdentity><Identity>" + IMPU4 + "</Identity></PublicIdentity>"
+            "</ServiceProfile></IMSSubscription>\n</ClearwaterRegData>\n\n",
+            req.content());
 
-  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
-  _caught_fd_msg = NULL;
+  ImpuRegDataTask::configure_reg_data_streaming(false);
 }
 
-// Other HSS errors should translate into a 500 error
-
-TEST_F(HandlersTest, IMSSubscriptionOtherErrorCallReg)
+// Reg-data requests are recorded by the hot key tracker, and the tracker's
+// warm-up reads the registration data back into the cache.
+TEST_F(HandlersTest, IMSSubscriptionRecordsHotKey)
 {
+  HotKeyTracker tracker("", 10);
+  HssCacheTask::configure_hot_key_tracker(&tracker);
+
   MockHttpStack::Request req(_httpstack,
                              "/impu/" + IMPU + "/reg-data",
                              "",
-                             "?private_id=" + IMPI,
-                             "{\"reqtype\": \"call\"}",
-                             htp_method_PUT);
-  req.method();
+                             "",
+                             "",
+                             htp_method_GET);
   ImpuRegDataTask::Config cfg(true, 3600);
   ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
 
@@ -2584,520 +3062,1906 @@ TEST_F(HandlersTest, IMSSubscriptionOtherErrorCallReg)
   EXPECT_DO_ASYNC(*_cache, mock_op);
   task->run();
 
+  EXPECT_EQ(IMPU_IN_VECTOR, tracker.hot_keys());
+  HssCacheTask::configure_hot_key_tracker(NULL);
+
+  // Tidy up the task.
   CassandraStore::Transaction* t = mock_op.get_trx();
   ASSERT_FALSE(t == NULL);
-  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
-    .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
-  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
-    .WillRepeatedly(SetArgReferee<0>(RegistrationState::NOT_REGISTERED));
-  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1))
-    .WillRepeatedly(SetArgReferee<0>(IMPI_IN_VECTOR));
-  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
-    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+  EXPECT_CALL(*_httpstack, send_reply(_, 404, _));
+  mock_op._cass_status = CassandraStore::NOT_FOUND;
+  mock_op._cass_error_text = "error";
+  t->on_failure(&mock_op);
+}
 
-  EXPECT_CALL(*_mock_stack, send(_, _, 200))
-    .Times(1)
-    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
-  std::string error_text = "error";
-  t->on_success(&mock_op);
+TEST_F(HandlersTest, IMSSubscriptionWarmUp)
+{
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  ImpuRegDataTask::warm_up(IMPU);
 
-  ASSERT_FALSE(_caught_diam_tsx == NULL);
-  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
-  Cx::ServerAssignmentRequest sar(msg);
+  // Without a reg-data cache there is nothing to prime, so the result isn't
+  // even read.
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  t->on_success(&mock_op);
+}
 
-  Cx::ServerAssignmentAnswer saa(_cx_dict,
-                                 _mock_stack,
-                                 0,
-                                 "",
-                                 NO_CHARGING_ADDRESSES);
+// The reg-data ETag changes whenever anything in the response body would.
+TEST_F(HandlersTest, IMSSubscriptionETag)
+{
+  std::string inputs = ImpuRegDataTask::reg_data_inputs(RegistrationState::REGISTERED,
+                                                        IMPU_IMS_SUBSCRIPTION,
+                                                        NO_CHARGING_ADDRESSES);
+  std::string etag = ImpuRegDataTask::reg_data_etag(inputs);
+  EXPECT_EQ(18u, etag.length());
+  EXPECT_EQ('"', etag[0]);
+  EXPECT_EQ(inputs,
+            ImpuRegDataTask::reg_data_inputs(RegistrationState::REGISTERED,
+                                             IMPU_IMS_SUBSCRIPTION,
+                                             NO_CHARGING_ADDRESSES));
+  EXPECT_EQ(etag, ImpuRegDataTask::reg_data_etag(inputs));
+  EXPECT_NE(etag,
+            ImpuRegDataTask::reg_data_etag(
+              ImpuRegDataTask::reg_data_inputs(RegistrationState::UNREGISTERED,
+                                               IMPU_IMS_SUBSCRIPTION,
+                                               NO_CHARGING_ADDRESSES)));
+  EXPECT_NE(etag,
+            ImpuRegDataTask::reg_data_etag(
+              ImpuRegDataTask::reg_data_inputs(RegistrationState::REGISTERED,
+                                               IMPU_IMS_SUBSCRIPTION_INVALID,
+                                               NO_CHARGING_ADDRESSES)));
+  EXPECT_NE(etag,
+            ImpuRegDataTask::reg_data_etag(
+              ImpuRegDataTask::reg_data_inputs(RegistrationState::REGISTERED,
+                                               IMPU_IMS_SUBSCRIPTION,
+                                               FULL_CHARGING_ADDRESSES)));
+}
 
-  EXPECT_CALL(*_httpstack, send_reply(_, 500, _));
-  _caught_diam_tsx->on_response(saa);
+// Each part of the inputs is length-prefixed, so moving characters from one
+// part to the next gives different inputs.
+TEST_F(HandlersTest, IMSSubscriptionInputsDelimited)
+{
+  ChargingAddresses one_ccf;
+  one_ccf.ccfs.push_back("ccf1ccf:ccf2");
+  ChargingAddresses two_ccfs;
+  two_ccfs.ccfs.push_back("ccf1");
+  two_ccfs.ccfs.push_back("ccf2");
+  EXPECT_NE(ImpuRegDataTask::reg_data_inputs(RegistrationState::REGISTERED,
+                                             IMPU_IMS_SUBSCRIPTION,
+                                             one_ccf),
+            ImpuRegDataTask::reg_data_inputs(RegistrationState::REGISTERED,
+                                             IMPU_IMS_SUBSCRIPTION,
+                                             two_ccfs));
+}
 
-  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
-  _caught_fd_msg = NULL;
+TEST_F(HandlersTest, IMSSubscriptionETagMatching)
+{
+  std::string etag = "\"0123456789abcdef\"";
+  EXPECT_TRUE(ImpuRegDataTask::etag_matches(etag, etag));
+  EXPECT_TRUE(ImpuRegDataTask::etag_matches("W/" + etag, etag));
+  EXPECT_TRUE(ImpuRegDataTask::etag_matches("\"other\", " + etag, etag));
+  EXPECT_TRUE(ImpuRegDataTask::etag_matches("*", etag));
+  EXPECT_FALSE(ImpuRegDataTask::etag_matches("\"other\"", etag));
+  EXPECT_FALSE(ImpuRegDataTask::etag_matches("\"0123456789abcdef", etag));
+
+  // The gzipped body has its own ETag, which matches too.
+  std::string gz_etag = ImpuRegDataTask::gzip_etag(etag);
+  EXPECT_EQ("\"0123456789abcdef-gz\"", gz_etag);
+  EXPECT_TRUE(ImpuRegDataTask::etag_matches(gz_etag, etag));
+  EXPECT_TRUE(ImpuRegDataTask::etag_matches("W/" + gz_etag, etag));
+  EXPECT_FALSE(ImpuRegDataTask::etag_matches(etag, gz_etag));
 }
 
-// Cache not found failures should translate into a 404 Not Found errors
-TEST_F(HandlersTest, IMSSubscriptionCacheNotFound)
+// A batch of reg-data requests reads the cache once for all of them, and
+// returns all the answers in one response.
+TEST_F(HandlersTest, IMSSubscriptionBatch)
 {
-  // This test tests an IMS Subscription handler case where the cache
-  // doesn't return a result. Start by building the HTTP request which will
-  // invoke a cache lookup.
   MockHttpStack::Request req(_httpstack,
-                             "/impu/" + IMPU,
+                             "/impu/batch/reg-data",
                              "",
-                             "");
-
-  ImpuIMSSubscriptionTask::Config cfg(false, 3600);
-  ImpuIMSSubscriptionTask* task = new ImpuIMSSubscriptionTask(req, &cfg, FAKE_TRAIL_ID);
+                             "",
+                             "[{\"impu\": \"" + IMPU + "\"}, "
+                             "{\"impu\": \"" + IMPU + "\", \"private_id\": \"" + IMPI + "\", \"reqtype\": \"call\"}]",
+                             htp_method_POST);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataBatchTask* task = new ImpuRegDataBatchTask(req, &cfg, FAKE_TRAIL_ID);
 
-  // Once the task's run function is called, expect to lookup IMS
-  // subscription information for the specified public ID.
-  MockCache::MockGetRegData mock_op;
-  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+  MockCache::MockMultiGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_MultiGetRegData(std::vector<std::string>({IMPU, IMPU})))
     .WillOnce(Return(&mock_op));
   EXPECT_DO_ASYNC(*_cache, mock_op);
-
   task->run();
 
-  // Confirm that the cache transaction is not NULL.
+  // Both entries get the same registration data. The subscriber is
+  // registered, so neither needs to go to the HSS.
+  MockCache::MockGetRegData mock_get_op;
+  EXPECT_CALL(mock_op, get_reg_data(IMPU)).Times(2)
+    .WillRepeatedly(Return(&mock_get_op));
+  EXPECT_CALL(mock_get_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
+  EXPECT_CALL(mock_get_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(RegistrationState::REGISTERED));
+  EXPECT_CALL(mock_get_op, get_associated_impis(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPI_IN_VECTOR));
+  EXPECT_CALL(mock_get_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+
   CassandraStore::Transaction* t = mock_op.get_trx();
   ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  t->on_success(&mock_op);
 
-  // Expect a 404 HTTP response once the cache returns an error to the task.
-  EXPECT_CALL(*_httpstack, send_reply(_, 404, _));
-
-  mock_op._cass_status = CassandraStore::NOT_FOUND;
-  mock_op._cass_error_text = "error";
-  t->on_failure(&mock_op);
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  writer.StartObject();
+  writer.String(JSON_RESPONSES.c_str());
+  writer.StartArray();
+  for (int ii = 0; ii < 2; ii++)
+  {
+    writer.StartObject();
+    writer.String(JSON_IMPU.c_str());
+    writer.String(IMPU.c_str());
+    writer.String(JSON_STATUS.c_str());
+    writer.Int(200);
+    writer.String(JSON_BODY.c_str());
+    writer.String(REGDATA_RESULT.c_str());
+    writer.EndObject();
+  }
+  writer.EndArray();
+  writer.EndObject();
+  EXPECT_EQ(sb.GetString(), req.content());
 }
 
-// Connection failures should translate into a 503 Service Unavailable error
-TEST_F(HandlersTest, IMSSubscriptionCacheConnectionFailure)
+// Each entry in a batch fails in the same way as a single request if the
+// cache read fails.
+TEST_F(HandlersTest, IMSSubscriptionBatchCacheFailure)
 {
-  // This test tests an IMS Subscription handler case where the cache
-  // has a connection failure. Start by building the HTTP request which
-  // will invoke a cache lookup.
   MockHttpStack::Request req(_httpstack,
-                             "/impu/" + IMPU,
+                             "/impu/batch/reg-data",
                              "",
-                             "");
-
-  ImpuIMSSubscriptionTask::Config cfg(false, 3600);
-  ImpuIMSSubscriptionTask* task = new ImpuIMSSubscriptionTask(req, &cfg, FAKE_TRAIL_ID);
+                             "",
+                             "[{\"impu\": \"" + IMPU + "\"}]",
+                             htp_method_POST);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataBatchTask* task = new ImpuRegDataBatchTask(req, &cfg, FAKE_TRAIL_ID);
 
-  // Once the task's run function is called, expect to lookup IMS
-  // subscription information for the specified public ID.
-  MockCache::MockGetRegData mock_op;
-  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+  MockCache::MockMultiGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_MultiGetRegData(IMPU_IN_VECTOR))
     .WillOnce(Return(&mock_op));
   EXPECT_DO_ASYNC(*_cache, mock_op);
-
   task->run();
 
-  // Confirm that the cache transaction is not NULL.
   CassandraStore::Transaction* t = mock_op.get_trx();
   ASSERT_FALSE(t == NULL);
-
-  // Expect a 503 HTTP response once the cache returns an error to the task.
-  EXPECT_CALL(*_httpstack, send_reply(_, 503, _));
-
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
   mock_op._cass_status = CassandraStore::CONNECTION_ERROR;
   mock_op._cass_error_text = "error";
   t->on_failure(&mock_op);
+
+  EXPECT_EQ("{\"responses\":[{\"impu\":\"" + IMPU + "\",\"status\":503}]}",
+            req.content());
 }
 
-// Cache failures should translate into a 504 Bad Gateway error
-TEST_F(HandlersTest, IMSSubscriptionCacheFailure)
+// If only some public IDs in a batch couldn't be read, only their entries
+// fail.
+TEST_F(HandlersTest, IMSSubscriptionBatchPartialCacheFailure)
 {
-  // This test tests an IMS Subscription handler case where the cache
-  // has an unknown failure. Start by building the HTTP request which
-  // will invoke a cache lookup.
   MockHttpStack::Request req(_httpstack,
-                             "/impu/" + IMPU,
+                             "/impu/batch/reg-data",
                              "",
-                             "");
-
-  ImpuIMSSubscriptionTask::Config cfg(false, 3600);
-  ImpuIMSSubscriptionTask* task = new ImpuIMSSubscriptionTask(req, &cfg, FAKE_TRAIL_ID);
+                             "",
+                             "[{\"impu\": \"" + IMPU + "\"}, {\"impu\": \"" + IMPU2 + "\"}]",
+                             htp_method_POST);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataBatchTask* task = new ImpuRegDataBatchTask(req, &cfg, FAKE_TRAIL_ID);
 
-  // Once the task's run function is called, expect to lookup IMS
-  // subscription information for the specified public ID.
-  MockCache::MockGetRegData mock_op;
-  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+  MockCache::MockMultiGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_MultiGetRegData(std::vector<std::string>({IMPU, IMPU2})))
     .WillOnce(Return(&mock_op));
   EXPECT_DO_ASYNC(*_cache, mock_op);
-
   task->run();
 
-  // Confirm that the cache transaction is not NULL.
+  MockCache::MockGetRegData mock_get_op;
+  EXPECT_CALL(mock_op, get_reg_data(IMPU))
+    .WillOnce(Return(&mock_get_op));
+  EXPECT_CALL(mock_get_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
+  EXPECT_CALL(mock_get_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(RegistrationState::REGISTERED));
+  EXPECT_CALL(mock_get_op, get_associated_impis(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPI_IN_VECTOR));
+  EXPECT_CALL(mock_get_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+  EXPECT_CALL(mock_op, get_reg_data(IMPU2))
+    .WillOnce(Return((Cache::GetRegData*)NULL));
+  EXPECT_CALL(mock_op, get_error(IMPU2, _, _))
+    .WillOnce(SetArgReferee<1>(CassandraStore::UNKNOWN_ERROR));
+
   CassandraStore::Transaction* t = mock_op.get_trx();
   ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  t->on_success(&mock_op);
 
-  // Expect a 504 HTTP response once the cache returns an error to the task.
-  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
-
-  mock_op._cass_status = CassandraStore::UNKNOWN_ERROR;
-  mock_op._cass_error_text = "error";
-  t->on_failure(&mock_op);
+  EXPECT_THAT(req.content(), HasSubstr("{\"impu\":\"" + IMPU + "\",\"status\":200,"));
+  EXPECT_THAT(req.content(), HasSubstr("{\"impu\":\"" + IMPU2 + "\",\"status\":504}"));
 }
 
-TEST_F(HandlersTest, RegistrationStatusHSSTimeout)
+// A batch with an invalid entry is rejected without doing anything.
+TEST_F(HandlersTest, IMSSubscriptionBatchInvalidEntry)
 {
-  // This test tests the common diameter timeout function. Build the HTTP request
-  // which will invoke a UAR to be sent to the HSS.
   MockHttpStack::Request req(_httpstack,
-                             "/impi/" + IMPI + "/",
-                             "registration-status",
-                             "?impu=" + IMPU);
-
-  ImpiRegistrationStatusTask::Config cfg(true);
-  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+                             "/impu/batch/reg-data",
+                             "",
+                             "",
+                             "[{\"impu\": \"" + IMPU + "\"}, "
+                             "{\"impu\": \"" + IMPU2 + "\", \"reqtype\": \"invalid\"}]",
+                             htp_method_POST);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataBatchTask* task = new ImpuRegDataBatchTask(req, &cfg, FAKE_TRAIL_ID);
 
-  // Once the task's run function is called, expect a diameter message to be
-  // sent. We don't bother checking the diameter message is as expected here. This
-  // is done by other tests.
-  EXPECT_CALL(*_mock_stack, send(_, _, 200))
-    .Times(1)
-    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  EXPECT_CALL(*_httpstack, send_reply(_, 400, _));
   task->run();
-  ASSERT_FALSE(_caught_diam_tsx == NULL);
-
-  // Expect a 504 response once we notify the task about the timeout error.
-  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
-  _caught_diam_tsx->on_timeout();
-  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
-  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
 }
 
-// This test checks that if the /impi/X/registration-status endpoint
-// returns a non-200 response, the health checker is not triggered.
-TEST_F(HandlersTest, RegistrationStatusHSSTimeoutFailsHealthCheck)
+TEST_F(HandlersTest, IMSSubscriptionBatchNotArray)
 {
-  MockHealthChecker* hc = new MockHealthChecker();
-  HssCacheTask::configure_health_checker(hc);
-
-  // Inject the appropriate HTTP request.
   MockHttpStack::Request req(_httpstack,
-                             "/impi/" + IMPI + "/",
-                             "registration-status",
-                             "?impu=" + IMPU);
-  ImpiRegistrationStatusTask::Config cfg(true);
-  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
-  EXPECT_CALL(*_mock_stack, send(_, _, 200))
-    .Times(1)
-    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+                             "/impu/batch/reg-data",
+                             "",
+                             "",
+                             "{\"impu\": \"" + IMPU + "\"}",
+                             htp_method_POST);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataBatchTask* task = new ImpuRegDataBatchTask(req, &cfg, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 400, _));
   task->run();
-  ASSERT_FALSE(_caught_diam_tsx == NULL);
+}
 
-  // Expect a 504 response once we notify the task about the timeout
-  // error. This should not trigger the health-checker.
-  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
-  EXPECT_CALL(*hc, health_check_passed()).Times(0);
-  _caught_diam_tsx->on_timeout();
+TEST_F(HandlersTest, IMSSubscriptionBatchWrongMethod)
+{
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/batch/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataBatchTask* task = new ImpuRegDataBatchTask(req, &cfg, FAKE_TRAIL_ID);
 
-  // Tidy up.
-  HssCacheTask::configure_health_checker(NULL);
-  delete hc; hc = NULL;
-  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
-  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  EXPECT_CALL(*_httpstack, send_reply(_, 405, _));
+  task->run();
 }
 
-TEST_F(HandlersTest, RegistrationStatus)
+// Test error handling
+
+// If we don't recognise the body, we should reject the request
+
+TEST_F(HandlersTest, IMSSubscriptionInvalidType)
 {
-  // This test tests a mainline Registration Status task case. Build the HTTP request
-  // which will invoke a UAR to be sent to the HSS.
   MockHttpStack::Request req(_httpstack,
-                             "/impi/" + IMPI + "/",
-                             "registration-status",
-                             "?impu=" + IMPU);
-
-  ImpiRegistrationStatusTask::Config cfg(true);
-  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "invalid",
+                             htp_method_PUT);
+  ImpuRegDataTask::Config cfg(false, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
 
-  // Once the task's run function is called, expect a diameter message to be
-  // sent.
-  EXPECT_CALL(*_mock_stack, send(_, _, 200))
-    .Times(1)
-    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  EXPECT_CALL(*_httpstack, send_reply(_, 400, _));
   task->run();
-  ASSERT_FALSE(_caught_diam_tsx == NULL);
+}
 
-  // Turn the caught Diameter msg structure into a UAR and check its contents.
-  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
-  Cx::UserAuthorizationRequest uar(msg);
-  EXPECT_TRUE(uar.get_str_from_avp(_cx_dict->DESTINATION_REALM, test_str));
-  EXPECT_EQ(DEST_REALM, test_str);
-  EXPECT_TRUE(uar.get_str_from_avp(_cx_dict->DESTINATION_HOST, test_str));
-  EXPECT_EQ(DEST_HOST, test_str);
-  EXPECT_EQ(IMPI, uar.impi());
-  EXPECT_EQ(IMPU, uar.impu());
-  EXPECT_TRUE(uar.visited_network(test_str));
-  EXPECT_EQ(DEST_REALM, test_str);
-  EXPECT_TRUE(uar.auth_type(test_i32));
-  EXPECT_EQ(0, test_i32);
+// If we don't get a PUT or GET, we should reject the request
 
-  // Build a UAA and expect a successful HTTP response.
-  Cx::UserAuthorizationAnswer uaa(_cx_dict,
-                                  _mock_stack,
-                                  DIAMETER_SUCCESS,
-                                  0,
-                                  SERVER_NAME,
-                                  CAPABILITIES);
-  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
-  _caught_diam_tsx->on_response(uaa);
-  _caught_fd_msg = NULL;
-  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+TEST_F(HandlersTest, IMSSubscriptionWrongMethod)
+{
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "{\"reqtype\": \"reg\"}",
+                             htp_method_DELETE);
+  ImpuRegDataTask::Config cfg(false, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
 
-  // Build the expected JSON response and check it's correct.
-  EXPECT_EQ(build_icscf_json(DIAMETER_SUCCESS, SERVER_NAME, CAPABILITIES), req.content());
+  EXPECT_CALL(*_httpstack, send_reply(_, 405, _));
+  task->run();
 }
 
-// 200 OK responses to the /impi/X/registration-status URL should
-// trigger the health-checker. Test that this happens.
-TEST_F(HandlersTest, RegistrationStatusPassesHealthCheck)
-{
-  MockHealthChecker* hc = new MockHealthChecker();
-  HssCacheTask::configure_health_checker(hc);
+// HSS USER_UNKNOWN errors should translate into a 404
 
-  // Set up a request into the right URL.
+TEST_F(HandlersTest, IMSSubscriptionUserUnknownDereg)
+{
   MockHttpStack::Request req(_httpstack,
-                             "/impi/" + IMPI + "/",
-                             "registration-status",
-                             "?impu=" + IMPU);
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "?private_id=" + ASSOCIATED_IDENTITY1,
+                             "{\"reqtype\": \"dereg-timeout\"}",
+                             htp_method_PUT);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+  MockCache::MockGetRegData mock_op;
 
-  ImpiRegistrationStatusTask::Config cfg(true);
-  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(RegistrationState::REGISTERED));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(ASSOCIATED_IDENTITY1_IN_VECTOR));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+
+  MockCache::MockDeletePublicIDs mock_op2;
+  EXPECT_CALL(*_cache, create_DeletePublicIDs(IMPU_REG_SET, _, _))
+    .WillOnce(Return(&mock_op2));
+  EXPECT_DO_ASYNC(*_cache, mock_op2);
 
-  // Mock out a UAA response in order to trigger a 200 OK return code.
   EXPECT_CALL(*_mock_stack, send(_, _, 200))
     .Times(1)
     .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
-  task->run();
+  std::string error_text = "error";
+  t->on_success(&mock_op);
+
   ASSERT_FALSE(_caught_diam_tsx == NULL);
   Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
-  Cx::UserAuthorizationRequest uar(msg);
-  Cx::UserAuthorizationAnswer uaa(_cx_dict,
-                                  _mock_stack,
-                                  DIAMETER_SUCCESS,
-                                  0,
-                                  SERVER_NAME,
-                                  CAPABILITIES);
+  Cx::ServerAssignmentRequest sar(msg);
+
+  Cx::ServerAssignmentAnswer saa(_cx_dict,
+                                 _mock_stack,
+                                 DIAMETER_ERROR_USER_UNKNOWN,
+                                 "",
+                                 NO_CHARGING_ADDRESSES);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 404, _));
+  _caught_diam_tsx->on_response(saa);
+
+  CassandraStore::Transaction* t2 = mock_op2.get_trx();
+  ASSERT_FALSE(t2 == NULL);
+
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  _caught_fd_msg = NULL;
+}
+
+// Other HSS errors should translate into a 500 error
+
+TEST_F(HandlersTest, IMSSubscriptionOtherErrorCallReg)
+{
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "?private_id=" + IMPI,
+                             "{\"reqtype\": \"call\"}",
+                             htp_method_PUT);
+  req.method();
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(RegistrationState::NOT_REGISTERED));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPI_IN_VECTOR));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  std::string error_text = "error";
+  t->on_success(&mock_op);
+
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::ServerAssignmentRequest sar(msg);
+
+  Cx::ServerAssignmentAnswer saa(_cx_dict,
+                                 _mock_stack,
+                                 0,
+                                 "",
+                                 NO_CHARGING_ADDRESSES);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 500, _));
+  _caught_diam_tsx->on_response(saa);
+
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  _caught_fd_msg = NULL;
+}
+
+// Cache not found failures should translate into a 404 Not Found errors
+TEST_F(HandlersTest, IMSSubscriptionCacheNotFound)
+{
+  // This test tests an IMS Subscription handler case where the cache
+  // doesn't return a result. Start by building the HTTP request which will
+  // invoke a cache lookup.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU,
+                             "",
+                             "");
+
+  ImpuIMSSubscriptionTask::Config cfg(false, 3600);
+  ImpuIMSSubscriptionTask* task = new ImpuIMSSubscriptionTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, expect to lookup IMS
+  // subscription information for the specified public ID.
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+
+  task->run();
+
+  // Confirm that the cache transaction is not NULL.
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+
+  // Expect a 404 HTTP response once the cache returns an error to the task.
+  EXPECT_CALL(*_httpstack, send_reply(_, 404, _));
+
+  mock_op._cass_status = CassandraStore::NOT_FOUND;
+  mock_op._cass_error_text = "error";
+  t->on_failure(&mock_op);
+}
+
+// Connection failures should translate into a 503 Service Unavailable error
+TEST_F(HandlersTest, IMSSubscriptionCacheConnectionFailure)
+{
+  // This test tests an IMS Subscription handler case where the cache
+  // has a connection failure. Start by building the HTTP request which
+  // will invoke a cache lookup.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU,
+                             "",
+                             "");
+
+  ImpuIMSSubscriptionTask::Config cfg(false, 3600);
+  ImpuIMSSubscriptionTask* task = new ImpuIMSSubscriptionTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, expect to lookup IMS
+  // subscription information for the specified public ID.
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+
+  task->run();
+
+  // Confirm that the cache transaction is not NULL.
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+
+  // Expect a 503 HTTP response once the cache returns an error to the task.
+  EXPECT_CALL(*_httpstack, send_reply(_, 503, _));
+
+  mock_op._cass_status = CassandraStore::CONNECTION_ERROR;
+  mock_op._cass_error_text = "error";
+  t->on_failure(&mock_op);
+}
+
+// Cache failures should translate into a 504 Bad Gateway error
+TEST_F(HandlersTest, IMSSubscriptionCacheFailure)
+{
+  // This test tests an IMS Subscription handler case where the cache
+  // has an unknown failure. Start by building the HTTP request which
+  // will invoke a cache lookup.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU,
+                             "",
+                             "");
+
+  ImpuIMSSubscriptionTask::Config cfg(false, 3600);
+  ImpuIMSSubscriptionTask* task = new ImpuIMSSubscriptionTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, expect to lookup IMS
+  // subscription information for the specified public ID.
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+
+  task->run();
+
+  // Confirm that the cache transaction is not NULL.
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+
+  // Expect a 504 HTTP response once the cache returns an error to the task.
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+
+  mock_op._cass_status = CassandraStore::UNKNOWN_ERROR;
+  mock_op._cass_error_text = "error";
+  t->on_failure(&mock_op);
+}
+
+// With serialization enabled, overlapping PUTs for the same public ID run
+// one at a time. Requests queued behind a registration see its outcome, so
+// they don't send their own SARs.
+TEST_F(HandlersTest, IMSSubscriptionSerializedRegThenRegAndCall)
+{
+  ImpuRegDataTask::configure_reg_data_serialization(true);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "?private_id=" + IMPI,
+                             "{\"reqtype\": \"reg\"}",
+                             htp_method_PUT);
+  MockHttpStack::Request req2(_httpstack,
+                              "/impu/" + IMPU + "/reg-data",
+                              "",
+                              "?private_id=" + IMPI,
+                              "{\"reqtype\": \"reg\"}",
+                              htp_method_PUT);
+  MockHttpStack::Request req3(_httpstack,
+                              "/impu/" + IMPU + "/reg-data",
+                              "",
+                              "",
+                              "{\"reqtype\": \"call\"}",
+                              htp_method_PUT);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+  ImpuRegDataTask* task2 = new ImpuRegDataTask(req2, &cfg, FAKE_TRAIL_ID);
+  ImpuRegDataTask* task3 = new ImpuRegDataTask(req3, &cfg, FAKE_TRAIL_ID);
+
+  // Only the first request reads the cache - the others are queued behind
+  // it.
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+  task2->run();
+  task3->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(""));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(RegistrationState::NOT_REGISTERED));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(std::vector<std::string>()));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  t->on_success(&mock_op);
+
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::ServerAssignmentRequest sar(msg);
+  EXPECT_TRUE(sar.server_assignment_type(test_i32));
+  EXPECT_EQ(Cx::ServerAssignmentType::REGISTRATION, test_i32);
+
+  Cx::ServerAssignmentAnswer saa(_cx_dict,
+                                 _mock_stack,
+                                 DIAMETER_SUCCESS,
+                                 IMPU_IMS_SUBSCRIPTION,
+                                 NO_CHARGING_ADDRESSES);
+
+  // When the SAA arrives the first request updates the cache and responds.
+  // The other two are then run against the updated registration data - so
+  // the second REG is a re-registration that's not yet due for a SAR, and
+  // the call is for a subscriber we've already been assigned.
+  MockCache::MockPutRegData mock_op2;
+  EXPECT_CALL(*_cache, create_PutRegData(IMPU_REG_SET, _, 7200))
+    .WillOnce(Return(&mock_op2));
+  EXPECT_CALL(mock_op2, with_xml(IMPU_IMS_SUBSCRIPTION))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_CALL(mock_op2, with_reg_state(RegistrationState::REGISTERED))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_CALL(mock_op2, with_associated_impis(IMPI_IN_VECTOR))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_CALL(mock_op2, with_charging_addrs(_))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_DO_ASYNC(*_cache, mock_op2);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _)).Times(3);
+  _caught_diam_tsx->on_response(saa);
+
+  EXPECT_EQ(REGDATA_RESULT, req.content());
+  EXPECT_EQ(REGDATA_RESULT, req2.content());
+  EXPECT_EQ(REGDATA_RESULT, req3.content());
+
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  ImpuRegDataTask::configure_reg_data_serialization(false);
+}
+
+// If the first request doesn't know what's in the cache, the next request
+// reads it for itself.
+TEST_F(HandlersTest, IMSSubscriptionSerializedAfterCacheFailure)
+{
+  ImpuRegDataTask::configure_reg_data_serialization(true);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "{\"reqtype\": \"call\"}",
+                             htp_method_PUT);
+  MockHttpStack::Request req2(_httpstack,
+                              "/impu/" + IMPU + "/reg-data",
+                              "",
+                              "",
+                              "{\"reqtype\": \"call\"}",
+                              htp_method_PUT);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+  ImpuRegDataTask* task2 = new ImpuRegDataTask(req2, &cfg, FAKE_TRAIL_ID);
+
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+  task2->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+
+  MockCache::MockGetRegData mock_op2;
+  EXPECT_CALL(*_httpstack, send_reply(_, 503, _));
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op2));
+  EXPECT_DO_ASYNC(*_cache, mock_op2);
+  mock_op._cass_status = CassandraStore::CONNECTION_ERROR;
+  mock_op._cass_error_text = "error";
+  t->on_failure(&mock_op);
+
+  t = mock_op2.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op2, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(DoAll(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION), SetArgReferee<1>(3600)));
+  EXPECT_CALL(mock_op2, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(DoAll(SetArgReferee<0>(RegistrationState::REGISTERED), SetArgReferee<1>(3600)));
+  EXPECT_CALL(mock_op2, get_associated_impis(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPI_IN_VECTOR));
+  EXPECT_CALL(mock_op2, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  t->on_success(&mock_op2);
+
+  EXPECT_EQ(REGDATA_RESULT, req2.content());
+
+  ImpuRegDataTask::configure_reg_data_serialization(false);
+}
+
+// Requests for different public IDs aren't serialized against each other.
+TEST_F(HandlersTest, IMSSubscriptionSerializedDifferentIMPUs)
+{
+  ImpuRegDataTask::configure_reg_data_serialization(true);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "{\"reqtype\": \"call\"}",
+                             htp_method_PUT);
+  MockHttpStack::Request req2(_httpstack,
+                              "/impu/" + IMPU2 + "/reg-data",
+                              "",
+                              "",
+                              "{\"reqtype\": \"call\"}",
+                              htp_method_PUT);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+  ImpuRegDataTask* task2 = new ImpuRegDataTask(req2, &cfg, FAKE_TRAIL_ID);
+
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  MockCache::MockGetRegData mock_op2;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU2))
+    .WillOnce(Return(&mock_op2));
+  EXPECT_DO_ASYNC(*_cache, mock_op2);
+  task2->run();
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _)).Times(2);
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  mock_op._cass_status = CassandraStore::UNKNOWN_ERROR;
+  mock_op._cass_error_text = "error";
+  t->on_failure(&mock_op);
+
+  t = mock_op2.get_trx();
+  ASSERT_FALSE(t == NULL);
+  mock_op2._cass_status = CassandraStore::UNKNOWN_ERROR;
+  mock_op2._cass_error_text = "error";
+  t->on_failure(&mock_op2);
+
+  ImpuRegDataTask::configure_reg_data_serialization(false);
+}
+
+TEST_F(HandlersTest, RegistrationStatusHSSTimeout)
+{
+  // This test tests the common diameter timeout function. Build the HTTP request
+  // which will invoke a UAR to be sent to the HSS.
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI + "/",
+                             "registration-status",
+                             "?impu=" + IMPU);
+
+  ImpiRegistrationStatusTask::Config cfg(true);
+  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, expect a diameter message to be
+  // sent. We don't bother checking the diameter message is as expected here. This
+  // is done by other tests.
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  // Expect a 504 response once we notify the task about the timeout error.
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  _caught_diam_tsx->on_timeout();
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+}
+
+// This test checks that if the /impi/X/registration-status endpoint
+// returns a non-200 response, the health checker is not triggered.
+TEST_F(HandlersTest, RegistrationStatusHSSTimeoutFailsHealthCheck)
+{
+  MockHealthChecker* hc = new MockHealthChecker();
+  HssCacheTask::configure_health_checker(hc);
+
+  // Inject the appropriate HTTP request.
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI + "/",
+                             "registration-status",
+                             "?impu=" + IMPU);
+  ImpiRegistrationStatusTask::Config cfg(true);
+  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  // Expect a 504 response once we notify the task about the timeout
+  // error. This should not trigger the health-checker.
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  EXPECT_CALL(*hc, health_check_passed()).Times(0);
+  _caught_diam_tsx->on_timeout();
+
+  // Tidy up.
+  HssCacheTask::configure_health_checker(NULL);
+  delete hc; hc = NULL;
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+}
+
+TEST_F(HandlersTest, RegistrationStatus)
+{
+  // This test tests a mainline Registration Status task case. Build the HTTP request
+  // which will invoke a UAR to be sent to the HSS.
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI + "/",
+                             "registration-status",
+                             "?impu=" + IMPU);
+
+  ImpiRegistrationStatusTask::Config cfg(true);
+  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, expect a diameter message to be
+  // sent.
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  // Turn the caught Diameter msg structure into a UAR and check its contents.
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::UserAuthorizationRequest uar(msg);
+  EXPECT_TRUE(uar.get_str_from_avp(_cx_dict->DESTINATION_REALM, test_str));
+  EXPECT_EQ(DEST_REALM, test_str);
+  EXPECT_TRUE(uar.get_str_from_avp(_cx_dict->DESTINATION_HOST, test_str));
+  EXPECT_EQ(DEST_HOST, test_str);
+  EXPECT_EQ(IMPI, uar.impi());
+  EXPECT_EQ(IMPU, uar.impu());
+  EXPECT_TRUE(uar.visited_network(test_str));
+  EXPECT_EQ(DEST_REALM, test_str);
+  EXPECT_TRUE(uar.auth_type(test_i32));
+  EXPECT_EQ(0, test_i32);
+
+  // Build a UAA and expect a successful HTTP response.
+  Cx::UserAuthorizationAnswer uaa(_cx_dict,
+                                  _mock_stack,
+                                  DIAMETER_SUCCESS,
+                                  0,
+                                  SERVER_NAME,
+                                  CAPABILITIES);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(uaa);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  // Build the expected JSON response and check it's correct.
+  EXPECT_EQ(build_icscf_json(DIAMETER_SUCCESS, SERVER_NAME, CAPABILITIES), req.content());
+}
+
+// 200 OK responses to the /impi/X/registration-status URL should
+// trigger the health-checker. Test that this happens.
+TEST_F(HandlersTest, RegistrationStatusPassesHealthCheck)
+{
+  MockHealthChecker* hc = new MockHealthChecker();
+  HssCacheTask::configure_health_checker(hc);
+
+  // Set up a request into the right URL.
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI + "/",
+                             "registration-status",
+                             "?impu=" + IMPU);
+
+  ImpiRegistrationStatusTask::Config cfg(true);
+  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Mock out a UAA response in order to trigger a 200 OK return code.
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::UserAuthorizationRequest uar(msg);
+  Cx::UserAuthorizationAnswer uaa(_cx_dict,
+                                  _mock_stack,
+                                  DIAMETER_SUCCESS,
+                                  0,
+                                  SERVER_NAME,
+                                  CAPABILITIES);
 
   // Expect that when we get a 200, the health-checker is notified.
   EXPECT_CALL(*hc, health_check_passed()).Times(1);
   EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
   _caught_diam_tsx->on_response(uaa);
 
-  // Tear down the test.
+  // Tear down the test.
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  HssCacheTask::configure_health_checker(NULL);
+  delete hc; hc = NULL;
+}
+
+
+TEST_F(HandlersTest, RegistrationStatusOptParamsSubseqRegCapabs)
+{
+  // This test tests a Registration Status task case. The scenario is unrealistic
+  // but lots of code branches are tested. Specifically, optional parameters
+  // on the HTTP request are added, and the success code
+  // DIAMETER_SUBSEQUENT_REGISTRATION is returned by the HSS with a set of server
+  // capabilities. Build the HTTP request which will invoke a UAR to be sent to the HSS.
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI + "/",
+                             "registration-status",
+                             "?impu=" + IMPU + "&visited-network=" + VISITED_NETWORK + "&auth-type=" + AUTH_TYPE_DEREG);
+
+  ImpiRegistrationStatusTask::Config cfg(true);
+  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, expect a diameter message to be
+  // sent.
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  // Turn the caught Diameter msg structure into a UAR and check its contents.
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::UserAuthorizationRequest uar(msg);
+  EXPECT_TRUE(uar.get_str_from_avp(_cx_dict->DESTINATION_REALM, test_str));
+  EXPECT_EQ(DEST_REALM, test_str);
+  EXPECT_TRUE(uar.get_str_from_avp(_cx_dict->DESTINATION_HOST, test_str));
+  EXPECT_EQ(DEST_HOST, test_str);
+  EXPECT_EQ(IMPI, uar.impi());
+  EXPECT_EQ(IMPU, uar.impu());
+  EXPECT_TRUE(uar.visited_network(test_str));
+  EXPECT_EQ(VISITED_NETWORK, test_str);
+  EXPECT_TRUE(uar.auth_type(test_i32));
+  EXPECT_EQ(1, test_i32);
+
+  // Build a UAA and expect a successful HTTP response.
+  Cx::UserAuthorizationAnswer uaa(_cx_dict,
+                                  _mock_stack,
+                                  0,
+                                  DIAMETER_SUBSEQUENT_REGISTRATION,
+                                  "",
+                                  CAPABILITIES_WITH_SERVER_NAME);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(uaa);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  // Build the expected JSON response and check it's correct.
+  EXPECT_EQ(build_icscf_json(DIAMETER_SUBSEQUENT_REGISTRATION, "", CAPABILITIES_WITH_SERVER_NAME), req.content());
+}
+
+TEST_F(HandlersTest, RegistrationStatusFirstRegNoCapabs)
+{
+  // This test tests a Registration Status task case. The scenario is unrealistic
+  // but lots of code branches are tested. Specifically, the success code
+  // DIAMETER_FIRST_REGISTRATION is returned by the HSS, but no server or server
+  // capabilities are specified. Build the HTTP request which will invoke a UAR to be sent
+  // to the HSS.
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI + "/",
+                             "registration-status",
+                             "?impu=" + IMPU);
+
+  ImpiRegistrationStatusTask::Config cfg(true);
+  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, expect a diameter message to be
+  // sent.
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  // Turn the caught Diameter msg structure into a UAR and check its contents.
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::UserAuthorizationRequest uar(msg);
+  EXPECT_TRUE(uar.get_str_from_avp(_cx_dict->DESTINATION_REALM, test_str));
+  EXPECT_EQ(DEST_REALM, test_str);
+  EXPECT_TRUE(uar.get_str_from_avp(_cx_dict->DESTINATION_HOST, test_str));
+  EXPECT_EQ(DEST_HOST, test_str);
+  EXPECT_EQ(IMPI, uar.impi());
+  EXPECT_EQ(IMPU, uar.impu());
+  EXPECT_TRUE(uar.visited_network(test_str));
+  EXPECT_EQ(DEST_REALM, test_str);
+  EXPECT_TRUE(uar.auth_type(test_i32));
+  EXPECT_EQ(0, test_i32);
+
+  // Build a UAA and expect a successful HTTP response.
+  Cx::UserAuthorizationAnswer uaa(_cx_dict,
+                                  _mock_stack,
+                                  0,
+                                  DIAMETER_FIRST_REGISTRATION,
+                                  "",
+                                  NO_CAPABILITIES);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(uaa);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  // Build the expected JSON response and check it's correct.
+  EXPECT_EQ(build_icscf_json(DIAMETER_FIRST_REGISTRATION, "", NO_CAPABILITIES), req.content());
+}
+
+// The following tests all test HSS error response cases, and use a template
+// function defined at the top of this file.
+TEST_F(HandlersTest, RegistrationStatusUserUnknown)
+{
+  registration_status_error_template(0, DIAMETER_ERROR_USER_UNKNOWN, 404);
+}
+
+TEST_F(HandlersTest, RegistrationStatusIdentitiesDontMatch)
+{
+  registration_status_error_template(0, DIAMETER_ERROR_IDENTITIES_DONT_MATCH, 404);
+}
+
+TEST_F(HandlersTest, RegistrationStatusRoamingNowAllowed)
+{
+  registration_status_error_template(0, DIAMETER_ERROR_ROAMING_NOT_ALLOWED, 403);
+}
+
+TEST_F(HandlersTest, RegistrationStatusAuthRejected)
+{
+  registration_status_error_template(DIAMETER_AUTHORIZATION_REJECTED, 0, 403);
+}
+
+TEST_F(HandlersTest, RegistrationStatusDiameterBusy)
+{
+  registration_status_error_template(DIAMETER_TOO_BUSY, 0, 504);
+}
+
+TEST_F(HandlersTest, RegistrationStatusOtherError)
+{
+  registration_status_error_template(0, 0, 500);
+}
+
+TEST_F(HandlersTest, RegistrationStatusNoHSS)
+{
+  // Test Registration Status task when no HSS is configured.
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI + "/",
+                             "registration-status",
+                             "?impu=sip:impu@example.com");
+
+  ImpiRegistrationStatusTask::Config cfg(false);
+  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, expect a successful HTTP response.
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  task->run();
+
+  // Build the expected JSON response and check it's correct.
+  EXPECT_EQ(build_icscf_json(DIAMETER_SUCCESS, DEFAULT_SERVER_NAME, NO_CAPABILITIES), req.content());
+}
+
+// 200 OK responses to the /impi/X/registration-status URL should
+// trigger the health-checker. Test that this happens even when there
+// is no HSS.
+TEST_F(HandlersTest, RegistrationStatusNoHSSPassesHealthCheck)
+{
+  MockHealthChecker* hc = new MockHealthChecker();
+  HssCacheTask::configure_health_checker(hc);
+
+  // Set up a request to the right URL.
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI + "/",
+                             "registration-status",
+                             "?impu=sip:impu@example.com");
+  ImpiRegistrationStatusTask::Config cfg(false);
+  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, expect a successful HTTP
+  // response and a call to the health-checker.
+  EXPECT_CALL(*hc, health_check_passed()).Times(1);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  task->run();
+
+  // Teardown.
+  HssCacheTask::configure_health_checker(NULL);
+  delete hc; hc = NULL;
+}
+
+//
+// Location Info tests
+//
+
+TEST_F(HandlersTest, LocationInfo)
+{
+  // This test tests a mainline Location Info task case. Build the HTTP request
+  // which will invoke an LIR to be sent to the HSS.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+
+  ImpuLocationInfoTask::Config cfg(true);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, expect a diameter message to be
+  // sent.
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  // Turn the caught Diameter msg structure into a LIR and check its contents.
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::LocationInfoRequest lir(msg);
+  EXPECT_TRUE(lir.get_str_from_avp(_cx_dict->DESTINATION_REALM, test_str));
+  EXPECT_EQ(DEST_REALM, test_str);
+  EXPECT_TRUE(lir.get_str_from_avp(_cx_dict->DESTINATION_HOST, test_str));
+  EXPECT_EQ(DEST_HOST, test_str);
+  EXPECT_EQ(IMPU, lir.impu());
+  EXPECT_FALSE(lir.originating(test_i32));
+  EXPECT_FALSE(lir.auth_type(test_i32));
+
+  // Build an LIA and expect a successful HTTP response.
+  Cx::LocationInfoAnswer lia(_cx_dict,
+                             _mock_stack,
+                             DIAMETER_SUCCESS,
+                             0,
+                             SERVER_NAME,
+                             CAPABILITIES);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+
+  _caught_diam_tsx->on_response(lia);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  // Build the expected JSON response and check it's correct.
+  EXPECT_EQ(build_icscf_json(DIAMETER_SUCCESS, SERVER_NAME, CAPABILITIES), req.content());
+}
+
+TEST_F(HandlersTest, LocationInfoOptParamsUnregisteredService)
+{
+  // This test tests a Location Info task case. The scenario is unrealistic
+  // but lots of code branches are tested. Specifically, optional parameters
+  // on the HTTP request are added, and the success code
+  // DIAMETER_UNREGISTERED_SERVICE is returned by the HSS with a set of server
+  // capabilities. Start by building the HTTP request which will invoke an LIR
+  // to be sent to the HSS.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "?originating=true&auth-type=" + AUTH_TYPE_CAPAB);
+
+  ImpuLocationInfoTask::Config cfg(true);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, expect a diameter message to be
+  // sent.
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  // Turn the caught Diameter msg structure into a LIR and check its contents.
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::LocationInfoRequest lir(msg);
+  EXPECT_TRUE(lir.get_str_from_avp(_cx_dict->DESTINATION_REALM, test_str));
+  EXPECT_EQ(DEST_REALM, test_str);
+  EXPECT_TRUE(lir.get_str_from_avp(_cx_dict->DESTINATION_HOST, test_str));
+  EXPECT_EQ(DEST_HOST, test_str);
+  EXPECT_EQ(IMPU, lir.impu());
+  EXPECT_TRUE(lir.originating(test_i32));
+  EXPECT_EQ(0, test_i32);
+  EXPECT_TRUE(lir.auth_type(test_i32));
+  EXPECT_EQ(2, test_i32);
+
+  // Build an LIA and expect a successful HTTP response.
+  Cx::LocationInfoAnswer lia(_cx_dict,
+                             _mock_stack,
+                             0,
+                             DIAMETER_UNREGISTERED_SERVICE,
+                             "",
+                             CAPABILITIES_WITH_SERVER_NAME);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(lia);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  // Build the expected JSON response and check it's correct.
+  EXPECT_EQ(build_icscf_json(DIAMETER_UNREGISTERED_SERVICE, "", CAPABILITIES_WITH_SERVER_NAME), req.content());
+}
+
+TEST_F(HandlersTest, LocationInfoUnregisteredError)
+{
+  // This test tests a Location-Information-Answer with a 5003 error - which
+  // is unusual because it means the user exists, but has no services. This has
+  // special handling to not return a 404 error, so that Sprout can detect this
+  // case and return a 480.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+
+  ImpuLocationInfoTask::Config cfg(true);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, expect a diameter message to be
+  // sent.
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  // Move the caught message onto the stack to avoid memory leaks
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::LocationInfoRequest lir(msg);
+  // Build an LIA and expect a successful HTTP response.
+  Cx::LocationInfoAnswer lia(_cx_dict,
+                             _mock_stack,
+                             0,
+                             DIAMETER_ERROR_IDENTITY_NOT_REGISTERED,
+                             "",
+                             NO_CAPABILITIES);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+
+  _caught_diam_tsx->on_response(lia);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  // Build the expected JSON response and check it's correct.
+  EXPECT_EQ("{\"result-code\":5003,\"mandatory-capabilities\":[],\"optional-capabilities\":[]}", req.content());
+}
+
+// The following tests all test HSS error response cases, and use a template
+// function defined at the top of this file.
+TEST_F(HandlersTest, LocationInfoUserUnknown)
+{
+  location_info_error_template(0, DIAMETER_ERROR_USER_UNKNOWN, 404);
+}
+
+TEST_F(HandlersTest, LocationInfoDiameterBusy)
+{
+  location_info_error_template(DIAMETER_TOO_BUSY, 0, 504);
+}
+
+TEST_F(HandlersTest, LocationInfoOtherError)
+{
+  location_info_error_template(0, 0, 500);
+}
+
+TEST_F(HandlersTest, LocationInfoNoHSS)
+{
+  // Test Location Info task when no HSS is configured.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+
+  ImpuLocationInfoTask::Config cfg(false);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, we expect a cache request for
+  // the registration state of the public identity.
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(RegistrationState::NOT_REGISTERED));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPI_IN_VECTOR));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  // The cache indicates success, so expect a 200 OK over HTTP.
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  t->on_success(&mock_op);
+
+  // Build the expected JSON response and check it's correct.
+  EXPECT_EQ(build_icscf_json(DIAMETER_SUCCESS, DEFAULT_SERVER_NAME, NO_CAPABILITIES), req.content());
+}
+
+TEST_F(HandlersTest, LocationInfoNoHSSNoSubscriber)
+{
+  // Test Location Info task when no HSS is configured.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+  ImpuLocationInfoTask::Config cfg(false);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, we expect a cache request for
+  // the registration state of the public identity.
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(""));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(RegistrationState::NOT_REGISTERED));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPI_IN_VECTOR));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  // The cache indicates not found, so expect a 404 Not Found over HTTP.
+  EXPECT_CALL(*_httpstack, send_reply(_, 404, _));
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  t->on_success(&mock_op);
+}
+
+TEST_F(HandlersTest, LocationInfoNoHSSConnectionError)
+{
+  // Test Location Info task when no HSS is configured.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+  ImpuLocationInfoTask::Config cfg(false);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, we expect a cache request for
+  // the registration state of the public identity.
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  // The cache indicates connection error, so expect a 503 Service Unavailable over HTTP.
+  EXPECT_CALL(*_httpstack, send_reply(_, 503, _));
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  mock_op._cass_status = CassandraStore::CONNECTION_ERROR;
+  mock_op._cass_error_text = "connection error";
+  t->on_failure(&mock_op);
+}
+
+TEST_F(HandlersTest, LocationInfoNoHSSTimeout)
+{
+  // Test Location Info task when no HSS is configured.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+  ImpuLocationInfoTask::Config cfg(false);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, we expect a cache request for
+  // the registration state of the public identity.
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  // The cache indicates error, so expect a 504 Gateway Timeout over HTTP.
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  mock_op._cass_status = CassandraStore::UNKNOWN_ERROR;
+  mock_op._cass_error_text = "error";
+  t->on_failure(&mock_op);
+}
+
+TEST_F(HandlersTest, RegistrationStatusICSCFCache)
+{
+  IcscfCache icscf_cache(30);
+  HssCacheTask::configure_icscf_cache(&icscf_cache);
+  MockHealthChecker* hc = new MockHealthChecker();
+  HssCacheTask::configure_health_checker(hc);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI + "/",
+                             "registration-status",
+                             "?impu=" + IMPU);
+  ImpiRegistrationStatusTask::Config cfg(true);
+  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  Cx::UserAuthorizationAnswer uaa(_cx_dict,
+                                  _mock_stack,
+                                  DIAMETER_SUCCESS,
+                                  0,
+                                  SERVER_NAME,
+                                  CAPABILITIES);
+  EXPECT_CALL(*hc, health_check_passed()).Times(1);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(uaa);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  // The next query is answered from the cache without going to the HSS, so
+  // doesn't pass the health check.
+  MockHttpStack::Request req2(_httpstack,
+                              "/impi/" + IMPI + "/",
+                              "registration-status",
+                              "?impu=" + IMPU);
+  task = new ImpiRegistrationStatusTask(req2, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*hc, health_check_passed()).Times(0);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  task->run();
+  EXPECT_EQ(build_icscf_json(DIAMETER_SUCCESS, SERVER_NAME, CAPABILITIES), req2.content());
+
+  // Once the private ID has been invalidated (as happens on an RTR), the HSS
+  // is queried again.
+  HssCacheTask::invalidate_icscf_answers(std::vector<std::string>(1, IMPI),
+                                         std::vector<std::string>());
+  MockHttpStack::Request req3(_httpstack,
+                              "/impi/" + IMPI + "/",
+                              "registration-status",
+                              "?impu=" + IMPU);
+  task = new ImpiRegistrationStatusTask(req3, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  _caught_diam_tsx->on_timeout();
   _caught_fd_msg = NULL;
   delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  HssCacheTask::configure_icscf_cache(NULL);
   HssCacheTask::configure_health_checker(NULL);
   delete hc; hc = NULL;
 }
 
+TEST_F(HandlersTest, RegistrationStatusICSCFCacheCapabilitiesNotCached)
+{
+  IcscfCache icscf_cache(30);
+  HssCacheTask::configure_icscf_cache(&icscf_cache);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI + "/",
+                             "registration-status",
+                             "?impu=" + IMPU);
+  ImpiRegistrationStatusTask::Config cfg(true);
+  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
 
-TEST_F(HandlersTest, RegistrationStatusOptParamsSubseqRegCapabs)
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  // No S-CSCF is assigned yet, so the answer isn't cached.
+  Cx::UserAuthorizationAnswer uaa(_cx_dict,
+                                  _mock_stack,
+                                  0,
+                                  DIAMETER_FIRST_REGISTRATION,
+                                  "",
+                                  CAPABILITIES);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(uaa);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  EXPECT_EQ(0u, icscf_cache.size());
+
+  HssCacheTask::configure_icscf_cache(NULL);
+}
+
+TEST_F(HandlersTest, LocationInfoICSCFCache)
 {
-  // This test tests a Registration Status task case. The scenario is unrealistic
-  // but lots of code branches are tested. Specifically, optional parameters
-  // on the HTTP request are added, and the success code
-  // DIAMETER_SUBSEQUENT_REGISTRATION is returned by the HSS with a set of server
-  // capabilities. Build the HTTP request which will invoke a UAR to be sent to the HSS.
+  IcscfCache icscf_cache(30);
+  HssCacheTask::configure_icscf_cache(&icscf_cache);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+  ImpuLocationInfoTask::Config cfg(true);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  Cx::LocationInfoAnswer lia(_cx_dict,
+                             _mock_stack,
+                             DIAMETER_SUCCESS,
+                             0,
+                             SERVER_NAME,
+                             CAPABILITIES);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(lia);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  // The next query is answered from the cache without going to the HSS.
+  MockHttpStack::Request req2(_httpstack,
+                              "/impu/" + IMPU + "/",
+                              "location",
+                              "");
+  task = new ImpuLocationInfoTask(req2, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  task->run();
+  EXPECT_EQ(build_icscf_json(DIAMETER_SUCCESS, SERVER_NAME, CAPABILITIES), req2.content());
+
+  // Queries with different parameters aren't answered from the cache.
+  MockHttpStack::Request req3(_httpstack,
+                              "/impu/" + IMPU + "/",
+                              "location",
+                              "?originating=true");
+  task = new ImpuLocationInfoTask(req3, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  _caught_diam_tsx->on_timeout();
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  // Invalidating the public ID discards the cached answer.
+  HssCacheTask::invalidate_icscf_answers(std::vector<std::string>(),
+                                         std::vector<std::string>(1, IMPU));
+  EXPECT_EQ(0u, icscf_cache.size());
+
+  HssCacheTask::configure_icscf_cache(NULL);
+}
+
+TEST_F(HandlersTest, LocationInfoCoalesced)
+{
+  HssCacheTask::configure_request_coalescing(true);
+  ImpuLocationInfoTask::Config cfg(true);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  // An identical request made while the first is in flight doesn't send
+  // another LIR.
+  MockHttpStack::Request req2(_httpstack,
+                              "/impu/" + IMPU + "/",
+                              "location",
+                              "");
+  task = new ImpuLocationInfoTask(req2, &cfg, FAKE_TRAIL_ID);
+  task->run();
+
+  // Both requests get the answer.
+  Cx::LocationInfoAnswer lia(_cx_dict,
+                             _mock_stack,
+                             DIAMETER_SUCCESS,
+                             0,
+                             SERVER_NAME,
+                             CAPABILITIES);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _)).Times(2);
+  _caught_diam_tsx->on_response(lia);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  EXPECT_EQ(build_icscf_json(DIAMETER_SUCCESS, SERVER_NAME, CAPABILITIES), req.content());
+  EXPECT_EQ(build_icscf_json(DIAMETER_SUCCESS, SERVER_NAME, CAPABILITIES), req2.content());
+
+  // Once the answer has arrived, a new request goes to the HSS again.
+  MockHttpStack::Request req3(_httpstack,
+                              "/impu/" + IMPU + "/",
+                              "location",
+                              "");
+  task = new ImpuLocationInfoTask(req3, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  _caught_diam_tsx->on_timeout();
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  HssCacheTask::configure_request_coalescing(false);
+}
+
+TEST_F(HandlersTest, RegistrationStatusCoalescedTimeout)
+{
+  HssCacheTask::configure_request_coalescing(true);
+  ImpiRegistrationStatusTask::Config cfg(true);
+
   MockHttpStack::Request req(_httpstack,
                              "/impi/" + IMPI + "/",
                              "registration-status",
-                             "?impu=" + IMPU + "&visited-network=" + VISITED_NETWORK + "&auth-type=" + AUTH_TYPE_DEREG);
-
-  ImpiRegistrationStatusTask::Config cfg(true);
+                             "?impu=" + IMPU);
   ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
-
-  // Once the task's run function is called, expect a diameter message to be
-  // sent.
   EXPECT_CALL(*_mock_stack, send(_, _, 200))
     .Times(1)
     .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
   task->run();
   ASSERT_FALSE(_caught_diam_tsx == NULL);
 
-  // Turn the caught Diameter msg structure into a UAR and check its contents.
-  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
-  Cx::UserAuthorizationRequest uar(msg);
-  EXPECT_TRUE(uar.get_str_from_avp(_cx_dict->DESTINATION_REALM, test_str));
-  EXPECT_EQ(DEST_REALM, test_str);
-  EXPECT_TRUE(uar.get_str_from_avp(_cx_dict->DESTINATION_HOST, test_str));
-  EXPECT_EQ(DEST_HOST, test_str);
-  EXPECT_EQ(IMPI, uar.impi());
-  EXPECT_EQ(IMPU, uar.impu());
-  EXPECT_TRUE(uar.visited_network(test_str));
-  EXPECT_EQ(VISITED_NETWORK, test_str);
-  EXPECT_TRUE(uar.auth_type(test_i32));
-  EXPECT_EQ(1, test_i32);
+  MockHttpStack::Request req2(_httpstack,
+                              "/impi/" + IMPI + "/",
+                              "registration-status",
+                              "?impu=" + IMPU);
+  task = new ImpiRegistrationStatusTask(req2, &cfg, FAKE_TRAIL_ID);
+  task->run();
 
-  // Build a UAA and expect a successful HTTP response.
-  Cx::UserAuthorizationAnswer uaa(_cx_dict,
-                                  _mock_stack,
-                                  0,
-                                  DIAMETER_SUBSEQUENT_REGISTRATION,
-                                  "",
-                                  CAPABILITIES_WITH_SERVER_NAME);
-  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
-  _caught_diam_tsx->on_response(uaa);
+  // Both requests time out together.
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _)).Times(2);
+  _caught_diam_tsx->on_timeout();
   _caught_fd_msg = NULL;
   delete _caught_diam_tsx; _caught_diam_tsx = NULL;
 
-  // Build the expected JSON response and check it's correct.
-  EXPECT_EQ(build_icscf_json(DIAMETER_SUBSEQUENT_REGISTRATION, "", CAPABILITIES_WITH_SERVER_NAME), req.content());
+  HssCacheTask::configure_request_coalescing(false);
 }
 
-TEST_F(HandlersTest, RegistrationStatusFirstRegNoCapabs)
+TEST_F(HandlersTest, AkaHSSNotCoalesced)
 {
-  // This test tests a Registration Status task case. The scenario is unrealistic
-  // but lots of code branches are tested. Specifically, the success code
-  // DIAMETER_FIRST_REGISTRATION is returned by the HSS, but no server or server
-  // capabilities are specified. Build the HTTP request which will invoke a UAR to be sent
-  // to the HSS.
+  HssCacheTask::configure_request_coalescing(true);
+  ImpiTask::Config cfg(true, 300, SCHEME_UNKNOWN, SCHEME_DIGEST, SCHEME_AKA);
+
+  // Each AKA request gets its own MAR, since vectors can't be shared.
   MockHttpStack::Request req(_httpstack,
-                             "/impi/" + IMPI + "/",
-                             "registration-status",
+                             "/impi/" + IMPI,
+                             "aka",
                              "?impu=" + IMPU);
+  ImpiAvTask* task = new ImpiAvTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  Diameter::Transaction* first_tsx = _caught_diam_tsx;
+  _caught_fd_msg = NULL;
 
-  ImpiRegistrationStatusTask::Config cfg(true);
-  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+  MockHttpStack::Request req2(_httpstack,
+                              "/impi/" + IMPI,
+                              "aka",
+                              "?impu=" + IMPU);
+  task = new ImpiAvTask(req2, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == first_tsx);
 
-  // Once the task's run function is called, expect a diameter message to be
-  // sent.
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _)).Times(2);
+  first_tsx->on_timeout();
+  delete first_tsx;
+  _caught_diam_tsx->on_timeout();
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  HssCacheTask::configure_request_coalescing(false);
+}
+
+//
+// Registration Termination tests
+//
+
+// With a Cx concurrency limit, requests over the limit wait until an earlier
+// request completes, and are shed once the queue is full.
+TEST_F(HandlersTest, LocationInfoCxLimiter)
+{
+  CxLimiter limiter(1, 1);
+  HssCacheTask::configure_cx_limiter(&limiter);
+  ImpuLocationInfoTask::Config cfg(true);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
   EXPECT_CALL(*_mock_stack, send(_, _, 200))
     .Times(1)
     .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
   task->run();
   ASSERT_FALSE(_caught_diam_tsx == NULL);
+  Diameter::Transaction* tsx = _caught_diam_tsx;
+
+  // The next request is queued...
+  MockHttpStack::Request req2(_httpstack,
+                              "/impu/" + IMPU2 + "/",
+                              "location",
+                              "");
+  task = new ImpuLocationInfoTask(req2, &cfg, FAKE_TRAIL_ID);
+  task->run();
 
-  // Turn the caught Diameter msg structure into a UAR and check its contents.
-  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
-  Cx::UserAuthorizationRequest uar(msg);
-  EXPECT_TRUE(uar.get_str_from_avp(_cx_dict->DESTINATION_REALM, test_str));
-  EXPECT_EQ(DEST_REALM, test_str);
-  EXPECT_TRUE(uar.get_str_from_avp(_cx_dict->DESTINATION_HOST, test_str));
-  EXPECT_EQ(DEST_HOST, test_str);
-  EXPECT_EQ(IMPI, uar.impi());
-  EXPECT_EQ(IMPU, uar.impu());
-  EXPECT_TRUE(uar.visited_network(test_str));
-  EXPECT_EQ(DEST_REALM, test_str);
-  EXPECT_TRUE(uar.auth_type(test_i32));
-  EXPECT_EQ(0, test_i32);
+  // ...and the one after that is rejected straight away, as the queue is
+  // full.
+  MockHttpStack::Request req3(_httpstack,
+                              "/impu/" + IMPU3 + "/",
+                              "location",
+                              "");
+  task = new ImpuLocationInfoTask(req3, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  task->run();
 
-  // Build a UAA and expect a successful HTTP response.
-  Cx::UserAuthorizationAnswer uaa(_cx_dict,
-                                  _mock_stack,
-                                  0,
-                                  DIAMETER_FIRST_REGISTRATION,
-                                  "",
-                                  NO_CAPABILITIES);
+  // When the first answer arrives, the queued request is sent.
+  Cx::LocationInfoAnswer lia(_cx_dict,
+                             _mock_stack,
+                             DIAMETER_SUCCESS,
+                             0,
+                             SERVER_NAME,
+                             CAPABILITIES);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
   EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
-  _caught_diam_tsx->on_response(uaa);
+  tsx->on_response(lia);
+  delete tsx;
+  ASSERT_FALSE(_caught_diam_tsx == tsx);
+
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::LocationInfoRequest lir(msg);
+  EXPECT_EQ(IMPU2, lir.impu());
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  _caught_diam_tsx->on_timeout();
   _caught_fd_msg = NULL;
   delete _caught_diam_tsx; _caught_diam_tsx = NULL;
 
-  // Build the expected JSON response and check it's correct.
-  EXPECT_EQ(build_icscf_json(DIAMETER_FIRST_REGISTRATION, "", NO_CAPABILITIES), req.content());
+  EXPECT_EQ(0, limiter.in_flight());
+  HssCacheTask::configure_cx_limiter(NULL);
 }
 
-// The following tests all test HSS error response cases, and use a template
-// function defined at the top of this file.
-TEST_F(HandlersTest, RegistrationStatusUserUnknown)
+// A request that waits in the Cx limiter's queue has its timeout worked out
+// when it is sent, so it takes account of the time spent waiting.
+TEST_F(HandlersTest, LocationInfoCxLimiterQueuedTimeout)
 {
-  registration_status_error_template(0, DIAMETER_ERROR_USER_UNKNOWN, 404);
-}
+  CxLimiter limiter(1, 1);
+  HssCacheTask::configure_cx_limiter(&limiter);
+  HssCacheTask::configure_default_deadline(150);
+  ImpuLocationInfoTask::Config cfg(true);
 
-TEST_F(HandlersTest, RegistrationStatusIdentitiesDontMatch)
-{
-  registration_status_error_template(0, DIAMETER_ERROR_IDENTITIES_DONT_MATCH, 404);
-}
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, 150))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  Diameter::Transaction* tsx = _caught_diam_tsx;
 
-TEST_F(HandlersTest, RegistrationStatusRoamingNowAllowed)
-{
-  registration_status_error_template(0, DIAMETER_ERROR_ROAMING_NOT_ALLOWED, 403);
-}
+  MockHttpStack::Request req2(_httpstack,
+                              "/impu/" + IMPU2 + "/",
+                              "location",
+                              "");
+  task = new ImpuLocationInfoTask(req2, &cfg, FAKE_TRAIL_ID);
+  task->run();
 
-TEST_F(HandlersTest, RegistrationStatusAuthRejected)
-{
-  registration_status_error_template(DIAMETER_AUTHORIZATION_REJECTED, 0, 403);
-}
+  // The queued request is sent when the first is answered, with what's left
+  // of its deadline.
+  cwtest_advance_time_ms(100);
+  Cx::LocationInfoAnswer lia(_cx_dict,
+                             _mock_stack,
+                             DIAMETER_SUCCESS,
+                             0,
+                             SERVER_NAME,
+                             CAPABILITIES);
+  EXPECT_CALL(*_mock_stack, send(_, _, 50))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  tsx->on_response(lia);
+  delete tsx;
 
-TEST_F(HandlersTest, RegistrationStatusDiameterBusy)
-{
-  registration_status_error_template(DIAMETER_TOO_BUSY, 0, 504);
-}
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  _caught_diam_tsx->on_timeout();
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
 
-TEST_F(HandlersTest, RegistrationStatusOtherError)
-{
-  registration_status_error_template(0, 0, 500);
+  HssCacheTask::configure_default_deadline(0);
+  HssCacheTask::configure_cx_limiter(NULL);
 }
 
-TEST_F(HandlersTest, RegistrationStatusNoHSS)
+TEST_F(HandlersTest, LocationInfoHedgeWins)
 {
-  // Test Registration Status task when no HSS is configured.
+  CxHedger hedger(100);
+  AdaptiveTimeout lir_hedge_delay(10, 1, 200);
+  HssCacheTask::configure_hedging(&hedger, NULL, NULL, &lir_hedge_delay);
+  ImpuLocationInfoTask::Config cfg(true);
+
   MockHttpStack::Request req(_httpstack,
-                             "/impi/" + IMPI + "/",
-                             "registration-status",
-                             "?impu=sip:impu@example.com");
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  Diameter::Transaction* tsx = _caught_diam_tsx;
+  struct msg* fd_msg = _caught_fd_msg;
+  EXPECT_EQ(1u, hedger.pending());
 
-  ImpiRegistrationStatusTask::Config cfg(false);
-  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+  // There's no answer after the hedge delay, so the request is sent again,
+  // with the time left before the first one times out.
+  cwtest_advance_time_ms(10);
+  EXPECT_CALL(*_mock_stack, send(_, _, 190))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  hedger.poll();
+  ASSERT_FALSE(_caught_diam_tsx == tsx);
 
-  // Once the task's run function is called, expect a successful HTTP response.
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::LocationInfoRequest lir(msg);
+  EXPECT_EQ(IMPU, lir.impu());
+
+  // The hedge is answered first, and its answer is used.
+  Cx::LocationInfoAnswer lia(_cx_dict,
+                             _mock_stack,
+                             DIAMETER_SUCCESS,
+                             0,
+                             SERVER_NAME,
+                             CAPABILITIES);
   EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
-  task->run();
+  _caught_diam_tsx->on_response(lia);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
 
-  // Build the expected JSON response and check it's correct.
-  EXPECT_EQ(build_icscf_json(DIAMETER_SUCCESS, DEFAULT_SERVER_NAME, NO_CAPABILITIES), req.content());
+  // The original's answer is then dropped.
+  tsx->on_response(lia);
+  fd_msg_free(fd_msg);
+  delete tsx;
+
+  HssCacheTask::configure_hedging(NULL, NULL, NULL, NULL);
 }
 
-// 200 OK responses to the /impi/X/registration-status URL should
-// trigger the health-checker. Test that this happens even when there
-// is no HSS.
-TEST_F(HandlersTest, RegistrationStatusNoHSSPassesHealthCheck)
+// Hedges go through the Cx concurrency limiter, so a hedge isn't sent if the
+// HSS has no room for it.
+TEST_F(HandlersTest, LocationInfoHedgeShed)
 {
-  MockHealthChecker* hc = new MockHealthChecker();
-  HssCacheTask::configure_health_checker(hc);
+  CxLimiter limiter(1, 0);
+  HssCacheTask::configure_cx_limiter(&limiter);
+  CxHedger hedger(100);
+  AdaptiveTimeout lir_hedge_delay(10, 1, 200);
+  HssCacheTask::configure_hedging(&hedger, NULL, NULL, &lir_hedge_delay);
+  ImpuLocationInfoTask::Config cfg(true);
 
-  // Set up a request to the right URL.
   MockHttpStack::Request req(_httpstack,
-                             "/impi/" + IMPI + "/",
-                             "registration-status",
-                             "?impu=sip:impu@example.com");
-  ImpiRegistrationStatusTask::Config cfg(false);
-  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
 
-  // Once the task's run function is called, expect a successful HTTP
-  // response and a call to the health-checker.
-  EXPECT_CALL(*hc, health_check_passed()).Times(1);
+  // The hedge is due, but the limiter sheds it.
+  cwtest_advance_time_ms(10);
+  EXPECT_CALL(*_mock_stack, send(_, _, _)).Times(0);
+  hedger.poll();
+  EXPECT_EQ(1, limiter.in_flight());
+
+  // The original is answered as normal.
+  Cx::LocationInfoAnswer lia(_cx_dict,
+                             _mock_stack,
+                             DIAMETER_SUCCESS,
+                             0,
+                             SERVER_NAME,
+                             CAPABILITIES);
   EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
-  task->run();
+  _caught_diam_tsx->on_response(lia);
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  EXPECT_EQ(0, limiter.in_flight());
 
-  // Teardown.
-  HssCacheTask::configure_health_checker(NULL);
-  delete hc; hc = NULL;
+  HssCacheTask::configure_hedging(NULL, NULL, NULL, NULL);
+  HssCacheTask::configure_cx_limiter(NULL);
 }
 
-//
-// Location Info tests
-//
-
-TEST_F(HandlersTest, LocationInfo)
+TEST_F(HandlersTest, LocationInfoHedgeNotNeeded)
 {
-  // This test tests a mainline Location Info task case. Build the HTTP request
-  // which will invoke an LIR to be sent to the HSS.
+  CxHedger hedger(100);
+  AdaptiveTimeout lir_hedge_delay(10, 1, 200);
+  HssCacheTask::configure_hedging(&hedger, NULL, NULL, &lir_hedge_delay);
+  ImpuLocationInfoTask::Config cfg(true);
+
   MockHttpStack::Request req(_httpstack,
                              "/impu/" + IMPU + "/",
                              "location",
                              "");
-
-  ImpuLocationInfoTask::Config cfg(true);
   ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
-
-  // Once the task's run function is called, expect a diameter message to be
-  // sent.
   EXPECT_CALL(*_mock_stack, send(_, _, 200))
     .Times(1)
     .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
   task->run();
   ASSERT_FALSE(_caught_diam_tsx == NULL);
 
-  // Turn the caught Diameter msg structure into a LIR and check its contents.
-  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
-  Cx::LocationInfoRequest lir(msg);
-  EXPECT_TRUE(lir.get_str_from_avp(_cx_dict->DESTINATION_REALM, test_str));
-  EXPECT_EQ(DEST_REALM, test_str);
-  EXPECT_TRUE(lir.get_str_from_avp(_cx_dict->DESTINATION_HOST, test_str));
-  EXPECT_EQ(DEST_HOST, test_str);
-  EXPECT_EQ(IMPU, lir.impu());
-  EXPECT_FALSE(lir.originating(test_i32));
-  EXPECT_FALSE(lir.auth_type(test_i32));
-
-  // Build an LIA and expect a successful HTTP response.
+  // The answer arrives before the hedge delay...
   Cx::LocationInfoAnswer lia(_cx_dict,
                              _mock_stack,
                              DIAMETER_SUCCESS,
@@ -3105,254 +4969,308 @@ TEST_F(HandlersTest, LocationInfo)
                              SERVER_NAME,
                              CAPABILITIES);
   EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
-
   _caught_diam_tsx->on_response(lia);
-  _caught_fd_msg = NULL;
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
   delete _caught_diam_tsx; _caught_diam_tsx = NULL;
 
-  // Build the expected JSON response and check it's correct.
-  EXPECT_EQ(build_icscf_json(DIAMETER_SUCCESS, SERVER_NAME, CAPABILITIES), req.content());
+  // ...so no hedge is sent.
+  cwtest_advance_time_ms(10);
+  EXPECT_CALL(*_mock_stack, send(_, _, _)).Times(0);
+  hedger.poll();
+  EXPECT_EQ(0u, hedger.pending());
+
+  HssCacheTask::configure_hedging(NULL, NULL, NULL, NULL);
 }
 
-TEST_F(HandlersTest, LocationInfoOptParamsUnregisteredService)
+TEST_F(HandlersTest, LocationInfoHedgeTimeout)
 {
-  // This test tests a Location Info task case. The scenario is unrealistic
-  // but lots of code branches are tested. Specifically, optional parameters
-  // on the HTTP request are added, and the success code
-  // DIAMETER_UNREGISTERED_SERVICE is returned by the HSS with a set of server
-  // capabilities. Start by building the HTTP request which will invoke an LIR
-  // to be sent to the HSS.
+  CxHedger hedger(100);
+  AdaptiveTimeout lir_hedge_delay(10, 1, 200);
+  HssCacheTask::configure_hedging(&hedger, NULL, NULL, &lir_hedge_delay);
+  ImpuLocationInfoTask::Config cfg(true);
+
   MockHttpStack::Request req(_httpstack,
                              "/impu/" + IMPU + "/",
                              "location",
-                             "?originating=true&auth-type=" + AUTH_TYPE_CAPAB);
+                             "");
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  Diameter::Transaction* tsx = _caught_diam_tsx;
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
+
+  cwtest_advance_time_ms(10);
+  EXPECT_CALL(*_mock_stack, send(_, _, 190))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  hedger.poll();
+  ASSERT_FALSE(_caught_diam_tsx == tsx);
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
+
+  // The request only times out once both copies have.
+  tsx->on_timeout();
+  delete tsx;
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  _caught_diam_tsx->on_timeout();
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  HssCacheTask::configure_hedging(NULL, NULL, NULL, NULL);
+}
 
+// A hedged request is reported to the circuit breaker once, with the outcome
+// of the group - so the original timing out doesn't count as a failure if
+// the hedge is then answered.
+TEST_F(HandlersTest, LocationInfoHedgeWinsAfterTimeout)
+{
+  CxCircuitBreaker breaker(50, 1);
+  HssCacheTask::configure_cx_circuit_breaker(&breaker);
+  CxHedger hedger(100);
+  AdaptiveTimeout lir_hedge_delay(10, 1, 200);
+  HssCacheTask::configure_hedging(&hedger, NULL, NULL, &lir_hedge_delay);
   ImpuLocationInfoTask::Config cfg(true);
-  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
 
-  // Once the task's run function is called, expect a diameter message to be
-  // sent.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
   EXPECT_CALL(*_mock_stack, send(_, _, 200))
     .Times(1)
     .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
   task->run();
   ASSERT_FALSE(_caught_diam_tsx == NULL);
+  Diameter::Transaction* tsx = _caught_diam_tsx;
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
 
-  // Turn the caught Diameter msg structure into a LIR and check its contents.
-  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
-  Cx::LocationInfoRequest lir(msg);
-  EXPECT_TRUE(lir.get_str_from_avp(_cx_dict->DESTINATION_REALM, test_str));
-  EXPECT_EQ(DEST_REALM, test_str);
-  EXPECT_TRUE(lir.get_str_from_avp(_cx_dict->DESTINATION_HOST, test_str));
-  EXPECT_EQ(DEST_HOST, test_str);
-  EXPECT_EQ(IMPU, lir.impu());
-  EXPECT_TRUE(lir.originating(test_i32));
-  EXPECT_EQ(0, test_i32);
-  EXPECT_TRUE(lir.auth_type(test_i32));
-  EXPECT_EQ(2, test_i32);
+  cwtest_advance_time_ms(10);
+  EXPECT_CALL(*_mock_stack, send(_, _, 190))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  hedger.poll();
+  ASSERT_FALSE(_caught_diam_tsx == tsx);
+
+  tsx->on_timeout();
+  delete tsx;
+  EXPECT_EQ(CxCircuitBreaker::CLOSED, breaker.state());
 
-  // Build an LIA and expect a successful HTTP response.
   Cx::LocationInfoAnswer lia(_cx_dict,
                              _mock_stack,
+                             DIAMETER_SUCCESS,
                              0,
-                             DIAMETER_UNREGISTERED_SERVICE,
-                             "",
-                             CAPABILITIES_WITH_SERVER_NAME);
+                             SERVER_NAME,
+                             CAPABILITIES);
   EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
   _caught_diam_tsx->on_response(lia);
-  _caught_fd_msg = NULL;
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
   delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  EXPECT_EQ(CxCircuitBreaker::CLOSED, breaker.state());
 
-  // Build the expected JSON response and check it's correct.
-  EXPECT_EQ(build_icscf_json(DIAMETER_UNREGISTERED_SERVICE, "", CAPABILITIES_WITH_SERVER_NAME), req.content());
+  HssCacheTask::configure_hedging(NULL, NULL, NULL, NULL);
+  HssCacheTask::configure_cx_circuit_breaker(NULL);
 }
 
-TEST_F(HandlersTest, LocationInfoUnregisteredError)
+TEST_F(HandlersTest, LocationInfoPeerSelection)
 {
-  // This test tests a Location-Information-Answer with a 5003 error - which
-  // is unusual because it means the user exists, but has no services. This has
-  // special handling to not return a 404 error, so that Sprout can detect this
-  // case and return a 480.
+  // Without a configured destination host, requests go to the peer the
+  // selector picks.
+  HssCacheTask::configure_diameter(_mock_stack,
+                                   DEST_REALM,
+                                   "",
+                                   DEFAULT_SERVER_NAME,
+                                   _cx_dict);
+  CxPeerSelector selector(DEST_REALM);
+  selector.peer_connection_cb(true, "hss1", DEST_REALM);
+  selector.on_complete("", "hss1", 1000, false);
+  HssCacheTask::configure_cx_peer_selector(&selector);
+  ImpuLocationInfoTask::Config cfg(true);
+
   MockHttpStack::Request req(_httpstack,
                              "/impu/" + IMPU + "/",
                              "location",
                              "");
-
-  ImpuLocationInfoTask::Config cfg(true);
   ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
-
-  // Once the task's run function is called, expect a diameter message to be
-  // sent.
   EXPECT_CALL(*_mock_stack, send(_, _, 200))
     .Times(1)
     .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
   task->run();
   ASSERT_FALSE(_caught_diam_tsx == NULL);
 
-  // Move the caught message onto the stack to avoid memory leaks
   Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
   Cx::LocationInfoRequest lir(msg);
-  // Build an LIA and expect a successful HTTP response.
+  std::string test_str;
+  EXPECT_TRUE(lir.get_str_from_avp(_cx_dict->DESTINATION_HOST, test_str));
+  EXPECT_EQ("hss1", test_str);
+  EXPECT_EQ(1, selector.peer_stats()[0].outstanding);
+
   Cx::LocationInfoAnswer lia(_cx_dict,
                              _mock_stack,
+                             DIAMETER_SUCCESS,
                              0,
-                             DIAMETER_ERROR_IDENTITY_NOT_REGISTERED,
-                             "",
-                             NO_CAPABILITIES);
+                             SERVER_NAME,
+                             CAPABILITIES);
   EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
-
   _caught_diam_tsx->on_response(lia);
   _caught_fd_msg = NULL;
   delete _caught_diam_tsx; _caught_diam_tsx = NULL;
-
-  // Build the expected JSON response and check it's correct.
-  EXPECT_EQ("{\"result-code\":5003,\"mandatory-capabilities\":[],\"optional-capabilities\":[]}", req.content());
-}
-
-// The following tests all test HSS error response cases, and use a template
-// function defined at the top of this file.
-TEST_F(HandlersTest, LocationInfoUserUnknown)
-{
-  location_info_error_template(0, DIAMETER_ERROR_USER_UNKNOWN, 404);
-}
-
-TEST_F(HandlersTest, LocationInfoDiameterBusy)
-{
-  location_info_error_template(DIAMETER_TOO_BUSY, 0, 504);
+  EXPECT_EQ(0, selector.peer_stats()[0].outstanding);
+
+  HssCacheTask::configure_cx_peer_selector(NULL);
+  HssCacheTask::configure_diameter(_mock_stack,
+                                   DEST_REALM,
+                                   DEST_HOST,
+                                   DEFAULT_SERVER_NAME,
+                                   _cx_dict);
 }
 
-TEST_F(HandlersTest, LocationInfoOtherError)
+TEST_F(HandlersTest, RegDataNoPeerSelectionForSAR)
 {
-  location_info_error_template(0, 0, 500);
-}
+  // A SAR is never pinned to the peer the selector picks - it is left to
+  // realm routing.
+  HssCacheTask::configure_diameter(_mock_stack,
+                                   DEST_REALM,
+                                   "",
+                                   DEFAULT_SERVER_NAME,
+                                   _cx_dict);
+  CxPeerSelector selector(DEST_REALM);
+  selector.peer_connection_cb(true, "hss1", DEST_REALM);
+  HssCacheTask::configure_cx_peer_selector(&selector);
 
-TEST_F(HandlersTest, LocationInfoNoHSS)
-{
-  // Test Location Info task when no HSS is configured.
   MockHttpStack::Request req(_httpstack,
-                             "/impu/" + IMPU + "/",
-                             "location",
-                             "");
-
-  ImpuLocationInfoTask::Config cfg(false);
-  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "?private_id=" + IMPI,
+                             "{\"reqtype\": \"reg\"}",
+                             htp_method_PUT);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
 
-  // Once the task's run function is called, we expect a cache request for
-  // the registration state of the public identity.
   MockCache::MockGetRegData mock_op;
-  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
-    .WillOnce(Return(&mock_op));
-  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
-    .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
-  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
-    .WillRepeatedly(SetArgReferee<0>(RegistrationState::NOT_REGISTERED));
-  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1))
-    .WillRepeatedly(SetArgReferee<0>(IMPI_IN_VECTOR));
-  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
-    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU)).WillOnce(Return(&mock_op));
   EXPECT_DO_ASYNC(*_cache, mock_op);
   task->run();
 
-  // The cache indicates success, so expect a 200 OK over HTTP.
-  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
   CassandraStore::Transaction* t = mock_op.get_trx();
   ASSERT_FALSE(t == NULL);
-  t->on_success(&mock_op);
-
-  // Build the expected JSON response and check it's correct.
-  EXPECT_EQ(build_icscf_json(DIAMETER_SUCCESS, DEFAULT_SERVER_NAME, NO_CAPABILITIES), req.content());
-}
-
-TEST_F(HandlersTest, LocationInfoNoHSSNoSubscriber)
-{
-  // Test Location Info task when no HSS is configured.
-  MockHttpStack::Request req(_httpstack,
-                             "/impu/" + IMPU + "/",
-                             "location",
-                             "");
-  ImpuLocationInfoTask::Config cfg(false);
-  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
-
-  // Once the task's run function is called, we expect a cache request for
-  // the registration state of the public identity.
-  MockCache::MockGetRegData mock_op;
-  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
-    .WillOnce(Return(&mock_op));
+  std::vector<std::string> associated_identities = ASSOCIATED_IDENTITIES;
+  associated_identities.push_back(IMPI);
   EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
-    .WillRepeatedly(SetArgReferee<0>(""));
+    .WillRepeatedly(DoAll(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION), SetArgReferee<1>(3600)));
   EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
-    .WillRepeatedly(SetArgReferee<0>(RegistrationState::NOT_REGISTERED));
-  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1))
-    .WillRepeatedly(SetArgReferee<0>(IMPI_IN_VECTOR));
+    .WillRepeatedly(DoAll(SetArgReferee<0>(RegistrationState::NOT_REGISTERED), SetArgReferee<1>(3600)));
   EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
     .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
-  EXPECT_DO_ASYNC(*_cache, mock_op);
-  task->run();
-
-  // The cache indicates not found, so expect a 404 Not Found over HTTP.
-  EXPECT_CALL(*_httpstack, send_reply(_, 404, _));
-  CassandraStore::Transaction* t = mock_op.get_trx();
-  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(associated_identities));
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
   t->on_success(&mock_op);
-}
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
 
-TEST_F(HandlersTest, LocationInfoNoHSSConnectionError)
-{
-  // Test Location Info task when no HSS is configured.
-  MockHttpStack::Request req(_httpstack,
-                             "/impu/" + IMPU + "/",
-                             "location",
-                             "");
-  ImpuLocationInfoTask::Config cfg(false);
-  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::ServerAssignmentRequest sar(msg);
+  std::string test_str;
+  EXPECT_FALSE(sar.get_str_from_avp(_cx_dict->DESTINATION_HOST, test_str));
+  EXPECT_TRUE(selector.peer_stats().empty());
 
-  // Once the task's run function is called, we expect a cache request for
-  // the registration state of the public identity.
-  MockCache::MockGetRegData mock_op;
-  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
-    .WillOnce(Return(&mock_op));
-  EXPECT_DO_ASYNC(*_cache, mock_op);
-  task->run();
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  _caught_diam_tsx->on_timeout();
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
 
-  // The cache indicates connection error, so expect a 503 Service Unavailable over HTTP.
-  EXPECT_CALL(*_httpstack, send_reply(_, 503, _));
-  CassandraStore::Transaction* t = mock_op.get_trx();
-  ASSERT_FALSE(t == NULL);
-  mock_op._cass_status = CassandraStore::CONNECTION_ERROR;
-  mock_op._cass_error_text = "connection error";
-  t->on_failure(&mock_op);
+  HssCacheTask::configure_cx_peer_selector(NULL);
+  HssCacheTask::configure_diameter(_mock_stack,
+                                   DEST_REALM,
+                                   DEST_HOST,
+                                   DEFAULT_SERVER_NAME,
+                                   _cx_dict);
 }
 
-TEST_F(HandlersTest, LocationInfoNoHSSTimeout)
+TEST_F(HandlersTest, LocationInfoCircuitOpen)
 {
-  // Test Location Info task when no HSS is configured.
+  // Open the circuit breaker by timing out a request to the HSS.
+  CxCircuitBreaker breaker(50, 1);
+  HssCacheTask::configure_cx_circuit_breaker(&breaker);
+  ImpuLocationInfoTask::Config cfg(true);
+
   MockHttpStack::Request req(_httpstack,
                              "/impu/" + IMPU + "/",
                              "location",
                              "");
-  ImpuLocationInfoTask::Config cfg(false);
   ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
 
-  // Once the task's run function is called, we expect a cache request for
-  // the registration state of the public identity.
-  MockCache::MockGetRegData mock_op;
-  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
-    .WillOnce(Return(&mock_op));
-  EXPECT_DO_ASYNC(*_cache, mock_op);
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  _caught_diam_tsx->on_timeout();
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  EXPECT_EQ(CxCircuitBreaker::OPEN, breaker.state());
+
+  // The next request fails straight away without being sent to the HSS.
+  MockHttpStack::Request req2(_httpstack,
+                              "/impu/" + IMPU + "/",
+                              "location",
+                              "");
+  task = new ImpuLocationInfoTask(req2, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, _)).Times(0);
+  EXPECT_CALL(*_httpstack, send_reply(_, 503, _));
+  task->run();
+
+  HssCacheTask::configure_cx_circuit_breaker(NULL);
+}
+
+TEST_F(HandlersTest, PeerStatus)
+{
+  CxPeerSelector selector(DEST_REALM);
+  selector.peer_connection_cb(true, "hss1", DEST_REALM);
+  selector.on_complete("", "hss1", 1000, false);
+  HssCacheTask::configure_cx_peer_selector(&selector);
+
+  MockHttpStack::Request req(_httpstack, "/peers", "", "");
+  PeerStatusTask::Config cfg;
+  PeerStatusTask* task = new PeerStatusTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
   task->run();
+  EXPECT_THAT(req.content(), HasSubstr("\"host\":\"hss1\""));
+  EXPECT_THAT(req.content(), HasSubstr("\"latency_us\":1000"));
+  EXPECT_THAT(req.content(), HasSubstr("\"outstanding\":0"));
+  EXPECT_THAT(req.content(), HasSubstr("\"degraded\":false"));
 
-  // The cache indicates error, so expect a 504 Gateway Timeout over HTTP.
-  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
-  CassandraStore::Transaction* t = mock_op.get_trx();
-  ASSERT_FALSE(t == NULL);
-  mock_op._cass_status = CassandraStore::UNKNOWN_ERROR;
-  mock_op._cass_error_text = "error";
-  t->on_failure(&mock_op);
+  HssCacheTask::configure_cx_peer_selector(NULL);
 }
 
-//
-// Registration Termination tests
-//
+TEST_F(HandlersTest, PeerStatusNotEnabled)
+{
+  MockHttpStack::Request req(_httpstack, "/peers", "", "");
+  PeerStatusTask::Config cfg;
+  PeerStatusTask* task = new PeerStatusTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_httpstack, send_reply(_, 404, _));
+  task->run();
+}
+
+TEST_F(HandlersTest, BulkDeregistrationUnauthorized)
+{
+  // A request without the configured secret is rejected before anything is
+  // queued.
+  MockHttpStack::Request req(_httpstack,
+                             "/admin/deregister",
+                             "",
+                             "",
+                             IMPU,
+                             htp_method_POST);
+  BulkDeregistrationTask::Config cfg(NULL, "secret");
+  BulkDeregistrationTask* task = new BulkDeregistrationTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_httpstack, send_reply(_, 403, _));
+  task->run();
+}
 
 TEST_F(HandlersTest, RegistrationTerminationPermanentTermination)
 {
@@ -3616,90 +5534,344 @@ TEST_F(HandlersTest, RegistrationTerminationAssocIMPUsCacheFailure)
   task->_msg._stack = _mock_stack;
   task->_rtr._stack = _mock_stack;
 
-  // No public identities, so once the task's run function is called, we
-  // expect a cache request for associated default public identities.
-  std::vector<std::string> impis{IMPI, ASSOCIATED_IDENTITY1, ASSOCIATED_IDENTITY2};
-  MockCache::MockGetAssociatedPrimaryPublicIDs mock_op;
-  EXPECT_CALL(*_cache, create_GetAssociatedPrimaryPublicIDs(impis))
+  // No public identities, so once the task's run function is called, we
+  // expect a cache request for associated default public identities.
+  std::vector<std::string> impis{IMPI, ASSOCIATED_IDENTITY1, ASSOCIATED_IDENTITY2};
+  MockCache::MockGetAssociatedPrimaryPublicIDs mock_op;
+  EXPECT_CALL(*_cache, create_GetAssociatedPrimaryPublicIDs(impis))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+
+  task->run();
+
+  // The cache request fails.
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+
+  // Expect to receive a diameter message.
+  EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
+    .Times(1)
+    .WillOnce(WithArgs<0>(Invoke(store_msg)));
+
+  mock_op._cass_status = CassandraStore::INVALID_REQUEST;
+  mock_op._cass_error_text = "error";
+  t->on_failure(&mock_op);
+
+  // Turn the caught Diameter msg structure into a RTA and confirm the result
+  // code is correct.
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::RegistrationTerminationAnswer rta(msg);
+  EXPECT_TRUE(rta.result_code(test_i32));
+  EXPECT_EQ(DIAMETER_UNABLE_TO_COMPLY, test_i32);
+}
+
+TEST_F(HandlersTest, RegistrationTerminationInvalidDeregReason)
+{
+  Cx::RegistrationTerminationRequest rtr(_cx_dict,
+                                         _mock_stack,
+                                         5,
+                                         IMPI,
+                                         ASSOCIATED_IDENTITIES,
+                                         IMPUS,
+                                         AUTH_SESSION_STATE);
+
+  // The free_on_delete flag controls whether we want to free the underlying
+  // fd_msg structure when we delete this RTR. We don't, since this will be
+  // freed when the answer is freed later in the test. If we leave this flag set
+  // then the request will be freed twice.
+  rtr._free_on_delete = false;
+
+  RegistrationTerminationTask::Config cfg(_cache, _cx_dict, _sprout_conn, 0);
+  RegistrationTerminationTask* task = new RegistrationTerminationTask(_cx_dict, &rtr._fd_msg, &cfg, FAKE_TRAIL_ID);
+
+  // We have to make sure the message is pointing at the mock stack.
+  task->_msg._stack = _mock_stack;
+  task->_rtr._stack = _mock_stack;
+
+  // We expect to receive a diameter message.
+  EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
+    .Times(1)
+    .WillOnce(WithArgs<0>(Invoke(store_msg)));
+
+  task->run();
+
+  // Turn the caught Diameter msg structure into a RTA and confirm it's contents.
+  std::vector<std::string> impis{IMPI, ASSOCIATED_IDENTITY1, ASSOCIATED_IDENTITY2};
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::RegistrationTerminationAnswer rta(msg);
+  EXPECT_TRUE(rta.result_code(test_i32));
+  EXPECT_EQ(DIAMETER_UNABLE_TO_COMPLY, test_i32);
+  EXPECT_EQ(impis, rta.associated_identities());
+  EXPECT_EQ(AUTH_SESSION_STATE, rta.auth_session_state());
+}
+
+//
+// Push Profile tests
+//
+
+TEST_F(HandlersTest, PushProfile)
+{
+  // Build a PPR and create a Push Profile Task with this message. This PPR
+  // contains an IMS subscription and charging addresses.
+  Cx::PushProfileRequest ppr(_cx_dict,
+                             _mock_stack,
+                             IMPI,
+                             IMS_SUBSCRIPTION,
+                             FULL_CHARGING_ADDRESSES,
+                             AUTH_SESSION_STATE);
+
+  // The free_on_delete flag controls whether we want to free the underlying
+  // fd_msg structure when we delete this PPR. We don't, since this will be
+  // freed when the answer is freed later in the test. If we leave this flag set
+  // then the request will be freed twice.
+  ppr._free_on_delete = false;
+
+  PushProfileTask::Config cfg(_cache, _cx_dict, 0, 3600);
+  PushProfileTask* task = new PushProfileTask(_cx_dict, &ppr._fd_msg, &cfg, FAKE_TRAIL_ID);
+
+  // We have to make sure the message is pointing at the mock stack.
+  task->_msg._stack = _mock_stack;
+  task->_ppr._stack = _mock_stack;
+
+  // Once the task's run function is called, we expect to try and update
+  // the IMS subscription the charging addresses in the cache.
+  MockCache::MockPutRegData mock_op;
+  EXPECT_CALL(*_cache, create_PutRegData(IMPU_IN_VECTOR, _, 7200))
+    .WillOnce(Return(&mock_op));
+  EXPECT_CALL(mock_op, with_xml(IMS_SUBSCRIPTION))
+    .WillOnce(ReturnRef(mock_op));
+  EXPECT_CALL(mock_op, with_charging_addrs(_))
+    .WillOnce(ReturnRef(mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+
+  // Finally we expect a PPA.
+  EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
+    .Times(1)
+    .WillOnce(WithArgs<0>(Invoke(store_msg)));
+
+  t->on_success(&mock_op);
+
+  // Turn the caught Diameter msg structure into a PPA and confirm it's contents.
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::PushProfileAnswer ppa(msg);
+  EXPECT_TRUE(ppa.result_code(test_i32));
+  EXPECT_EQ(DIAMETER_SUCCESS, test_i32);
+  EXPECT_EQ(AUTH_SESSION_STATE, ppa.auth_session_state());
+}
+
+TEST_F(HandlersTest, PushProfileChargingAddrs)
+{
+  // Build a PPR and create a Push Profile Task with this message. This PPR
+  // contains some charging addresses but no IMS subscription.
+  Cx::PushProfileRequest ppr(_cx_dict,
+                             _mock_stack,
+                             IMPI,
+                             "",
+                             FULL_CHARGING_ADDRESSES,
+                             AUTH_SESSION_STATE);
+
+  // The free_on_delete flag controls whether we want to free the underlying
+  // fd_msg structure when we delete this PPR. We don't, since this will be
+  // freed when the answer is freed later in the test. If we leave this flag set
+  // then the request will be freed twice.
+  ppr._free_on_delete = false;
+
+  PushProfileTask::Config cfg(_cache, _cx_dict, 0, 3600);
+  PushProfileTask* task = new PushProfileTask(_cx_dict, &ppr._fd_msg, &cfg, FAKE_TRAIL_ID);
+
+  // We have to make sure the message is pointing at the mock stack.
+  task->_msg._stack = _mock_stack;
+  task->_ppr._stack = _mock_stack;
+
+  // Once the task's run function is called, expect to look for public IDs
+  // associated with IMPI in the cache. We do this because there is no
+  // IMS susbcription so we don't know which public IDs to update the charging
+  // addresses for.
+  MockCache::MockGetAssociatedPublicIDs mock_op;
+  EXPECT_CALL(*_cache, create_GetAssociatedPublicIDs(IMPI))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+
+  task->run();
+
+  // Confirm the transaction is not NULL, and specify a list of IMPUS to be returned on
+  // the expected call for the cache request's results.
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_result(_))
+    .WillRepeatedly(SetArgReferee<0>(IMPUS));
+
+  // Next we expect to try and update the charging addresses (but not the IMS
+  // subscription) in the cache. Each public ID is the default public ID of a
+  // different IRS, so they are written one at a time.
+  MockCache::MockPutRegData mock_op2;
+  EXPECT_CALL(*_cache, create_PutRegData(IMPU_IN_VECTOR, _, 7200))
+    .WillOnce(Return(&mock_op2));
+  EXPECT_CALL(mock_op2, with_charging_addrs(_))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_DO_ASYNC(*_cache, mock_op2);
+
+  t->on_success(&mock_op);
+
+  t = mock_op2.get_trx();
+  ASSERT_FALSE(t == NULL);
+
+  std::vector<std::string> impu2_in_vector = {IMPU2};
+  MockCache::MockPutRegData mock_op3;
+  EXPECT_CALL(*_cache, create_PutRegData(impu2_in_vector, _, 7200))
+    .WillOnce(Return(&mock_op3));
+  EXPECT_CALL(mock_op3, with_charging_addrs(_))
+    .WillOnce(ReturnRef(mock_op3));
+  EXPECT_DO_ASYNC(*_cache, mock_op3);
+
+  t->on_success(&mock_op2);
+
+  t = mock_op3.get_trx();
+  ASSERT_FALSE(t == NULL);
+
+  // Finally we expect a PPA.
+  EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
+    .Times(1)
+    .WillOnce(WithArgs<0>(Invoke(store_msg)));
+
+  t->on_success(&mock_op3);
+
+  // Turn the caught Diameter msg structure into a PPA and confirm it's contents.
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::PushProfileAnswer ppa(msg);
+  EXPECT_TRUE(ppa.result_code(test_i32));
+  EXPECT_EQ(DIAMETER_SUCCESS, test_i32);
+  EXPECT_EQ(AUTH_SESSION_STATE, ppa.auth_session_state());
+}
+
+TEST_F(HandlersTest, PushProfileNoPublicIDs)
+{
+  // Build a PPR and create a Push Profile Task with this message. This PPR
+  // contains charging addresses but no IMS subscription. We find no
+  // public identities associated with IMPI, and so don't know whose
+  // charging addresses to update.
+  Cx::PushProfileRequest ppr(_cx_dict,
+                             _mock_stack,
+                             IMPI,
+                             "",
+                             FULL_CHARGING_ADDRESSES,
+                             AUTH_SESSION_STATE);
+
+  // The free_on_delete flag controls whether we want to free the underlying
+  // fd_msg structure when we delete this PPR. We don't, since this will be
+  // freed when the answer is freed later in the test. If we leave this flag set
+  // then the request will be freed twice.
+  ppr._free_on_delete = false;
+
+  PushProfileTask::Config cfg(_cache, _cx_dict, 0, 3600);
+  PushProfileTask* task = new PushProfileTask(_cx_dict, &ppr._fd_msg, &cfg, FAKE_TRAIL_ID);
+
+  // We have to make sure the message is pointing at the mock stack.
+  task->_msg._stack = _mock_stack;
+  task->_ppr._stack = _mock_stack;
+
+  // Once the task's run function is called, expect to look for public IDs
+  // associated with IMPI in the cache. We do this because there is no
+  // IMS susbcription so we don't know which public IDs to update the charging
+  // addresses for.
+  MockCache::MockGetAssociatedPublicIDs mock_op;
+  EXPECT_CALL(*_cache, create_GetAssociatedPublicIDs(IMPI))
     .WillOnce(Return(&mock_op));
   EXPECT_DO_ASYNC(*_cache, mock_op);
 
   task->run();
 
-  // The cache request fails.
+  // Confirm the transaction is not NULL, and specify an empity list of IMPUS
+  // to be returned on the expected call for the cache request's results.
   CassandraStore::Transaction* t = mock_op.get_trx();
   ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_result(_))
+    .WillRepeatedly(SetArgReferee<0>(EMPTY_VECTOR));
 
-  // Expect to receive a diameter message.
+  // Finally we expect a PPA.
   EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
     .Times(1)
     .WillOnce(WithArgs<0>(Invoke(store_msg)));
 
-  mock_op._cass_status = CassandraStore::INVALID_REQUEST;
-  mock_op._cass_error_text = "error";
-  t->on_failure(&mock_op);
+  t->on_success(&mock_op);
 
-  // Turn the caught Diameter msg structure into a RTA and confirm the result
-  // code is correct.
+  // Turn the caught Diameter msg structure into a PPA and confirm the result code.
   Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
-  Cx::RegistrationTerminationAnswer rta(msg);
-  EXPECT_TRUE(rta.result_code(test_i32));
+  Cx::PushProfileAnswer ppa(msg);
+  EXPECT_TRUE(ppa.result_code(test_i32));
   EXPECT_EQ(DIAMETER_UNABLE_TO_COMPLY, test_i32);
 }
 
-TEST_F(HandlersTest, RegistrationTerminationInvalidDeregReason)
+TEST_F(HandlersTest, PushProfileLookupPublicIDsFail)
 {
-  Cx::RegistrationTerminationRequest rtr(_cx_dict,
-                                         _mock_stack,
-                                         5,
-                                         IMPI,
-                                         ASSOCIATED_IDENTITIES,
-                                         IMPUS,
-                                         AUTH_SESSION_STATE);
+  // Build a PPR and create a Push Profile Task with this message. This PPR
+  // contains charging addresses but no IMS subscription. We fail to find
+  // any public identities associated with IMPI, and so don't know whose
+  // charging addresses to update.
+  Cx::PushProfileRequest ppr(_cx_dict,
+                             _mock_stack,
+                             IMPI,
+                             "",
+                             FULL_CHARGING_ADDRESSES,
+                             AUTH_SESSION_STATE);
 
   // The free_on_delete flag controls whether we want to free the underlying
-  // fd_msg structure when we delete this RTR. We don't, since this will be
+  // fd_msg structure when we delete this PPR. We don't, since this will be
   // freed when the answer is freed later in the test. If we leave this flag set
   // then the request will be freed twice.
-  rtr._free_on_delete = false;
+  ppr._free_on_delete = false;
 
-  RegistrationTerminationTask::Config cfg(_cache, _cx_dict, _sprout_conn, 0);
-  RegistrationTerminationTask* task = new RegistrationTerminationTask(_cx_dict, &rtr._fd_msg, &cfg, FAKE_TRAIL_ID);
+  PushProfileTask::Config cfg(_cache, _cx_dict, 0, 3600);
+  PushProfileTask* task = new PushProfileTask(_cx_dict, &ppr._fd_msg, &cfg, FAKE_TRAIL_ID);
 
   // We have to make sure the message is pointing at the mock stack.
   task->_msg._stack = _mock_stack;
-  task->_rtr._stack = _mock_stack;
+  task->_ppr._stack = _mock_stack;
+
+  // Once the task's run function is called, expect to look for public IDs
+  // associated with IMPI in the cache. We do this because there is no
+  // IMS susbcription so we don't know which public IDs to update the charging
+  // addresses for.
+  MockCache::MockGetAssociatedPublicIDs mock_op;
+  EXPECT_CALL(*_cache, create_GetAssociatedPublicIDs(IMPI))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+
+  task->run();
+
+  // The cache request fails and we expect a PPA.
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  mock_op._cass_status = CassandraStore::INVALID_REQUEST;
+  mock_op._cass_error_text = "error";
 
-  // We expect to receive a diameter message.
   EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
     .Times(1)
     .WillOnce(WithArgs<0>(Invoke(store_msg)));
 
-  task->run();
+  t->on_failure(&mock_op);
 
-  // Turn the caught Diameter msg structure into a RTA and confirm it's contents.
-  std::vector<std::string> impis{IMPI, ASSOCIATED_IDENTITY1, ASSOCIATED_IDENTITY2};
+  // Turn the caught Diameter msg structure into a PPA and confirm the result code.
   Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
-  Cx::RegistrationTerminationAnswer rta(msg);
-  EXPECT_TRUE(rta.result_code(test_i32));
+  Cx::PushProfileAnswer ppa(msg);
+  EXPECT_TRUE(ppa.result_code(test_i32));
   EXPECT_EQ(DIAMETER_UNABLE_TO_COMPLY, test_i32);
-  EXPECT_EQ(impis, rta.associated_identities());
-  EXPECT_EQ(AUTH_SESSION_STATE, rta.auth_session_state());
 }
 
-//
-// Push Profile tests
-//
-
-TEST_F(HandlersTest, PushProfile)
+TEST_F(HandlersTest, PushProfileIMSSub)
 {
   // Build a PPR and create a Push Profile Task with this message. This PPR
-  // contains an IMS subscription and charging addresses.
+  // contains an IMS subscription and no charging addresses.
   Cx::PushProfileRequest ppr(_cx_dict,
                              _mock_stack,
                              IMPI,
                              IMS_SUBSCRIPTION,
-                             FULL_CHARGING_ADDRESSES,
+                             NO_CHARGING_ADDRESSES,
                              AUTH_SESSION_STATE);
 
   // The free_on_delete flag controls whether we want to free the underlying
@@ -3716,14 +5888,12 @@ TEST_F(HandlersTest, PushProfile)
   task->_ppr._stack = _mock_stack;
 
   // Once the task's run function is called, we expect to try and update
-  // the IMS subscription the charging addresses in the cache.
+  // the IMS Subscription (but not the charging addresses) in the cache.
   MockCache::MockPutRegData mock_op;
   EXPECT_CALL(*_cache, create_PutRegData(IMPU_IN_VECTOR, _, 7200))
     .WillOnce(Return(&mock_op));
   EXPECT_CALL(mock_op, with_xml(IMS_SUBSCRIPTION))
     .WillOnce(ReturnRef(mock_op));
-  EXPECT_CALL(mock_op, with_charging_addrs(_))
-    .WillOnce(ReturnRef(mock_op));
   EXPECT_DO_ASYNC(*_cache, mock_op);
 
   task->run();
@@ -3746,15 +5916,17 @@ TEST_F(HandlersTest, PushProfile)
   EXPECT_EQ(AUTH_SESSION_STATE, ppa.auth_session_state());
 }
 
-TEST_F(HandlersTest, PushProfileChargingAddrs)
+TEST_F(HandlersTest, PushProfileIMSSubNoSIPURI)
 {
+  CapturingTestLogger log;
+
   // Build a PPR and create a Push Profile Task with this message. This PPR
-  // contains some charging addresses but no IMS subscription.
+  // contains an IMS subscription with no SIP URIs.
   Cx::PushProfileRequest ppr(_cx_dict,
                              _mock_stack,
                              IMPI,
-                             "",
-                             FULL_CHARGING_ADDRESSES,
+                             TEL_URIS_IMS_SUBSCRIPTION,
+                             NO_CHARGING_ADDRESSES,
                              AUTH_SESSION_STATE);
 
   // The free_on_delete flag controls whether we want to free the underlying
@@ -3770,64 +5942,43 @@ TEST_F(HandlersTest, PushProfileChargingAddrs)
   task->_msg._stack = _mock_stack;
   task->_ppr._stack = _mock_stack;
 
-  // Once the task's run function is called, expect to look for public IDs
-  // associated with IMPI in the cache. We do this because there is no
-  // IMS susbcription so we don't know which public IDs to update the charging
-  // addresses for.
-  MockCache::MockGetAssociatedPublicIDs mock_op;
-  EXPECT_CALL(*_cache, create_GetAssociatedPublicIDs(IMPI))
+  // Once the task's run function is called, we expect to try and update
+  // the IMS Subscription (but not the charging addresses) in the cache.
+  MockCache::MockPutRegData mock_op;
+  EXPECT_CALL(*_cache, create_PutRegData(TEL_URIS_IN_VECTOR, _, 7200))
     .WillOnce(Return(&mock_op));
+  EXPECT_CALL(mock_op, with_xml(TEL_URIS_IMS_SUBSCRIPTION))
+    .WillOnce(ReturnRef(mock_op));
   EXPECT_DO_ASYNC(*_cache, mock_op);
 
   task->run();
 
-  // Confirm the transaction is not NULL, and specify a list of IMPUS to be returned on
-  // the expected call for the cache request's results.
   CassandraStore::Transaction* t = mock_op.get_trx();
   ASSERT_FALSE(t == NULL);
-  EXPECT_CALL(mock_op, get_result(_))
-    .WillRepeatedly(SetArgReferee<0>(IMPUS));
-
-  // Next we expect to try and update the charging addresses (but not the IMS
-  // subscription) in the cache.
-  MockCache::MockPutRegData mock_op2;
-  EXPECT_CALL(*_cache, create_PutRegData(IMPUS, _, 7200))
-    .WillOnce(Return(&mock_op2));
-  EXPECT_CALL(mock_op2, with_charging_addrs(_))
-    .WillOnce(ReturnRef(mock_op2));
-  EXPECT_DO_ASYNC(*_cache, mock_op2);
-
-  t->on_success(&mock_op);
-
-  t = mock_op2.get_trx();
-  ASSERT_FALSE(t == NULL);
 
   // Finally we expect a PPA.
   EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
     .Times(1)
     .WillOnce(WithArgs<0>(Invoke(store_msg)));
 
-  t->on_success(&mock_op2);
+  t->on_success(&mock_op);
 
-  // Turn the caught Diameter msg structure into a PPA and confirm it's contents.
+  // Turn the caught Diameter msg structure so it gets deleted properly.
   Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
-  Cx::PushProfileAnswer ppa(msg);
-  EXPECT_TRUE(ppa.result_code(test_i32));
-  EXPECT_EQ(DIAMETER_SUCCESS, test_i32);
-  EXPECT_EQ(AUTH_SESSION_STATE, ppa.auth_session_state());
+
+  // Check for the log indicating there were no SIP URIs in the IRS.
+  EXPECT_TRUE(log.contains("No SIP URI in Implicit Registration Set"));
 }
 
-TEST_F(HandlersTest, PushProfileNoPublicIDs)
+TEST_F(HandlersTest, PushProfileCacheFailure)
 {
   // Build a PPR and create a Push Profile Task with this message. This PPR
-  // contains charging addresses but no IMS subscription. We find no
-  // public identities associated with IMPI, and so don't know whose
-  // charging addresses to update.
+  // contains an IMS subscription.
   Cx::PushProfileRequest ppr(_cx_dict,
                              _mock_stack,
                              IMPI,
-                             "",
-                             FULL_CHARGING_ADDRESSES,
+                             IMS_SUBSCRIPTION,
+                             NO_CHARGING_ADDRESSES,
                              AUTH_SESSION_STATE);
 
   // The free_on_delete flag controls whether we want to free the underlying
@@ -3843,30 +5994,27 @@ TEST_F(HandlersTest, PushProfileNoPublicIDs)
   task->_msg._stack = _mock_stack;
   task->_ppr._stack = _mock_stack;
 
-  // Once the task's run function is called, expect to look for public IDs
-  // associated with IMPI in the cache. We do this because there is no
-  // IMS susbcription so we don't know which public IDs to update the charging
-  // addresses for.
-  MockCache::MockGetAssociatedPublicIDs mock_op;
-  EXPECT_CALL(*_cache, create_GetAssociatedPublicIDs(IMPI))
+  // Once the task's run function is called, we expect to try and update
+  // the IMS Subscription in the cache.
+  MockCache::MockPutRegData mock_op;
+  EXPECT_CALL(*_cache, create_PutRegData(IMPU_IN_VECTOR, _, 7200))
     .WillOnce(Return(&mock_op));
+  EXPECT_CALL(mock_op, with_xml(IMS_SUBSCRIPTION))
+    .WillOnce(ReturnRef(mock_op));
   EXPECT_DO_ASYNC(*_cache, mock_op);
 
   task->run();
 
-  // Confirm the transaction is not NULL, and specify an empity list of IMPUS
-  // to be returned on the expected call for the cache request's results.
   CassandraStore::Transaction* t = mock_op.get_trx();
   ASSERT_FALSE(t == NULL);
-  EXPECT_CALL(mock_op, get_result(_))
-    .WillRepeatedly(SetArgReferee<0>(EMPTY_VECTOR));
-
-  // Finally we expect a PPA.
   EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
     .Times(1)
     .WillOnce(WithArgs<0>(Invoke(store_msg)));
 
-  t->on_success(&mock_op);
+  // The cache request fails.
+  mock_op._cass_status = CassandraStore::INVALID_REQUEST;
+  mock_op._cass_error_text = "error";
+  t->on_failure(&mock_op);
 
   // Turn the caught Diameter msg structure into a PPA and confirm the result code.
   Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
@@ -3875,17 +6023,15 @@ TEST_F(HandlersTest, PushProfileNoPublicIDs)
   EXPECT_EQ(DIAMETER_UNABLE_TO_COMPLY, test_i32);
 }
 
-TEST_F(HandlersTest, PushProfileLookupPublicIDsFail)
+TEST_F(HandlersTest, PushProfileNoIMSSubNoChargingAddrs)
 {
   // Build a PPR and create a Push Profile Task with this message. This PPR
-  // contains charging addresses but no IMS subscription. We fail to find
-  // any public identities associated with IMPI, and so don't know whose
-  // charging addresses to update.
+  // does not contian an IMS subscription.
   Cx::PushProfileRequest ppr(_cx_dict,
                              _mock_stack,
                              IMPI,
                              "",
-                             FULL_CHARGING_ADDRESSES,
+                             NO_CHARGING_ADDRESSES,
                              AUTH_SESSION_STATE);
 
   // The free_on_delete flag controls whether we want to free the underlying
@@ -3897,237 +6043,433 @@ TEST_F(HandlersTest, PushProfileLookupPublicIDsFail)
   PushProfileTask::Config cfg(_cache, _cx_dict, 0, 3600);
   PushProfileTask* task = new PushProfileTask(_cx_dict, &ppr._fd_msg, &cfg, FAKE_TRAIL_ID);
 
-  // We have to make sure the message is pointing at the mock stack.
+  // We have to make sure the message representations are pointing at the mock stack.
   task->_msg._stack = _mock_stack;
   task->_ppr._stack = _mock_stack;
 
-  // Once the task's run function is called, expect to look for public IDs
-  // associated with IMPI in the cache. We do this because there is no
-  // IMS susbcription so we don't know which public IDs to update the charging
-  // addresses for.
-  MockCache::MockGetAssociatedPublicIDs mock_op;
-  EXPECT_CALL(*_cache, create_GetAssociatedPublicIDs(IMPI))
-    .WillOnce(Return(&mock_op));
-  EXPECT_DO_ASYNC(*_cache, mock_op);
+  // Once the task's run function is called, we just expect a PPA to be sent
+  // since there was nothing to do on this PPR.
+  EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
+    .Times(1)
+    .WillOnce(WithArgs<0>(Invoke(store_msg)));
 
   task->run();
 
-  // The cache request fails and we expect a PPA.
-  CassandraStore::Transaction* t = mock_op.get_trx();
-  ASSERT_FALSE(t == NULL);
-  mock_op._cass_status = CassandraStore::INVALID_REQUEST;
-  mock_op._cass_error_text = "error";
+  // Turn the caught Diameter msg structure into a PPA and confirm the result code.
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::PushProfileAnswer ppa(msg);
+  EXPECT_TRUE(ppa.result_code(test_i32));
+  EXPECT_EQ(DIAMETER_SUCCESS, test_i32);
+}
+
+TEST_F(HandlersTest, PushProfileBatched)
+{
+  PushProfileTask::configure_ppr_batching(true);
+  PushProfileTask::Config cfg(_cache, _cx_dict, 0, 3600);
+
+  // Build three PPRs for the same IRS, each with an IMS subscription. As in
+  // the tests above, the PPRs are freed along with their answers.
+  Cx::PushProfileRequest ppr1(_cx_dict,
+                              _mock_stack,
+                              IMPI,
+                              IMS_SUBSCRIPTION,
+                              NO_CHARGING_ADDRESSES,
+                              AUTH_SESSION_STATE);
+  ppr1._free_on_delete = false;
+  Cx::PushProfileRequest ppr2(_cx_dict,
+                              _mock_stack,
+                              IMPI,
+                              IMS_SUBSCRIPTION,
+                              NO_CHARGING_ADDRESSES,
+                              AUTH_SESSION_STATE);
+  ppr2._free_on_delete = false;
+  Cx::PushProfileRequest ppr3(_cx_dict,
+                              _mock_stack,
+                              IMPI,
+                              IMPU_IMS_SUBSCRIPTION,
+                              NO_CHARGING_ADDRESSES,
+                              AUTH_SESSION_STATE);
+  ppr3._free_on_delete = false;
+
+  PushProfileTask* task1 = new PushProfileTask(_cx_dict, &ppr1._fd_msg, &cfg, FAKE_TRAIL_ID);
+  task1->_msg._stack = _mock_stack;
+  task1->_ppr._stack = _mock_stack;
+  PushProfileTask* task2 = new PushProfileTask(_cx_dict, &ppr2._fd_msg, &cfg, FAKE_TRAIL_ID + 1);
+  task2->_msg._stack = _mock_stack;
+  task2->_ppr._stack = _mock_stack;
+  PushProfileTask* task3 = new PushProfileTask(_cx_dict, &ppr3._fd_msg, &cfg, FAKE_TRAIL_ID + 2);
+  task3->_msg._stack = _mock_stack;
+  task3->_ppr._stack = _mock_stack;
+
+  // The first PPR is applied straight away.
+  MockCache::MockPutRegData mock_op1;
+  EXPECT_CALL(*_cache, create_PutRegData(IMPU_IN_VECTOR, _, 7200))
+    .WillOnce(Return(&mock_op1));
+  EXPECT_CALL(mock_op1, with_xml(IMS_SUBSCRIPTION))
+    .WillOnce(ReturnRef(mock_op1));
+  EXPECT_DO_ASYNC(*_cache, mock_op1);
+
+  task1->run();
+
+  CassandraStore::Transaction* t1 = mock_op1.get_trx();
+  ASSERT_FALSE(t1 == NULL);
+
+  // The other two arrive while the first is being written, so they wait.
+  task2->run();
+  task3->run();
+
+  // When the first write completes, it is answered and the two waiting PPRs
+  // are applied in a single write of the latest IMS subscription.
+  EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
+    .WillOnce(WithArgs<0>(Invoke(store_msg)));
+  MockCache::MockPutRegData mock_op2;
+  EXPECT_CALL(*_cache, create_PutRegData(_, _, 7200))
+    .WillOnce(Return(&mock_op2));
+  EXPECT_CALL(mock_op2, with_xml(IMPU_IMS_SUBSCRIPTION))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_DO_ASYNC(*_cache, mock_op2);
+
+  t1->on_success(&mock_op1);
+
+  Diameter::Message msg1(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::PushProfileAnswer ppa1(msg1);
+  EXPECT_TRUE(ppa1.result_code(test_i32));
+  EXPECT_EQ(DIAMETER_SUCCESS, test_i32);
+
+  CassandraStore::Transaction* t2 = mock_op2.get_trx();
+  ASSERT_FALSE(t2 == NULL);
+
+  // Both waiting PPRs are answered once the combined write completes.
+  EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID + 1))
+    .WillOnce(WithArgs<0>(Invoke(free_msg)));
+  EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID + 2))
+    .WillOnce(WithArgs<0>(Invoke(store_msg)));
+
+  t2->on_success(&mock_op2);
+
+  Diameter::Message msg3(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::PushProfileAnswer ppa3(msg3);
+  EXPECT_TRUE(ppa3.result_code(test_i32));
+  EXPECT_EQ(DIAMETER_SUCCESS, test_i32);
+
+  PushProfileTask::configure_ppr_batching(false);
+}
+
+// PPRs for different IRSs of the same private ID aren't batched together,
+// so each IRS gets its own update.
+TEST_F(HandlersTest, PushProfileBatchedSeparateIrss)
+{
+  PushProfileTask::configure_ppr_batching(true);
+  PushProfileTask::Config cfg(_cache, _cx_dict, 0, 3600);
+
+  // The first and third PPRs are for the IRS whose default public ID is
+  // IMPU. The second is for the IRS whose default public ID is IMPU3.
+  Cx::PushProfileRequest ppr1(_cx_dict,
+                              _mock_stack,
+                              IMPI,
+                              IMS_SUBSCRIPTION,
+                              NO_CHARGING_ADDRESSES,
+                              AUTH_SESSION_STATE);
+  ppr1._free_on_delete = false;
+  Cx::PushProfileRequest ppr2(_cx_dict,
+                              _mock_stack,
+                              IMPI,
+                              IMPU3_IMS_SUBSCRIPTION,
+                              NO_CHARGING_ADDRESSES,
+                              AUTH_SESSION_STATE);
+  ppr2._free_on_delete = false;
+  Cx::PushProfileRequest ppr3(_cx_dict,
+                              _mock_stack,
+                              IMPI,
+                              IMPU_IMS_SUBSCRIPTION,
+                              NO_CHARGING_ADDRESSES,
+                              AUTH_SESSION_STATE);
+  ppr3._free_on_delete = false;
+
+  PushProfileTask* task1 = new PushProfileTask(_cx_dict, &ppr1._fd_msg, &cfg, FAKE_TRAIL_ID);
+  task1->_msg._stack = _mock_stack;
+  task1->_ppr._stack = _mock_stack;
+  PushProfileTask* task2 = new PushProfileTask(_cx_dict, &ppr2._fd_msg, &cfg, FAKE_TRAIL_ID + 1);
+  task2->_msg._stack = _mock_stack;
+  task2->_ppr._stack = _mock_stack;
+  PushProfileTask* task3 = new PushProfileTask(_cx_dict, &ppr3._fd_msg, &cfg, FAKE_TRAIL_ID + 2);
+  task3->_msg._stack = _mock_stack;
+  task3->_ppr._stack = _mock_stack;
+
+  MockCache::MockPutRegData mock_op1;
+  EXPECT_CALL(*_cache, create_PutRegData(IMPU_IN_VECTOR, _, 7200))
+    .WillOnce(Return(&mock_op1));
+  EXPECT_CALL(mock_op1, with_xml(IMS_SUBSCRIPTION))
+    .WillOnce(ReturnRef(mock_op1));
+  EXPECT_DO_ASYNC(*_cache, mock_op1);
+  task1->run();
+  CassandraStore::Transaction* t1 = mock_op1.get_trx();
+  ASSERT_FALSE(t1 == NULL);
+
+  // The second PPR is for a different IRS, so it is written straight away
+  // rather than waiting for the first.
+  MockCache::MockPutRegData mock_op2;
+  EXPECT_CALL(*_cache, create_PutRegData(std::vector<std::string>({IMPU3, IMPU2}), _, 7200))
+    .WillOnce(Return(&mock_op2));
+  EXPECT_CALL(mock_op2, with_xml(IMPU3_IMS_SUBSCRIPTION))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_DO_ASYNC(*_cache, mock_op2);
+  task2->run();
+  CassandraStore::Transaction* t2 = mock_op2.get_trx();
+  ASSERT_FALSE(t2 == NULL);
 
+  // The third PPR waits for the first.
+  task3->run();
+
+  EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID + 1))
+    .WillOnce(WithArgs<0>(Invoke(store_msg)));
+  t2->on_success(&mock_op2);
+
+  Diameter::Message msg2(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::PushProfileAnswer ppa2(msg2);
+  EXPECT_TRUE(ppa2.result_code(test_i32));
+  EXPECT_EQ(DIAMETER_SUCCESS, test_i32);
+
+  // When the first write completes, the third PPR is applied.
   EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
-    .Times(1)
+    .WillOnce(WithArgs<0>(Invoke(free_msg)));
+  MockCache::MockPutRegData mock_op3;
+  EXPECT_CALL(*_cache, create_PutRegData(std::vector<std::string>({IMPU, IMPU4}), _, 7200))
+    .WillOnce(Return(&mock_op3));
+  EXPECT_CALL(mock_op3, with_xml(IMPU_IMS_SUBSCRIPTION))
+    .WillOnce(ReturnRef(mock_op3));
+  EXPECT_DO_ASYNC(*_cache, mock_op3);
+  t1->on_success(&mock_op1);
+
+  CassandraStore::Transaction* t3 = mock_op3.get_trx();
+  ASSERT_FALSE(t3 == NULL);
+
+  EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID + 2))
     .WillOnce(WithArgs<0>(Invoke(store_msg)));
+  t3->on_success(&mock_op3);
 
-  t->on_failure(&mock_op);
+  Diameter::Message msg3(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::PushProfileAnswer ppa3(msg3);
+  EXPECT_TRUE(ppa3.result_code(test_i32));
+  EXPECT_EQ(DIAMETER_SUCCESS, test_i32);
 
-  // Turn the caught Diameter msg structure into a PPA and confirm the result code.
-  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
-  Cx::PushProfileAnswer ppa(msg);
-  EXPECT_TRUE(ppa.result_code(test_i32));
-  EXPECT_EQ(DIAMETER_UNABLE_TO_COMPLY, test_i32);
+  PushProfileTask::configure_ppr_batching(false);
 }
 
-TEST_F(HandlersTest, PushProfileIMSSub)
+TEST_F(HandlersTest, PushProfileIrsUnchanged)
 {
-  // Build a PPR and create a Push Profile Task with this message. This PPR
-  // contains an IMS subscription and no charging addresses.
+  PushProfileTask::configure_incremental_irs_updates(true);
+
+  // Build a PPR containing the IMS subscription that is already cached.
   Cx::PushProfileRequest ppr(_cx_dict,
                              _mock_stack,
                              IMPI,
                              IMS_SUBSCRIPTION,
                              NO_CHARGING_ADDRESSES,
                              AUTH_SESSION_STATE);
-
-  // The free_on_delete flag controls whether we want to free the underlying
-  // fd_msg structure when we delete this PPR. We don't, since this will be
-  // freed when the answer is freed later in the test. If we leave this flag set
-  // then the request will be freed twice.
   ppr._free_on_delete = false;
 
   PushProfileTask::Config cfg(_cache, _cx_dict, 0, 3600);
   PushProfileTask* task = new PushProfileTask(_cx_dict, &ppr._fd_msg, &cfg, FAKE_TRAIL_ID);
-
-  // We have to make sure the message is pointing at the mock stack.
   task->_msg._stack = _mock_stack;
   task->_ppr._stack = _mock_stack;
 
-  // Once the task's run function is called, we expect to try and update
-  // the IMS Subscription (but not the charging addresses) in the cache.
-  MockCache::MockPutRegData mock_op;
-  EXPECT_CALL(*_cache, create_PutRegData(IMPU_IN_VECTOR, _, 7200))
+  // We expect the task to look up the cached IMS subscription first, via
+  // the default public IDs associated with the private ID.
+  MockCache::MockGetAssociatedPublicIDs mock_op1;
+  EXPECT_CALL(*_cache, create_GetAssociatedPublicIDs(IMPI))
+    .WillOnce(Return(&mock_op1));
+  EXPECT_DO_ASYNC(*_cache, mock_op1);
+
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op1.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op1, get_result(_))
+    .WillOnce(SetArgReferee<0>(IMPU_IN_VECTOR));
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
     .WillOnce(Return(&mock_op));
-  EXPECT_CALL(mock_op, with_xml(IMS_SUBSCRIPTION))
-    .WillOnce(ReturnRef(mock_op));
   EXPECT_DO_ASYNC(*_cache, mock_op);
 
-  task->run();
+  t->on_success(&mock_op1);
 
-  CassandraStore::Transaction* t = mock_op.get_trx();
+  t = mock_op.get_trx();
   ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _))
+    .WillOnce(DoAll(SetArgReferee<0>(IMS_SUBSCRIPTION), SetArgReferee<1>(0)));
+  EXPECT_CALL(mock_op, get_associated_impis(_))
+    .WillOnce(SetArgReferee<0>(IMPI_IN_VECTOR));
 
-  // Finally we expect a PPA.
+  // Nothing has changed, so nothing is written and we just expect a PPA.
   EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
     .Times(1)
     .WillOnce(WithArgs<0>(Invoke(store_msg)));
 
   t->on_success(&mock_op);
 
-  // Turn the caught Diameter msg structure into a PPA and confirm it's contents.
   Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
   Cx::PushProfileAnswer ppa(msg);
   EXPECT_TRUE(ppa.result_code(test_i32));
   EXPECT_EQ(DIAMETER_SUCCESS, test_i32);
-  EXPECT_EQ(AUTH_SESSION_STATE, ppa.auth_session_state());
+
+  PushProfileTask::configure_incremental_irs_updates(false);
 }
 
-TEST_F(HandlersTest, PushProfileIMSSubNoSIPURI)
+TEST_F(HandlersTest, PushProfileIrsPublicIdRemoved)
 {
-  CapturingTestLogger log;
+  PushProfileTask::configure_incremental_irs_updates(true);
 
-  // Build a PPR and create a Push Profile Task with this message. This PPR
-  // contains an IMS subscription with no SIP URIs.
+  // Build a PPR whose IMS subscription no longer contains IMPU4.
   Cx::PushProfileRequest ppr(_cx_dict,
                              _mock_stack,
                              IMPI,
-                             TEL_URIS_IMS_SUBSCRIPTION,
+                             IMS_SUBSCRIPTION,
                              NO_CHARGING_ADDRESSES,
                              AUTH_SESSION_STATE);
-
-  // The free_on_delete flag controls whether we want to free the underlying
-  // fd_msg structure when we delete this PPR. We don't, since this will be
-  // freed when the answer is freed later in the test. If we leave this flag set
-  // then the request will be freed twice.
   ppr._free_on_delete = false;
 
   PushProfileTask::Config cfg(_cache, _cx_dict, 0, 3600);
   PushProfileTask* task = new PushProfileTask(_cx_dict, &ppr._fd_msg, &cfg, FAKE_TRAIL_ID);
-
-  // We have to make sure the message is pointing at the mock stack.
   task->_msg._stack = _mock_stack;
   task->_ppr._stack = _mock_stack;
 
-  // Once the task's run function is called, we expect to try and update
-  // the IMS Subscription (but not the charging addresses) in the cache.
-  MockCache::MockPutRegData mock_op;
-  EXPECT_CALL(*_cache, create_PutRegData(TEL_URIS_IN_VECTOR, _, 7200))
+  MockCache::MockGetAssociatedPublicIDs mock_op1;
+  EXPECT_CALL(*_cache, create_GetAssociatedPublicIDs(IMPI))
+    .WillOnce(Return(&mock_op1));
+  EXPECT_DO_ASYNC(*_cache, mock_op1);
+
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op1.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op1, get_result(_))
+    .WillOnce(SetArgReferee<0>(IMPU_IN_VECTOR));
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
     .WillOnce(Return(&mock_op));
-  EXPECT_CALL(mock_op, with_xml(TEL_URIS_IMS_SUBSCRIPTION))
-    .WillOnce(ReturnRef(mock_op));
   EXPECT_DO_ASYNC(*_cache, mock_op);
 
-  task->run();
+  t->on_success(&mock_op1);
 
-  CassandraStore::Transaction* t = mock_op.get_trx();
+  t = mock_op.get_trx();
   ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _))
+    .WillOnce(DoAll(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION), SetArgReferee<1>(0)));
+  EXPECT_CALL(mock_op, get_associated_impis(_))
+    .WillOnce(SetArgReferee<0>(IMPI_IN_VECTOR));
+
+  // IMPU4 is deleted from the cache. It wasn't the default public ID, so
+  // isn't dissociated from the private ID. The new IMS subscription is then
+  // written for the remaining public ID.
+  std::vector<std::string> removed = {IMPU4};
+  std::vector<std::string> no_impis;
+  MockCache::MockDeletePublicIDs mock_op2;
+  EXPECT_CALL(*_cache, create_DeletePublicIDs(removed, no_impis, _))
+    .WillOnce(Return(&mock_op2));
+  EXPECT_DO_ASYNC(*_cache, mock_op2);
+  MockCache::MockPutRegData mock_op3;
+  EXPECT_CALL(*_cache, create_PutRegData(IMPU_IN_VECTOR, _, 7200))
+    .WillOnce(Return(&mock_op3));
+  EXPECT_CALL(mock_op3, with_xml(IMS_SUBSCRIPTION))
+    .WillOnce(ReturnRef(mock_op3));
+  EXPECT_DO_ASYNC(*_cache, mock_op3);
 
-  // Finally we expect a PPA.
+  t->on_success(&mock_op);
+
+  t = mock_op3.get_trx();
+  ASSERT_FALSE(t == NULL);
   EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
     .Times(1)
     .WillOnce(WithArgs<0>(Invoke(store_msg)));
 
-  t->on_success(&mock_op);
+  t->on_success(&mock_op3);
 
-  // Turn the caught Diameter msg structure so it gets deleted properly.
   Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::PushProfileAnswer ppa(msg);
+  EXPECT_TRUE(ppa.result_code(test_i32));
+  EXPECT_EQ(DIAMETER_SUCCESS, test_i32);
 
-  // Check for the log indicating there were no SIP URIs in the IRS.
-  EXPECT_TRUE(log.contains("No SIP URI in Implicit Registration Set"));
+  PushProfileTask::configure_incremental_irs_updates(false);
 }
 
-TEST_F(HandlersTest, PushProfileCacheFailure)
+TEST_F(HandlersTest, PushProfileIrsDefaultIdChanged)
 {
-  // Build a PPR and create a Push Profile Task with this message. This PPR
-  // contains an IMS subscription.
+  PushProfileTask::configure_incremental_irs_updates(true);
+
+  // The cached IRS has IMPU4 as its default public ID. Build a PPR whose IMS
+  // subscription has removed it, so IMPU is now the default.
+  std::string cached_xml = "<?xml version=\"1.0\"?><IMSSubscription><PrivateID>" + IMPI + "</PrivateID><ServiceProfile><PublicIdentity><Identity>" + IMPU4 + "</Identity></PublicIdentity><PublicIdentity><Identity>" + IMPU + "</Identity></PublicIdentity></ServiceProfile></IMSSubscription>";
   Cx::PushProfileRequest ppr(_cx_dict,
                              _mock_stack,
                              IMPI,
                              IMS_SUBSCRIPTION,
                              NO_CHARGING_ADDRESSES,
                              AUTH_SESSION_STATE);
-
-  // The free_on_delete flag controls whether we want to free the underlying
-  // fd_msg structure when we delete this PPR. We don't, since this will be
-  // freed when the answer is freed later in the test. If we leave this flag set
-  // then the request will be freed twice.
   ppr._free_on_delete = false;
 
   PushProfileTask::Config cfg(_cache, _cx_dict, 0, 3600);
   PushProfileTask* task = new PushProfileTask(_cx_dict, &ppr._fd_msg, &cfg, FAKE_TRAIL_ID);
-
-  // We have to make sure the message is pointing at the mock stack.
   task->_msg._stack = _mock_stack;
   task->_ppr._stack = _mock_stack;
 
-  // Once the task's run function is called, we expect to try and update
-  // the IMS Subscription in the cache.
-  MockCache::MockPutRegData mock_op;
-  EXPECT_CALL(*_cache, create_PutRegData(IMPU_IN_VECTOR, _, 7200))
-    .WillOnce(Return(&mock_op));
-  EXPECT_CALL(mock_op, with_xml(IMS_SUBSCRIPTION))
-    .WillOnce(ReturnRef(mock_op));
-  EXPECT_DO_ASYNC(*_cache, mock_op);
+  MockCache::MockGetAssociatedPublicIDs mock_op1;
+  EXPECT_CALL(*_cache, create_GetAssociatedPublicIDs(IMPI))
+    .WillOnce(Return(&mock_op1));
+  EXPECT_DO_ASYNC(*_cache, mock_op1);
 
   task->run();
 
-  CassandraStore::Transaction* t = mock_op.get_trx();
+  // The cached IRS is found under the old default public ID.
+  CassandraStore::Transaction* t = mock_op1.get_trx();
   ASSERT_FALSE(t == NULL);
-  EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
-    .Times(1)
-    .WillOnce(WithArgs<0>(Invoke(store_msg)));
-
-  // The cache request fails.
-  mock_op._cass_status = CassandraStore::INVALID_REQUEST;
-  mock_op._cass_error_text = "error";
-  t->on_failure(&mock_op);
-
-  // Turn the caught Diameter msg structure into a PPA and confirm the result code.
-  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
-  Cx::PushProfileAnswer ppa(msg);
-  EXPECT_TRUE(ppa.result_code(test_i32));
-  EXPECT_EQ(DIAMETER_UNABLE_TO_COMPLY, test_i32);
-}
-
-TEST_F(HandlersTest, PushProfileNoIMSSubNoChargingAddrs)
-{
-  // Build a PPR and create a Push Profile Task with this message. This PPR
-  // does not contian an IMS subscription.
-  Cx::PushProfileRequest ppr(_cx_dict,
-                             _mock_stack,
-                             IMPI,
-                             "",
-                             NO_CHARGING_ADDRESSES,
-                             AUTH_SESSION_STATE);
+  std::vector<std::string> default_ids = {IMPU4};
+  EXPECT_CALL(mock_op1, get_result(_))
+    .WillOnce(SetArgReferee<0>(default_ids));
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU4))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
 
-  // The free_on_delete flag controls whether we want to free the underlying
-  // fd_msg structure when we delete this PPR. We don't, since this will be
-  // freed when the answer is freed later in the test. If we leave this flag set
-  // then the request will be freed twice.
-  ppr._free_on_delete = false;
+  t->on_success(&mock_op1);
 
-  PushProfileTask::Config cfg(_cache, _cx_dict, 0, 3600);
-  PushProfileTask* task = new PushProfileTask(_cx_dict, &ppr._fd_msg, &cfg, FAKE_TRAIL_ID);
+  t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _))
+    .WillOnce(DoAll(SetArgReferee<0>(cached_xml), SetArgReferee<1>(0)));
+  EXPECT_CALL(mock_op, get_associated_impis(_))
+    .WillOnce(SetArgReferee<0>(IMPI_IN_VECTOR));
+
+  // The old default public ID is deleted and dissociated from the private
+  // ID, and the new IMS subscription is written.
+  std::vector<std::string> removed = {IMPU4};
+  MockCache::MockDeletePublicIDs mock_op2;
+  EXPECT_CALL(*_cache, create_DeletePublicIDs(removed, IMPI_IN_VECTOR, _))
+    .WillOnce(Return(&mock_op2));
+  EXPECT_DO_ASYNC(*_cache, mock_op2);
+  MockCache::MockPutRegData mock_op3;
+  EXPECT_CALL(*_cache, create_PutRegData(IMPU_IN_VECTOR, _, 7200))
+    .WillOnce(Return(&mock_op3));
+  EXPECT_CALL(mock_op3, with_xml(IMS_SUBSCRIPTION))
+    .WillOnce(ReturnRef(mock_op3));
+  EXPECT_DO_ASYNC(*_cache, mock_op3);
 
-  // We have to make sure the message representations are pointing at the mock stack.
-  task->_msg._stack = _mock_stack;
-  task->_ppr._stack = _mock_stack;
+  t->on_success(&mock_op);
 
-  // Once the task's run function is called, we just expect a PPA to be sent
-  // since there was nothing to do on this PPR.
+  t = mock_op3.get_trx();
+  ASSERT_FALSE(t == NULL);
   EXPECT_CALL(*_mock_stack, send(_, FAKE_TRAIL_ID))
     .Times(1)
     .WillOnce(WithArgs<0>(Invoke(store_msg)));
 
-  task->run();
+  t->on_success(&mock_op3);
 
-  // Turn the caught Diameter msg structure into a PPA and confirm the result code.
   Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
   Cx::PushProfileAnswer ppa(msg);
   EXPECT_TRUE(ppa.result_code(test_i32));
   EXPECT_EQ(DIAMETER_SUCCESS, test_i32);
+
+  PushProfileTask::configure_incremental_irs_updates(false);
 }
 
 //
@@ -4304,64 +6646,213 @@ TEST_F(HandlerStatsTest, DigestHSS)
   digest.qop = "qop";
   AKAAuthVector aka;
 
-  Cx::MultimediaAuthAnswer maa(_cx_dict,
-                               _mock_stack,
-                               DIAMETER_SUCCESS,
-                               SCHEME_DIGEST,
-                               digest,
-                               aka);
+  Cx::MultimediaAuthAnswer maa(_cx_dict,
+                               _mock_stack,
+                               DIAMETER_SUCCESS,
+                               SCHEME_DIGEST,
+                               digest,
+                               aka);
+
+  // The HSS and digest stats are updated.
+  EXPECT_CALL(*_stats, update_H_hss_latency_us(13000));
+  EXPECT_CALL(*_stats, update_H_hss_digest_latency_us(13000));
+
+  MockCache::MockPutAssociatedPublicID mock_op;
+  EXPECT_CALL(*_cache, create_PutAssociatedPublicID(IMPI, IMPU,  _, _))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, _, _));
+  _caught_diam_tsx->on_response(maa);
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+}
+
+
+TEST_F(HandlerStatsTest, DigestHSSTimeout)
+{
+  // Check that a timed-out MultimediaAuthRequest updates the HSS and digest
+  // stats.
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI,
+                             "digest",
+                             "?public_id=" + IMPU);
+
+  ImpiTask::Config cfg(true, 300, SCHEME_UNKNOWN, SCHEME_DIGEST, SCHEME_AKA);
+  ImpiDigestTask* task = new ImpiDigestTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Once the task's run function is called, expect a diameter message to be sent.
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  // The transaction takes some time.
+  _caught_diam_tsx->start_timer();
+  cwtest_advance_time_ms(13);
+  _caught_diam_tsx->stop_timer();
+
+  // Free the underlying FD message.
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
+
+  EXPECT_CALL(*_stats, update_H_hss_latency_us(13000));
+  EXPECT_CALL(*_stats, update_H_hss_digest_latency_us(13000));
+
+  EXPECT_CALL(*_httpstack, send_reply(_, _, _));
+  _caught_diam_tsx->on_timeout();
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+}
+
+
+TEST_F(HandlerStatsTest, LocationInfoICSCFCache)
+{
+  // Check that I-CSCF cache lookups update the hit and miss stats.
+  IcscfCache icscf_cache(30);
+  icscf_cache.put(IcscfCache::lir_key(IMPU, "", ""), "", IMPU, "{}");
+  HssCacheTask::configure_icscf_cache(&icscf_cache);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+  ImpuLocationInfoTask::Config cfg(true);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(*_stats, incr_H_icscf_cache_hits());
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  task->run();
+
+  MockHttpStack::Request req2(_httpstack,
+                              "/impu/" + IMPU + "/",
+                              "location",
+                              "?originating=true");
+  task = new ImpuLocationInfoTask(req2, &cfg, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(*_stats, incr_H_icscf_cache_misses());
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  _caught_diam_tsx->on_timeout();
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  HssCacheTask::configure_icscf_cache(NULL);
+}
+
+TEST_F(HandlerStatsTest, IMSSubscriptionRegDataCache)
+{
+  // Check that the second GET for the same registration data copies the body
+  // from the reg-data cache, and that the cache stats are updated.
+  RegDataCache reg_data_cache(1024 * 1024);
+  ImpuRegDataTask::configure_reg_data_cache(&reg_data_cache);
+  ImpuRegDataTask::Config cfg(true, 3600);
+
+  for (int ii = 0; ii < 2; ii++)
+  {
+    MockHttpStack::Request req(_httpstack,
+                               "/impu/" + IMPU + "/reg-data",
+                               "",
+                               "",
+                               "",
+                               htp_method_GET);
+    ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+    MockCache::MockGetRegData mock_op;
+    EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+      .WillOnce(Return(&mock_op));
+    EXPECT_DO_ASYNC(*_cache, mock_op);
+    task->run();
+
+    CassandraStore::Transaction* t = mock_op.get_trx();
+    ASSERT_FALSE(t == NULL);
+    EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+      .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
+    EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+      .WillRepeatedly(SetArgReferee<0>(RegistrationState::REGISTERED));
+    EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1));
+    EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+      .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
 
-  // The HSS and digest stats are updated.
-  EXPECT_CALL(*_stats, update_H_hss_latency_us(13000));
-  EXPECT_CALL(*_stats, update_H_hss_digest_latency_us(13000));
+    if (ii == 0)
+    {
+      EXPECT_CALL(*_stats, incr_H_reg_data_cache_misses());
+      EXPECT_CALL(*_stats, update_H_reg_data_cache_bytes(_));
+    }
+    else
+    {
+      EXPECT_CALL(*_stats, incr_H_reg_data_cache_hits());
+    }
+    EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+    t->on_success(&mock_op);
 
-  MockCache::MockPutAssociatedPublicID mock_op;
-  EXPECT_CALL(*_cache, create_PutAssociatedPublicID(IMPI, IMPU,  _, _))
-    .WillOnce(Return(&mock_op));
-  EXPECT_DO_ASYNC(*_cache, mock_op);
+    EXPECT_EQ(REGDATA_RESULT, req.content());
+  }
 
-  EXPECT_CALL(*_httpstack, send_reply(_, _, _));
-  _caught_diam_tsx->on_response(maa);
-  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  EXPECT_EQ(1u, reg_data_cache.size());
+  ImpuRegDataTask::configure_reg_data_cache(NULL);
 }
 
-
-TEST_F(HandlerStatsTest, DigestHSSTimeout)
+TEST_F(HandlerStatsTest, IMSSubscriptionWarmUpPrimesRegDataCache)
 {
-  // Check that a timed-out MultimediaAuthRequest updates the HSS and digest
-  // stats.
-  MockHttpStack::Request req(_httpstack,
-                             "/impi/" + IMPI,
-                             "digest",
-                             "?public_id=" + IMPU);
+  // Check that warming up a public ID caches the body a GET would return,
+  // so that the first GET after the warm-up is a cache hit.
+  RegDataCache reg_data_cache(1024 * 1024);
+  ImpuRegDataTask::configure_reg_data_cache(&reg_data_cache);
 
-  ImpiTask::Config cfg(true, 300, SCHEME_UNKNOWN, SCHEME_DIGEST, SCHEME_AKA);
-  ImpiDigestTask* task = new ImpiDigestTask(req, &cfg, FAKE_TRAIL_ID);
+  MockCache::MockGetRegData warm_up_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&warm_up_op));
+  EXPECT_DO_ASYNC(*_cache, warm_up_op);
+  ImpuRegDataTask::warm_up(IMPU);
 
-  // Once the task's run function is called, expect a diameter message to be sent.
-  EXPECT_CALL(*_mock_stack, send(_, _, 200))
-    .Times(1)
-    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
-  task->run();
-  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  CassandraStore::Transaction* t = warm_up_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(warm_up_op, get_xml(_, _))
+    .WillOnce(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
+  EXPECT_CALL(warm_up_op, get_registration_state(_, _))
+    .WillOnce(SetArgReferee<0>(RegistrationState::REGISTERED));
+  EXPECT_CALL(warm_up_op, get_charging_addrs(_))
+    .WillOnce(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+  EXPECT_CALL(*_stats, update_H_reg_data_cache_bytes(_));
+  t->on_success(&warm_up_op);
+  EXPECT_EQ(1u, reg_data_cache.size());
 
-  // The transaction takes some time.
-  _caught_diam_tsx->start_timer();
-  cwtest_advance_time_ms(13);
-  _caught_diam_tsx->stop_timer();
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
 
-  // Free the underlying FD message.
-  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
 
-  EXPECT_CALL(*_stats, update_H_hss_latency_us(13000));
-  EXPECT_CALL(*_stats, update_H_hss_digest_latency_us(13000));
+  t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(RegistrationState::REGISTERED));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+  EXPECT_CALL(*_stats, incr_H_reg_data_cache_hits());
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  t->on_success(&mock_op);
+  EXPECT_EQ(REGDATA_RESULT, req.content());
 
-  EXPECT_CALL(*_httpstack, send_reply(_, _, _));
-  _caught_diam_tsx->on_timeout();
-  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  ImpuRegDataTask::configure_reg_data_cache(NULL);
 }
 
-
 TEST_F(HandlerStatsTest, IMSSubscriptionReregHSS)
 {
   // Check a ServerAssignmentRequest updates the HSS and subscription stats.
@@ -4542,6 +7033,47 @@ TEST_F(HandlerStatsTest, LocationInfo)
 }
 
 
+TEST_F(HandlerStatsTest, LocationInfoAdaptiveTimeout)
+{
+  // Check that an LIR uses the adaptive timeout when one is configured, and
+  // that the answer's latency feeds back into it.
+  AdaptiveTimeout lir_timeout(100, 10, 1000);
+  HssCacheTask::configure_adaptive_timeouts(NULL, NULL, NULL, &lir_timeout);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+
+  ImpuLocationInfoTask::Config cfg(true);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // The request is sent with the adaptive timeout rather than the configured
+  // one.
+  EXPECT_CALL(*_stats, update_H_hss_lir_timeout_ms(100));
+  EXPECT_CALL(*_mock_stack, send(_, _, 100))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  _caught_diam_tsx->start_timer();
+  cwtest_advance_time_ms(16);
+  _caught_diam_tsx->stop_timer();
+
+  // Free the underlying FD message.
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  EXPECT_CALL(*_stats, update_H_hss_latency_us(16000));
+  EXPECT_CALL(*_stats, update_H_hss_subscription_latency_us(16000));
+  _caught_diam_tsx->on_timeout();
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  HssCacheTask::configure_adaptive_timeouts(NULL, NULL, NULL, NULL);
+}
+
+
 TEST_F(HandlerStatsTest, LocationInfoOverload)
 {
   // Check that an HSS overload repsonse causes the tasks to record a latency
@@ -4585,3 +7117,211 @@ TEST_F(HandlerStatsTest, LocationInfoOverload)
   _caught_diam_tsx->on_response(lia);
   delete _caught_diam_tsx; _caught_diam_tsx = NULL;
 }
+
+TEST_F(HandlerStatsTest, LocationInfoDeadline)
+{
+  // Check that an LIR's timeout is cut down to the time left before the
+  // request's deadline.
+  HssCacheTask::configure_default_deadline(150);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+
+  ImpuLocationInfoTask::Config cfg(true);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+  cwtest_advance_time_ms(100);
+
+  EXPECT_CALL(*_mock_stack, send(_, _, 50))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  _caught_diam_tsx->start_timer();
+  cwtest_advance_time_ms(50);
+  _caught_diam_tsx->stop_timer();
+
+  // Free the underlying FD message.
+  fd_msg_free(_caught_fd_msg); _caught_fd_msg = NULL;
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  EXPECT_CALL(*_stats, update_H_hss_latency_us(50000));
+  EXPECT_CALL(*_stats, update_H_hss_subscription_latency_us(50000));
+  _caught_diam_tsx->on_timeout();
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  HssCacheTask::configure_default_deadline(0);
+}
+
+TEST_F(HandlerStatsTest, RegDataDeadlineExpired)
+{
+  // Check that a request which has run out of time by the time it is
+  // processed is abandoned without querying the cache.
+  HssCacheTask::configure_default_deadline(100);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "");
+
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+  cwtest_advance_time_ms(100);
+
+  EXPECT_CALL(*_cache, create_GetRegData(_)).Times(0);
+  EXPECT_CALL(*_stats, incr_H_deadline_expired());
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  task->run();
+
+  HssCacheTask::configure_default_deadline(0);
+}
+
+TEST_F(HandlerStatsTest, RegDataDeregPastDeadline)
+{
+  // Check that a deregistration is carried on with even if it has run out
+  // of time, as it changes the subscriber's state.
+  HssCacheTask::configure_default_deadline(100);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "{\"reqtype\": \"dereg-admin\"}",
+                             htp_method_PUT);
+
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+  cwtest_advance_time_ms(100);
+
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(*_httpstack, send_reply(_, 404, _));
+  mock_op._cass_status = CassandraStore::NOT_FOUND;
+  mock_op._cass_error_text = "error";
+  t->on_failure(&mock_op);
+
+  HssCacheTask::configure_default_deadline(0);
+}
+
+TEST_F(HandlerStatsTest, RegDataBatchDeregPastDeadline)
+{
+  // Check that a batch which has run out of time abandons its lookups, but
+  // carries on with its deregistrations.
+  HssCacheTask::configure_default_deadline(100);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/batch/reg-data",
+                             "",
+                             "",
+                             "[{\"impu\": \"" + IMPU + "\", \"reqtype\": \"dereg-admin\"}, "
+                             "{\"impu\": \"" + IMPU2 + "\"}]",
+                             htp_method_POST);
+
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataBatchTask* task = new ImpuRegDataBatchTask(req, &cfg, FAKE_TRAIL_ID);
+  cwtest_advance_time_ms(100);
+
+  // Only the deregistration is read from the cache.
+  MockCache::MockMultiGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_MultiGetRegData(IMPU_IN_VECTOR))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  EXPECT_CALL(*_stats, incr_H_deadline_expired());
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  mock_op._cass_status = CassandraStore::NOT_FOUND;
+  mock_op._cass_error_text = "error";
+  t->on_failure(&mock_op);
+
+  EXPECT_EQ("{\"responses\":[{\"impu\":\"" + IMPU + "\",\"status\":404},"
+            "{\"impu\":\"" + IMPU2 + "\",\"status\":504}]}",
+            req.content());
+
+  HssCacheTask::configure_default_deadline(0);
+}
+
+TEST_F(HandlerStatsTest, RegDataQueuedDeadlineExpired)
+{
+  // Check that a request queued behind another for the same public ID is
+  // abandoned if it has run out of time by the time it is resumed.
+  ImpuRegDataTask::configure_reg_data_serialization(true);
+  HssCacheTask::configure_default_deadline(100);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "{\"reqtype\": \"call\"}",
+                             htp_method_PUT);
+  MockHttpStack::Request req2(_httpstack,
+                              "/impu/" + IMPU + "/reg-data",
+                              "",
+                              "",
+                              "{\"reqtype\": \"call\"}",
+                              htp_method_PUT);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+  ImpuRegDataTask* task2 = new ImpuRegDataTask(req2, &cfg, FAKE_TRAIL_ID);
+
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+  task2->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(DoAll(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION), SetArgReferee<1>(3600)));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(DoAll(SetArgReferee<0>(RegistrationState::REGISTERED), SetArgReferee<1>(3600)));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPI_IN_VECTOR));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+
+  // The cache read is slow, so by the time the first request finishes the
+  // second has run out of time.
+  cwtest_advance_time_ms(150);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  EXPECT_CALL(*_stats, incr_H_deadline_expired());
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  t->on_success(&mock_op);
+
+  HssCacheTask::configure_default_deadline(0);
+  ImpuRegDataTask::configure_reg_data_serialization(false);
+}
+
+TEST_F(HandlerStatsTest, LocationInfoDeadlineExpired)
+{
+  // Check that an LIR isn't sent if the request has already run out of time.
+  HssCacheTask::configure_default_deadline(100);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+
+  ImpuLocationInfoTask::Config cfg(true);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+  cwtest_advance_time_ms(150);
+
+  EXPECT_CALL(*_mock_stack, send(_, _, _)).Times(0);
+  EXPECT_CALL(*_stats, incr_H_deadline_expired());
+  EXPECT_CALL(*_httpstack, send_reply(_, 504, _));
+  task->run();
+
+  HssCacheTask::configure_default_deadline(0);
+}
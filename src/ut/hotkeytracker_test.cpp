@@ -0,0 +1,160 @@
+/**
+ * @file hotkeytracker_test.cpp UT for HotKeyTracker class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
+
+#include "hotkeytracker.h"
+
+/// Fixture for HotKeyTrackerTest.
+class HotKeyTrackerTest : public testing::Test
+{
+public:
+  HotKeyTrackerTest()
+  {
+    char file[] = "/tmp/hotkeytracker_test_XXXXXX";
+    int fd = mkstemp(file);
+    close(fd);
+    _snapshot_file = file;
+  }
+
+  ~HotKeyTrackerTest()
+  {
+    unlink(_snapshot_file.c_str());
+  }
+
+  void warm_up(const std::string& key)
+  {
+    _warmed_keys.push_back(key);
+  }
+
+  std::string _snapshot_file;
+  std::vector<std::string> _warmed_keys;
+};
+
+TEST_F(HotKeyTrackerTest, HotKeysOrderedByCount)
+{
+  HotKeyTracker tracker(_snapshot_file, 10);
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    tracker.record("sip:warm@example.com");
+  }
+  for (int ii = 0; ii < 5; ii++)
+  {
+    tracker.record("sip:hot@example.com");
+  }
+  tracker.record("sip:cold@example.com");
+
+  std::vector<std::string> expected = {"sip:hot@example.com",
+                                       "sip:warm@example.com",
+                                       "sip:cold@example.com"};
+  EXPECT_EQ(expected, tracker.hot_keys());
+}
+
+TEST_F(HotKeyTrackerTest, ColdKeysEvicted)
+{
+  HotKeyTracker tracker(_snapshot_file, 2);
+
+  tracker.record("sip:cold@example.com");
+  tracker.record("sip:warm@example.com");
+  tracker.record("sip:warm@example.com");
+
+  // A new key only displaces the coldest key once it's hotter than it.
+  tracker.record("sip:hot@example.com");
+  std::vector<std::string> expected = {"sip:warm@example.com",
+                                       "sip:cold@example.com"};
+  EXPECT_EQ(expected, tracker.hot_keys());
+
+  tracker.record("sip:hot@example.com");
+  tracker.record("sip:hot@example.com");
+  expected = {"sip:hot@example.com", "sip:warm@example.com"};
+  EXPECT_EQ(expected, tracker.hot_keys());
+}
+
+TEST_F(HotKeyTrackerTest, SnapshotRoundTrip)
+{
+  HotKeyTracker tracker(_snapshot_file, 10);
+  tracker.record("sip:one@example.com");
+  tracker.record("sip:two@example.com");
+  tracker.record("sip:two@example.com");
+  EXPECT_TRUE(tracker.save_snapshot());
+
+  HotKeyTracker restarted(_snapshot_file, 10);
+  std::vector<std::string> expected = {"sip:two@example.com",
+                                       "sip:one@example.com"};
+  EXPECT_EQ(expected, restarted.load_snapshot());
+}
+
+TEST_F(HotKeyTrackerTest, SnapshotDisabled)
+{
+  HotKeyTracker tracker("", 10);
+  tracker.record("sip:one@example.com");
+  EXPECT_FALSE(tracker.save_snapshot());
+  EXPECT_TRUE(tracker.load_snapshot().empty());
+}
+
+TEST_F(HotKeyTrackerTest, SnapshotWriteFailure)
+{
+  HotKeyTracker tracker("/nonexistent/directory/snapshot", 10);
+  tracker.record("sip:one@example.com");
+  EXPECT_FALSE(tracker.save_snapshot());
+}
+
+TEST_F(HotKeyTrackerTest, WarmUpReplaysSnapshot)
+{
+  FILE* f = fopen(_snapshot_file.c_str(), "w");
+  fputs("sip:one@example.com\nsip:two@example.com\n", f);
+  fclose(f);
+
+  HotKeyTracker tracker(_snapshot_file, 10);
+  tracker.start(boost::bind(&HotKeyTrackerTest::warm_up, this, _1), 1000);
+
+  // Warm-up happens on a background thread - give it a moment to finish.
+  for (int ii = 0; (ii < 100) && (_warmed_keys.size() < 2); ii++)
+  {
+    usleep(10000);
+  }
+  tracker.stop();
+
+  std::vector<std::string> expected = {"sip:one@example.com",
+                                       "sip:two@example.com"};
+  EXPECT_EQ(expected, _warmed_keys);
+}
@@ -0,0 +1,134 @@
+/**
+ * @file icscfcache_test.cpp UT for the I-CSCF answer cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include "icscfcache.h"
+
+/// Fixture for IcscfCacheTest.
+class IcscfCacheTest : public testing::Test
+{
+public:
+  static const std::string IMPI;
+  static const std::string IMPU;
+  static const std::string ANSWER;
+};
+
+const std::string IcscfCacheTest::IMPI = "_impi@example.com";
+const std::string IcscfCacheTest::IMPU = "sip:impu@example.com";
+const std::string IcscfCacheTest::ANSWER = "{\"result-code\":2001,\"scscf\":\"sip:scscf.example.com\"}";
+
+TEST_F(IcscfCacheTest, Miss)
+{
+  IcscfCache cache(30);
+  std::string answer;
+  EXPECT_FALSE(cache.get(IcscfCache::lir_key(IMPU, "", ""), answer));
+}
+
+TEST_F(IcscfCacheTest, PutAndGet)
+{
+  IcscfCache cache(30);
+  std::string key = IcscfCache::uar_key(IMPI, IMPU, "example.com", "");
+  cache.put(key, IMPI, IMPU, ANSWER);
+
+  std::string answer;
+  EXPECT_TRUE(cache.get(key, answer));
+  EXPECT_EQ(ANSWER, answer);
+
+  // The key depends on all the request parameters.
+  EXPECT_FALSE(cache.get(IcscfCache::uar_key(IMPI, IMPU, "example.com", "REG"), answer));
+  EXPECT_FALSE(cache.get(IcscfCache::lir_key(IMPU, "", ""), answer));
+
+  // Replacing an answer doesn't leave the old one behind.
+  cache.put(key, IMPI, IMPU, "new answer");
+  EXPECT_EQ(1u, cache.size());
+  EXPECT_TRUE(cache.get(key, answer));
+  EXPECT_EQ("new answer", answer);
+}
+
+TEST_F(IcscfCacheTest, Expiry)
+{
+  IcscfCache cache(0);
+  std::string key = IcscfCache::lir_key(IMPU, "", "");
+  cache.put(key, "", IMPU, ANSWER);
+
+  std::string answer;
+  EXPECT_FALSE(cache.get(key, answer));
+  EXPECT_EQ(0u, cache.size());
+}
+
+TEST_F(IcscfCacheTest, Invalidate)
+{
+  IcscfCache cache(30);
+  std::string uar_key = IcscfCache::uar_key(IMPI, IMPU, "example.com", "");
+  std::string lir_key = IcscfCache::lir_key(IMPU, "", "");
+  std::string other_key = IcscfCache::lir_key("sip:other@example.com", "", "");
+  cache.put(uar_key, IMPI, IMPU, ANSWER);
+  cache.put(lir_key, "", IMPU, ANSWER);
+  cache.put(other_key, "", "sip:other@example.com", ANSWER);
+
+  // Invalidating the private ID only discards the UAR answer.
+  std::string answer;
+  cache.invalidate_impi(IMPI);
+  EXPECT_FALSE(cache.get(uar_key, answer));
+  EXPECT_TRUE(cache.get(lir_key, answer));
+
+  // Invalidating the public ID discards the LIR answer too.
+  cache.put(uar_key, IMPI, IMPU, ANSWER);
+  cache.invalidate_impu(IMPU);
+  EXPECT_FALSE(cache.get(uar_key, answer));
+  EXPECT_FALSE(cache.get(lir_key, answer));
+  EXPECT_TRUE(cache.get(other_key, answer));
+  EXPECT_EQ(1u, cache.size());
+}
+
+TEST_F(IcscfCacheTest, LruEviction)
+{
+  IcscfCache cache(30, 2);
+  cache.put("key1", "", IMPU, ANSWER);
+  cache.put("key2", "", IMPU, ANSWER);
+
+  // Use key1 so that key2 is the least recently used.
+  std::string answer;
+  EXPECT_TRUE(cache.get("key1", answer));
+
+  cache.put("key3", "", IMPU, ANSWER);
+  EXPECT_TRUE(cache.get("key1", answer));
+  EXPECT_FALSE(cache.get("key2", answer));
+  EXPECT_TRUE(cache.get("key3", answer));
+  EXPECT_EQ(2u, cache.size());
+}
@@ -0,0 +1,113 @@
+/**
+ * @file imssubscription_test.cpp UT for ImsSubscription.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include "imssubscription.h"
+
+/// Fixture for ImsSubscriptionTest.
+class ImsSubscriptionTest : public testing::Test
+{
+public:
+  static const std::string USER_DATA;
+};
+
+const std::string ImsSubscriptionTest::USER_DATA =
+  "<?xml version=\"1.0\"?>"
+  "<IMSSubscription>"
+    "<PrivateID>impi@example.com</PrivateID>"
+    "<ServiceProfile>"
+      "<PublicIdentity><Identity>sip:impu@example.com</Identity></PublicIdentity>"
+      "<PublicIdentity><Identity>tel:+16505550000</Identity></PublicIdentity>"
+    "</ServiceProfile>"
+    "<ServiceProfile>"
+      "<PublicIdentity><Identity>sip:impu2@example.com</Identity></PublicIdentity>"
+    "</ServiceProfile>"
+  "</IMSSubscription>";
+
+TEST_F(ImsSubscriptionTest, Empty)
+{
+  ImsSubscriptionPtr subscription = ImsSubscription::create("");
+  EXPECT_TRUE(subscription->empty());
+  EXPECT_TRUE(subscription->valid());
+  EXPECT_EQ("", subscription->private_id());
+  EXPECT_TRUE(subscription->public_ids().empty());
+  EXPECT_EQ("", subscription->reg_data_element());
+
+  // Empty subscriptions are all the same object.
+  EXPECT_EQ(subscription, ImsSubscription::create(""));
+}
+
+TEST_F(ImsSubscriptionTest, Ids)
+{
+  ImsSubscriptionPtr subscription = ImsSubscription::create(USER_DATA);
+  EXPECT_FALSE(subscription->empty());
+  EXPECT_TRUE(subscription->valid());
+  EXPECT_EQ(USER_DATA, subscription->xml());
+  EXPECT_EQ("impi@example.com", subscription->private_id());
+  EXPECT_EQ(std::vector<std::string>({"sip:impu@example.com",
+                                      "tel:+16505550000",
+                                      "sip:impu2@example.com"}),
+            subscription->public_ids());
+}
+
+TEST_F(ImsSubscriptionTest, RegDataElement)
+{
+  ImsSubscription subscription("<?xml?><IMSSubscription>test</IMSSubscription>");
+  EXPECT_EQ("\t<IMSSubscription>test</IMSSubscription>\n",
+            subscription.reg_data_element());
+
+  // The element is printed separately from the IDs being parsed, so either
+  // can be asked for first.
+  ImsSubscription ids_after(USER_DATA);
+  EXPECT_NE("", ids_after.reg_data_element());
+  EXPECT_EQ("impi@example.com", ids_after.private_id());
+}
+
+TEST_F(ImsSubscriptionTest, Invalid)
+{
+  ImsSubscription bad_xml("<?xml?><InvalidXML</IMSSubscription>");
+  EXPECT_FALSE(bad_xml.valid());
+  EXPECT_EQ("", bad_xml.private_id());
+  EXPECT_TRUE(bad_xml.public_ids().empty());
+  EXPECT_EQ("", bad_xml.reg_data_element());
+
+  ImsSubscription wrong_root("<?xml?><IMSSubscriptionwrong>test</IMSSubscriptionwrong>");
+  EXPECT_FALSE(wrong_root.valid());
+  EXPECT_TRUE(wrong_root.public_ids().empty());
+  EXPECT_EQ("", wrong_root.reg_data_element());
+}
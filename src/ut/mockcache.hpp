@@ -81,6 +81,8 @@ public:
                                const int32_t ttl));
   MOCK_METHOD1(create_GetRegData,
                GetRegData*(const std::string& public_id));
+  MOCK_METHOD1(create_MultiGetRegData,
+               MultiGetRegData*(const std::vector<std::string>& public_ids));
   MOCK_METHOD1(create_GetAssociatedPublicIDs,
                GetAssociatedPublicIDs*(const std::string& private_id));
   MOCK_METHOD1(create_GetAssociatedPublicIDs,
@@ -111,6 +113,9 @@ public:
   MOCK_METHOD2(create_DeleteIMPIMapping,
                DeleteIMPIMapping*(const std::vector<std::string>& private_ids,
                                   int64_t timestamp));
+  MOCK_METHOD2(create_DeleteAuthVector,
+               DeleteAuthVector*(const std::vector<std::string>& private_ids,
+                                 int64_t timestamp));
   MOCK_METHOD3(create_DissociateImplicitRegistrationSetFromImpi,
                DissociateImplicitRegistrationSetFromImpi*(const std::vector<std::string>& impus,
                                                           const std::string& impi,
@@ -186,6 +191,17 @@ public:
     MOCK_METHOD1(get_charging_addrs, void(ChargingAddresses& charging_addrs));
   };
 
+  class MockMultiGetRegData : public MultiGetRegData, public MockOperationMixin
+  {
+    MockMultiGetRegData() : MultiGetRegData(std::vector<std::string>()) {}
+    virtual ~MockMultiGetRegData() {}
+
+    MOCK_METHOD1(get_reg_data, GetRegData*(const std::string& public_id));
+    MOCK_METHOD3(get_error, void(const std::string& public_id,
+                                 CassandraStore::ResultCode& error,
+                                 std::string& text));
+  };
+
   class MockGetAssociatedPublicIDs : public GetAssociatedPublicIDs, public MockOperationMixin
   {
     MockGetAssociatedPublicIDs() : GetAssociatedPublicIDs("") {}
@@ -228,6 +244,12 @@ public:
     virtual ~MockDeleteIMPIMapping() {}
   };
 
+  class MockDeleteAuthVector : public DeleteAuthVector, public MockOperationMixin
+  {
+    MockDeleteAuthVector() : DeleteAuthVector({}, 0) {}
+    virtual ~MockDeleteAuthVector() {}
+  };
+
   class MockDissociateImplicitRegistrationSetFromImpi : public DissociateImplicitRegistrationSetFromImpi, public MockOperationMixin
   {
     MockDissociateImplicitRegistrationSetFromImpi() : DissociateImplicitRegistrationSetFromImpi({}, "", 0) {}
@@ -52,9 +52,30 @@ public:
   MOCK_METHOD1(update_H_hss_digest_latency_us, void(unsigned long sample));
   MOCK_METHOD1(update_H_hss_subscription_latency_us, void(unsigned long sample));
   MOCK_METHOD1(update_H_cache_latency_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_hss_concurrency_window, void(unsigned long sample));
+  MOCK_METHOD1(update_H_hss_queue_wait_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_hss_mar_timeout_ms, void(unsigned long sample));
+  MOCK_METHOD1(update_H_hss_sar_timeout_ms, void(unsigned long sample));
+  MOCK_METHOD1(update_H_hss_uar_timeout_ms, void(unsigned long sample));
+  MOCK_METHOD1(update_H_hss_lir_timeout_ms, void(unsigned long sample));
+  MOCK_METHOD1(update_H_handler_queue_depth, void(unsigned long sample));
+  MOCK_METHOD1(update_H_handler_queue_wait_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_handler_cx_answer_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_handler_rtr_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_handler_ppr_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_reg_data_cache_bytes, void(unsigned long sample));
 
   MOCK_METHOD0(incr_H_incoming_requests, void());
   MOCK_METHOD0(incr_H_rejected_overload, void());
+  MOCK_METHOD0(incr_H_icscf_cache_hits, void());
+  MOCK_METHOD0(incr_H_icscf_cache_misses, void());
+  MOCK_METHOD0(incr_H_hss_hedged, void());
+  MOCK_METHOD0(incr_H_hss_hedge_won, void());
+  MOCK_METHOD0(incr_H_hss_circuit_opened, void());
+  MOCK_METHOD0(incr_H_hss_fast_failed, void());
+  MOCK_METHOD0(incr_H_deadline_expired, void());
+  MOCK_METHOD0(incr_H_reg_data_cache_hits, void());
+  MOCK_METHOD0(incr_H_reg_data_cache_misses, void());
 
   MOCK_METHOD1(update_http_latency_us, void(unsigned long sample));
   MOCK_METHOD0(incr_http_incoming_requests, void());
@@ -0,0 +1,131 @@
+/**
+ * @file regdatacache_test.cpp UT for RegDataCache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include "regdatacache.h"
+
+/// Fixture for RegDataCacheTest.
+class RegDataCacheTest : public testing::Test
+{
+public:
+  static const std::string INPUTS;
+  static const std::string BODY;
+};
+
+const std::string RegDataCacheTest::INPUTS = "1:1";
+
+const std::string RegDataCacheTest::BODY =
+  "<ClearwaterRegData><RegistrationState>REGISTERED</RegistrationState></ClearwaterRegData>";
+
+TEST_F(RegDataCacheTest, Miss)
+{
+  RegDataCache cache(4096);
+  std::string body;
+  EXPECT_FALSE(cache.get("\"1\"", INPUTS, body));
+}
+
+TEST_F(RegDataCacheTest, PutAndGet)
+{
+  RegDataCache cache(4096);
+  cache.put("\"1\"", INPUTS, BODY);
+
+  std::string body;
+  EXPECT_TRUE(cache.get("\"1\"", INPUTS, body));
+  EXPECT_EQ(BODY, body);
+  EXPECT_EQ(1u, cache.size());
+  EXPECT_LT(BODY.length(), cache.bytes());
+
+  // Putting the same key again doesn't use any more memory.
+  size_t bytes = cache.bytes();
+  cache.put("\"1\"", INPUTS, BODY);
+  EXPECT_EQ(1u, cache.size());
+  EXPECT_EQ(bytes, cache.bytes());
+}
+
+TEST_F(RegDataCacheTest, TooBigNotCached)
+{
+  RegDataCache cache(BODY.length());
+  cache.put("\"1\"", INPUTS, BODY);
+  EXPECT_EQ(0u, cache.size());
+  EXPECT_EQ(0u, cache.bytes());
+}
+
+TEST_F(RegDataCacheTest, LeastRecentlyUsedDiscarded)
+{
+  // Size the cache to hold two bodies.
+  RegDataCache probe(4096);
+  probe.put("\"1\"", INPUTS, BODY);
+  RegDataCache small_cache(probe.bytes() * 2);
+  small_cache.put("\"1\"", INPUTS, BODY);
+  small_cache.put("\"2\"", INPUTS, BODY);
+
+  // Use the first body, so the second is the least recently used.
+  std::string body;
+  EXPECT_TRUE(small_cache.get("\"1\"", INPUTS, body));
+
+  small_cache.put("\"3\"", INPUTS, BODY);
+  EXPECT_EQ(2u, small_cache.size());
+  EXPECT_EQ(probe.bytes() * 2, small_cache.bytes());
+  EXPECT_TRUE(small_cache.get("\"1\"", INPUTS, body));
+  EXPECT_FALSE(small_cache.get("\"2\"", INPUTS, body));
+  EXPECT_TRUE(small_cache.get("\"3\"", INPUTS, body));
+}
+
+TEST_F(RegDataCacheTest, KeyCollision)
+{
+  // Different inputs that hash to the same key never get each other's body.
+  const std::string other_inputs = "1:2";
+  const std::string other_body = "<ClearwaterRegData/>";
+
+  RegDataCache cache(4096);
+  cache.put("\"1\"", INPUTS, BODY);
+
+  std::string body;
+  EXPECT_FALSE(cache.get("\"1\"", other_inputs, body));
+
+  // The newer body replaces the older one.
+  cache.put("\"1\"", other_inputs, other_body);
+  EXPECT_EQ(1u, cache.size());
+  EXPECT_TRUE(cache.get("\"1\"", other_inputs, body));
+  EXPECT_EQ(other_body, body);
+  EXPECT_FALSE(cache.get("\"1\"", INPUTS, body));
+
+  RegDataCache probe(4096);
+  probe.put("\"1\"", other_inputs, other_body);
+  EXPECT_EQ(probe.bytes(), cache.bytes());
+}
@@ -0,0 +1,215 @@
+/**
+ * @file responsecompressor_test.cpp UT for ResponseCompressor.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include <stdio.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "responsecompressor.h"
+
+/// Fixture for ResponseCompressorTest.
+class ResponseCompressorTest : public testing::Test
+{
+public:
+  // Builds an IMS subscription with the given number of iFCs, which is the
+  // bulk of a large reg-data body.
+  static std::string subscription(int num_ifcs)
+  {
+    std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><IMSSubscription>"
+                      "<PrivateID>1234567890@example.com</PrivateID><ServiceProfile>"
+                      "<PublicIdentity><Identity>sip:1234567890@example.com</Identity></PublicIdentity>";
+    for (int ii = 0; ii < num_ifcs; ii++)
+    {
+      char ifc[512];
+      snprintf(ifc, sizeof(ifc),
+               "<InitialFilterCriteria><Priority>%d</Priority><TriggerPoint>"
+               "<ConditionTypeCNF>0</ConditionTypeCNF><SPT><ConditionNegated>0</ConditionNegated>"
+               "<Group>0</Group><Method>INVITE</Method><Extension></Extension></SPT></TriggerPoint>"
+               "<ApplicationServer><ServerName>sip:as%d.example.com:5060</ServerName>"
+               "<DefaultHandling>0</DefaultHandling></ApplicationServer></InitialFilterCriteria>",
+               ii, ii);
+      xml += ifc;
+    }
+    xml += "</ServiceProfile></IMSSubscription>";
+    return xml;
+  }
+
+  static std::string gunzip(const std::string& compressed)
+  {
+    z_stream stream = z_stream();
+    inflateInit2(&stream, 15 + 16);
+    stream.next_in = (Bytef*)compressed.data();
+    stream.avail_in = compressed.length();
+
+    std::string body;
+    char buffer[4096];
+    int rc;
+    do
+    {
+      stream.next_out = (Bytef*)buffer;
+      stream.avail_out = sizeof(buffer);
+      rc = inflate(&stream, Z_NO_FLUSH);
+      body.append(buffer, sizeof(buffer) - stream.avail_out);
+    }
+    while (rc == Z_OK);
+
+    inflateEnd(&stream);
+    return (rc == Z_STREAM_END) ? body : "";
+  }
+};
+
+TEST_F(ResponseCompressorTest, AcceptsGzip)
+{
+  EXPECT_TRUE(ResponseCompressor::accepts_gzip("gzip"));
+  EXPECT_TRUE(ResponseCompressor::accepts_gzip("deflate, GZIP;q=0.5"));
+  EXPECT_TRUE(ResponseCompressor::accepts_gzip("x-gzip"));
+  EXPECT_TRUE(ResponseCompressor::accepts_gzip("*"));
+  EXPECT_FALSE(ResponseCompressor::accepts_gzip(""));
+  EXPECT_FALSE(ResponseCompressor::accepts_gzip("identity, deflate"));
+  EXPECT_FALSE(ResponseCompressor::accepts_gzip("gzip;q=0"));
+  EXPECT_FALSE(ResponseCompressor::accepts_gzip("gzip; q=0.0, *"));
+  EXPECT_FALSE(ResponseCompressor::accepts_gzip("*;q=0"));
+}
+
+TEST_F(ResponseCompressorTest, CompressesLargeBodies)
+{
+  ResponseCompressor compressor(1024);
+  std::string body = subscription(20);
+  std::string compressed;
+
+  ASSERT_TRUE(compressor.compress("", "", body, compressed));
+  EXPECT_LT(compressed.length(), body.length());
+  EXPECT_EQ(body, gunzip(compressed));
+
+  // The thread's stream is reused for the next body.
+  std::string other_body = subscription(30);
+  ASSERT_TRUE(compressor.compress("", "", other_body, compressed));
+  EXPECT_EQ(other_body, gunzip(compressed));
+}
+
+TEST_F(ResponseCompressorTest, SmallBodiesNotCompressed)
+{
+  ResponseCompressor compressor(1024);
+  std::string compressed;
+  EXPECT_FALSE(compressor.compress("", "", subscription(0), compressed));
+}
+
+TEST_F(ResponseCompressorTest, IncompressibleBodiesNotCompressed)
+{
+  ResponseCompressor compressor(0);
+  std::string compressed;
+  EXPECT_FALSE(compressor.compress("", "", "a", compressed));
+}
+
+TEST_F(ResponseCompressorTest, CompressedBodiesCached)
+{
+  std::string body = subscription(20);
+  std::string other_body = subscription(30);
+  std::string compressed;
+
+  // Size the cache to hold one compressed body, but not two.
+  ResponseCompressor sizer(1024, 0);
+  ASSERT_TRUE(sizer.compress("", "", other_body, compressed));
+  ResponseCompressor compressor(1024, compressed.length() + 256);
+
+  // A body cached against a key and inputs is returned for the same key
+  // and inputs, even though this body is different (which won't happen in
+  // real life).
+  ASSERT_TRUE(compressor.compress("\"1\"", "a", body, compressed));
+  ASSERT_TRUE(compressor.compress("\"1\"", "a", other_body, compressed));
+  EXPECT_EQ(body, gunzip(compressed));
+  compressed.clear();
+  ASSERT_TRUE(compressor.lookup("\"1\"", "a", compressed));
+  EXPECT_EQ(body, gunzip(compressed));
+
+  // Different inputs with the same key don't get the cached body.
+  EXPECT_FALSE(compressor.lookup("\"1\"", "b", compressed));
+  ASSERT_TRUE(compressor.compress("\"1\"", "b", other_body, compressed));
+  EXPECT_EQ(other_body, gunzip(compressed));
+  EXPECT_FALSE(compressor.lookup("\"1\"", "a", compressed));
+
+  // Only one body fits in the cache, so this pushes the other one out.
+  ASSERT_TRUE(compressor.compress("\"2\"", "c", body, compressed));
+  EXPECT_EQ(body, gunzip(compressed));
+  EXPECT_FALSE(compressor.lookup("\"1\"", "b", compressed));
+  ASSERT_TRUE(compressor.lookup("\"2\"", "c", compressed));
+  EXPECT_EQ(body, gunzip(compressed));
+}
+
+// Measures the CPU cost of compressing reg-data bodies of various sizes
+// against the bytes saved. Run with --gtest_also_run_disabled_tests.
+TEST_F(ResponseCompressorTest, DISABLED_CostAgainstBytesSaved)
+{
+  const int ITERATIONS = 1000;
+  int sizes[] = {5, 20, 100};
+  int levels[] = {1, 6, 9};
+
+  printf("%8s %6s %10s %10s %8s %12s\n",
+         "ifcs", "level", "bytes", "gzipped", "saved", "us/body");
+
+  for (size_t ii = 0; ii < sizeof(sizes) / sizeof(sizes[0]); ii++)
+  {
+    std::string body = subscription(sizes[ii]);
+
+    for (size_t jj = 0; jj < sizeof(levels) / sizeof(levels[0]); jj++)
+    {
+      ResponseCompressor compressor(0, 0, levels[jj]);
+      std::string compressed;
+
+      struct timespec start;
+      struct timespec end;
+      clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+      for (int kk = 0; kk < ITERATIONS; kk++)
+      {
+        compressor.compress("", "", body, compressed);
+      }
+      clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+
+      double us = ((end.tv_sec - start.tv_sec) * 1e6 +
+                   (end.tv_nsec - start.tv_nsec) / 1e3) / ITERATIONS;
+      printf("%8d %6d %10d %10d %7.1f%% %12.1f\n",
+             sizes[ii],
+             levels[jj],
+             (int)body.length(),
+             (int)compressed.length(),
+             100.0 * (body.length() - compressed.length()) / body.length(),
+             us);
+    }
+  }
+}
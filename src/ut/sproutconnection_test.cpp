@@ -0,0 +1,224 @@
+/**
+ * @file sproutconnection_test.cpp UT for the Sprout connection.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+
+#include "sproutconnection.h"
+#include "mockhttpconnection.hpp"
+#include "fakehttpresolver.hpp"
+
+using ::testing::_;
+using ::testing::HasSubstr;
+using ::testing::Invoke;
+using ::testing::Return;
+
+/// Fixture for SproutConnectionTest. The mock HTTP connection can be told to
+/// block, so that tests can queue deregistrations behind a request that is
+/// in progress.
+class SproutConnectionTest : public testing::Test
+{
+public:
+  FakeHttpResolver _resolver;
+  MockHttpConnection* _http;
+  SproutConnection* _sprout_conn;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  bool _blocked;
+  bool _in_progress;
+  std::vector<HTTPCode> _results;
+
+  SproutConnectionTest() :
+    _resolver("1.2.3.4"),
+    _blocked(false),
+    _in_progress(false)
+  {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+    _http = new MockHttpConnection(&_resolver);
+    _sprout_conn = new SproutConnection(_http);
+  }
+
+  virtual ~SproutConnectionTest()
+  {
+    delete _sprout_conn; _sprout_conn = NULL;
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  void record_result(HTTPCode rc)
+  {
+    pthread_mutex_lock(&_lock);
+    _results.push_back(rc);
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  void deregister(bool send_notifications, const std::string& impu)
+  {
+    _sprout_conn->deregister_bindings_async(send_notifications,
+                                            std::vector<std::string>(1, impu),
+                                            std::vector<std::string>(),
+                                            0,
+                                            boost::bind(&SproutConnectionTest::record_result, this, _1));
+  }
+
+  // Stands in for HttpConnection::send_delete, waiting until unblocked.
+  long blocking_delete(const std::string& path,
+                       SAS::TrailId trail,
+                       const std::string& body)
+  {
+    pthread_mutex_lock(&_lock);
+    _in_progress = true;
+    pthread_cond_broadcast(&_cond);
+    while (_blocked)
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+    pthread_mutex_unlock(&_lock);
+    return HTTP_OK;
+  }
+
+  void wait_for_in_progress()
+  {
+    pthread_mutex_lock(&_lock);
+    while (!_in_progress)
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+    pthread_mutex_unlock(&_lock);
+  }
+
+  void unblock()
+  {
+    pthread_mutex_lock(&_lock);
+    _blocked = false;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  void wait_for_results(size_t count)
+  {
+    pthread_mutex_lock(&_lock);
+    while (_results.size() < count)
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+    pthread_mutex_unlock(&_lock);
+  }
+
+  static void* unblock_thread(void* test)
+  {
+    // Give the test a chance to stop the connection before letting the
+    // outstanding request finish.
+    usleep(50000);
+    ((SproutConnectionTest*)test)->unblock();
+    return NULL;
+  }
+};
+
+// Before the connection is started, deregistrations are sent straight away.
+TEST_F(SproutConnectionTest, NotStarted)
+{
+  EXPECT_CALL(*_http, send_delete("/registrations?send-notifications=true",
+                                  _,
+                                  "{\"registrations\":[{\"primary-impu\":\"sip:a@home.domain\"}]}"))
+    .WillOnce(Return(HTTP_OK));
+  deregister(true, "sip:a@home.domain");
+
+  ASSERT_EQ(1u, _results.size());
+  EXPECT_EQ(HTTP_OK, _results[0]);
+}
+
+// Deregistrations queued behind an outstanding request are combined, as long
+// as they agree about sending notifications.
+TEST_F(SproutConnectionTest, Batching)
+{
+  _blocked = true;
+  _sprout_conn->start(1);
+
+  EXPECT_CALL(*_http, send_delete(_, _, HasSubstr("sip:a@home.domain")))
+    .WillOnce(Invoke(this, &SproutConnectionTest::blocking_delete));
+  deregister(false, "sip:a@home.domain");
+  wait_for_in_progress();
+
+  EXPECT_CALL(*_http, send_delete("/registrations?send-notifications=false",
+                                  _,
+                                  "{\"registrations\":[{\"primary-impu\":\"sip:b@home.domain\"},"
+                                                     "{\"primary-impu\":\"sip:d@home.domain\"}]}"))
+    .WillOnce(Return(HTTP_OK));
+  EXPECT_CALL(*_http, send_delete("/registrations?send-notifications=true",
+                                  _,
+                                  "{\"registrations\":[{\"primary-impu\":\"sip:c@home.domain\"}]}"))
+    .WillOnce(Return(HTTP_SERVER_ERROR));
+  deregister(false, "sip:b@home.domain");
+  deregister(true, "sip:c@home.domain");
+  deregister(false, "sip:d@home.domain");
+
+  unblock();
+  wait_for_results(4);
+  EXPECT_EQ(3, std::count(_results.begin(), _results.end(), HTTP_OK));
+  EXPECT_EQ(1, std::count(_results.begin(), _results.end(), HTTP_SERVER_ERROR));
+}
+
+// Deregistrations still queued when the connection is stopped fail.
+TEST_F(SproutConnectionTest, Stop)
+{
+  _blocked = true;
+  _sprout_conn->start(1);
+
+  EXPECT_CALL(*_http, send_delete(_, _, HasSubstr("sip:a@home.domain")))
+    .WillOnce(Invoke(this, &SproutConnectionTest::blocking_delete));
+  deregister(false, "sip:a@home.domain");
+  wait_for_in_progress();
+  deregister(false, "sip:b@home.domain");
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, &SproutConnectionTest::unblock_thread, this);
+  _sprout_conn->stop();
+  pthread_join(thread, NULL);
+
+  ASSERT_EQ(2u, _results.size());
+  EXPECT_EQ(HTTP_OK, _results[0]);
+  EXPECT_EQ(HTTP_SERVER_UNAVAILABLE, _results[1]);
+}
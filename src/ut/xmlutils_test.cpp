@@ -37,7 +37,11 @@
 #define GTEST_HAS_POSIX_RE 0
 #include "test_utils.hpp"
 
+#include <stdio.h>
+#include <time.h>
+
 #include "xmlutils.h"
+#include "imssubscription.h"
 #include "reg_state.h"
 
 /// Fixture for XmlUtilsTest.
@@ -112,6 +116,173 @@ TEST_F(XmlUtilsTest, InvalidXML)
   ASSERT_EQ(500, rc);
 }
 
+// The streaming builder gives the same result as the normal one, as long as
+// the IMS subscription is formatted the same way.
+TEST_F(XmlUtilsTest, StreamMatchesBuild)
+{
+  ChargingAddresses charging_addresses({"ccf1", "ccf2&"}, {"ecf1"});
+  std::string user_data = "<?xml?><IMSSubscription>test</IMSSubscription>";
+  std::string built;
+  std::string streamed;
+
+  ASSERT_EQ(200, XmlUtils::build_ClearwaterRegData_xml(RegistrationState::REGISTERED,
+                                                       user_data,
+                                                       charging_addresses,
+                                                       built));
+  ASSERT_EQ(200, XmlUtils::stream_ClearwaterRegData_xml(RegistrationState::REGISTERED,
+                                                        user_data,
+                                                        charging_addresses,
+                                                        streamed));
+  EXPECT_EQ(built, streamed);
+
+  built.clear();
+  streamed.clear();
+  ASSERT_EQ(200, XmlUtils::build_ClearwaterRegData_xml(RegistrationState::UNCHANGED,
+                                                       "",
+                                                       ChargingAddresses(),
+                                                       built));
+  ASSERT_EQ(200, XmlUtils::stream_ClearwaterRegData_xml(RegistrationState::UNCHANGED,
+                                                        "",
+                                                        ChargingAddresses(),
+                                                        streamed));
+  EXPECT_EQ(built, streamed);
+}
+
+TEST_F(XmlUtilsTest, StreamStripsNamespaces)
+{
+  std::string result;
+  int rc = XmlUtils::stream_ClearwaterRegData_xml(
+    RegistrationState::REGISTERED,
+    "<?xml version=\"1.0\"?>\n<!-- From the HSS -->\n"
+    "<cx:IMSSubscription xmlns:cx=\"urn:cx\"><cx:PrivateID>a<!-- b --></cx:PrivateID>"
+    "<cx:Extension cx:type='x>y'/><![CDATA[</cx:Not>]]></cx:IMSSubscription><!-- end -->",
+    ChargingAddresses(),
+    result);
+
+  ASSERT_EQ(200, rc);
+  EXPECT_EQ("<ClearwaterRegData>\n\t<RegistrationState>REGISTERED</RegistrationState>\n"
+            "\t<IMSSubscription xmlns:cx=\"urn:cx\"><PrivateID>a</PrivateID>"
+            "<Extension type='x>y'/><![CDATA[</cx:Not>]]></IMSSubscription>\n"
+            "</ClearwaterRegData>\n\n", result);
+}
+
+TEST_F(XmlUtilsTest, StreamInvalidIMSSubscription)
+{
+  const char* invalid[] = {
+    "<?xml?><IMSSubscriptionwrong>test</IMSSubscriptionwrong>",
+    "<?xml?><InvalidXML</IMSSubscription>",
+    "<?xml?><IMSSubscription><PrivateID>test</IMSSubscription>",
+    "<?xml?><IMSSubscription><PrivateID>test</PrivateID>",
+    "<?xml?><IMSSubscription><PrivateID a=b>test</PrivateID></IMSSubscription>",
+    "<?xml?><IMSSubscription><!-- test</IMSSubscription>",
+    "<?xml",
+    "test"};
+
+  for (size_t ii = 0; ii < sizeof(invalid) / sizeof(invalid[0]); ii++)
+  {
+    std::string result;
+    EXPECT_EQ(500, XmlUtils::stream_ClearwaterRegData_xml(RegistrationState::REGISTERED,
+                                                          invalid[ii],
+                                                          ChargingAddresses(),
+                                                          result)) << invalid[ii];
+  }
+}
+
+// Compares the time taken by the normal and streaming builders for a large
+// IMS subscription. Run with --gtest_also_run_disabled_tests.
+TEST_F(XmlUtilsTest, DISABLED_StreamBenchmark)
+{
+  const int ITERATIONS = 1000;
+  std::string user_data = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><IMSSubscription>"
+                          "<PrivateID>1234567890@example.com</PrivateID><ServiceProfile>"
+                          "<PublicIdentity><Identity>sip:1234567890@example.com</Identity></PublicIdentity>";
+  for (int ii = 0; ii < 100; ii++)
+  {
+    user_data += "<InitialFilterCriteria><Priority>" + std::to_string(ii) + "</Priority>"
+                 "<TriggerPoint><ConditionTypeCNF>0</ConditionTypeCNF><SPT>"
+                 "<ConditionNegated>0</ConditionNegated><Group>0</Group><Method>INVITE</Method>"
+                 "</SPT></TriggerPoint><ApplicationServer><ServerName>sip:as" + std::to_string(ii) +
+                 ".example.com</ServerName><DefaultHandling>0</DefaultHandling>"
+                 "</ApplicationServer></InitialFilterCriteria>";
+  }
+  user_data += "</ServiceProfile></IMSSubscription>";
+  ChargingAddresses charging_addresses({"ccf1", "ccf2"}, {"ecf1", "ecf2"});
+
+  struct timespec start;
+  struct timespec end;
+  std::string result;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+  for (int ii = 0; ii < ITERATIONS; ii++)
+  {
+    result.clear();
+    XmlUtils::build_ClearwaterRegData_xml(RegistrationState::REGISTERED,
+                                          user_data,
+                                          charging_addresses,
+                                          result);
+  }
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+  printf("Built %d byte body in %.1fus\n",
+         (int)result.length(),
+         ((end.tv_sec - start.tv_sec) * 1e6 +
+          (end.tv_nsec - start.tv_nsec) / 1e3) / ITERATIONS);
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+  for (int ii = 0; ii < ITERATIONS; ii++)
+  {
+    result.clear();
+    XmlUtils::stream_ClearwaterRegData_xml(RegistrationState::REGISTERED,
+                                           user_data,
+                                           charging_addresses,
+                                           result);
+  }
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+  printf("Streamed %d byte body in %.1fus\n",
+         (int)result.length(),
+         ((end.tv_sec - start.tv_sec) * 1e6 +
+          (end.tv_nsec - start.tv_nsec) / 1e3) / ITERATIONS);
+}
+
+// Building from a parsed IMS subscription gives exactly the same result as
+// building from the User-Data.
+TEST_F(XmlUtilsTest, BuildFromSubscription)
+{
+  ChargingAddresses charging_addresses({"ccf1", "ccf2&"}, {"ecf1"});
+  std::string user_data = "<?xml version=\"1.0\"?><IMSSubscription xmlns=\"urn:example\"><PrivateID>impi@example.com</PrivateID><ServiceProfile><PublicIdentity><BarringIndication>1</BarringIndication><Identity>sip:impu@example.com</Identity></PublicIdentity><InitialFilterCriteria><Priority>0</Priority><TriggerPoint><SPT><Method>INVITE</Method><Extension/></SPT></TriggerPoint><ApplicationServer><ServerName>sip:as@example.com;a=&quot;b&quot;</ServerName></ApplicationServer></InitialFilterCriteria></ServiceProfile></IMSSubscription>";
+  ImsSubscription subscription(user_data);
+  std::string built;
+  std::string from_subscription;
+
+  ASSERT_EQ(200, XmlUtils::build_ClearwaterRegData_xml(RegistrationState::REGISTERED,
+                                                       user_data,
+                                                       charging_addresses,
+                                                       built));
+  ASSERT_EQ(200, XmlUtils::build_ClearwaterRegData_xml(RegistrationState::REGISTERED,
+                                                       subscription,
+                                                       charging_addresses,
+                                                       from_subscription));
+  EXPECT_EQ(built, from_subscription);
+
+  built.clear();
+  from_subscription.clear();
+  ASSERT_EQ(200, XmlUtils::build_ClearwaterRegData_xml(RegistrationState::UNREGISTERED,
+                                                       "",
+                                                       ChargingAddresses(),
+                                                       built));
+  ASSERT_EQ(200, XmlUtils::build_ClearwaterRegData_xml(RegistrationState::UNREGISTERED,
+                                                       *ImsSubscription::create(""),
+                                                       ChargingAddresses(),
+                                                       from_subscription));
+  EXPECT_EQ(built, from_subscription);
+
+  from_subscription.clear();
+  ImsSubscription invalid_subscription("<?xml?><InvalidXML</IMSSubscription>");
+  EXPECT_EQ(500, XmlUtils::build_ClearwaterRegData_xml(RegistrationState::REGISTERED,
+                                                       invalid_subscription,
+                                                       ChargingAddresses(),
+                                                       from_subscription));
+}
+
 TEST_F(XmlUtilsTest, GetIds)
 {
   std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><IMSSubscription><PrivateID>rkdtestplan1@rkd.cw-ngv.com</PrivateID><ServiceProfile><PublicIdentity><Identity>sip:rkdtestplan1@rkd.cw-ngv.com</Identity><Extension><IdentityType>0</IdentityType></Extension></PublicIdentity><PublicIdentity><Identity>sip:rkdtestplan1_a@rkd.cw-ngv.com</Identity><Extension><IdentityType>0</IdentityType></Extension></PublicIdentity><PublicIdentity><Identity>sip:rkdtestplan1_b@rkd.cw-ngv.com</Identity><Extension><IdentityType>0</IdentityType></Extension></PublicIdentity><InitialFilterCriteria><Priority>0</Priority><TriggerPoint><ConditionTypeCNF>0</ConditionTypeCNF><SPT><ConditionNegated>0</ConditionNegated><Group>0</Group><Method>PUBLISH</Method><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>0</Group><SIPHeader><Header>Event</Header><Content>.*presence.*</Content></SIPHeader><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>0</Group><SessionCase>0</SessionCase><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>1</Group><Method>PUBLISH</Method><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>1</Group><SIPHeader><Header>Event</Header><Content>.*presence.*</Content></SIPHeader><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>1</Group><SessionCase>3</SessionCase><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>2</Group><Method>SUBSCRIBE</Method><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>2</Group><SIPHeader><Header>Event</Header><Content>.*presence.*</Content></SIPHeader><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>2</Group><SessionCase>1</SessionCase><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>3</Group><Method>SUBSCRIBE</Method><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>3</Group><SIPHeader><Header>Event</Header><Content>.*presence.*</Content></SIPHeader><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>3</Group><SessionCase>2</SessionCase><Extension></Extension></SPT></TriggerPoint><ApplicationServer><ServerName>sip:127.0.0.1:5065</ServerName><DefaultHandling>0</DefaultHandling></ApplicationServer></InitialFilterCriteria></ServiceProfile></IMSSubscription>";
@@ -140,3 +311,73 @@ TEST_F(XmlUtilsTest, GetIdsMissingIds)
   std::string private_id = XmlUtils::get_private_id(xml);
   EXPECT_EQ("", private_id);
 }
+
+TEST_F(XmlUtilsTest, DiffUnchanged)
+{
+  // The same IMS subscription, formatted differently.
+  std::string old_xml = "<?xml version=\"1.0\"?><IMSSubscription><PrivateID>impi@example.com</PrivateID><ServiceProfile><PublicIdentity><Identity>sip:impu@example.com</Identity></PublicIdentity><PublicIdentity><Identity>sip:impu2@example.com</Identity></PublicIdentity><InitialFilterCriteria><Priority>0</Priority></InitialFilterCriteria></ServiceProfile></IMSSubscription>";
+  std::string new_xml = "<?xml version=\"1.0\"?>\n<IMSSubscription>\n  <PrivateID>impi@example.com</PrivateID>\n  <ServiceProfile>\n    <PublicIdentity><Identity>sip:impu@example.com</Identity></PublicIdentity>\n    <PublicIdentity><Identity>sip:impu2@example.com</Identity></PublicIdentity>\n    <InitialFilterCriteria><Priority>0</Priority></InitialFilterCriteria>\n  </ServiceProfile>\n</IMSSubscription>";
+
+  XmlUtils::IrsDiff diff = XmlUtils::diff_ims_subscriptions(old_xml, new_xml);
+  EXPECT_TRUE(diff.added.empty());
+  EXPECT_TRUE(diff.removed.empty());
+  EXPECT_EQ(2u, diff.unchanged.size());
+  EXPECT_FALSE(diff.default_id_removed);
+  EXPECT_FALSE(diff.service_profiles_changed);
+}
+
+TEST_F(XmlUtilsTest, DiffServiceProfileChanged)
+{
+  // Only the filter criteria have changed.
+  std::string old_xml = "<?xml version=\"1.0\"?><IMSSubscription><PrivateID>impi@example.com</PrivateID><ServiceProfile><PublicIdentity><Identity>sip:impu@example.com</Identity></PublicIdentity><InitialFilterCriteria><Priority>0</Priority></InitialFilterCriteria></ServiceProfile></IMSSubscription>";
+  std::string new_xml = "<?xml version=\"1.0\"?><IMSSubscription><PrivateID>impi@example.com</PrivateID><ServiceProfile><PublicIdentity><Identity>sip:impu@example.com</Identity></PublicIdentity><InitialFilterCriteria><Priority>1</Priority></InitialFilterCriteria></ServiceProfile></IMSSubscription>";
+
+  XmlUtils::IrsDiff diff = XmlUtils::diff_ims_subscriptions(old_xml, new_xml);
+  EXPECT_TRUE(diff.added.empty());
+  EXPECT_TRUE(diff.removed.empty());
+  EXPECT_EQ(1u, diff.unchanged.size());
+  EXPECT_TRUE(diff.service_profiles_changed);
+}
+
+TEST_F(XmlUtilsTest, DiffPublicIdsChanged)
+{
+  // The default public ID has been removed, and another one added.
+  std::string old_xml = "<?xml version=\"1.0\"?><IMSSubscription><PrivateID>impi@example.com</PrivateID><ServiceProfile><PublicIdentity><Identity>sip:impu@example.com</Identity></PublicIdentity><PublicIdentity><Identity>sip:impu2@example.com</Identity></PublicIdentity></ServiceProfile></IMSSubscription>";
+  std::string new_xml = "<?xml version=\"1.0\"?><IMSSubscription><PrivateID>impi@example.com</PrivateID><ServiceProfile><PublicIdentity><Identity>sip:impu2@example.com</Identity></PublicIdentity><PublicIdentity><Identity>sip:impu3@example.com</Identity></PublicIdentity></ServiceProfile></IMSSubscription>";
+
+  XmlUtils::IrsDiff diff = XmlUtils::diff_ims_subscriptions(old_xml, new_xml);
+  EXPECT_EQ(std::vector<std::string>({"sip:impu3@example.com"}), diff.added);
+  EXPECT_EQ(std::vector<std::string>({"sip:impu@example.com"}), diff.removed);
+  EXPECT_EQ(std::vector<std::string>({"sip:impu2@example.com"}), diff.unchanged);
+  EXPECT_TRUE(diff.default_id_removed);
+  EXPECT_TRUE(diff.service_profiles_changed);
+}
+
+TEST_F(XmlUtilsTest, DiffSubscriptions)
+{
+  ImsSubscription old_subscription("<?xml version=\"1.0\"?><IMSSubscription><PrivateID>impi@example.com</PrivateID><ServiceProfile><PublicIdentity><Identity>sip:impu@example.com</Identity></PublicIdentity><PublicIdentity><Identity>sip:impu2@example.com</Identity></PublicIdentity></ServiceProfile></IMSSubscription>");
+  ImsSubscription new_subscription("<?xml version=\"1.0\"?><IMSSubscription><PrivateID>impi@example.com</PrivateID><ServiceProfile><PublicIdentity><Identity>sip:impu2@example.com</Identity></PublicIdentity><PublicIdentity><Identity>sip:impu3@example.com</Identity></PublicIdentity></ServiceProfile></IMSSubscription>");
+
+  XmlUtils::IrsDiff diff = XmlUtils::diff_ims_subscriptions(old_subscription, new_subscription);
+  EXPECT_EQ(std::vector<std::string>({"sip:impu3@example.com"}), diff.added);
+  EXPECT_EQ(std::vector<std::string>({"sip:impu@example.com"}), diff.removed);
+  EXPECT_EQ(std::vector<std::string>({"sip:impu2@example.com"}), diff.unchanged);
+  EXPECT_TRUE(diff.default_id_removed);
+  EXPECT_TRUE(diff.service_profiles_changed);
+
+  diff = XmlUtils::diff_ims_subscriptions(old_subscription, old_subscription);
+  EXPECT_TRUE(diff.added.empty());
+  EXPECT_TRUE(diff.removed.empty());
+  EXPECT_FALSE(diff.service_profiles_changed);
+}
+
+TEST_F(XmlUtilsTest, DiffInvalidXml)
+{
+  std::string old_xml = "<?xml version=\"1.0\"?><IMSSubscription><PrivateID>impi@example.com</PrivateID><ServiceProfile><PublicIdentity><Identity>sip:impu@example.com</Identity></PublicIdentity></ServiceProfile></IMSSubscription>";
+  std::string new_xml = "?xml veron=\"1.0\" encoding=\"UTF-8\"?>";
+
+  XmlUtils::IrsDiff diff = XmlUtils::diff_ims_subscriptions(old_xml, new_xml);
+  EXPECT_TRUE(diff.added.empty());
+  EXPECT_EQ(1u, diff.removed.size());
+  EXPECT_TRUE(diff.service_profiles_changed);
+}
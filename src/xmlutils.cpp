@@ -34,7 +34,12 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <string.h>
+
+#include <algorithm>
+
 #include "xmlutils.h"
+#include "imssubscription.h"
 
 #include "log.h"
 
@@ -50,24 +55,16 @@ const char* PRIORITY_2 = "2";
 namespace XmlUtils
 {
 
-// Builds a ClearwaterRegData XML document for passing to Sprout,
-// based on the given registration state and User-Data XML from the HSS.
-int build_ClearwaterRegData_xml(RegistrationState state,
-                                std::string xml,
-                                const ChargingAddresses& charging_addrs,
-                                std::string& xml_str)
+// Returns the name of the registration state, as used in ClearwaterRegData.
+static const char* registration_state_name(RegistrationState state)
 {
-  rapidxml::xml_document<> doc;
-
-  rapidxml::xml_node<>* root = doc.allocate_node(rapidxml::node_type::node_element, "ClearwaterRegData");
-  std::string regtype;
   if (state == RegistrationState::REGISTERED)
   {
-    regtype = "REGISTERED";
+    return "REGISTERED";
   }
   else if (state == RegistrationState::UNREGISTERED)
   {
-    regtype = "UNREGISTERED";
+    return "UNREGISTERED";
   }
   else
   {
@@ -75,10 +72,21 @@ int build_ClearwaterRegData_xml(RegistrationState state,
     {
       TRC_DEBUG("Invalid registration state %d", state);
     }
-    regtype = "NOT_REGISTERED";
+    return "NOT_REGISTERED";
   }
+}
 
-  rapidxml::xml_node<>* reg = doc.allocate_node(rapidxml::node_type::node_element, "RegistrationState", regtype.c_str());
+// Builds a ClearwaterRegData XML document for passing to Sprout,
+// based on the given registration state and User-Data XML from the HSS.
+int build_ClearwaterRegData_xml(RegistrationState state,
+                                std::string xml,
+                                const ChargingAddresses& charging_addrs,
+                                std::string& xml_str)
+{
+  rapidxml::xml_document<> doc;
+
+  rapidxml::xml_node<>* root = doc.allocate_node(rapidxml::node_type::node_element, "ClearwaterRegData");
+  rapidxml::xml_node<>* reg = doc.allocate_node(rapidxml::node_type::node_element, "RegistrationState", registration_state_name(state));
 
   root->append_node(reg);
 
@@ -169,6 +177,454 @@ int build_ClearwaterRegData_xml(RegistrationState state,
   return 200;
 }
 
+// Appends text to an XML document, escaping it in the same way as
+// rapidxml::print.
+static void append_escaped(std::string& out, const std::string& text)
+{
+  for (std::string::const_iterator it = text.begin(); it != text.end(); ++it)
+  {
+    switch (*it)
+    {
+    case '<': out.append("&lt;"); break;
+    case '>': out.append("&gt;"); break;
+    case '&': out.append("&amp;"); break;
+    case '"': out.append("&quot;"); break;
+    case '\'': out.append("&apos;"); break;
+    default: out.push_back(*it); break;
+    }
+  }
+}
+
+static void append_charging_address(std::string& out,
+                                     const char* type,
+                                     const char* priority,
+                                     const std::string& address)
+{
+  out.append("\t\t<").append(type).append(" ").append(PRIORITY).append("=\"");
+  out.append(priority).append("\">");
+  append_escaped(out, address);
+  out.append("</").append(type).append(">\n");
+}
+
+static bool is_xml_space(char c)
+{
+  return ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n'));
+}
+
+static const char* skip_space(const char* pos, const char* end)
+{
+  while ((pos < end) && (is_xml_space(*pos)))
+  {
+    pos++;
+  }
+  return pos;
+}
+
+// Returns whether the text at pos starts with the given string.
+static bool starts_with(const char* pos, const char* end, const char* str, size_t len)
+{
+  return (((size_t)(end - pos) >= len) && (memcmp(pos, str, len) == 0));
+}
+
+// Returns the end of the XML name starting at pos. The text must be
+// NUL-terminated at end, as std::string data is.
+static const char* end_of_name(const char* pos, const char* end)
+{
+  return std::min(pos + strcspn(pos, " \t\r\n/>="), end);
+}
+
+// Returns the start of the XML name between start and end, skipping any
+// namespace prefix.
+static const char* local_name(const char* start, const char* end)
+{
+  const char* colon = (const char*)memchr(start, ':', end - start);
+  return (colon != NULL) ? colon + 1 : start;
+}
+
+// Skips past the markup starting at pos that isn't an element (comments,
+// processing instructions, CDATA sections and declarations), copying CDATA
+// sections to the output if it isn't NULL. Returns NULL if the markup isn't
+// terminated.
+static const char* skip_markup(const char* pos, const char* end, std::string* out)
+{
+  const char* terminator;
+  bool cdata = false;
+  if (starts_with(pos, end, "<!--", 4))
+  {
+    terminator = "-->";
+  }
+  else if (starts_with(pos, end, "<![CDATA[", 9))
+  {
+    terminator = "]]>";
+    cdata = true;
+  }
+  else if (starts_with(pos, end, "<?", 2))
+  {
+    terminator = "?>";
+  }
+  else
+  {
+    // A DOCTYPE, which may have an internal subset in square brackets.
+    terminator = ">";
+    const char* bracket = pos;
+    while ((bracket < end) && (*bracket != '[') && (*bracket != '>'))
+    {
+      bracket++;
+    }
+    if ((bracket < end) && (*bracket == '['))
+    {
+      bracket = (const char*)memchr(bracket, ']', end - bracket);
+      if (bracket == NULL)
+      {
+        return NULL;
+      }
+    }
+    pos = bracket;
+  }
+
+  size_t terminator_len = strlen(terminator);
+  const char* markup_end = std::search(pos, end, terminator, terminator + terminator_len);
+  if (markup_end == end)
+  {
+    return NULL;
+  }
+  markup_end += terminator_len;
+
+  if ((out != NULL) && (cdata))
+  {
+    out->append(pos, markup_end - pos);
+  }
+
+  return markup_end;
+}
+
+// Copies the IMSSubscription element from the User-Data XML to the output in
+// a single pass, stripping namespace prefixes from element and attribute
+// names (but leaving the xmlns declarations themselves). Comments and
+// processing instructions are dropped, as rapidxml drops them, and
+// everything else is copied verbatim.
+//
+// This checks that the element is well-formed - elements are balanced and
+// properly closed, and attributes are quoted - but doesn't validate the
+// document as fully as rapidxml does.
+static bool copy_ims_subscription(const std::string& xml, std::string& out)
+{
+  const char* pos = xml.data();
+  const char* end = pos + xml.length();
+
+  // Skip the prolog, to find the root element.
+  while (true)
+  {
+    pos = skip_space(pos, end);
+    if ((pos >= end) || (*pos != '<'))
+    {
+      TRC_DEBUG("Missing IMS Subscription in XML");
+      return false;
+    }
+
+    if ((!starts_with(pos, end, "<?", 2)) && (!starts_with(pos, end, "<!", 2)))
+    {
+      break;
+    }
+
+    pos = skip_markup(pos, end, NULL);
+    if (pos == NULL)
+    {
+      TRC_DEBUG("Unterminated markup in IMS Subscription document");
+      return false;
+    }
+  }
+
+  const char* root_end = end_of_name(pos + 1, end);
+  const char* root_start = local_name(pos + 1, root_end);
+  if (!starts_with(root_start, root_end, "IMSSubscription", 15) ||
+      (root_end - root_start != 15))
+  {
+    TRC_DEBUG("Missing IMS Subscription in XML");
+    return false;
+  }
+
+  // The open elements, as the start and end of their names.
+  std::vector<std::pair<const char*, const char*>> open_elements;
+  do
+  {
+    // Copy any text up to the next piece of markup.
+    const char* markup = (const char*)memchr(pos, '<', end - pos);
+    if (markup == NULL)
+    {
+      TRC_DEBUG("Unterminated IMS Subscription element");
+      return false;
+    }
+    out.append(pos, markup - pos);
+    pos = markup;
+
+    if (starts_with(pos, end, "</", 2))
+    {
+      const char* name_end = end_of_name(pos + 2, end);
+      const char* name_start = local_name(pos + 2, name_end);
+      size_t name_len = name_end - name_start;
+      pos = skip_space(name_end, end);
+
+      if ((pos >= end) ||
+          (*pos != '>') ||
+          (name_len != (size_t)(open_elements.back().second - open_elements.back().first)) ||
+          (memcmp(name_start, open_elements.back().first, name_len) != 0))
+      {
+        TRC_DEBUG("Mismatched end tag in IMS Subscription document");
+        return false;
+      }
+
+      out.append("</", 2).append(name_start, name_len).push_back('>');
+      open_elements.pop_back();
+      pos++;
+    }
+    else if ((starts_with(pos, end, "<!", 2)) || (starts_with(pos, end, "<?", 2)))
+    {
+      pos = skip_markup(pos, end, &out);
+      if (pos == NULL)
+      {
+        TRC_DEBUG("Unterminated markup in IMS Subscription document");
+        return false;
+      }
+    }
+    else
+    {
+      const char* name_end = end_of_name(pos + 1, end);
+      const char* name_start = local_name(pos + 1, name_end);
+      if (name_start == name_end)
+      {
+        TRC_DEBUG("Invalid start tag in IMS Subscription document");
+        return false;
+      }
+      out.push_back('<');
+      out.append(name_start, name_end - name_start);
+      pos = name_end;
+
+      // Copy the attributes.
+      bool empty_element = false;
+      while (true)
+      {
+        pos = skip_space(pos, end);
+        if (pos >= end)
+        {
+          TRC_DEBUG("Unterminated start tag in IMS Subscription document");
+          return false;
+        }
+        else if (starts_with(pos, end, "/>", 2))
+        {
+          empty_element = true;
+          pos += 2;
+          break;
+        }
+        else if (*pos == '>')
+        {
+          pos++;
+          break;
+        }
+
+        const char* attr_start = pos;
+        const char* attr_end = end_of_name(pos, end);
+        pos = skip_space(attr_end, end);
+        if ((attr_end == attr_start) || (pos >= end) || (*pos != '='))
+        {
+          TRC_DEBUG("Invalid attribute in IMS Subscription document");
+          return false;
+        }
+        pos = skip_space(pos + 1, end);
+
+        const char* value_end = NULL;
+        if ((pos < end) && ((*pos == '"') || (*pos == '\'')))
+        {
+          value_end = (const char*)memchr(pos + 1, *pos, end - pos - 1);
+        }
+        if (value_end == NULL)
+        {
+          TRC_DEBUG("Unquoted attribute in IMS Subscription document");
+          return false;
+        }
+
+        out.push_back(' ');
+        if ((starts_with(attr_start, attr_end, "xmlns", 5)) &&
+            ((attr_end == attr_start + 5) || (attr_start[5] == ':')))
+        {
+          out.append(attr_start, attr_end - attr_start);
+        }
+        else
+        {
+          const char* local_start = local_name(attr_start, attr_end);
+          out.append(local_start, attr_end - local_start);
+        }
+        out.push_back('=');
+        out.append(pos, value_end + 1 - pos);
+        pos = value_end + 1;
+      }
+
+      if (empty_element)
+      {
+        out.append("/>", 2);
+      }
+      else
+      {
+        out.push_back('>');
+        open_elements.push_back(std::make_pair(name_start, name_end));
+      }
+    }
+  }
+  while (!open_elements.empty());
+
+  return true;
+}
+
+// Appends the start of a ClearwaterRegData document, up to the
+// IMSSubscription element, formatted as rapidxml::print would.
+static void append_reg_data_start(std::string& out, RegistrationState state)
+{
+  out.append("<ClearwaterRegData>\n\t<RegistrationState>");
+  out.append(registration_state_name(state));
+  out.append("</RegistrationState>\n");
+}
+
+// Appends the rest of a ClearwaterRegData document, after the
+// IMSSubscription element.
+static void append_reg_data_end(std::string& out,
+                                const ChargingAddresses& charging_addrs)
+{
+  if (!charging_addrs.empty())
+  {
+    out.append("\t<ChargingAddresses>\n");
+    if (!charging_addrs.ccfs.empty())
+    {
+      append_charging_address(out, CCF, PRIORITY_1, charging_addrs.ccfs[0]);
+    }
+    if (charging_addrs.ccfs.size() > 1)
+    {
+      append_charging_address(out, CCF, PRIORITY_2, charging_addrs.ccfs[1]);
+    }
+    if (!charging_addrs.ecfs.empty())
+    {
+      append_charging_address(out, ECF, PRIORITY_1, charging_addrs.ecfs[0]);
+    }
+    if (charging_addrs.ecfs.size() > 1)
+    {
+      append_charging_address(out, ECF, PRIORITY_2, charging_addrs.ecfs[1]);
+    }
+    out.append("\t</ChargingAddresses>\n");
+  }
+
+  out.append("</ClearwaterRegData>\n\n");
+}
+
+// Builds the same ClearwaterRegData XML document as
+// build_ClearwaterRegData_xml, but splices the IMSSubscription element from
+// the User-Data straight into the output rather than parsing it into a
+// document and printing it again.
+//
+// The envelope is identical, but the IMSSubscription element keeps the
+// formatting it has in the User-Data, so the result is only byte-for-byte
+// identical if the User-Data is formatted as rapidxml would print it.
+int stream_ClearwaterRegData_xml(RegistrationState state,
+                                 const std::string& xml,
+                                 const ChargingAddresses& charging_addrs,
+                                 std::string& xml_str)
+{
+  // Everything but the IMS subscription is small, so this is normally enough
+  // room for the whole document.
+  size_t original_length = xml_str.length();
+  xml_str.reserve(original_length + xml.length() + 512);
+  append_reg_data_start(xml_str, state);
+
+  if (xml != "")
+  {
+    xml_str.append("\t");
+    if (!copy_ims_subscription(xml, xml_str))
+    {
+      TRC_DEBUG("Invalid IMS Subscription document:\n\n%s", xml.c_str());
+      xml_str.resize(original_length);
+      return 500;
+    }
+    xml_str.append("\n");
+  }
+
+  append_reg_data_end(xml_str, charging_addrs);
+  return 200;
+}
+
+// Builds the same ClearwaterRegData XML document as
+// build_ClearwaterRegData_xml from an IMS subscription that has already been
+// parsed, copying in the IMSSubscription element that was printed when it
+// was parsed.
+int build_ClearwaterRegData_xml(RegistrationState state,
+                                const ImsSubscription& subscription,
+                                const ChargingAddresses& charging_addrs,
+                                std::string& xml_str)
+{
+  if (!subscription.valid())
+  {
+    TRC_DEBUG("Invalid IMS Subscription document:\n\n%s",
+              subscription.xml().c_str());
+    return 500;
+  }
+
+  const std::string& element = subscription.reg_data_element();
+  xml_str.reserve(xml_str.length() + element.length() + 512);
+  append_reg_data_start(xml_str, state);
+  xml_str.append(element);
+  append_reg_data_end(xml_str, charging_addrs);
+  return 200;
+}
+
+// Retrieves the public IDs from a parsed IMSSubscription element, walking
+// through all nodes in the hierarchy
+// ServiceProfile->PublicIdentity->Identity.
+static void get_public_ids(rapidxml::xml_node<>* is,
+                           const std::string& user_data,
+                           std::vector<std::string>& public_ids)
+{
+  for (rapidxml::xml_node<>* sp = is->first_node("ServiceProfile");
+       sp;
+       sp = sp->next_sibling("ServiceProfile"))
+  {
+    for (rapidxml::xml_node<>* pi = sp->first_node("PublicIdentity");
+         pi;
+         pi = pi->next_sibling("PublicIdentity"))
+    {
+      rapidxml::xml_node<>* id = pi->first_node("Identity");
+      if (id)
+      {
+        public_ids.push_back((std::string)id->value());
+      }
+      else
+      {
+        TRC_WARNING("PublicIdentity node was missing Identity child: %s", user_data.c_str());
+      }
+    }
+  }
+}
+
+// Retrieves the single PrivateID from a parsed IMSSubscription element.
+static std::string get_private_id(rapidxml::xml_node<>* is,
+                                  const std::string& user_data)
+{
+  std::string impi;
+
+  rapidxml::xml_node<>* id = is->first_node("PrivateID");
+  if (id)
+  {
+    impi = id->value();
+  }
+  else
+  {
+    TRC_ERROR("Missing Private ID in IMS Subscription document: \n\n%s", user_data.c_str());
+  }
+
+  if (impi.compare("null") == 0)
+  {
+    impi = ""; // LCOV_EXCL_LINE
+  }
+
+  return impi;
+}
+
 // Parses the given User-Data XML to retrieve a list of all the public IDs.
 std::vector<std::string> get_public_ids(const std::string& user_data)
 {
@@ -192,30 +648,10 @@ std::vector<std::string> get_public_ids(const std::string& user_data)
     doc.clear();
   }
 
-  // Walk through all nodes in the hierarchy IMSSubscription->ServiceProfile->PublicIdentity
-  // ->Identity.
   rapidxml::xml_node<>* is = doc.first_node("IMSSubscription");
   if (is)
   {
-    for (rapidxml::xml_node<>* sp = is->first_node("ServiceProfile");
-         sp;
-         sp = sp->next_sibling("ServiceProfile"))
-    {
-      for (rapidxml::xml_node<>* pi = sp->first_node("PublicIdentity");
-           pi;
-           pi = pi->next_sibling("PublicIdentity"))
-      {
-        rapidxml::xml_node<>* id = pi->first_node("Identity");
-        if (id)
-        {
-          public_ids.push_back((std::string)id->value());
-        }
-        else
-        {
-          TRC_WARNING("PublicIdentity node was missing Identity child: %s", user_data.c_str());
-        }
-      }
-    }
+    get_public_ids(is, user_data, public_ids);
   }
 
   if (public_ids.size() == 0)
@@ -225,6 +661,242 @@ std::vector<std::string> get_public_ids(const std::string& user_data)
   return public_ids;
 }
 
+// Parses the given User-Data XML and returns its IMSSubscription element,
+// or NULL if the User-Data isn't a valid IMSSubscription document. The
+// element belongs to the passed-in document.
+static rapidxml::xml_node<>* parse_ims_subscription(rapidxml::xml_document<>& doc,
+                                                    const std::string& user_data)
+{
+  // This doesn't need freeing - it uses the document's memory pool.
+  char* user_data_str = doc.allocate_string(user_data.c_str());
+
+  try
+  {
+    doc.parse<rapidxml::parse_strip_xml_namespaces>(user_data_str);
+  }
+  catch (rapidxml::parse_error err)
+  {
+    TRC_DEBUG("Parse error in IMS Subscription document: %s\n\n%s", err.what(), user_data.c_str());
+    return NULL;
+  }
+
+  rapidxml::xml_node<>* is = doc.first_node("IMSSubscription");
+  if (!is)
+  {
+    TRC_DEBUG("Missing IMS Subscription in XML");
+  }
+
+  return is;
+}
+
+// Parses the given User-Data XML to retrieve the IDs an ImsSubscription
+// holds. Returns false if the User-Data isn't a valid IMSSubscription
+// document.
+bool parse_ims_subscription(const std::string& user_data,
+                            std::string& private_id,
+                            std::vector<std::string>& public_ids)
+{
+  rapidxml::xml_document<> doc;
+  rapidxml::xml_node<>* is = parse_ims_subscription(doc, user_data);
+  if (!is)
+  {
+    return false;
+  }
+
+  private_id = get_private_id(is, user_data);
+  get_public_ids(is, user_data, public_ids);
+  if (public_ids.size() == 0)
+  {
+    TRC_ERROR("Failed to extract any ServiceProfile/PublicIdentity/Identity nodes from %s", user_data.c_str());
+  }
+
+  return true;
+}
+
+// Prints the IMSSubscription element from the given User-Data XML, as it
+// appears in a ClearwaterRegData document. Returns false if the User-Data
+// isn't a valid IMSSubscription document.
+bool render_reg_data_element(const std::string& user_data,
+                             std::string& reg_data_element)
+{
+  rapidxml::xml_document<> doc;
+  rapidxml::xml_node<>* is = parse_ims_subscription(doc, user_data);
+  if (!is)
+  {
+    return false;
+  }
+
+  // Print the IMSSubscription element inside an otherwise empty
+  // ClearwaterRegData element, and keep what is between that element's tags.
+  // This is exactly what printing a full ClearwaterRegData document would
+  // produce for it.
+  rapidxml::xml_document<> reg_data_doc;
+  rapidxml::xml_node<>* root = reg_data_doc.allocate_node(rapidxml::node_type::node_element, "ClearwaterRegData");
+  root->append_node(reg_data_doc.clone_node(is));
+  reg_data_doc.append_node(root);
+
+  std::string printed;
+  rapidxml::print(std::back_inserter(printed), reg_data_doc, 0);
+  size_t start = printed.find('\n') + 1;
+  size_t end = printed.rfind("</ClearwaterRegData>");
+  reg_data_element = printed.substr(start, end - start);
+
+  return true;
+}
+
+// Returns the given node, or the first sibling after it, that isn't just
+// whitespace between elements.
+static rapidxml::xml_node<>* skip_whitespace(rapidxml::xml_node<>* node)
+{
+  while ((node) &&
+         (node->type() == rapidxml::node_data) &&
+         (std::string(node->value(), node->value_size()).find_first_not_of(" \t\r\n") == std::string::npos))
+  {
+    node = node->next_sibling();
+  }
+
+  return node;
+}
+
+// Returns whether two XML elements have the same name, value, attributes and
+// children. Differences in whitespace between elements are ignored.
+static bool nodes_equal(rapidxml::xml_node<>* a, rapidxml::xml_node<>* b)
+{
+  if ((a->type() != b->type()) ||
+      (std::string(a->name(), a->name_size()) != std::string(b->name(), b->name_size())))
+  {
+    return false;
+  }
+
+  if ((a->type() == rapidxml::node_data) || (a->type() == rapidxml::node_cdata))
+  {
+    return (std::string(a->value(), a->value_size()) ==
+            std::string(b->value(), b->value_size()));
+  }
+
+  rapidxml::xml_attribute<>* aa = a->first_attribute();
+  rapidxml::xml_attribute<>* ba = b->first_attribute();
+  while ((aa) && (ba))
+  {
+    if ((std::string(aa->name(), aa->name_size()) != std::string(ba->name(), ba->name_size())) ||
+        (std::string(aa->value(), aa->value_size()) != std::string(ba->value(), ba->value_size())))
+    {
+      return false;
+    }
+    aa = aa->next_attribute();
+    ba = ba->next_attribute();
+  }
+
+  if ((aa) || (ba))
+  {
+    return false;
+  }
+
+  rapidxml::xml_node<>* ac = skip_whitespace(a->first_node());
+  rapidxml::xml_node<>* bc = skip_whitespace(b->first_node());
+  while ((ac) && (bc))
+  {
+    if (!nodes_equal(ac, bc))
+    {
+      return false;
+    }
+    ac = skip_whitespace(ac->next_sibling());
+    bc = skip_whitespace(bc->next_sibling());
+  }
+
+  return ((!ac) && (!bc));
+}
+
+// Compares two User-Data XML documents, given the public IDs in each,
+// working out which public IDs have been added, removed or kept, and whether
+// the service profiles have changed at all.
+static IrsDiff diff_ims_subscriptions(const std::vector<std::string>& old_ids,
+                                      const std::vector<std::string>& new_ids,
+                                      const std::string& old_user_data,
+                                      const std::string& new_user_data)
+{
+  IrsDiff diff;
+
+  for (std::vector<std::string>::const_iterator it = new_ids.begin();
+       it != new_ids.end();
+       ++it)
+  {
+    if (std::find(old_ids.begin(), old_ids.end(), *it) == old_ids.end())
+    {
+      diff.added.push_back(*it);
+    }
+    else
+    {
+      diff.unchanged.push_back(*it);
+    }
+  }
+
+  for (std::vector<std::string>::const_iterator it = old_ids.begin();
+       it != old_ids.end();
+       ++it)
+  {
+    if (std::find(new_ids.begin(), new_ids.end(), *it) == new_ids.end())
+    {
+      diff.removed.push_back(*it);
+    }
+  }
+
+  diff.default_id_removed = ((!diff.removed.empty()) &&
+                             (diff.removed[0] == old_ids[0]));
+
+  if (old_user_data == new_user_data)
+  {
+    return diff;
+  }
+
+  // The documents differ, so compare their structure. As parsing is
+  // destructive, parse copies of the strings. If either fails to parse we
+  // treat the service profiles as changed.
+  rapidxml::xml_document<> old_doc;
+  rapidxml::xml_document<> new_doc;
+  char* old_str = old_doc.allocate_string(old_user_data.c_str());
+  char* new_str = new_doc.allocate_string(new_user_data.c_str());
+  diff.service_profiles_changed = true;
+
+  try
+  {
+    old_doc.parse<rapidxml::parse_strip_xml_namespaces>(old_str);
+    new_doc.parse<rapidxml::parse_strip_xml_namespaces>(new_str);
+  }
+  catch (rapidxml::parse_error err)
+  {
+    TRC_DEBUG("Parse error comparing IMS Subscription documents: %s", err.what());
+    return diff;
+  }
+
+  rapidxml::xml_node<>* old_is = old_doc.first_node("IMSSubscription");
+  rapidxml::xml_node<>* new_is = new_doc.first_node("IMSSubscription");
+  if ((old_is) && (new_is))
+  {
+    diff.service_profiles_changed = !nodes_equal(old_is, new_is);
+  }
+
+  return diff;
+}
+
+IrsDiff diff_ims_subscriptions(const std::string& old_user_data,
+                               const std::string& new_user_data)
+{
+  return diff_ims_subscriptions(get_public_ids(old_user_data),
+                                get_public_ids(new_user_data),
+                                old_user_data,
+                                new_user_data);
+}
+
+IrsDiff diff_ims_subscriptions(const ImsSubscription& old_subscription,
+                               const ImsSubscription& new_subscription)
+{
+  return diff_ims_subscriptions(old_subscription.public_ids(),
+                                new_subscription.public_ids(),
+                                old_subscription.xml(),
+                                new_subscription.xml());
+}
+
 // Parses the given User-Data XML to retrieve the single PrivateID element.
 std::string get_private_id(const std::string& user_data)
 {
@@ -251,20 +923,7 @@ std::string get_private_id(const std::string& user_data)
   rapidxml::xml_node<>* is = doc.first_node("IMSSubscription");
   if (is)
   {
-    rapidxml::xml_node<>* id = is->first_node("PrivateID");
-    if (id)
-    {
-      impi = id->value();
-    }
-    else
-    {
-      TRC_ERROR("Missing Private ID in IMS Subscription document: \n\n%s", user_data.c_str());
-    }
-  }
-
-  if (impi.compare("null") == 0)
-  {
-    impi = ""; // LCOV_EXCL_LINE
+    impi = get_private_id(is, user_data);
   }
 
   return impi;